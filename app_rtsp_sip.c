@@ -83,13 +83,80 @@
  * This will support multiple Auth methods in same WWW-Authenticate header
  * or across multiple WWW-Authenticate headers.
  *
+ * [v2.1]
+ * Performance work on the camera media path and call setup.
+ * New code is tagged [v2.1]. Adds an optional 5th "options" argument to RTSP-SIP().
+ *   - b: batched RTP ingest. Every datagram pending on a ready camera RTP socket
+ *        is drained with recvmmsg() and handed to the frame builder in one pass.
+ *   - Camera RTP is read straight into a per-session pool of cache line aligned,
+ *     MTU sized slots instead of zeroing a 9 KB buffer for every packet.
+ *   - j(min:max:target): adaptive jitter buffer for camera audio, keyed on RTP
+ *        sequence number, played out on a 20 ms clock.
+ *   - RTCP receiver reports per RFC 3550 appendix A (loss, jitter, LSR/DLSR).
+ *   - RTCP session engine: compound packet parsing, SR clock mapping, reports
+ *     with SDES CNAME on the RFC 3550 randomized interval, BYE on teardown.
+ *     RTSP OPTIONS keepalive follows the session timeout.
+ *   - t: RTP/AVP/TCP interleaved transport. Media is demuxed from the RTSP
+ *        connection in place; no UDP sockets.
+ *   - h: calls to the same camera URL and credentials share one RTSP
+ *     session, pulled by its own thread and fanned out to every channel.
+ *     The last call to hang up tears it down. Cameras with a warm pool are
+ *     always shared.
+ *   - Warm session pool per camera from rtsp_sip.conf: DESCRIBE and SETUP
+ *     done ahead of time, kept alive with OPTIONS or GET_PARAMETER, and
+ *     handed to a call so only PLAY is left.
+ *   - Camera SDP and codec choice cached per url (sdp_cache_ttl), calls skip
+ *     DESCRIBE. SETUP answers 401 itself and drops a stale entry on failure.
+ *   - Auth cache per camera: scheme, realm, nonce and opaque of the last
+ *     challenge. The first RTSP request and SIP INVITE of a call carry
+ *     credentials; a stale=true digest is answered with the new nonce.
+ *   - l: pipelined setup. Video SETUP and PLAY go out back to back once the
+ *        session is known, responses matched by CSeq; serial fallback.
+ *   - e: early talkback. SIP INVITE goes out with the first SETUP instead of
+ *        after PLAY; talkback audio is held until both legs are up.
+ *   - Optional epoll media reactor (media_threads): a few threads own the
+ *     rtp/rtcp sockets of every UDP session; session threads keep RTSP,
+ *     the channel and timers.
+ *   - w: channel writer thread fed by a lock-free SPSC ring, drop oldest
+ *        when full, high water mark logged.
+ *   - media_backend = io_uring (built with HAVE_LIBURING): multishot receives
+ *     into provided buffer rings for the media reactor, RTCP and talkback
+ *     sends queued on the same ring.
+ *   - s(depth): talkback RTP queued and sent on ptime boundaries from an
+ *     Asterisk timer, late/early sends logged.
+ *   - Packets due in one pacer tick go out with one sendmmsg(), or one
+ *     UDP_SEGMENT (GSO) sendmsg() when equal sized. Packets per syscall logged.
+ *   - Talkback RTP with one SSRC per SIP leg, random initial seq/ts, marker
+ *     per talkspurt, RTCP SR/SDES to the speaker and its RRs parsed.
+ *   - Talkback header built in its own buffer and sent with the payload by
+ *     sendmsg() iovecs, frames with no headroom are no longer dropped.
+ *   - c(codecs): talkback offers G.722, Opus and L16 as well as G.711, the
+ *     channel's native formats first, and reads talkback in the answered codec.
+ *   - RTSP/SIP headers indexed in one pass as name/value spans over the message,
+ *     looked up by name hash. No per-header copies, obs-fold and repeated
+ *     headers handled by every lookup.
+ *   - RTSP responses framed incrementally: the empty line search resumes where
+ *     the last read stopped, the end comes from Content-Length, consumed
+ *     messages advance a cursor instead of being moved, and every complete
+ *     response in a read is handled.
+ *   - SDP model built in one arena allocation over a copy of the text, freed in
+ *     one go. Formats follow the m= payload types, with static types, a=fmtp
+ *     and a=ptime.
+ *   - rtpmap encodings looked up by exact name and clock rate in a hash table
+ *     built at load, holding referenced formats.
+ *   - -DRTSP_SIP_STANDALONE builds only the header, auth, SDP and framing
+ *     parsers, the RTP header stamping and parsing and the packet slot pool
+ *     over a small libc shim, with entry points for bench/ and fuzz/.
+ *
  */
 
 /* Use the following to test for Buffer length issues */
 /* #define TEST_BUFFER */
 
+#ifndef RTSP_SIP_STANDALONE /* [v2.1] */
 #include <asterisk.h>
 #include "asterisk/app.h" /* PORT 17.3 ADDed for parsing args */
+#endif /* RTSP_SIP_STANDALONE */
 
 
 #include <stdlib.h>
@@ -98,9 +165,105 @@
 #include <string.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/uio.h> /* [v2.1] struct iovec for recvmmsg() */
+#include <sys/epoll.h> /* [v2.1] media reactor */
+#ifdef HAVE_LIBURING
+#include <liburing.h> /* [v2.1] io_uring media reactor, see media_backend */
+#endif
 #include <errno.h>
+#include <limits.h> /* [v2.1] INT_MAX */
 #include <arpa/inet.h> /* [17.x NEW]. needed for getsockname() */
+#include <netinet/udp.h> /* [v2.1] UDP_SEGMENT */
+
+#ifdef RTSP_SIP_STANDALONE
+/*
+ * [v2.1] Standalone parsers.
+ * The RTSP/SIP header index, auth challenge parsing, SDP model, response
+ * framer, RTP header stamping and parsing and the packet slot pool only
+ * need libc. Built with -DRTSP_SIP_STANDALONE, this file compiles just
+ * those, with the shim below for the few Asterisk calls they make, so they
+ * can be timed and fuzzed without a running Asterisk. The entry points are
+ * at the end of the file and declared in rtsp_sip_standalone.h. Everything
+ * else is left out.
+ */
+#include <ctype.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <sys/time.h>
+#include "rtsp_sip_standalone.h"
+
+#define LOG_ERROR			0
+#define LOG_WARNING			0
+#define LOG_NOTICE			0
+#define ast_log(level,...)		do { } while (0)
+#define ast_debug(level,...)		do { } while (0)
+#define ast_malloc(size)		malloc(size)
+#define ast_calloc(num,size)		calloc(num,size)
+#define ast_free(ptr)			free(ptr)
+#define ast_strdup(str)			strdup(str)
+#define ast_strndup(str,len)		strndup(str,len)
+#define ast_copy_string(dst,src,size)	snprintf(dst,size,"%s",src)
+#define ao2_bump(obj)			(obj)
+#define ao2_cleanup(obj)		do { } while (0)
+#define ast_random()			random()
+
+/* Bits of frame.h */
+#define AST_FRIENDLY_OFFSET		64
+
+/* Bits of time.h */
+static inline int64_t ast_tvdiff_us(struct timeval end,struct timeval start)
+{
+	return (end.tv_sec-start.tv_sec)*(int64_t)1000000 + (end.tv_usec-start.tv_usec);
+}
+
+static inline int64_t ast_tvdiff_ms(struct timeval end,struct timeval start)
+{
+	return ast_tvdiff_us(end,start)/1000;
+}
+
+/* Bits of format_compatibility.h */
+#define AST_FORMAT_G723		(1ULL << 0)
+#define AST_FORMAT_GSM		(1ULL << 1)
+#define AST_FORMAT_ULAW		(1ULL << 2)
+#define AST_FORMAT_ALAW		(1ULL << 3)
+#define AST_FORMAT_G726_AAL2	(1ULL << 4)
+#define AST_FORMAT_ADPCM	(1ULL << 5)
+#define AST_FORMAT_SLIN		(1ULL << 6)
+#define AST_FORMAT_LPC10	(1ULL << 7)
+#define AST_FORMAT_G729		(1ULL << 8)
+#define AST_FORMAT_SPEEX	(1ULL << 9)
+#define AST_FORMAT_ILBC		(1ULL << 10)
+#define AST_FORMAT_G726		(1ULL << 11)
+#define AST_FORMAT_G722		(1ULL << 12)
+#define AST_FORMAT_SLIN16	(1ULL << 15)
+#define AST_FORMAT_JPEG		(1ULL << 16)
+#define AST_FORMAT_PNG		(1ULL << 17)
+#define AST_FORMAT_H261		(1ULL << 18)
+#define AST_FORMAT_H263		(1ULL << 19)
+#define AST_FORMAT_H263P	(1ULL << 20)
+#define AST_FORMAT_H264		(1ULL << 21)
+#define AST_FORMAT_MP4		(1ULL << 22)
+#define AST_FORMAT_OPUS		(1ULL << 34)
+
+/* One static format per bit */
+struct ast_format
+{
+	uint64_t bitfield;
+};
+
+static struct ast_format standaloneFormats[64];
+
+static struct ast_format* ast_format_compatibility_bitfield2format(uint64_t bitfield)
+{
+	int bit;
 
+	if (!bitfield)
+		return NULL;
+	bit = __builtin_ctzll(bitfield);
+	standaloneFormats[bit].bitfield = 1ULL << bit;
+	return &standaloneFormats[bit];
+}
+#else
 #include <asterisk/lock.h>
 #include <asterisk/file.h>
 #include <asterisk/logger.h>
@@ -110,6 +273,9 @@
 #include <asterisk/utils.h>
 #include <asterisk/translate.h>
 #include <asterisk/format_compatibility.h>
+#include <asterisk/config.h> /* [v2.1] rtsp_sip.conf */
+#include <asterisk/timing.h> /* [v2.1] talkback pacer */
+#endif /* RTSP_SIP_STANDALONE */
 
 
 /* 
@@ -180,6 +346,74 @@
 				<para>If enable-sip = 1, this optional parameter can be used 
 				to specify a different SIP port for the target device to listen on.  Default is 5060. </para>
 			</parameter>
+			<parameter name="options" required="false">
+				<optionlist>
+					<option name="b">
+						<para>Batched RTP ingest. When a camera RTP socket is ready, drain
+						every pending datagram with a single recvmmsg() call (or a few) instead of
+						one wakeup and one recv() per packet. Packets per wakeup counters
+						are logged at debug level 2 when the call ends.</para>
+					</option>
+					<option name="j">
+						<argument name="min" />
+						<argument name="max" />
+						<argument name="target" />
+						<para>Adaptive jitter buffer for the camera audio. Packets are
+						reordered by RTP sequence number, duplicates and late packets are
+						dropped, and audio is played out on a steady 20 ms clock. The depth
+						follows the measured interarrival jitter between <replaceable>min</replaceable>
+						and <replaceable>max</replaceable> ms and starts at <replaceable>target</replaceable> ms.
+						Arguments are separated by <literal>:</literal>, e.g. <literal>j(20:200:60)</literal>.
+						Empty arguments use the defaults 20, 200 and 60.</para>
+					</option>
+					<option name="t">
+						<para>Ask the camera for RTP/AVP/TCP interleaved transport. Media and
+						RTCP come as <literal>$</literal> framed packets on the RTSP connection,
+						so no UDP sockets are opened. Use for cameras behind NAT or on lossy links.</para>
+					</option>
+					<option name="h">
+						<para>Shared session. Calls to the same URL with the same credentials
+						share one RTSP session to the camera and each call gets a copy of its
+						frames. Calls to a camera with warm sessions in rtsp_sip.conf are shared
+						without it. Calls with SIP talkback always have their own session.</para>
+					</option>
+					<option name="l">
+						<para>Pipelined setup. Once the first SETUP returns a session, the video
+						SETUP and PLAY are sent back to back without waiting for each other.
+						A camera that rejects it is set up serially from then on.</para>
+					</option>
+					<option name="e">
+						<para>Early talkback. With SIP enabled, the INVITE goes out as soon as the
+						audio codec is known from DESCRIBE or a cached SDP, so the SIP and RTSP
+						handshakes run in parallel. Talkback audio starts once both are up.</para>
+					</option>
+					<option name="w">
+						<para>Channel writer thread. Camera frames go through a bounded lock-free
+						ring to a thread that writes them to the channel, so a slow write never
+						holds up receiving. When the ring is full the oldest frame is dropped.
+						Shared sessions already write from each caller's thread.</para>
+					</option>
+					<option name="c">
+						<argument name="codecs" />
+						<para>Talkback codecs the speaker takes, in order of preference,
+						separated by <literal>:</literal>. Known codecs are <literal>opus</literal>,
+						<literal>g722</literal>, <literal>slin16</literal> (L16/16000),
+						<literal>ulaw</literal>, <literal>alaw</literal> and <literal>slin</literal>
+						(L16/8000), e.g. <literal>c(g722:ulaw)</literal>. Codecs the channel
+						has natively are offered first, so talkback needs no transcoding.
+						Without it the camera audio codec is offered.</para>
+					</option>
+					<option name="s">
+						<argument name="depth" />
+						<para>Paced talkback. SIP RTP to the speaker is queued and sent on an
+						Asterisk timer, one packet per ptime, instead of as soon as the frame
+						is read, so bursts from the bridge don't underrun or clip small speaker
+						buffers. Up to <replaceable>depth</replaceable> ms are queued (default 60),
+						sending starts once half of it is buffered and the oldest packet is
+						dropped when full. Late and early sends are logged when the call ends.</para>
+					</option>
+				</optionlist>
+			</parameter>
 		</syntax>
 
 		<see-also>
@@ -189,202 +423,207 @@
  ***/
 
 /* [v2.0] Adders for new message/header/auth params parsing */
-#define MAX_HEADERS 100		//max number of header lines in an RTSP/SIP message
-#define MAX_HEADER_LINE 1024    //max size of a header line
-#define MAX_FIELD_NAME 1024     //max size of a header's field name; otherwise strncpy warns of trunc
-#define MAX_FIELD_VALUE 1024    //max size of a header's field value; otherwise strncpy warns of trunc
-
-#define MAX_TOKEN 512        //number of chars say in a name, a key, a value
 #define MAX_AUTH_KEY_VAL 20  //max num of an auth scheme's parameters as key/value pairs
 
-typedef struct {
-    char field_name[MAX_FIELD_NAME];
-    char field_value[MAX_FIELD_VALUE];
-} HeaderStruct;
-
-typedef struct {
-    HeaderStruct headers[MAX_HEADERS];
-    int count;
-} HeaderStructList;
 
 /*
- * [v2.0] Simple routine that removes whitespaces from a string
- * starting at the beginning moving forward and 
- * then starting at the end and moving backwards.
+ * [v2.1] Header index.
+ * One pass over an RTSP/SIP message records where each header's name and
+ * value are in the buffer, with a hash of the lower-cased name, so a lookup
+ * compares ints and only strncasecmp()s the name on a hash hit.
+ * Nothing is copied. OWS around the value is skipped, and a value continued
+ * with obs-fold (CRLF 1*( SP / HTAB )) spans the folded lines, CRLF and all.
+ * A header that appears more than once gets a span per occurrence.
  */
-static void trim_whitespace(char *str) {
-    char *end;
-    // Trim leading space
-    while(isspace((unsigned char)*str)) str++;
-    // Trim trailing space
-    end = str + strlen(str) - 1;
-    while(end > str && isspace((unsigned char)*end)) end--;
-    *(end + 1) = 0;
+#define HEADER_INDEX_MAX	64	/* headers indexed per message, the rest are ignored */
+
+struct HeaderSpan
+{
+	unsigned int	hash;		/* HeaderNameHash() of the name */
+	int		nameOff;
+	int		nameLen;
+	int		valueOff;
+	int		valueLen;
+};
+
+struct HeaderIndex
+{
+	const char		*buffer;
+	int			count;
+	int			bodyOff;	/* first byte after the empty line, 0 if not seen */
+	struct HeaderSpan	headers[HEADER_INDEX_MAX];
+};
+
+/* [v2.1] FNV-1a of the lower-cased header name */
+static unsigned int HeaderNameHash(const char *name,int len)
+{
+	unsigned int hash = 2166136261u;
+	int i;
+
+	for (i=0;i<len;i++)
+	{
+		hash ^= (unsigned char)tolower((unsigned char)name[i]);
+		hash *= 16777619u;
+	}
+	return hash;
 }
 
-/* 
- * Helper function to get a trimmed copy of a string without modifying the original
- */
-static char* get_trimmed_string(const char *str) {
-    if (!str) return NULL;
-    
-    // Find start of non-whitespace content
-    const char *start = str;
-    while (*start && isspace((unsigned char)*start)) {
-        start++;
-    }
-    
-    // Find end of non-whitespace content
-    const char *end = start + strlen(start) - 1;
-    while (end > start && isspace((unsigned char)*end)) {
-        end--;
-    }
-    
-    // Calculate length and create copy
-    size_t len = end - start + 1;
-    char *trimmed = ast_malloc(len + 1);
-    if (trimmed) {
-        strncpy(trimmed, start, len);
-        trimmed[len] = '\0';
-    }
-    
-    return trimmed;
+static int HeaderIndexBuild(struct HeaderIndex *index,const char *buffer,int bufferLen)
+{
+	const char *end = buffer+bufferLen;
+	const char *p = buffer;
+	const char *line;
+	const char *colon;
+	const char *eol;
+	const char *name;
+	const char *value;
+	const char *valueEnd;
+	struct HeaderSpan *span;
+
+	/* Empty */
+	index->buffer = buffer;
+	index->count = 0;
+	index->bodyOff = 0;
+
+	/* Skip Request-Line or Status-Line */
+	while (p<end && *p && *p!='\n')
+		p++;
+	if (p>=end || *p!='\n')
+	{
+		ast_log(LOG_WARNING,"Parsing RTSP/SIP message: No Start Line found\n");
+		return -1;
+	}
+	p++;
+
+	while (p<end && *p)
+	{
+		line = p;
+
+		/* Empty line ends the headers */
+		if (*p=='\n' || (*p=='\r' && p+1<end && p[1]=='\n'))
+		{
+			index->bodyOff = (p-buffer) + (*p=='\r' ? 2 : 1);
+			break;
+		}
+
+		/* Find end of field, following obs-fold onto the next lines */
+		colon = NULL;
+		eol = p;
+		while (1)
+		{
+			while (eol<end && *eol && *eol!='\n')
+			{
+				if (!colon && *eol==':')
+					colon = eol;
+				eol++;
+			}
+			if (eol+1<end && *eol=='\n' && (eol[1]==' ' || eol[1]=='\t'))
+			{
+				ast_debug(6,"  Header line %d is extended\n",index->count);
+				eol++;
+				continue;
+			}
+			break;
+		}
+
+		/* Next line */
+		p = (eol<end && *eol=='\n') ? eol+1 : eol;
+
+		if (!colon)
+		{
+			ast_debug(4,"Malformed header line (no colon): %.*s\n",(int)(eol-line),line);
+			continue;
+		}
+		if (index->count==HEADER_INDEX_MAX)
+		{
+			ast_debug(4,"Too many headers, ignoring %.*s\n",(int)(colon-line),line);
+			continue;
+		}
+
+		/* Name, without BWS before the colon */
+		name = colon;
+		while (name>line && (name[-1]==' ' || name[-1]=='\t'))
+			name--;
+
+		/* Value, without OWS and CRLF on either side */
+		value = colon+1;
+		valueEnd = eol;
+		while (value<valueEnd && isspace((unsigned char)*value))
+			value++;
+		while (valueEnd>value && isspace((unsigned char)valueEnd[-1]))
+			valueEnd--;
+
+		/* Add span */
+		span = &index->headers[index->count++];
+		span->nameOff = line-buffer;
+		span->nameLen = name-line;
+		span->valueOff = value-buffer;
+		span->valueLen = valueEnd-value;
+		span->hash = HeaderNameHash(line,span->nameLen);
+	}
+
+	return 0;
 }
 
-/* 
- * [v2.0]
- * Parse raw buffer (string) containing an RTSP or SIP Message 
- *   to get at the start of the list of Headers.
- *   Return the location (as an arg) where the headers start.
- *
- * RFC7826 RSTP2.0 Sect. 20.2.2 RTSP Message
- * RTSP-message      = Request / Response  ; RTSP/2.0 messages
- * Request/Response  = Request-Line or Status-Line
- *                     *((Header) CRLF) 
- *                     CRLF
- *                     [ message-body-data ]
- * Request-Line = Method SP Request-URI SP RTSP-Version CRLF
- * Status-Line  = RTSP-Version SP Status-Code SP Reason-Phrase CRLF
- *
- * RFC3261 SIP Messages Sect. 7 much the same.
- *
- * So Buffer may contain other stuff before the list of headers.
- * Start at beginning (skipping over RTSP/SIP Request/Response)
- *   looking for the first "CRLF", then headers (if any) should start.
- *
- */
-static int parse_message(char *buffer, char **headers_start) {
-    if ( (*headers_start = strstr(buffer, "\r\n")) == NULL)
-    {
-	ast_log(LOG_WARNING,"Parsing RTSP/SIP message: No Start Line found\n");
-        return -1;
-    }
-    else
-    {
-        *headers_start+=2;  //skip over CR LF
-      //printf("first header char is %c\n",**headers_start);
-    }
-    return 0;
+/* [v2.1] Next header named name at or after span from, -1 if none */
+static int HeaderIndexFind(const struct HeaderIndex *index,const char *name,int from)
+{
+	const struct HeaderSpan *span;
+	int len = strlen(name);
+	unsigned int hash;
+	int i;
+
+	/* If no header */
+	if (!len)
+		/* Exit */
+		return -1;
+
+	hash = HeaderNameHash(name,len);
+	for (i=from;i<index->count;i++)
+	{
+		span = &index->headers[i];
+		if (span->hash==hash && span->nameLen==len && !strncasecmp(index->buffer+span->nameOff,name,len))
+			return i;
+	}
+	return -1;
 }
 
-/*
- * [v2.0]
- * Parse RTSP/SIP Headers (within raw string buffer) beginning at the 
- *  location where the headers actually start.
- *
- * RFC7230 Definition of Header
- *   header-field   = field-name ":" OWS field-value OWS
- *
- *   field-name     = token
- *   field-value    = *( field-content / obs-fold )
- *   field-content  = field-vchar [ 1*( SP / HTAB ) field-vchar ]
- *   field-vchar    = VCHAR / obs-text
- *
- *   obs-fold       = CRLF 1*( SP / HTAB )
- *                  ; obsolete line folding
- */
-static int parse_headers(char *buffer, HeaderStructList *header_list) {
-    header_list->count = 0;
-    char *line_start = buffer;
-    char *fold_start;
-    char *line_end;
-    char line[MAX_HEADER_LINE];
-
-    while (*line_start && header_list->count < MAX_HEADERS) 
-    {
-        /*
-         * handle obsolete line folding where a Header line
-         * can be extended using CRLF 1*( SP / HTAB )
-         */
-        int  line_extended = 0;
-        fold_start = line_start;
-        do
-        {
-            line_end = strstr(fold_start, "\r\n");
-            if (!line_end) 
-            {
-                break; //Returned Null - Malformed header block
-            }
-            if( *(line_end+2) == ' '  || *(line_end+2) == '\t' )
-            {
-                line_extended=1;
-	        ast_debug(6,"  Header line %d is extended\n",header_list->count);
-                fold_start = line_end+2;
-            }
-            else
-            {
-                if( *(line_end+2) == '\r'  && *(line_end+3) == '\n' )
-                {
-                    //we're at CRLF after last header line.
-                    line_extended=0;
-	            ast_debug(6,"  Header line %d is NOT extended\n",header_list->count);
-	            ast_debug(6,"  End of Headers found. Processing last line\n");
-                }
-                else
-                {
-                    line_extended=0;
-	            ast_debug(6,"  Header line %d is NOT extended\n",header_list->count);
-                }
-            }
-        }
-        while( line_extended);
+/* [v2.1] Value of the first header named name, NULL if none. It is not terminated, *len is its length */
+static const char* HeaderIndexValue(const struct HeaderIndex *index,const char *name,int *len)
+{
+	int i;
 
-        if (!line_end) 
-        {  
-	    ast_log(LOG_WARNING,"  Malformed Header (no CRLF).\n");
-            break; //Above returned Null looking for crlf - Malformed header block
-        }
-        size_t line_len = line_end - line_start;
-        if (line_len == 0)  //line_start and line_end both at CRLF after all headers
-        {
-	    ast_debug(6,"  Header Line %d has length of zero (so not a line)\n",header_list->count);
-            break; // Empty line = end of headers
-        }
-        if (line_len >= MAX_HEADER_LINE) {
-	    ast_log(LOG_WARNING,"  Header line too long\n");
-            return -1;
-        }
+	/* Get Header */
+	if ((i=HeaderIndexFind(index,name,0))<0)
+		/* Exit */
+		return NULL;
 
-        strncpy(line, line_start, line_len);
-        line[line_len] = '\0';
+	*len = index->headers[i].valueLen;
+	return index->buffer+index->headers[i].valueOff;
+}
 
-        char *colon = strchr(line, ':');
-        if (!colon) {
-	    ast_log(LOG_WARNING,"Malformed header line (no colon): %s\n", line);
-            return -1;
-        }
+/* [v2.1] Case-insensitive search in a value, NULL if not there */
+static const char* HeaderValueFind(const char *value,int len,const char *needle)
+{
+	int needleLen = strlen(needle);
+	int i;
 
-        *colon = '\0';
-        strncpy(header_list->headers[header_list->count].field_name, line, MAX_FIELD_NAME);
-        strncpy(header_list->headers[header_list->count].field_value, colon + 1, MAX_FIELD_VALUE);
-        trim_whitespace(header_list->headers[header_list->count].field_name);
-        trim_whitespace(header_list->headers[header_list->count].field_value);
+	for (i=0;i+needleLen<=len;i++)
+		if (!strncasecmp(value+i,needle,needleLen))
+			return value+i;
+	return NULL;
+}
 
-        header_list->count++;
-        line_start = line_end + 2; // Skip over \r\n
-    }
+/* [v2.1] Leading digits of a value, INT_MAX if they don't fit */
+static int HeaderValueInt(const char *value,int len)
+{
+	long long n = 0;
+	int i;
 
-    return 0;
+	for (i=0;i<len && isdigit((unsigned char)value[i]);i++)
+		if ((n = n*10 + (value[i]-'0'))>INT_MAX)
+			return INT_MAX;
+	return (int)n;
 }
 
 
@@ -409,12 +648,74 @@ static int parse_headers(char *buffer, HeaderStructList *header_list) {
  * #endif OLD
  */
 
+#ifndef RTSP_SIP_STANDALONE /* [v2.1] */
 /* PORT17.3. Update to use xml based loading and documentation */
 /* static char *name_rtsp_sip = "rtsp_sip"; OLD */
 /* static char *syn_rtsp_sip = "sip caller with rtsp player"; */
 /* static char *des_rtsp_sip = "  rtsp(url):  Play url. \n"; */
 static const char app[] = "RTSP-SIP";
 
+/* [v2.1] RTSP-SIP() options (5th argument) */
+enum {
+	OPT_BATCH_INGEST	= (1 << 0),
+	OPT_JITTER_BUFFER	= (1 << 1),
+	OPT_INTERLEAVED		= (1 << 2),
+	OPT_SHARED_PULL		= (1 << 3),
+	OPT_PIPELINED		= (1 << 4),
+	OPT_EARLY_SIP		= (1 << 5),
+	OPT_CHANNEL_WRITER	= (1 << 6),
+	OPT_PACED_TALKBACK	= (1 << 7),
+	OPT_SIP_CODECS		= (1 << 8),
+};
+
+enum {
+	OPT_ARG_JITTER_BUFFER = 0,
+	OPT_ARG_PACED_TALKBACK,
+	OPT_ARG_SIP_CODECS,
+	/* This MUST be the last value in this enum! */
+	OPT_ARG_ARRAY_SIZE,
+};
+
+AST_APP_OPTIONS(rtsp_sip_opts, {
+	AST_APP_OPTION('b', OPT_BATCH_INGEST),
+	AST_APP_OPTION_ARG('j', OPT_JITTER_BUFFER, OPT_ARG_JITTER_BUFFER),
+	AST_APP_OPTION('t', OPT_INTERLEAVED),
+	AST_APP_OPTION('h', OPT_SHARED_PULL),
+	AST_APP_OPTION('l', OPT_PIPELINED),
+	AST_APP_OPTION('e', OPT_EARLY_SIP),
+	AST_APP_OPTION('w', OPT_CHANNEL_WRITER),
+	AST_APP_OPTION_ARG('s', OPT_PACED_TALKBACK, OPT_ARG_PACED_TALKBACK),
+	AST_APP_OPTION_ARG('c', OPT_SIP_CODECS, OPT_ARG_SIP_CODECS),
+});
+
+/* [v2.1] Talkback codecs offered at most, see sipCodecs[] */
+#define SIP_MAX_CODECS		8
+
+/* [v2.1] Jitter buffer depth defaults, ms */
+#define JB_DEFAULT_MIN		20
+#define JB_DEFAULT_MAX		200
+#define JB_DEFAULT_TARGET	60
+
+/* [v2.1] Parsed options handed to main_loop() */
+struct RtspSipOptions
+{
+	int	batchIngest;	/* drain RTP sockets with recvmmsg() */
+	int	jitterBuffer;	/* buffer camera audio */
+	int	jbMin;		/* ms */
+	int	jbMax;		/* ms */
+	int	jbTarget;	/* ms, starting depth */
+	int	interleaved;	/* RTP/AVP/TCP on the RTSP connection */
+	int	sharedPull;	/* share the camera session with other calls */
+	int	getParameter;	/* keepalive with GET_PARAMETER instead of OPTIONS */
+	int	pipelined;	/* SETUP and PLAY back to back once the session is known */
+	int	earlySip;	/* INVITE the speaker while RTSP is still setting up */
+	int	channelWriter;	/* ast_write() on a writer thread, fed through a ring */
+	int	pacedTalkback;	/* send SIP RTP on ptime boundaries */
+	int	paceDepth;	/* ms of talkback queued at most */
+	int	sipCodecs[SIP_MAX_CODECS]; /* sipCodecs[] indexes the speaker takes, in preference order */
+	int	numSipCodecs;	/* 0 offers the camera audio codec */
+};
+
 /* RTSP states */
 #define RTSP_NONE		0
 #define RTSP_DESCRIBE		1
@@ -423,6 +724,16 @@ static const char app[] = "RTSP-SIP";
 #define RTSP_PLAY 		4
 #define RTSP_PLAYING		5
 #define RTSP_RELEASED 		6
+#define RTSP_READY		7	/* [v2.1] warm session, SETUP done and PLAY held for a call */
+
+/* [v2.1] Requests in flight when pipelining, matched to responses by CSeq */
+#define RTSP_MAX_PENDING	4
+
+struct RtspPending
+{
+	int	cseq;
+	int	state;    /* RTSP_xxx the response is handled in */
+};
 
 /* [17.x NEW] SIP states */
 #define SIP_STATE_NONE		0
@@ -438,11 +749,16 @@ static const char app[] = "RTSP-SIP";
 #define SIP_STATE_INFO		10
 
 
-#define PKT_PAYLOAD     9000
+/* [v2.1] RTSP control buffer. Interleaved frames can be up to 4+65535 bytes */
+#define RTSP_BUFFER_SIZE	(16384 + 4 + 65535)
 #define PKT_SIZE        (sizeof(struct ast_frame) + AST_FRIENDLY_OFFSET + PKT_PAYLOAD)
 #define PKT_OFFSET      (sizeof(struct ast_frame) + AST_FRIENDLY_OFFSET)
 
 
+#endif /* RTSP_SIP_STANDALONE */
+
+#define PKT_PAYLOAD     9000
+
 /* PORT 17.3
  *   Some of the following AST_FORMAT_xx were tweaked in format_compatibility.h;
  *   Plus the bit list is now 64bits
@@ -452,32 +768,109 @@ static struct
      /* int format; OLD */
         uint64_t format;
         char*    name;
+	int	 rate;	/* [v2.1] RTP clock rate, the first entry of a name is its default */
 } mimeTypes[] = {
-	{ AST_FORMAT_G723, "G723"}, /* OLD { AST_FORMAT_G723_1, "G723"}, */
-	{ AST_FORMAT_GSM, "GSM"},
-	{ AST_FORMAT_ULAW, "PCMU"},
-	{ AST_FORMAT_ALAW, "PCMA"},
-	{ AST_FORMAT_G726, "G726-32"},
-	{ AST_FORMAT_ADPCM, "DVI4"},
-	{ AST_FORMAT_SLIN, "L16"}, /* OLD { AST_FORMAT_SLINEAR, "L16"}, */
-	{ AST_FORMAT_LPC10, "LPC"},
-	{ AST_FORMAT_G729, "G729"}, /* { AST_FORMAT_G729A, "G729"}, */
-	{ AST_FORMAT_SPEEX, "speex"},
-	{ AST_FORMAT_ILBC, "iLBC"},
-	{ AST_FORMAT_G722, "G722"},
-	{ AST_FORMAT_G726_AAL2, "AAL2-G726-32"},
-	{ AST_FORMAT_AMRNB, "AMR"},
-	{ AST_FORMAT_JPEG, "JPEG"},
-	{ AST_FORMAT_PNG, "PNG"},
-	{ AST_FORMAT_H261, "H261"},
-	{ AST_FORMAT_H263, "H263"},
+	{ AST_FORMAT_G723, "G723", 8000}, /* OLD { AST_FORMAT_G723_1, "G723"}, */
+	{ AST_FORMAT_GSM, "GSM", 8000},
+	{ AST_FORMAT_ULAW, "PCMU", 8000},
+	{ AST_FORMAT_ALAW, "PCMA", 8000},
+	{ AST_FORMAT_G726, "G726-32", 8000},
+	{ AST_FORMAT_ADPCM, "DVI4", 8000},
+	{ AST_FORMAT_SLIN, "L16", 8000}, /* OLD { AST_FORMAT_SLINEAR, "L16"}, */
+	{ AST_FORMAT_SLIN16, "L16", 16000}, /* [v2.1] */
+	{ AST_FORMAT_LPC10, "LPC", 8000},
+	{ AST_FORMAT_G729, "G729", 8000}, /* { AST_FORMAT_G729A, "G729"}, */
+	{ AST_FORMAT_SPEEX, "speex", 8000},
+	{ AST_FORMAT_ILBC, "iLBC", 8000},
+	{ AST_FORMAT_G722, "G722", 8000}, /* [v2.1] 16 kHz audio, 8000 RTP clock (RFC 3551) */
+	{ AST_FORMAT_G726_AAL2, "AAL2-G726-32", 8000},
+	{ AST_FORMAT_AMRNB, "AMR", 8000},
+	{ AST_FORMAT_OPUS, "opus", 48000}, /* [v2.1] */
+	{ AST_FORMAT_JPEG, "JPEG", 90000},
+	{ AST_FORMAT_PNG, "PNG", 90000},
+	{ AST_FORMAT_H261, "H261", 90000},
+	{ AST_FORMAT_H263, "H263", 90000},
       /*{ AST_FORMAT_H263_PLUS, "H263-1998"}, OLD removed*/
-	{ AST_FORMAT_H263P, "H263-2000"},/* OLD { AST_FORMAT_H263_PLUS, "H263-2000"}, */
-	{ AST_FORMAT_H264, "H264"},
+	{ AST_FORMAT_H263P, "H263-2000", 90000},/* OLD { AST_FORMAT_H263_PLUS, "H263-2000"}, */
+	{ AST_FORMAT_H264, "H264", 90000},
      /*	{ AST_FORMAT_MPEG4, "MP4V-ES"}, OLD */
-	{ AST_FORMAT_MP4, "MP4V-ES"},
+	{ AST_FORMAT_MP4, "MP4V-ES", 90000},
 };
 
+/*
+ * [v2.1] rtpmap lookup table.
+ * Every a=rtpmap used to walk mimeTypes[] with a prefix strncasecmp(), so
+ * "H263" also took "H263-2000", and converted the bitfield to a format each
+ * time. load_module() now puts mimeTypes[] in an open addressing table keyed
+ * on the exact encoding name (HeaderNameHash(), case-insensitive) and clock
+ * rate, each entry holding a referenced ast_format.
+ */
+#define RTPMAP_TABLE_SIZE	64	/* power of 2, over twice the size of mimeTypes[] */
+
+struct RtpmapEntry
+{
+	const char		*name;		/* NULL if free */
+	int			 nameLen;
+	unsigned int		 hash;
+	int			 rate;
+	uint64_t		 format;
+	struct ast_format	*new_format;	/* referenced */
+};
+
+static struct RtpmapEntry rtpmapTable[RTPMAP_TABLE_SIZE];
+
+static void RtpmapTableBuild(void)
+{
+	struct RtpmapEntry *entry;
+	unsigned int hash;
+	int f;
+	int i;
+
+	for (f = 0; f < (int)(sizeof(mimeTypes)/sizeof(mimeTypes[0])); ++f)
+	{
+		/* No format in this Asterisk */
+		if (!mimeTypes[f].format)
+			continue;
+		/* Probe for a free slot, entries of the same name stay in mimeTypes[] order */
+		hash = HeaderNameHash(mimeTypes[f].name,strlen(mimeTypes[f].name));
+		for (i=hash&(RTPMAP_TABLE_SIZE-1); rtpmapTable[i].name; i=(i+1)&(RTPMAP_TABLE_SIZE-1))
+			;
+		entry = &rtpmapTable[i];
+		entry->name = mimeTypes[f].name;
+		entry->nameLen = strlen(mimeTypes[f].name);
+		entry->hash = hash;
+		entry->rate = mimeTypes[f].rate;
+		entry->format = mimeTypes[f].format;
+		entry->new_format = ao2_bump(ast_format_compatibility_bitfield2format(mimeTypes[f].format));
+	}
+}
+
+static void RtpmapTableDestroy(void)
+{
+	int i;
+
+	for (i=0;i<RTPMAP_TABLE_SIZE;i++)
+		ao2_cleanup(rtpmapTable[i].new_format);
+	memset(rtpmapTable,0,sizeof(rtpmapTable));
+}
+
+/* [v2.1] Entry for an encoding name and clock rate, rate 0 takes the default one */
+static const struct RtpmapEntry* RtpmapLookup(const char *name,int nameLen,int rate)
+{
+	const struct RtpmapEntry *entry;
+	unsigned int hash = HeaderNameHash(name,nameLen);
+	int i;
+
+	for (i=hash&(RTPMAP_TABLE_SIZE-1); rtpmapTable[i].name; i=(i+1)&(RTPMAP_TABLE_SIZE-1))
+	{
+		entry = &rtpmapTable[i];
+		if (entry->hash==hash && entry->nameLen==nameLen && (!rate || entry->rate==rate) &&
+		    !strncasecmp(entry->name,name,nameLen))
+			return entry;
+	}
+	return NULL;
+}
+
 typedef enum 
 {
 	RTCP_SR   = 200,
@@ -516,8 +909,9 @@ struct RtcpCommonHeader
 struct RtcpReceptionReport
 {
 	unsigned int  ssrc;            /* data source being reported */
-	unsigned int fraction:8;       /* fraction lost since last SR/RR */
-	int lost:24;                   /* cumulative number of packets lost (signed!) */
+     /*	unsigned int fraction:8;       fraction lost since last SR/RR */
+     /*	int lost:24;                   cumulative number of packets lost (signed!) */
+	unsigned int  fractionLost;    /* [v2.1] fraction (8 bits) and cumulative lost (24 bits signed), network order */
 	unsigned int  last_seq;        /* extended last sequence number received */
 	unsigned int  jitter;          /* interarrival jitter */
 	unsigned int  lsr;             /* last SR packet from this source */
@@ -587,38 +981,213 @@ struct RtpHeader
  /* unsigned int csrc[1];      * optional CSRC list. REMOVE. Not supported BY SIP. */
 };
 
+/* [v2.1] Received RTP header fields, host order */
+struct RtpPacketInfo
+{
+	uint16_t	seq;
+	unsigned int	ts;
+	unsigned int	ssrc;
+	int		marker;
+	int		payload;	/* type */
+	int		ini;		/* payload offset, past the CSRC list */
+};
+
+/* [v2.1] Read the RTP header at the start of packet. -1 if too short or nothing left for payload */
+static int RtpParseHeader(const uint8_t *packet,int len,struct RtpPacketInfo *info)
+{
+	const struct RtpHeader *rtp = (const struct RtpHeader*)packet;
+
+	/* If not got enough data */
+	if (len<12)
+		return -1;
+
+	/* Set data ini. Skip the CSRC list (4 bytes each) */
+	info->ini = sizeof(struct RtpHeader) + rtp->cc*4;
+
+	/* Nothing left for payload */
+	if (info->ini>=len)
+		return -1;
+
+	info->seq	= ntohs(rtp->seq);
+	info->ts	= ntohl(rtp->ts);
+	info->ssrc	= ntohl(rtp->ssrc);
+	info->marker	= rtp->m;
+	info->payload	= rtp->pt;
+
+	return 0;
+}
+
+#ifndef RTSP_SIP_STANDALONE /* [v2.1] */
+/*
+ * [v2.1] Receiver statistics for one RTP source, RFC 3550 appendix A.
+ * Replaces the old count/min/max SN tracking, which did not handle the
+ * 16 bit sequence wrap, hard coded jitter and put the last RTP timestamp
+ * in LSR. Sequence numbers are extended with a cycle count, a new SSRC
+ * goes through probation, jitter follows A.8 and loss is expected minus
+ * received, per interval for the fraction and cumulative for the count.
+ */
+#define RTP_SEQ_MOD		(1<<16)
+#define RTP_MAX_DROPOUT		3000
+#define RTP_MAX_MISORDER	100
+#define RTP_MIN_SEQUENTIAL	2
+
 struct MediaStats
 {
-	unsigned int count;
-	unsigned int minSN;
-	unsigned int maxSN;
-	unsigned int lastTS;
-	unsigned int ssrc;
-	struct timeval time;
+	unsigned int ssrc;            /* source being tracked */
+	int          valid;           /* got at least one packet from ssrc */
+	unsigned int rate;            /* RTP clock rate, for jitter */
+	uint16_t     maxSeq;          /* highest seq. number seen */
+	unsigned int cycles;          /* shifted count of seq. number cycles */
+	unsigned int baseSeq;         /* base seq number */
+	unsigned int badSeq;          /* last 'bad' seq number + 1 */
+	unsigned int probation;       /* sequ. packets till source is valid */
+	unsigned int received;        /* packets received */
+	unsigned int expectedPrior;   /* packet expected at last interval */
+	unsigned int receivedPrior;   /* packet received at last interval */
+	unsigned int transit;         /* relative trans time for prev pkt */
+	unsigned int jitter;          /* estimated jitter, scaled by 16 */
+	unsigned int lsr;             /* middle 32 bits of NTP timestamp of last SR */
+	struct timeval lsrTime;       /* when the last SR arrived */
+	struct timeval time;          /* reference for arrival timestamps */
 };
 
 static void MediaStatsReset(struct MediaStats *stats)
 {
-	stats->count 	= 0;
-	stats->minSN 	= 0;
-	stats->maxSN 	= 0;
-	stats->lastTS	= 0;
-	stats->time 	= ast_tvnow();
+	unsigned int rate = stats->rate;
+
+	/* Forget the source, keep the clock */
+	memset(stats,0,sizeof(struct MediaStats));
+	stats->rate	= rate ? rate : 8000;
+	stats->time	= ast_tvnow();
+}
+
+static void MediaStatsSetRate(struct MediaStats *stats, unsigned int rate)
+{
+	if (rate)
+		stats->rate = rate;
+}
+
+/* A.1 init_seq() */
+static void MediaStatsInitSeq(struct MediaStats *stats, uint16_t seq)
+{
+	stats->baseSeq		= seq;
+	stats->maxSeq		= seq;
+	stats->badSeq		= RTP_SEQ_MOD + 1;   /* so seq == badSeq is false */
+	stats->cycles		= 0;
+	stats->received		= 0;
+	stats->receivedPrior	= 0;
+	stats->expectedPrior	= 0;
+}
+
+/* A.1 update_seq(). Returns 0 while the source is on probation or for a bogus packet */
+static int MediaStatsUpdateSeq(struct MediaStats *stats, uint16_t seq)
+{
+	uint16_t udelta = seq - stats->maxSeq;
+
+	/*
+	 * Source is not valid until RTP_MIN_SEQUENTIAL packets with
+	 * sequential sequence numbers have been received.
+	 */
+	if (stats->probation)
+	{
+		/* packet is in sequence */
+		if (seq == (uint16_t)(stats->maxSeq + 1))
+		{
+			stats->probation--;
+			stats->maxSeq = seq;
+			if (stats->probation == 0)
+			{
+				MediaStatsInitSeq(stats,seq);
+				stats->received++;
+				return 1;
+			}
+		} else {
+			stats->probation = RTP_MIN_SEQUENTIAL - 1;
+			stats->maxSeq = seq;
+		}
+		return 0;
+	} else if (udelta < RTP_MAX_DROPOUT) {
+		/* in order, with permissible gap */
+		if (seq < stats->maxSeq)
+			/* Sequence number wrapped - count another 64K cycle */
+			stats->cycles += RTP_SEQ_MOD;
+		stats->maxSeq = seq;
+	} else if (udelta <= RTP_SEQ_MOD - RTP_MAX_MISORDER) {
+		/* the sequence number made a very large jump */
+		if (seq == stats->badSeq)
+		{
+			/*
+			 * Two sequential packets -- assume that the other side
+			 * restarted without telling us so just re-sync
+			 * (i.e., pretend this was the first packet).
+			 */
+			MediaStatsInitSeq(stats,seq);
+		} else {
+			stats->badSeq = (seq + 1) & (RTP_SEQ_MOD-1);
+			return 0;
+		}
+	} else {
+		/* duplicate or reordered packet */
+	}
+	stats->received++;
+	return 1;
 }
 
 static void MediaStatsUpdate(struct MediaStats *stats,unsigned int ts,unsigned int sn,unsigned int ssrc)
 {
-	stats->ssrc = ssrc;
-	stats->count++;
-	if (!stats->minSN)
-		stats->minSN = sn;
-	if (stats->maxSN<sn)
-		stats->maxSN = sn;
-	stats->lastTS = ts;
+	unsigned int arrival;
+	unsigned int transit;
+	int d;
+
+	/* New source goes on probation */
+	if (!stats->valid || stats->ssrc!=ssrc)
+	{
+		if (stats->valid)
+			ast_debug(2,"-rtp ssrc changed %08x -> %08x\n",stats->ssrc,ssrc);
+		stats->ssrc = ssrc;
+		stats->valid = 1;
+		stats->lsr = 0;
+		stats->transit = 0;
+		stats->jitter = 0;
+		MediaStatsInitSeq(stats,sn);
+		stats->maxSeq = sn - 1;
+		stats->probation = RTP_MIN_SEQUENTIAL;
+	}
+
+	/* Sequence */
+	if (!MediaStatsUpdateSeq(stats,sn))
+		return;
+
+	/* A.8 interarrival jitter, arrival time in timestamp units */
+	arrival = (unsigned int)(ast_tvdiff_us(ast_tvnow(),stats->time)*stats->rate/1000000);
+	transit = arrival - ts;
+	if (stats->transit)
+	{
+		d = (int)(transit - stats->transit);
+		if (d < 0)
+			d = -d;
+		stats->jitter += d - ((stats->jitter + 8) >> 4);
+	}
+	stats->transit = transit;
+}
+
+/* [v2.1] Remember when an SR came in, for LSR/DLSR */
+static void MediaStatsSR(struct MediaStats *stats, unsigned int ntpSec, unsigned int ntpFrac)
+{
+	stats->lsr	= (ntpSec << 16) | (ntpFrac >> 16);
+	stats->lsrTime	= ast_tvnow();
 }
 
-static void MediaStatsRR(struct MediaStats *stats, struct Rtcp *rtcp)
+static void MediaStatsRR(struct MediaStats *stats, struct Rtcp *rtcp, unsigned int localSsrc)
 {
+	unsigned int extendedMax;
+	unsigned int expected;
+	unsigned int expectedInterval;
+	unsigned int receivedInterval;
+	int lostInterval;
+	int lost;
+	unsigned int fraction;
+
 	/* Set pointer as ssrc */
 	/* COMMENT 
 	 * Build a Receiver Report packet.
@@ -632,33 +1201,57 @@ static void MediaStatsRR(struct MediaStats *stats, struct Rtcp *rtcp)
 	 * The next line originally set the SSRC to a pointer's value
  	 * because the pointer value is fairly random as the SSRC value.
  	 * However it doesn't always port/compile very well.  Let's use random() instead.
+	 * [v2.1] Use the player's SSRC so it is the same in every report.
  	 */
      /* rtcp->r.rr.ssrc = htonl(stats); OLD */
-        rtcp->r.rr.ssrc = htonl((uint32_t)random()); /* PORT17.5 fix compiler warning */
+     /* rtcp->r.rr.ssrc = htonl((uint32_t)random()); PORT17.5 fix compiler warning */
+	rtcp->r.rr.ssrc = htonl(localSsrc);
 
 	/* data source being reported */
 	rtcp->r.rr.rr[0].ssrc = htonl(stats->ssrc);
 
+	/* A.3 expected and lost packets */
+	extendedMax = stats->cycles + stats->maxSeq;
+	expected = stats->received ? extendedMax - stats->baseSeq + 1 : 0;
+	lost = (int)(expected - stats->received);
+	/* Clamp to 24 bit signed */
+	if (lost > 0x7FFFFF)
+		lost = 0x7FFFFF;
+	else if (lost < -0x800000)
+		lost = -0x800000;
+
 	/* fraction lost since last SR/RR */
-	if (stats->maxSN-stats->minSN>0)
-		rtcp->r.rr.rr[0].fraction = (signed)(255*stats->count/(stats->maxSN-stats->minSN)); 
+	expectedInterval = expected - stats->expectedPrior;
+	stats->expectedPrior = expected;
+	receivedInterval = stats->received - stats->receivedPrior;
+	stats->receivedPrior = stats->received;
+	lostInterval = (int)(expectedInterval - receivedInterval);
+	if (expectedInterval == 0 || lostInterval <= 0)
+		fraction = 0;
 	else
-		rtcp->r.rr.rr[0].fraction = 0xFF;
+		fraction = (lostInterval << 8) / expectedInterval;
 
-	/* cumulative number of packets lost (signed!) */
-	rtcp->r.rr.rr[0].lost = htonl((signed int)(stats->maxSN-stats->minSN-stats->count));
+	/* fraction lost (8 bits) and cumulative number of packets lost (24 bits, signed!) */
+	rtcp->r.rr.rr[0].fractionLost = htonl((fraction << 24) | ((unsigned int)lost & 0xFFFFFF));
 
 	/* extended last sequence number received */
-	rtcp->r.rr.rr[0].last_seq = htonl(stats->maxSN);
+	rtcp->r.rr.rr[0].last_seq = htonl(extendedMax);
 
 	/* interarrival jitter */
-	rtcp->r.rr.rr[0].jitter	= htonl(0xFF);
+	rtcp->r.rr.rr[0].jitter	= htonl(stats->jitter >> 4);
 
 	/* last SR packet from this source */	
-	rtcp->r.rr.rr[0].lsr = htonl(stats->lastTS);
+	rtcp->r.rr.rr[0].lsr = htonl(stats->lsr);
+
+	/* delay since last SR packet, in 1/65536 seconds */
+	if (stats->lsr)
+		rtcp->r.rr.rr[0].dlsr = htonl((unsigned int)(ast_tvdiff_us(ast_tvnow(),stats->lsrTime)*65536/1000000));
+	else
+		rtcp->r.rr.rr[0].dlsr = 0;
 
-	/* delay since last SR packet */
-	rtcp->r.rr.rr[0].dlsr = htonl(ast_tvdiff_ms(ast_tvnow(),stats->time));
+	/* log */
+	ast_debug(2,"-rr ssrc %08x: expected %u received %u lost %d fraction %u/256 jitter %u\n",
+		stats->ssrc,expected,stats->received,lost,fraction,stats->jitter >> 4);
 
 	/* Set common headers */
 	rtcp->common.version	= 2;
@@ -669,35 +1262,605 @@ static void MediaStatsRR(struct MediaStats *stats, struct Rtcp *rtcp)
 	/* Length */
 	rtcp->common.length = htons(7);
 }
+#endif /* RTSP_SIP_STANDALONE */
 
 
-/* [17.x NEW]. For SIP */
-enum SipMethodsIndex
+/*
+ * [v2.1] RTP sender for the SIP talkback leg. The old code picked a new
+ * random SSRC for every packet and took seq/ts from frame counters, so the
+ * speaker saw each packet as a new source. One SSRC per leg now, random
+ * initial seq and timestamp (RFC 3550 5.1), the timestamp advanced by the
+ * samples of each frame on the codec clock and by wall clock across gaps,
+ * and the marker set on the first packet of each talkspurt. Sender Reports
+ * go out through an RtcpSession, and the speaker's reception reports about
+ * us are kept so talkback loss, jitter and round trip time are visible.
+ */
+#define RTP_TALKSPURT_GAP	200	/* ms without a frame ends a talkspurt */
+
+struct RtpSender
 {
-	INVITE,  /* 0 */
-	OPTIONS,
-	ACK,
-	CANCEL,
-	BYE,
-	REFER,
-	NOTIFY,
-	MESSAGE,
-	SUBSCRIBE,
-	INFO,
-	MAX_METHODS
+	unsigned int		ssrc;
+	uint16_t		seq;            /* of the next packet */
+	unsigned int		ts;             /* of the next packet */
+	unsigned int		rate;           /* codec clock */
+	int			payload;
+	int			started;
+	struct timeval		lastFrame;
+	unsigned int		lastTs;         /* with lastFrame, the SR mapping */
+	unsigned int		psent;
+	unsigned int		osent;
+	unsigned int		talkspurts;
+
+	/* From the speaker's reception reports */
+	unsigned int		rrs;
+	unsigned int		fraction;       /* /256, last interval */
+	int			lost;           /* cumulative */
+	unsigned int		jitter;         /* timestamp units */
+	int			rtt;            /* ms, -1 unknown */
 };
 
-/* 
- * [17.x Changed]. 
- * RTSP Player was orignally modelled as a stream player 
- *   to get the camera to send streams to it.
- * Add stuff so SIP will use a Player instance to model 
- *   itself as a SIP Client.
- *  
- */
-struct RtspPlayer
+static void RtpSenderInit(struct RtpSender *sender,int payload)
 {
-	int	fd;
+	memset(sender,0,sizeof(struct RtpSender));
+	sender->ssrc	= (unsigned int)ast_random();
+	sender->seq	= (uint16_t)ast_random();
+	sender->ts	= (unsigned int)ast_random();
+	sender->rate	= 8000;
+	sender->payload	= payload;
+	sender->rtt	= -1;
+}
+
+/*
+ * Fill the caller's RTP header for a frame of samples at sampleRate going out
+ * at now, sent ahead of the payload, and advance seq and timestamp.
+ * clockRate is the codec's RTP clock. A sampleRate of 0 counts samples on it.
+ */
+static void RtpSenderStampAt(struct RtpSender *sender,struct RtpHeader *rtp,struct timeval now,
+			     unsigned int sampleRate,unsigned int clockRate,int samples,int datalen)
+{
+	int marker = 0;
+
+	/* RTP clock of the codec, not its sample rate (G.722) */
+	if (sampleRate)
+		sender->rate = clockRate;
+
+	/* New talkspurt, the timestamp covers the silence */
+	if (!sender->started)
+	{
+		sender->started = 1;
+		marker = 1;
+	} else if (ast_tvdiff_ms(now,sender->lastFrame)>RTP_TALKSPURT_GAP) {
+		sender->ts = sender->lastTs + (unsigned int)(ast_tvdiff_us(now,sender->lastFrame)*sender->rate/1000000);
+		marker = 1;
+	}
+	if (marker)
+		sender->talkspurts++;
+
+	rtp->version	= 2;
+	rtp->p		= 0;
+	rtp->x		= 0;
+	rtp->cc		= 0;
+	rtp->m		= marker;
+	rtp->pt		= sender->payload;
+	rtp->seq	= htons(sender->seq);
+	rtp->ts		= htonl(sender->ts);
+	rtp->ssrc	= htonl(sender->ssrc);
+
+	sender->lastTs	  = sender->ts;
+	sender->lastFrame = now;
+	sender->seq++;
+	sender->ts += sampleRate ? (unsigned int)((uint64_t)samples*sender->rate/sampleRate) : (unsigned int)samples;
+	sender->psent++;
+	sender->osent += datalen;
+}
+
+#ifndef RTSP_SIP_STANDALONE /* [v2.1] */
+static int RtpClockRate(struct ast_format *format);
+#define NTP_UNIX_OFFSET		2208988800U
+
+/* Wall clock as 32.32 NTP */
+static uint64_t RtcpNtpNow(void)
+{
+	struct timeval now = ast_tvnow();
+
+	return ((uint64_t)((unsigned int)now.tv_sec + NTP_UNIX_OFFSET) << 32) | (((uint64_t)now.tv_usec << 32)/1000000);
+}
+
+/* Stamp for this frame, now */
+static void RtpSenderStamp(struct RtpSender *sender,struct RtpHeader *rtp,struct ast_frame *f)
+{
+	unsigned int sampleRate = ast_format_get_sample_rate(f->subclass.format);
+
+	RtpSenderStampAt(sender,rtp,ast_tvnow(),sampleRate,sampleRate ? RtpClockRate(f->subclass.format) : 0,f->samples,f->datalen);
+}
+
+/* SR sender info, extrapolating our timestamp to now */
+static void RtpSenderInfo(struct RtpSender *sender,struct Rtcp *rtcp)
+{
+	uint64_t ntp = RtcpNtpNow();
+
+	rtcp->r.sr.ssrc		= htonl(sender->ssrc);
+	rtcp->r.sr.ntp_sec	= htonl((unsigned int)(ntp >> 32));
+	rtcp->r.sr.ntp_frac	= htonl((unsigned int)ntp);
+	rtcp->r.sr.rtp_ts	= htonl(sender->lastTs + (sender->started ? (unsigned int)(ast_tvdiff_us(ast_tvnow(),sender->lastFrame)*sender->rate/1000000) : 0));
+	rtcp->r.sr.psent	= htonl(sender->psent);
+	rtcp->r.sr.osent	= htonl(sender->osent);
+}
+
+/* A reception report block about us */
+static void RtpSenderReport(struct RtpSender *sender,const struct RtcpReceptionReport *rr)
+{
+	unsigned int fractionLost = ntohl(rr->fractionLost);
+	unsigned int lsr = ntohl(rr->lsr);
+	unsigned int now;
+
+	sender->rrs++;
+	sender->fraction = fractionLost >> 24;
+	/* 24 bit signed */
+	sender->lost = (int)(fractionLost << 8) >> 8;
+	sender->jitter = ntohl(rr->jitter);
+	/* A.8 round trip, in 1/65536 s */
+	if (lsr)
+	{
+		now = (unsigned int)(RtcpNtpNow() >> 16);
+		sender->rtt = (int)((uint64_t)(now - lsr - ntohl(rr->dlsr))*1000 >> 16);
+	}
+
+	/* log */
+	ast_debug(3,"-talkback rr: fraction %u/256 lost %d jitter %u rtt %d ms\n",
+		sender->fraction,sender->lost,sender->jitter,sender->rtt);
+}
+
+static void RtpSenderLogStats(struct RtpSender *sender)
+{
+	ast_debug(2,"-talkback ssrc %08x: %u packets %u octets in %u talkspurts, speaker reports %u: fraction lost %u/256, lost %d, jitter %u ms, rtt %d ms\n",
+		sender->ssrc,sender->psent,sender->osent,sender->talkspurts,sender->rrs,sender->fraction,sender->lost,
+		sender->rate ? sender->jitter*1000/sender->rate : 0,sender->rtt);
+}
+
+/*
+ * [v2.1] RTCP session engine, one per camera stream.
+ * Parses compound packets from the camera (SR, RR, SDES, BYE, APP) with
+ * bounds checks, keeps the SR NTP/RTP mapping for A/V sync and an estimate
+ * of the camera RTP clock drift, and schedules our RR + SDES CNAME on the
+ * RFC 3550 randomized interval (appendix A.7) instead of answering every
+ * packet and a fixed 10 s timer.
+ */
+#define RTCP_MIN_TIME		5.0		/* seconds */
+#define RTCP_BW_FRACTION	0.05		/* of session bandwidth */
+#define RTCP_COMPENSATION	(2.71828 - 1.5)
+#define RTCP_UDP_IP_OVERHEAD	28		/* octets added to every packet for avgSize */
+#define RTCP_CNAME_MAX		64
+#define RTCP_COMPOUND_MAX	(4+52+8+2+255+1+3+8)	/* '$' header, SR with one block, SDES, BYE */
+
+/* SR NTP/RTP mapping */
+struct RtcpSenderClock
+{
+	int		valid;
+	uint64_t	ntp;            /* 32.32 fixed point seconds */
+	unsigned int	rtpTs;
+	unsigned int	psent;
+	unsigned int	osent;
+	struct timeval	arrival;
+};
+
+/* [v2.1] UDP reports go through the session's media reactor, see MediaSessionSend() */
+struct MediaSession;
+static int MediaSessionSend(struct MediaSession *media,int fd,const struct iovec *iov,int iovcnt);
+
+struct RtcpSession
+{
+	int			fd;
+	int			channel;        /* interleaved channel on fd, -1 for UDP */
+	struct MediaSession	*media;         /* UDP sends queued on its reactor ring, NULL sends directly */
+	struct MediaStats	*stats;         /* the camera source we report on */
+	unsigned int		localSsrc;
+	const char		*cname;         /* our CNAME */
+
+	/* From the camera */
+	char			peerCname[RTCP_CNAME_MAX];
+	struct RtcpSenderClock	first;          /* first SR, drift reference */
+	struct RtcpSenderClock	last;           /* latest SR */
+	double			drift;          /* ppm, camera RTP clock against its NTP clock */
+	int			bye;
+
+	/* Scheduling, A.7 */
+	int			members;
+	int			senders;
+	double			bandwidth;      /* RTCP bandwidth, octets/s. 0 if unknown */
+	double			avgSize;        /* average compound packet size, octets */
+	int			initial;
+	struct timeval		next;           /* when our next report is due */
+
+	/* Counters */
+	unsigned int		srs;
+	unsigned int		rrs;
+	unsigned int		sdes;
+	unsigned int		byes;
+	unsigned int		apps;
+	unsigned int		malformed;
+	unsigned int		sent;
+
+	/* Set when we send, SR instead of RR */
+	struct RtpSender	*sender;
+};
+
+/* A.7 rtcp_interval(), in seconds. We never send media to the camera */
+static double RtcpInterval(struct RtcpSession *session)
+{
+	double rtcpMinTime = session->initial ? RTCP_MIN_TIME/2 : RTCP_MIN_TIME;
+	double rtcpBw = session->bandwidth;
+	double t;
+	int n = session->members;
+
+	/*
+	 * Dedicate a fraction of the RTCP bandwidth to senders unless
+	 * the number of senders is large enough that their share is
+	 * more than that fraction.
+	 */
+	if (session->senders <= session->members*0.25)
+	{
+		rtcpBw *= 1 - 0.25;
+		n -= session->senders;
+	}
+
+	/* Interval from bandwidth, but not less than the minimum */
+	t = rtcpBw>0 ? session->avgSize*n/rtcpBw : rtcpMinTime;
+	if (t < rtcpMinTime)
+		t = rtcpMinTime;
+
+	/* Randomize to [0.5,1.5] times, compensate for the timer reconsideration bias */
+	t = t * ((double)(ast_random() % 1000000)/1000000 + 0.5);
+	return t / RTCP_COMPENSATION;
+}
+
+static void RtcpSessionSchedule(struct RtcpSession *session)
+{
+	session->next = ast_tvadd(ast_tvnow(),ast_samp2tv((unsigned int)(RtcpInterval(session)*1000),1000));
+}
+
+/*
+ * Start reporting on a stream.
+ * sessionKbps is b=AS from the SDP, 0 if the camera did not say.
+ * channel is the interleaved RTCP channel when fd is the RTSP connection.
+ */
+static void RtcpSessionInit(struct RtcpSession *session, int fd, int channel, struct MediaStats *stats,
+			    unsigned int localSsrc, const char *cname, int sessionKbps)
+{
+	memset(session,0,sizeof(struct RtcpSession));
+	session->fd		= fd;
+	session->channel	= channel;
+	session->stats		= stats;
+	session->localSsrc	= localSsrc;
+	session->cname		= cname;
+	session->members	= 2;    /* camera and us */
+	session->senders	= 1;    /* camera */
+	session->bandwidth	= sessionKbps*1000/8*RTCP_BW_FRACTION;
+	session->avgSize	= 32 + 20 + RTCP_UDP_IP_OVERHEAD;    /* RR + small SDES */
+	session->initial	= 1;
+	RtcpSessionSchedule(session);
+}
+
+/* ms until the next report is due */
+static int RtcpSessionNext(struct RtcpSession *session)
+{
+	int64_t ms;
+
+	if (session->fd<=0)
+		return INT_MAX;
+	ms = ast_tvdiff_ms(session->next,ast_tvnow());
+	return ms>0 ? (int)ms : 0;
+}
+
+/* Record an SR. Returns 0 if too short */
+static int RtcpSessionSR(struct RtcpSession *session, const struct Rtcp *rtcp, int len)
+{
+	struct RtcpSenderClock clock;
+	double ntpDelta;
+	double rtpDelta;
+
+	/* Header, ssrc and sender info */
+	if (len<28)
+		return 0;
+
+	clock.valid	= 1;
+	clock.ntp	= ((uint64_t)ntohl(rtcp->r.sr.ntp_sec) << 32) | ntohl(rtcp->r.sr.ntp_frac);
+	clock.rtpTs	= ntohl(rtcp->r.sr.rtp_ts);
+	clock.psent	= ntohl(rtcp->r.sr.psent);
+	clock.osent	= ntohl(rtcp->r.sr.osent);
+	clock.arrival	= ast_tvnow();
+
+	/* LSR/DLSR for our RR */
+	MediaStatsSR(session->stats,ntohl(rtcp->r.sr.ntp_sec),ntohl(rtcp->r.sr.ntp_frac));
+
+	/* Drift of RTP clock against NTP clock since the first SR */
+	if (!session->first.valid)
+		session->first = clock;
+	else if (clock.ntp>session->first.ntp && session->stats->rate) {
+		ntpDelta = (double)(clock.ntp - session->first.ntp)/4294967296.0;
+		rtpDelta = (double)(unsigned int)(clock.rtpTs - session->first.rtpTs)/session->stats->rate;
+		/* Only once there is enough of a baseline */
+		if (ntpDelta>=10.0)
+			session->drift = (rtpDelta/ntpDelta - 1.0)*1000000.0;
+	}
+	session->last = clock;
+	session->srs++;
+
+	return 1;
+}
+
+/* Record the CNAME from an SDES. Returns 0 if malformed */
+static int RtcpSessionSDES(struct RtcpSession *session, const uint8_t *data, int len, int chunks)
+{
+	int pos = 4;   /* skip common header */
+	int type;
+	int itemLen;
+
+	while (chunks-- > 0)
+	{
+		/* SSRC/CSRC */
+		if (pos+4>len)
+			return 0;
+		pos += 4;
+		/* Items up to END */
+		while (pos<len && data[pos]!=RTCP_SDES_END)
+		{
+			if (pos+2>len)
+				return 0;
+			type = data[pos];
+			itemLen = data[pos+1];
+			if (pos+2+itemLen>len)
+				return 0;
+			if (type==RTCP_SDES_CNAME)
+				ast_copy_string(session->peerCname,(const char*)data+pos+2,
+						itemLen+1<RTCP_CNAME_MAX ? itemLen+1 : RTCP_CNAME_MAX);
+			pos += 2+itemLen;
+		}
+		/* END and padding to the next 32 bit boundary */
+		pos = (pos+4) & ~3;
+	}
+	session->sdes++;
+
+	return 1;
+}
+
+/*
+ * Parse a compound RTCP packet from the camera.
+ * Returns number of packets parsed; stops at the first malformed one.
+ */
+static int RtcpSessionParse(struct RtcpSession *session, const uint8_t *buffer, int bufferLen)
+{
+	const struct Rtcp *rtcp;
+	int num = 0;
+	int pos = 0;
+	int len;
+	int i;
+
+	/* Each packet in the compound */
+	while (pos+4<=bufferLen)
+	{
+		rtcp = (const struct Rtcp*)(buffer+pos);
+		len = (ntohs(rtcp->common.length)+1)*4;
+
+		/* Version and length must fit */
+		if (rtcp->common.version!=2 || pos+len>bufferLen)
+		{
+			session->malformed++;
+			ast_debug(3,"-malformed rtcp packet at %d of %d\n",pos,bufferLen);
+			break;
+		}
+
+		/* Depending on type */
+		switch (rtcp->common.pt)
+		{
+			case RTCP_SR:
+				if (!RtcpSessionSR(session,rtcp,len))
+					session->malformed++;
+				/* [v2.1] Reports about what we send */
+				else if (session->sender)
+					for (i=0;i<rtcp->common.count && 28+(i+1)*24<=len;i++)
+						if (ntohl(rtcp->r.sr.rr[i].ssrc)==session->sender->ssrc)
+							RtpSenderReport(session->sender,&rtcp->r.sr.rr[i]);
+				break;
+			case RTCP_RR:
+				session->rrs++;
+				/* [v2.1] Reports about what we send */
+				if (session->sender)
+					for (i=0;i<rtcp->common.count && 8+(i+1)*24<=len;i++)
+						if (ntohl(rtcp->r.rr.rr[i].ssrc)==session->sender->ssrc)
+							RtpSenderReport(session->sender,&rtcp->r.rr.rr[i]);
+				break;
+			case RTCP_SDES:
+				if (!RtcpSessionSDES(session,buffer+pos,len,rtcp->common.count))
+					session->malformed++;
+				break;
+			case RTCP_BYE:
+				session->byes++;
+				/* Only when the source we play says goodbye */
+				for (i=0;i<rtcp->common.count && 4+(i+1)*4<=len;i++)
+					if (!session->stats->valid || ntohl(rtcp->r.bye.src[i])==session->stats->ssrc)
+						session->bye = 1;
+				/* BYE without SSRC list */
+				if (!rtcp->common.count)
+					session->bye = 1;
+				break;
+			case RTCP_APP:
+				session->apps++;
+				break;
+			default:
+				ast_debug(3,"-unknown rtcp packet type %d\n",rtcp->common.pt);
+				break;
+		}
+		pos += len;
+		num++;
+	}
+
+	/* Everybody's packets count for the average size */
+	session->avgSize = (bufferLen+RTCP_UDP_IP_OVERHEAD)/16.0 + 15.0*session->avgSize/16.0;
+
+	return num;
+}
+
+/* Append SDES CNAME, and optionally BYE, after the RR (SR when sending). Returns compound length */
+static int RtcpSessionCompound(struct RtcpSession *session, uint8_t *buffer, int bye)
+{
+	struct Rtcp rtcp;
+	struct Rtcp sr;
+	uint32_t ssrc = htonl(session->localSsrc);
+	int cnameLen = strlen(session->cname);
+	int len;
+	int sdesLen;
+
+	/* RR */
+	MediaStatsRR(session->stats,&rtcp,session->localSsrc);
+	len = (ntohs(rtcp.common.length)+1)*4;
+	memcpy(buffer,&rtcp,len);
+
+	/* [v2.1] SR, with the block of the RR if we also receive */
+	if (session->sender)
+	{
+		memset(&sr,0,sizeof(sr));
+		RtpSenderInfo(session->sender,&sr);
+		sr.common.version	= 2;
+		sr.common.p		= 0;
+		sr.common.count		= session->stats->valid ? 1 : 0;
+		sr.common.pt		= RTCP_SR;
+		sr.common.length	= htons(6+6*sr.common.count);
+		if (sr.common.count)
+			sr.r.sr.rr[0] = rtcp.r.rr.rr[0];
+		len = (ntohs(sr.common.length)+1)*4;
+		memcpy(buffer,&sr,len);
+	}
+
+	/* SDES: header, ssrc, CNAME item, END, padded to 32 bits */
+	if (cnameLen>255)
+		cnameLen = 255;
+	sdesLen = (4 + 4 + 2 + cnameLen + 1 + 3) & ~3;
+	memset(buffer+len,0,sdesLen);
+	buffer[len]	= 0x81;          /* V=2, P=0, SC=1 */
+	buffer[len+1]	= RTCP_SDES;
+	buffer[len+2]	= (sdesLen/4-1) >> 8;
+	buffer[len+3]	= (sdesLen/4-1) & 0xFF;
+	memcpy(buffer+len+4,&ssrc,4); /* may be unaligned */
+	buffer[len+8]	= RTCP_SDES_CNAME;
+	buffer[len+9]	= cnameLen;
+	memcpy(buffer+len+10,session->cname,cnameLen);
+	len += sdesLen;
+
+	/* BYE with our ssrc */
+	if (bye)
+	{
+		buffer[len]	= 0x81;  /* V=2, P=0, SC=1 */
+		buffer[len+1]	= RTCP_BYE;
+		buffer[len+2]	= 0;
+		buffer[len+3]	= 1;
+		memcpy(buffer+len+4,&ssrc,4);
+		len += 8;
+	}
+
+	return len;
+}
+
+/* Send a compound built at buffer+4. Interleaved gets the '$' header in front */
+static int RtcpSessionSend(struct RtcpSession *session, uint8_t *buffer, int len)
+{
+	struct iovec iov;
+
+	/* UDP, on the reactor ring if the session has one */
+	if (session->channel<0)
+	{
+		iov.iov_base = buffer+4;
+		iov.iov_len = len;
+		return MediaSessionSend(session->media,session->fd,&iov,1);
+	}
+
+	/* Interleaved */
+	buffer[0] = '$';
+	buffer[1] = session->channel;
+	buffer[2] = len >> 8;
+	buffer[3] = len & 0xFF;
+	return send(session->fd,buffer,len+4,0);
+}
+
+/* Send our report if due. Returns 1 if sent */
+static int RtcpSessionTick(struct RtcpSession *session)
+{
+	uint8_t buffer[RTCP_COMPOUND_MAX];
+	int len;
+
+	/* Not connected or not yet */
+	if (session->fd<=0 || ast_tvcmp(ast_tvnow(),session->next)<0)
+		return 0;
+
+	/* Build and send */
+	len = RtcpSessionCompound(session,buffer+4,0);
+	if (RtcpSessionSend(session,buffer,len)<0)
+		ast_debug(2,"-failed sending rtcp report [%d]\n",errno);
+	else
+		session->sent++;
+
+	/* Reschedule */
+	session->avgSize = (len+RTCP_UDP_IP_OVERHEAD)/16.0 + 15.0*session->avgSize/16.0;
+	session->initial = 0;
+	RtcpSessionSchedule(session);
+
+	/* log */
+	ast_debug(2,"-sent rtcp report on [%d], next in %d ms\n",session->fd,RtcpSessionNext(session));
+
+	return 1;
+}
+
+/* Say goodbye when leaving */
+static void RtcpSessionBye(struct RtcpSession *session)
+{
+	uint8_t buffer[RTCP_COMPOUND_MAX];
+	int len;
+
+	if (session->fd<=0)
+		return;
+	len = RtcpSessionCompound(session,buffer+4,1);
+	RtcpSessionSend(session,buffer,len);
+}
+
+static void RtcpSessionLogStats(struct RtcpSession *session, const char *name)
+{
+	ast_debug(2,"-rtcp %s: cname '%s', %u SR, %u RR, %u SDES, %u BYE, %u APP, %u malformed, %u reports sent\n",
+		name,session->peerCname,session->srs,session->rrs,session->sdes,session->byes,session->apps,
+		session->malformed,session->sent);
+	if (session->last.valid)
+		ast_debug(2,"-rtcp %s: last SR ntp %08x.%08x rtp %u, %u packets %u octets sent, clock drift %.1f ppm\n",
+			name,(unsigned int)(session->last.ntp>>32),(unsigned int)session->last.ntp,
+			session->last.rtpTs,session->last.psent,session->last.osent,session->drift);
+}
+
+
+/* [17.x NEW]. For SIP */
+enum SipMethodsIndex
+{
+	INVITE,  /* 0 */
+	OPTIONS,
+	ACK,
+	CANCEL,
+	BYE,
+	REFER,
+	NOTIFY,
+	MESSAGE,
+	SUBSCRIBE,
+	INFO,
+	MAX_METHODS
+};
+
+/* 
+ * [17.x Changed]. 
+ * RTSP Player was orignally modelled as a stream player 
+ *   to get the camera to send streams to it.
+ * Add stuff so SIP will use a Player instance to model 
+ *   itself as a SIP Client.
+ *  
+ */
+struct RtspPlayer
+{
+	int	fd;
 	int	state;
 	int	cseq;     
 	char*	session[2];
@@ -711,6 +1874,18 @@ struct RtspPlayer
 	int	isIPv6;
 
 	char*	authorization;
+	int	authScheme;       /* [v2.1] AUTH_SCHEME_xxx of the last challenge, or cached */
+	char	authRealm[32];    /* [v2.1] */
+	char	authNonce[64];    /* [v2.1] */
+	char	authOpaque[64];   /* [v2.1] */
+	char	authKey[256];     /* [v2.1] auth cache key */
+	char*	authUsername;     /* [v2.1] caller's, not freed */
+	char*	authPassword;     /* [v2.1] caller's, not freed */
+	int	authAttempts;     /* [v2.1] challenges answered */
+	int	pipelined;        /* [v2.1] SETUP and PLAY sent back to back */
+	struct RtspPending pending[RTSP_MAX_PENDING]; /* [v2.1] */
+	int	numPending;       /* [v2.1] */
+	int	resumeState;      /* [v2.1] step to redo serially after the camera rejected the pipeline */
 
 	int	audioRtp;      /* file descriptor */
 	int	audioRtcp;     /* file descriptor */
@@ -724,6 +1899,13 @@ struct RtspPlayer
 
 	struct 	MediaStats audioStats;
 	struct	MediaStats videoStats;
+	unsigned int ssrc;     /* [v2.1] our SSRC in RTCP reports */
+	char	cname[32];     /* [v2.1] our SDES CNAME */
+	int	sessionTimeout;/* [v2.1] RTSP session timeout, seconds */
+
+	int	interleaved;   /* [v2.1] RTP/AVP/TCP, media on fd */
+	int	audioChannel;  /* [v2.1] interleaved rtp channel, rtcp is +1 */
+	int	videoChannel;  /* [v2.1] interleaved rtp channel, rtcp is +1 */
 
         /* [17.x NEW]. SIP */
 	char*   local_ctrl_ip; /* source IPv4 address string used by SIP */
@@ -736,7 +1918,10 @@ struct RtspPlayer
 	char    branch_id[100];/* SIP random branch_id last transaction. Hopefully only on transaction per time. */
 	/* SDP */
 	char    session_id[64];/* SDP for SIP sessionID */
+	int	sipOffer[SIP_MAX_CODECS]; /* [v2.1] sipCodecs[] indexes in the INVITE, in order */
+	int	numSipOffer;   /* [v2.1] */
 };
+#endif /* RTSP_SIP_STANDALONE */
 
 
 /*
@@ -800,6 +1985,18 @@ struct RtspPlayer
  */ 
 
 
+/*
+ * [v2.1] An auth param.
+ * Key and value point into the message and are not terminated.
+ */
+struct AuthParam
+{
+    const char *key;
+    int keyLen;
+    const char *value;
+    int valueLen;
+};
+
 /*
  * [v2.0] Parse for Authentication Scheme
  * 
@@ -809,18 +2006,16 @@ struct RtspPlayer
  * It then returns (as an arg) what should be the location of the start of the 
  * authentication parameters for that scheme which
  * should be after all the 1 or more SPs.
+ * [v2.1] The input is len bytes long, the scheme is its first *schemeLen bytes.
  *
  */
-static int parse_auth_scheme(char *input, char *scheme, char **rest) {
+static int parse_auth_scheme(const char *input, int len, int *schemeLen, const char **rest) {
     int i = 0;
-    while (input[i] && !isspace((unsigned char)input[i]) && i < MAX_TOKEN - 1) {
-        scheme[i] = input[i];
-        i++;
-    }
-    scheme[i] = '\0';
+    while (i < len && !isspace((unsigned char)input[i])) i++;
+    *schemeLen = i;
 
     // Skip spaces after scheme
-    while (input[i] && isspace((unsigned char)input[i])) i++;
+    while (i < len && isspace((unsigned char)input[i])) i++;
 
     *rest = &input[i];
     return 0;
@@ -831,8 +2026,8 @@ static int parse_auth_scheme(char *input, char *scheme, char **rest) {
  *        An Auth scheme can use a token instead of parameters (key/value pairs)
  * Try parsing/verifying presence of a token68
  */
-static int is_token68(char *str) {
-    for (int i = 0; str[i]; i++) {
+static int is_token68(const char *str, int len) {
+    for (int i = 0; i < len; i++) {
         if (!isalnum((unsigned char)str[i]) && str[i] != '+' && str[i] != '/' && str[i] != '=')
             return 0;
     }
@@ -844,80 +2039,66 @@ static int is_token68(char *str) {
  * 
  * Given the start of a string containing one or more authentication parameters
  * in a comma separated list (within a WWW-Authenticate header), find
- * and separate into an array of "key" and an array of "value" where each
- * array element is a pointer to a string for that key or value.
- * Return these arrays (as args).
+ * and separate into an array of key/value spans.
+ * Return this array (as an arg).
  *
  * A comma-separated list may continue on not with a parameter but
  * instead with another Authentication Scheme (with its own parameters)
  * which is denoted by lack of "=". So return (as an arg) 
  * with the starting location of this additional Scheme (if none, return NULL).
- * Note: Each key/value string is allocated from memory, so needs to be freed later.
+ * [v2.1] Nothing is allocated, the spans point into str. Params past
+ *        MAX_AUTH_KEY_VAL are skipped.
  * 
  */
-static int parse_auth_params(char *str,char *param_key[], char *param_val[], int *param_count, char **more_auths) {
-    char key[MAX_TOKEN], value[MAX_TOKEN];
-    char *p = str;
+static int parse_auth_params(const char *str, int len, struct AuthParam param[], int *param_count, const char **more_auths) {
+    const char *p = str;
+    const char *end = str + len;
+    const char *key;
+    const char *value;
+    int keyLen, valueLen;
     int param_kv_count=0;
 
-  //*more_auths = '\0';
     *more_auths = NULL;
 
-    while (*p) {
-        while (isspace((unsigned char)*p) || *p == ',') p++;  // OWS and comma
+    while (p < end) {
+        while (p < end && (isspace((unsigned char)*p) || *p == ','))  p++;  // OWS and comma
+        if (p == end)
+            break;
 
         // Parse key
-        int i = 0;
-        while (*p && *p != '=' && *p !=' ' && i < MAX_TOKEN - 1 && *p != '\0') {  //Key could have BWS, but we won't support.
-            key[i++] = *p++;
-        }
-        key[i] = '\0';
-        param_key[param_kv_count] = ast_strdup(key);  //does a malloc
-        if (param_key[param_kv_count] == NULL)
-        {
-	    ast_log(LOG_ERROR,"ast_strdup param_key failure.\n");
-            return -1;
-        }
-      //printf("Key: %s ",key);
-        if (*p != '=') {
-          //printf("Key not followed by '='. May be finished or may be another auth-scheme.\n");
-            //Backup 
-          //printf("Removing last Key with length %li\n",strlen(key));
-            *more_auths = (p-strlen(key));
-            key[i-strlen(key)] = '\0';
+        key = p;
+        while (p < end && *p != '=' && *p != ' ') p++;  //Key could have BWS, but we won't support.
+        keyLen = p - key;
+        if (p == end || *p != '=') {
+            // Key not followed by '='. Another auth-scheme starts at the key.
+            *more_auths = key;
             break;
         }
         p++;  // skip '='
 
         // Parse value
-        i = 0;
-        if (*p == '"') {
+        if (p < end && *p == '"') {
             p++;  // skip opening quote
-            while (*p && i < MAX_TOKEN - 1) {
-                if (*p == '"' && *(p-1) != '\\'){  //if quote not escaped, then done
-                    break;
-                }
-                value[i++] = *p++;
-            }
-            if (*p == '"') p++;  // skip closing quote
+            value = p;
+            while (p < end && !(*p == '"' && *(p-1) != '\\')) p++;  //if quote not escaped, then done
+            valueLen = p - value;
+            if (p < end) p++;  // skip closing quote
         } else {
-            while (*p && *p != ',' && i < MAX_TOKEN - 1) {
-                value[i++] = *p++;
-            }
-        }
-        value[i] = '\0';
-        param_val[param_kv_count] = ast_strdup(value); //does a malloc
-        if (param_val[param_kv_count] == NULL)
-        {
-	    ast_log(LOG_ERROR,"ast_strdup param_val failure.\n");
-            return -1;
+            value = p;
+            while (p < end && *p != ',') p++;
+            valueLen = p - value;
         }
-      //printf("Value: %s\n",value);
-      //printf("Auth-Param: %s = %s\n", key, value);
 
+        if (param_kv_count == MAX_AUTH_KEY_VAL) {
+            ast_debug(5,"  Too many Auth-Params, skipping %.*s\n", keyLen, key);
+            continue;
+        }
+        param[param_kv_count].key = key;
+        param[param_kv_count].keyLen = keyLen;
+        param[param_kv_count].value = value;
+        param[param_kv_count].valueLen = valueLen;
         param_kv_count++;
     }
-  //printf("Num of Auth Parm K-V pairs %i\n",param_kv_count);
     *param_count = param_kv_count;
     
     return 0;
@@ -934,6 +2115,7 @@ struct DigestAuthData
 	char rx_realm[32];
 	char opaque[64];
 	char algorithm[64]; //[v2.0] adder
+	char stale[8]; //[v2.1] adder
 };
 
 /* [v2.0] adder - Basic Auth Data */
@@ -946,136 +2128,126 @@ struct BasicAuthData
 /*
  * [v2.0] Check for Presence of a Specific Authentication Scheme.
  *
- * Given a buffer string containing an entire RTSP/SIP message, 
- * parse the message looking for one or more Authentication Schemes 
- * (in a WWW-Authenticate header) until a match on a specific
- * scheme is found, and then have that scheme parsed for its authentication parameters
- * and then separate the parameters into an array of "key" and an array of "value" where each
- * array element is a pointer to a string for that key or value.
- * These arrays are returned (as args) along with a count. 
- * Note: Each key/value string is allocated from memory, so needs to be freed later.
+ * Given the headers of an RTSP/SIP message, look through one or more
+ * Authentication Schemes (in WWW-Authenticate headers) until a match on
+ * a specific scheme is found, and then have that scheme parsed for its
+ * authentication parameters.
+ * These are returned (as args) along with a count. 
+ * [v2.1] The params point into the indexed message, nothing needs freeing.
+ *        Schemes that don't match are parsed into scratch so the
+ *        matching scheme's params are never overwritten.
  */
-static int CheckAuthScheme(char *buffer,int bufferLen, char *scheme_to_match, char *auth_paramkey[], char *auth_paramval[], int *auth_paramcount)
+static int CheckAuthScheme(const struct HeaderIndex *index, char *scheme_to_match, struct AuthParam auth_param[], int *auth_paramcount)
 {
-    char* headers_start;
-
-    char scheme[MAX_TOKEN];
-    char *paramkey[MAX_AUTH_KEY_VAL];
-    char *paramval[MAX_AUTH_KEY_VAL];
+    const struct HeaderSpan *span;
+    struct AuthParam scratch[MAX_AUTH_KEY_VAL];
+    struct AuthParam *param;
+    int  matchLen = strlen(scheme_to_match);
+    int  schemeLen;
     int  param_count;
     int  i,j;
     int return_code=-10;
-    char *auth_start;
+    const char *auth_start;
+    const char *auth_end;
 
-    char *rest;       /* rest of the string after Auth Scheme (which are the params) */
-    char *more_auths; /* Another Auth Scheme (and its params) found afterwards */
+    const char *rest;       /* rest of the string after Auth Scheme (which are the params) */
+    const char *more_auths; /* Another Auth Scheme (and its params) found afterwards */
 
     ast_debug(5,"    Checking Headers for Matching Auth Scheme.\n");
-    if( parse_message(buffer, &headers_start) )
+    if( index->count == 0 )
     {
-        ast_debug(5,"    Could not parse RTSP/SIP message\n");
-        return_code= -1;
+	ast_log(LOG_WARNING,"No RTSP/SIP headers found.\n");
+        return -2;
+    }
+
+    ast_debug(5,"  ---Parsing Headers---\n");
+    for (i = 0; i < index->count; ++i) {
+        span = &index->headers[i];
+        ast_debug(5,"    %.*s = %.*s\n", span->nameLen, index->buffer+span->nameOff, span->valueLen, index->buffer+span->valueOff);
     }
-    else
+    for (i = HeaderIndexFind(index,"WWW-Authenticate",0); i >= 0 && return_code != 0; i = HeaderIndexFind(index,"WWW-Authenticate",i+1))
     {
-        HeaderStructList headers;
-    
-        if (parse_headers(headers_start, &headers) == 0) //returns with 2xarray of parsed header key,value pairs
-        {
-            ast_debug(5,"  ---Parsing Headers---\n");
-            for (i = 0; i < headers.count; ++i) {
-                ast_debug(5,"    %s = %s\n", headers.headers[i].field_name, headers.headers[i].field_value);
-                if(strstr(headers.headers[i].field_name,"WWW-Authenticate")!=NULL)
-                {
-                    ast_debug(5,"    Found a WWW-Authenticate Header\n" );
-
-                    // Get a trimmed copy of the auth header value
-                    char *auth_start_trimmed = get_trimmed_string(headers.headers[i].field_value);
-                    if (!auth_start_trimmed) {
-                        ast_debug(5,"    Failed to allocate memory for trimmed auth string\n");
-                        continue;
-                    }
-                    auth_start = auth_start_trimmed;
-                    ast_debug(6,"      Auth start string:\n%s\n",auth_start);
-                    do {
-                        more_auths = NULL;
-                        parse_auth_scheme(auth_start, scheme, &rest);
-                        ast_debug(6,"    Found an Auth-Scheme: %s\n", scheme);
-                        if(strcmp(scheme, scheme_to_match) == 0)
-                        {
-                            ast_debug(5,"    Found matching Auth-Scheme: %s\n", scheme_to_match);
-                            return_code= 0;
-                        }         
-
-                        if (*rest == '\0') {
-                            ast_debug(5,"    No parameters or token68 found.\n");
-                            auth_paramkey[0] = ast_strdup("None"); //does a malloc
-                            auth_paramval[0] = ast_strdup("None"); //does a malloc
-                            *auth_paramcount=1;
-                        } else if (is_token68(rest)) {
-                            ast_debug(5,"  Token68: %s\n", rest);
-                            //Have not tested token68!!
-                            auth_paramkey[0] = ast_strdup("Token68"); //does a malloc
-                            auth_paramval[0] = ast_strdup(rest); //does a malloc
-                            *auth_paramcount=1;
-                        } else {
-                            ast_debug(5,"  ---Parsing Auth-Params---\n");
-                            if( parse_auth_params(rest,paramkey,paramval,&param_count, &more_auths) == 0)
-                            {
-                              //printf("Param Count: %d\n", param_count);
-                                for ( j = 0; j < param_count; j++) {
-                                    ast_debug(5,"  Paramkey[%d]: %s    Paramval[%d]: %s\n", j,paramkey[j], j, paramval[j]);
-                                    if( return_code == 0)
-                                    {
-                                        auth_paramkey[j] = ast_strdup(paramkey[j]); //does a malloc
-                                        auth_paramval[j] = ast_strdup(paramval[j]); //does a malloc
-                                        *auth_paramcount = param_count;
-                                    }
-                                    ast_free(paramkey[j]);
-                                    ast_free(paramval[j]);
-                                }
-                            }
-                            ast_debug(5,"  ---End Parsing Auth-Params---\n");
-                        }
-                        if (more_auths != NULL)
-                        {
-                            ast_debug(6,"  more auths after comma-sep list: %s\n",more_auths);
-                            auth_start = more_auths;
-                        }
-
-                    }
-                    while(more_auths != NULL);
-                    
-                    // Free the allocated trimmed string
-                    ast_free(auth_start_trimmed);
+        ast_debug(5,"    Found a WWW-Authenticate Header\n" );
+        span = &index->headers[i];
+        auth_start = index->buffer + span->valueOff;
+        auth_end = auth_start + span->valueLen;
+
+        ast_debug(6,"      Auth start string:\n%.*s\n",(int)(auth_end-auth_start),auth_start);
+        do {
+            more_auths = NULL;
+            parse_auth_scheme(auth_start, auth_end-auth_start, &schemeLen, &rest);
+            ast_debug(6,"    Found an Auth-Scheme: %.*s\n", schemeLen, auth_start);
+            param = scratch;
+            if(schemeLen == matchLen && strncmp(auth_start, scheme_to_match, matchLen) == 0)
+            {
+                ast_debug(5,"    Found matching Auth-Scheme: %s\n", scheme_to_match);
+                return_code= 0;
+                param = auth_param;
+            }         
+
+            if (rest == auth_end) {
+                ast_debug(5,"    No parameters or token68 found.\n");
+                param[0].key = "None";
+                param[0].keyLen = 4;
+                param[0].value = "None";
+                param[0].valueLen = 4;
+                param_count=1;
+            } else if (is_token68(rest, auth_end-rest)) {
+                ast_debug(5,"  Token68: %.*s\n", (int)(auth_end-rest), rest);
+                //Have not tested token68!!
+                param[0].key = "Token68";
+                param[0].keyLen = 7;
+                param[0].value = rest;
+                param[0].valueLen = auth_end-rest;
+                param_count=1;
+            } else {
+                ast_debug(5,"  ---Parsing Auth-Params---\n");
+                parse_auth_params(rest, auth_end-rest, param, &param_count, &more_auths);
+                for ( j = 0; j < param_count; j++) {
+                    ast_debug(5,"  Paramkey[%d]: %.*s    Paramval[%d]: %.*s\n", j, param[j].keyLen, param[j].key, j, param[j].valueLen, param[j].value);
                 }
+                ast_debug(5,"  ---End Parsing Auth-Params---\n");
+            }
+            if (return_code == 0)
+            {
+                *auth_paramcount = param_count;
+                break;
+            }
+            if (more_auths != NULL)
+            {
+                ast_debug(6,"  more auths after comma-sep list: %.*s\n",(int)(auth_end-more_auths),more_auths);
+                auth_start = more_auths;
             }
-            ast_debug(5,"  ---End Parsing Headers---\n");
 
-        } else {
-	    ast_log(LOG_WARNING,"No RTSP/SIP headers found.\n");
-            return_code= -2;
         }
+        while(more_auths != NULL);
     }
+    ast_debug(5,"  ---End Parsing Headers---\n");
     return return_code;
 }
 
+/* [v2.1] Auth param key is name */
+static int AuthParamIs(const struct AuthParam *param, const char *name)
+{
+    return param->keyLen == (int)strlen(name) && strncmp(param->key, name, param->keyLen) == 0;
+}
+
 /* 
  * [v2.0] Check WWW-Authenticate Headers for Basic Authentication scheme and get/convert any parameters 
  */
-static int GetAuthSchemeBasic(char *buffer,int bufferLen, struct BasicAuthData *basic_data)
+static int GetAuthSchemeBasic(const struct HeaderIndex *index, struct BasicAuthData *basic_data)
 {
     int return_code = -1;
-    char *auth_paramkey[MAX_AUTH_KEY_VAL];
-    char *auth_paramval[MAX_AUTH_KEY_VAL];
+    struct AuthParam auth_param[MAX_AUTH_KEY_VAL];
     int auth_paramcount;
     int pi; //auth parameter index
+    int len;
 
     basic_data->rx_realm[0]='\0';
 
     ast_debug(5,"\n");
     ast_debug(5,"GetAuthSchemeBasic()\n");
-    if (CheckAuthScheme(buffer,bufferLen,"Basic", auth_paramkey, auth_paramval, &auth_paramcount) == 0 )
+    if (CheckAuthScheme(index,"Basic", auth_param, &auth_paramcount) == 0 )
     {
         ast_debug(5,"    - GetAuthSchemeBasic: Found WWW-Authenticate Method of Basic\n");
         return_code = 0;
@@ -1087,15 +2259,15 @@ static int GetAuthSchemeBasic(char *buffer,int bufferLen, struct BasicAuthData *
         {
             ast_debug(5,"  --- Auth Key/Value pairs/struct ---\n");
             for ( pi = 0; pi < auth_paramcount; pi++) {
-	        ast_debug(5,"  AuthParamkey[%d]: %s, AuthParamval[%d]: %s\n", pi,auth_paramkey[pi], pi, auth_paramval[pi]);
-                if( strcmp(auth_paramkey[pi],"realm") == 0 )
+	        ast_debug(5,"  AuthParamkey[%d]: %.*s, AuthParamval[%d]: %.*s\n", pi, auth_param[pi].keyLen, auth_param[pi].key, pi, auth_param[pi].valueLen, auth_param[pi].value);
+                if( AuthParamIs(&auth_param[pi],"realm") )
                 {
-                    strcpy(basic_data->rx_realm, auth_paramval[pi]);
+                    /* [v2.1] Truncated like ast_copy_string() */
+                    len = auth_param[pi].valueLen < (int)sizeof(basic_data->rx_realm) ? auth_param[pi].valueLen : (int)sizeof(basic_data->rx_realm)-1;
+                    memcpy(basic_data->rx_realm, auth_param[pi].value, len);
+                    basic_data->rx_realm[len] = '\0';
 	            ast_debug(5,"  basic_data->rx_realm: %s\n",basic_data->rx_realm);
                 } 
-                /* Always free the malloc for the Auth param key/value arrays.*/
-                ast_free(auth_paramkey[pi]);
-                ast_free(auth_paramval[pi]);
             }
             ast_debug(5,"  --- End Auth Key/Value pairs/struct ---\n");
         }
@@ -1104,16 +2276,34 @@ static int GetAuthSchemeBasic(char *buffer,int bufferLen, struct BasicAuthData *
     return return_code;
 }
 
+/*
+ * [v2.1] Copy an auth param into its fixed size field.
+ * Returns 1 if the value doesn't fit, a truncated nonce or realm gives a wrong response.
+ */
+static int AuthParamCopy(char *field, int size, const struct AuthParam *param)
+{
+    if (param->valueLen >= size)
+    {
+        ast_log(LOG_WARNING,"Auth param %.*s too long [%d]\n", param->keyLen, param->key, param->valueLen);
+        field[0] = '\0';
+        return 1;
+    }
+    memcpy(field, param->value, param->valueLen);
+    field[param->valueLen] = '\0';
+    return 0;
+}
+
 /* 
  * [v2.0] Check WWW-Authenticate Headers for Digest Authentication scheme and get/convert any parameters 
  */
-static int GetAuthSchemeDigest(char *buffer,int bufferLen, struct DigestAuthData *digest_data)
+static int GetAuthSchemeDigest(const struct HeaderIndex *index, struct DigestAuthData *digest_data)
 {
     int return_code = -1;
-    char *auth_paramkey[MAX_AUTH_KEY_VAL];
-    char *auth_paramval[MAX_AUTH_KEY_VAL];
+    struct AuthParam auth_param[MAX_AUTH_KEY_VAL];
     int auth_paramcount;
     int pi; //auth parameter index
+    int too_long = 0; /* [v2.1] */
+    int len;
 
     digest_data->nonce[0]='\0';
     digest_data->nc[0]='\0';
@@ -1123,10 +2313,11 @@ static int GetAuthSchemeDigest(char *buffer,int bufferLen, struct DigestAuthData
     digest_data->rx_realm[0]='\0';
     digest_data->opaque[0]='\0';
     digest_data->algorithm[0]='\0';
+    digest_data->stale[0]='\0';
 
     ast_debug(5,"\n");
     ast_debug(5,"GetAuthSchemeDigest()\n");
-    if (CheckAuthScheme(buffer,bufferLen,"Digest", auth_paramkey, auth_paramval, &auth_paramcount) == 0 )
+    if (CheckAuthScheme(index,"Digest", auth_param, &auth_paramcount) == 0 )
     {
         ast_debug(5,"    - GetAuthSchemeDigest: Found WWW-Authenticate Method of Digest\n");
         return_code = 0;
@@ -1139,60 +2330,68 @@ static int GetAuthSchemeDigest(char *buffer,int bufferLen, struct DigestAuthData
             ast_debug(5,"    --- Auth Key/Value pairs/struct ---\n");
             for ( pi = 0; pi < auth_paramcount; pi++) 
             {
-	        ast_debug(5,"    AuthParamkey[%d]: %s, AuthParamval[%d]: %s\n", pi,auth_paramkey[pi], pi, auth_paramval[pi]);
+	        ast_debug(5,"    AuthParamkey[%d]: %.*s, AuthParamval[%d]: %.*s\n", pi, auth_param[pi].keyLen, auth_param[pi].key, pi, auth_param[pi].valueLen, auth_param[pi].value);
 
-                if( strcmp(auth_paramkey[pi],"realm") == 0 )
+                if( AuthParamIs(&auth_param[pi],"realm") )
                 {
-                    strcpy(digest_data->rx_realm, auth_paramval[pi]);
+                    too_long |= AuthParamCopy(digest_data->rx_realm, sizeof(digest_data->rx_realm), &auth_param[pi]);
 	            ast_debug(5,"    digest_data->rx_realm: %s\n",digest_data->rx_realm);
                 } 
-                if( strcmp(auth_paramkey[pi],"nonce") == 0 )
+                if( AuthParamIs(&auth_param[pi],"nonce") )
                 {
-                    strcpy(digest_data->nonce, auth_paramval[pi]);
+                    too_long |= AuthParamCopy(digest_data->nonce, sizeof(digest_data->nonce), &auth_param[pi]);
 	            ast_debug(5,"    digest_data->nonce: %s\n",digest_data->nonce);
                 } 
-                if( strcmp(auth_paramkey[pi],"nc") == 0 )
+                if( AuthParamIs(&auth_param[pi],"nc") )
                 {
-                    strcpy(digest_data->nc, auth_paramval[pi]);
+                    too_long |= AuthParamCopy(digest_data->nc, sizeof(digest_data->nc), &auth_param[pi]);
 	            ast_debug(5,"    digest_data->nc: %s\n",digest_data->nc);
                 } 
-                if( strcmp(auth_paramkey[pi],"cnonce") == 0 )
+                if( AuthParamIs(&auth_param[pi],"cnonce") )
                 {
-                    strcpy(digest_data->cnonce, auth_paramval[pi]);
+                    too_long |= AuthParamCopy(digest_data->cnonce, sizeof(digest_data->cnonce), &auth_param[pi]);
 	            ast_debug(5,"    digest_data->cnonce: %s\n",digest_data->cnonce);
                 } 
-                if( strcmp(auth_paramkey[pi],"qop") == 0 )
+                if( AuthParamIs(&auth_param[pi],"qop") )
                 {
-                    strcpy(digest_data->qop, auth_paramval[pi]);
+                    too_long |= AuthParamCopy(digest_data->qop, sizeof(digest_data->qop), &auth_param[pi]);
 	            ast_debug(5,"    digest_data->qop: %s\n",digest_data->qop);
                 } 
-                if( strcmp(auth_paramkey[pi],"uri") == 0 )
+                if( AuthParamIs(&auth_param[pi],"uri") )
                 {
-                    strcpy(digest_data->uri, auth_paramval[pi]);
+                    too_long |= AuthParamCopy(digest_data->uri, sizeof(digest_data->uri), &auth_param[pi]);
 	            ast_debug(5,"    digest_data->uri: %s\n",digest_data->uri);
                 } 
-                if( strcmp(auth_paramkey[pi],"opaque") == 0 )
+                if( AuthParamIs(&auth_param[pi],"opaque") )
                 {
-                    strcpy(digest_data->opaque, auth_paramval[pi]);
+                    too_long |= AuthParamCopy(digest_data->opaque, sizeof(digest_data->opaque), &auth_param[pi]);
 	            ast_debug(5,"    digest_data->opaque: %s\n",digest_data->opaque);
                 } 
-                if( strcmp(auth_paramkey[pi],"algorithm") == 0 )
+                if( AuthParamIs(&auth_param[pi],"algorithm") )
                 {
-                    strcpy(digest_data->algorithm, auth_paramval[pi]);
+                    too_long |= AuthParamCopy(digest_data->algorithm, sizeof(digest_data->algorithm), &auth_param[pi]);
 	            ast_debug(5,"    digest_data->algorithm: %s\n",digest_data->algorithm);
                 } 
-                /* Always free the malloc for the Auth param key/value arrays.*/
-                ast_free(auth_paramkey[pi]);
-                ast_free(auth_paramval[pi]);
+                if( AuthParamIs(&auth_param[pi],"stale") ) /* [v2.1] */
+                {
+                    len = auth_param[pi].valueLen < (int)sizeof(digest_data->stale) ? auth_param[pi].valueLen : (int)sizeof(digest_data->stale)-1;
+                    memcpy(digest_data->stale, auth_param[pi].value, len);
+                    digest_data->stale[len] = '\0';
+	            ast_debug(5,"    digest_data->stale: %s\n",digest_data->stale);
+                } 
             }
             ast_debug(5,"    --- End Auth Key/Value pairs/struct ---\n");
         }
+        /* [v2.1] Don't answer, or cache, a challenge we could only keep part of */
+        if (too_long)
+            return_code = -1;
     }
     ast_debug(5,"End of GetAuthSchemeDigest()\n");
     return return_code;
 }
 
 
+#ifndef RTSP_SIP_STANDALONE /* [v2.1] */
 /*
  * [v1.1] Custom code for Digest Authentication.
  * Computes the response parameters to a challenge for MD5
@@ -1316,6 +2515,17 @@ static struct RtspPlayer* RtspPlayerCreate(void)
 	player->port		= 0;
 	player->url		= NULL;
 	player->authorization	= NULL;
+	player->authScheme	= 0; /* [v2.1] */
+	player->authRealm[0]	= 0;
+	player->authNonce[0]	= 0;
+	player->authOpaque[0]	= 0;
+	player->authKey[0]	= 0;
+	player->authUsername	= NULL;
+	player->authPassword	= NULL;
+	player->authAttempts	= 0;
+	player->pipelined	= 0; /* [v2.1] */
+	player->numPending	= 0;
+	player->resumeState	= 0;
 	player->fd		= 0; /* Control Protocol (RTSP or SIP) file descriptor */
 	player->audioRtp	= 0; /* file descriptor */
 	player->audioRtcp	= 0; /* file descriptor */
@@ -1326,6 +2536,22 @@ static struct RtspPlayer* RtspPlayerCreate(void)
 	player->videoRtpPort	= 0; /* Source udp ports */
 	player->videoRtcpPort	= 0; /* Source udp ports */
 
+	/* [v2.1] Receiver stats. Video RTP clock is always 90 kHz */
+	memset(&player->audioStats,0,sizeof(struct MediaStats));
+	memset(&player->videoStats,0,sizeof(struct MediaStats));
+	MediaStatsSetRate(&player->videoStats,90000);
+	MediaStatsReset(&player->audioStats);
+	MediaStatsReset(&player->videoStats);
+	/* [v2.1] Our SSRC, the same for the whole session */
+	player->ssrc		= (unsigned int)ast_random();
+	snprintf(player->cname,sizeof(player->cname),"%08x@rtsp-sip",player->ssrc);
+	/* [v2.1] RFC 2326 default, until the camera says otherwise */
+	player->sessionTimeout	= 60;
+	/* [v2.1] UDP unless asked */
+	player->interleaved	= 0;
+	player->audioChannel	= 0;
+	player->videoChannel	= 2;
+
         /* ADD. SIP */
 	player->local_ctrl_ip   = NULL; /* source IPv4 address string*/
 	player->local_ctrl_port = 0;  /* source port used by SIP */
@@ -1400,7 +2626,8 @@ static int RtspPlayerDigestAuthorization(struct RtspPlayer *player,char *cfg_use
 		return -1;
 	}
 	/* Create authorization header */
-	player->authorization = ast_malloc(256); /* Freed in  RtspPlayerDestroy */
+     /*	player->authorization = ast_malloc(256); [v2.1] uri alone may be 256 */
+	player->authorization = ast_malloc(640); /* Freed in  RtspPlayerDestroy */
 
 	int  string_len = 0;
 
@@ -1465,32 +2692,280 @@ static int RtspPlayerDigestAuthorization(struct RtspPlayer *player,char *cfg_use
 	return 1;
 }
 
-/* 
- * COMMENT: 
- * GetUdpPorts() forces the source ports for RTP/RTCP to be paired odd/even respectively. 
- */ 
-static void GetUdpPorts(int *a,int *b,int *p,int *q,int isIPv6)
+/*
+ * [v2.1] Auth cache.
+ * The scheme, realm, nonce and opaque of the last challenge from each
+ * camera (RTSP and SIP apart, per username) are kept, so the first request
+ * of the next call carries credentials and the 401 round trip is skipped.
+ * Basic is sent right away. Digest reuses the cached nonce; when the camera
+ * has expired it, it answers 401 with stale=true and the request is sent
+ * again with the new nonce.
+ */
+#define AUTH_SCHEME_BASIC	1
+#define AUTH_SCHEME_DIGEST	2
+#define RTSP_AUTH_ATTEMPTS	2	/* challenges answered before giving up */
+
+struct AuthCacheEntry
 {
-	struct sockaddr *sendAddr;
-	int size;
-	int len;
-	int PF;
-	unsigned short *port;
+	char	key[256];	/* rtsp|sip, host:port, username */
+	int	scheme;
+	char	realm[32];
+	char	nonce[64];
+	char	opaque[64];
+	AST_LIST_ENTRY(AuthCacheEntry) list;
+};
 
-	/* If it is ipv6 */
-	if (isIPv6)
+static AST_LIST_HEAD_STATIC(auth_cache, AuthCacheEntry);
+
+/* Remember the challenge for the next call */
+static void AuthCacheStore(struct RtspPlayer *player)
+{
+	struct AuthCacheEntry *entry;
+
+	AST_LIST_LOCK(&auth_cache);
+	AST_LIST_TRAVERSE(&auth_cache, entry, list)
+		if (!strcmp(entry->key,player->authKey))
+			break;
+	if (!entry && (entry = ast_calloc(1,sizeof(struct AuthCacheEntry))))
 	{
-		/* Set size*/
-		size = sizeof(struct sockaddr_in6);
-		/*Create address */
-           /*	sendAddr = (struct sockaddr *)malloc(size); OLD */
-		sendAddr = (struct sockaddr *)ast_malloc(size);
-		/* empty addres */
-		memset(sendAddr,0,size);
-		/*Set family */
-		((struct sockaddr_in6*)sendAddr)->sin6_family = AF_INET6;
-		/* Set PF */
-		PF = PF_INET6;
+		ast_copy_string(entry->key,player->authKey,sizeof(entry->key));
+		AST_LIST_INSERT_TAIL(&auth_cache, entry, list);
+	}
+	if (entry)
+	{
+		entry->scheme = player->authScheme;
+		ast_copy_string(entry->realm,player->authRealm,sizeof(entry->realm));
+		ast_copy_string(entry->nonce,player->authNonce,sizeof(entry->nonce));
+		ast_copy_string(entry->opaque,player->authOpaque,sizeof(entry->opaque));
+	}
+	AST_LIST_UNLOCK(&auth_cache);
+}
+
+/* Credentials were rejected, don't send them again unasked */
+static void AuthCacheForget(struct RtspPlayer *player)
+{
+	struct AuthCacheEntry *entry;
+
+	AST_LIST_LOCK(&auth_cache);
+	AST_LIST_TRAVERSE_SAFE_BEGIN(&auth_cache, entry, list)
+	{
+		if (!strcmp(entry->key,player->authKey))
+		{
+			AST_LIST_REMOVE_CURRENT(list);
+			ast_free(entry);
+		}
+	}
+	AST_LIST_TRAVERSE_SAFE_END;
+	AST_LIST_UNLOCK(&auth_cache);
+}
+
+static void AuthCacheFlush(void)
+{
+	struct AuthCacheEntry *entry;
+
+	AST_LIST_LOCK(&auth_cache);
+	while ((entry = AST_LIST_REMOVE_HEAD(&auth_cache, list)))
+		ast_free(entry);
+	AST_LIST_UNLOCK(&auth_cache);
+}
+
+/*
+ * Set the credentials of a player after connect and load what we know
+ * about its server. proto is "rtsp" or "sip". Returns 1 on a cache hit.
+ */
+static int RtspPlayerUseCachedAuth(struct RtspPlayer *player,const char *proto,char *username,char *password)
+{
+	struct AuthCacheEntry *entry;
+	int found = 0;
+
+	player->authUsername = username;
+	player->authPassword = password;
+	/* Nothing to authenticate with */
+	if (!username)
+		return 0;
+	snprintf(player->authKey,sizeof(player->authKey),"%s|%s|%s",proto,player->hostport,username);
+
+	AST_LIST_LOCK(&auth_cache);
+	AST_LIST_TRAVERSE(&auth_cache, entry, list)
+		if (!strcmp(entry->key,player->authKey))
+		{
+			player->authScheme = entry->scheme;
+			ast_copy_string(player->authRealm,entry->realm,sizeof(player->authRealm));
+			ast_copy_string(player->authNonce,entry->nonce,sizeof(player->authNonce));
+			ast_copy_string(player->authOpaque,entry->opaque,sizeof(player->authOpaque));
+			found = 1;
+			break;
+		}
+	AST_LIST_UNLOCK(&auth_cache);
+
+	if (found)
+		ast_debug(2,"-auth cache hit for %s, %s\n",player->hostport,player->authScheme==AUTH_SCHEME_BASIC?"basic":"digest");
+	return found;
+}
+
+/*
+ * Build the Authorization header for one request.
+ * A digest response covers method and uri, so it is computed again for
+ * every request instead of reusing the one that answered the challenge.
+ * Returns 1 if player->authorization is set.
+ */
+static int RtspPlayerAuthorize(struct RtspPlayer *player,char *method,char *uri,int isSIP)
+{
+	char *header;
+
+	/* No challenge seen, none cached */
+	if (!player->authScheme || !player->authUsername)
+		return player->authorization!=NULL;
+
+	/* Basic does not change */
+	if (player->authScheme==AUTH_SCHEME_BASIC)
+	{
+		if (!player->authorization)
+			RtspPlayerBasicAuthorization(player,player->authUsername,player->authPassword?:"");
+		return 1;
+	}
+
+	/* Digest for this method and uri */
+	if (player->authorization)
+	{
+		ast_free(player->authorization);
+		player->authorization = NULL;
+	}
+	if (RtspPlayerDigestAuthorization(player,player->authUsername,player->authPassword?:"",
+			player->authRealm,player->authNonce,NULL,NULL,NULL,uri,player->authRealm,method,isSIP) <= 0)
+	{
+		/* Realm mismatch leaves it allocated but unset */
+		ast_free(player->authorization);
+		player->authorization = NULL;
+		return 0;
+	}
+
+	/* Echo opaque, RFC 2617 3.2.2 */
+	if (!ast_strlen_zero(player->authOpaque)
+	    && (header = ast_malloc(strlen(player->authorization)+strlen(player->authOpaque)+16)))
+	{
+		sprintf(header,"%s, opaque=\"%s\"",player->authorization,player->authOpaque);
+		ast_free(player->authorization);
+		player->authorization = header;
+	}
+	return 1;
+}
+
+/*
+ * [v2.1] Answer a 401 from the camera with Basic or Digest credentials.
+ * This was inline in the DESCRIBE response handling; SETUP needs it too
+ * when DESCRIBE was skipped for a cached SDP. The challenge is kept in the
+ * auth cache, and the digest is computed for method and uri of the request
+ * that was challenged.
+ * Returns 1 when player->authorization is ready for a retry.
+ */
+static int RtspPlayerAuthenticate(struct RtspPlayer *player,const struct HeaderIndex *index,char *username,char *password,
+				  char *method,char *uri)
+{
+	struct BasicAuthData basic_data;
+	struct DigestAuthData digest_data;
+	int stale = 0;
+
+	/* Replace previous one */
+	if (player->authorization)
+	{
+		ast_free(player->authorization);
+		player->authorization = NULL;
+	}
+	player->authUsername = username;
+	player->authPassword = password;
+
+	ast_debug(3,"    - Checking for Auth Method of Basic\n");
+	if (GetAuthSchemeBasic(index,&basic_data) == 0 )
+	{
+		ast_debug(3,"    - Found Auth Method of Basic\n");
+		player->authScheme = AUTH_SCHEME_BASIC;
+		ast_copy_string(player->authRealm,basic_data.rx_realm,sizeof(player->authRealm));
+		player->authNonce[0] = player->authOpaque[0] = 0;
+	} else {
+		ast_debug(3,"    - No Auth Method of Basic\n");
+		ast_debug(3,"    - Checking for Auth Method of Digest\n");
+		if (GetAuthSchemeDigest(index,&digest_data) != 0 )
+		{
+			ast_debug(3,"    - No Auth Method of Digest\n");
+			/* Error */
+			ast_log(LOG_ERROR,"-No Basic or Digest Authentication found for RTSP.\n");	
+			return 0;
+		}
+		ast_debug(3,"    - Found Auth Method of Digest\n");
+		ast_debug(5,"  Challenge Response Data- rx_realm: %s nonce: %s uri %s",\
+			digest_data.rx_realm, digest_data.nonce, uri); 
+		player->authScheme = AUTH_SCHEME_DIGEST;
+		ast_copy_string(player->authRealm,digest_data.rx_realm,sizeof(player->authRealm));
+		ast_copy_string(player->authNonce,digest_data.nonce,sizeof(player->authNonce));
+		ast_copy_string(player->authOpaque,digest_data.opaque,sizeof(player->authOpaque));
+		stale = !strcasecmp(digest_data.stale,"true");
+	}
+
+	/* Only a new nonce was needed, allow one more */
+	if (stale)
+		ast_debug(2,"-stale nonce from %s, retrying\n",player->hostport);
+	/* Same credentials rejected again */
+	if (++player->authAttempts>RTSP_AUTH_ATTEMPTS+stale)
+	{
+		ast_log(LOG_ERROR,"Credentials rejected by %s\n",player->hostport);
+		AuthCacheForget(player);
+		return 0;
+	}
+
+	/* Next call starts with these */
+	if (player->authKey[0])
+		AuthCacheStore(player);
+
+	return RtspPlayerAuthorize(player,method,uri,0);
+}
+
+/* [v2.1] Keep a SIP digest challenge for the next INVITE */
+static void AuthCacheStoreDigest(struct RtspPlayer *player,struct DigestAuthData *digest_data)
+{
+	player->authScheme = AUTH_SCHEME_DIGEST;
+	ast_copy_string(player->authRealm,digest_data->rx_realm,sizeof(player->authRealm));
+	ast_copy_string(player->authNonce,digest_data->nonce,sizeof(player->authNonce));
+	ast_copy_string(player->authOpaque,digest_data->opaque,sizeof(player->authOpaque));
+	if (player->authKey[0])
+		AuthCacheStore(player);
+}
+
+/* [v2.1] Request uri for a SETUP on a media control, absolute or relative to the session url */
+static void RtspPlayerControlUri(struct RtspPlayer *player,const char *control,char *uri,int size)
+{
+	if (strncmp(control,"rtsp://",7)==0)
+		snprintf(uri,size,"%s",control);
+	else
+		snprintf(uri,size,"rtsp://%s%s/%s",player->hostport,player->url,control);
+}
+
+/* 
+ * COMMENT: 
+ * GetUdpPorts() forces the source ports for RTP/RTCP to be paired odd/even respectively. 
+ */ 
+static void GetUdpPorts(int *a,int *b,int *p,int *q,int isIPv6)
+{
+	struct sockaddr *sendAddr;
+	int size;
+	int len;
+	int PF;
+	unsigned short *port;
+
+	/* If it is ipv6 */
+	if (isIPv6)
+	{
+		/* Set size*/
+		size = sizeof(struct sockaddr_in6);
+		/*Create address */
+           /*	sendAddr = (struct sockaddr *)malloc(size); OLD */
+		sendAddr = (struct sockaddr *)ast_malloc(size);
+		/* empty addres */
+		memset(sendAddr,0,size);
+		/*Set family */
+		((struct sockaddr_in6*)sendAddr)->sin6_family = AF_INET6;
+		/* Set PF */
+		PF = PF_INET6;
 		/* Get port */
 		port = &(((struct sockaddr_in6 *)sendAddr)->sin6_port);
 	} else {
@@ -1641,18 +3116,29 @@ static int RtspPlayerConnect(struct RtspPlayer *player, const char *ip, int port
 	    player->fd = socket(PF,SOCK_STREAM,0);
 
 
-	/* Create/Open audio datagram sockets and ports for RTP and RTCP*/
-	GetUdpPorts(&player->audioRtp,&player->audioRtcp,&player->audioRtpPort,&player->audioRtcpPort,isIPv6);
-
-	/* Create/Open video datagram sockets and ports for RTP and RTCP*/
-	GetUdpPorts(&player->videoRtp,&player->videoRtcp,&player->videoRtpPort,&player->videoRtcpPort,isIPv6);
-
-	/* Set non blocking */
-	SetNonBlocking(player->fd);
-	SetNonBlocking(player->audioRtp);
-	SetNonBlocking(player->audioRtcp);
-	SetNonBlocking(player->videoRtp);
-	SetNonBlocking(player->videoRtcp);
+	/* [v2.1] Interleaved media comes on the control socket, no UDP sockets */
+	if (player->interleaved)
+	{
+		player->audioRtp	= -1;
+		player->audioRtcp	= -1;
+		player->videoRtp	= -1;
+		player->videoRtcp	= -1;
+		/* Set non blocking */
+		SetNonBlocking(player->fd);
+	} else {
+		/* Create/Open audio datagram sockets and ports for RTP and RTCP*/
+		GetUdpPorts(&player->audioRtp,&player->audioRtcp,&player->audioRtpPort,&player->audioRtcpPort,isIPv6);
+
+		/* Create/Open video datagram sockets and ports for RTP and RTCP*/
+		GetUdpPorts(&player->videoRtp,&player->videoRtcp,&player->videoRtpPort,&player->videoRtcpPort,isIPv6);
+
+		/* Set non blocking */
+		SetNonBlocking(player->fd);
+		SetNonBlocking(player->audioRtp);
+		SetNonBlocking(player->audioRtcp);
+		SetNonBlocking(player->videoRtp);
+		SetNonBlocking(player->videoRtcp);
+	}
 
 	/* Connect */
 	if (connect(player->fd,sendAddr,size)<0)
@@ -1706,33 +3192,40 @@ static int RtspPlayerConnect(struct RtspPlayer *player, const char *ip, int port
 	return 1;
 }
 
-static int RtspPlayerAddSession(struct RtspPlayer *player,char *session)
+static int RtspPlayerAddSession(struct RtspPlayer *player,const char *session,int len) /* [v2.1] header value, not terminated */
 {
 	int i;
-	char *p;
+	const char *p;
+	char *id;
+	int idLen;
 
 	/* If max sessions reached */
 	if (player->numSessions == 2)
 		/* Exit */
 		return 0;
 
+	/* [v2.1] Session timeout in seconds, RFC 2326 12.37 */
+	if ((p=HeaderValueFind(session,len,";timeout=")) && HeaderValueInt(p+9,len-(p+9-session))>0)
+		player->sessionTimeout = HeaderValueInt(p+9,len-(p+9-session));
+
 	/* Check if it has parameters */
-	if ((p=strchr(session,';'))>0)
+	if ((p=memchr(session,';',len)))
 		/* Remove then */
-		*p = 0;
+		idLen = p-session;
+	else
+		idLen = len;
 
 	/* Check if we have that session already */
 	for (i=0;i<player->numSessions;i++)
-		if (strcmp(player->session[i],session)==0)
-		{
-			/* Free */
-	             /*	free(session); OLD */
-			ast_free(session);
+		if ((int)strlen(player->session[i])==idLen && strncmp(player->session[i],session,idLen)==0)
 			/* exit */
 			return 0;
-		}
+	/* Copy */
+	if (!(id = ast_strndup(session,idLen)))
+		/* exit */
+		return 0;
 	/* Save */
-	player->session[player->numSessions++] = session;
+	player->session[player->numSessions++] = id;
 
 	/* exit */
 	return player->numSessions;
@@ -1740,36 +3233,44 @@ static int RtspPlayerAddSession(struct RtspPlayer *player,char *session)
 
 }
 
-static void RrspPlayerSetAudioTransport(struct RtspPlayer *player,const char* transport)
+static void RrspPlayerSetAudioTransport(struct RtspPlayer *player,const char* transport,int len) /* [v2.1] header value, not terminated */
 {
-	char *i;
+	const char *i;
 	int port;
 	struct sockaddr * addr;
 	int size;
 	int PF;
 
+	/* [v2.1] Interleaved, just keep the channels the camera picked */
+	if (player->interleaved)
+	{
+		if ((i=HeaderValueFind(transport,len,"interleaved=")))
+			player->audioChannel = HeaderValueInt(i+12,len-(i+12-transport));
+		return;
+	}
+
 	/* Find server port values */
-	if (!(i=strstr(transport,"server_port=")))
+	if (!(i=HeaderValueFind(transport,len,"server_port=")))
 	{
 		/* Log */
 	     /*	ast_log(LOG_DEBUG,"Not server found in transport [%s]\n",transport); CHANGE */
-		ast_log(LOG_WARNING,"No server found in transport [%s]\n",transport);
+		ast_log(LOG_WARNING,"No server found in transport [%.*s]\n",len,transport);
 		/* Exit */
 		return;
 	}
 
 	/* Get to the rtcp port */
-	if (!(i=strstr(i,"-")))
+	if (!(i=memchr(i,'-',len-(i-transport))))
 	{
 		/* Log */
 	     /*	ast_log(LOG_DEBUG,"Not rtcp found in transport  [%s]\n",transport); CHANGE */
-		ast_log(LOG_WARNING,"No rtcp found in transport  [%s]\n",transport);
+		ast_log(LOG_WARNING,"No rtcp found in transport  [%.*s]\n",len,transport);
 		/* exit */
 		return;
 	}	
 
 	/* Get port number */
-	port = atoi(i+1);
+	port = HeaderValueInt(i+1,len-(i+1-transport));
 
 	/* Get send address */
 	addr = GetIPAddr(player->ip,port,player->isIPv6,&size,&PF);
@@ -1786,39 +3287,47 @@ static void RrspPlayerSetAudioTransport(struct RtspPlayer *player,const char* tr
 
 }
 
-static void RrspPlayerSetVideoTransport(struct RtspPlayer *player,const char* transport)
+static void RrspPlayerSetVideoTransport(struct RtspPlayer *player,const char* transport,int len) /* [v2.1] header value, not terminated */
 {
-	char *i;
+	const char *i;
 	int rtp_port,rtcp_port;
 	struct sockaddr * addr;
 	int size;
 	int PF;
 
+	/* [v2.1] Interleaved, just keep the channels the camera picked */
+	if (player->interleaved)
+	{
+		if ((i=HeaderValueFind(transport,len,"interleaved=")))
+			player->videoChannel = HeaderValueInt(i+12,len-(i+12-transport));
+		return;
+	}
+
 	/* Find server port values */
-	if (!(i=strstr(transport,"server_port=")))
+	if (!(i=HeaderValueFind(transport,len,"server_port=")))
 	{
 		/* Log */
 	     /*	ast_log(LOG_DEBUG,"Not server found in transport [%s]\n",transport); CHANGE */
-		ast_log(LOG_WARNING,"No server found in transport [%s]\n",transport);
+		ast_log(LOG_WARNING,"No server found in transport [%.*s]\n",len,transport);
 		/* Exit */
 		return;
 	}
 
 	/* Get port number */
-	rtp_port = atoi(i+12);
+	rtp_port = HeaderValueInt(i+12,len-(i+12-transport));
 
 	/* Get to the rtcp port */
-	if (!(i=strstr(i,"-")))
+	if (!(i=memchr(i,'-',len-(i-transport))))
 	{
 		/* Log */
 	     /*	ast_log(LOG_DEBUG,"Not rtcp found in transport  [%s]\n",transport); CHANGE */
-		ast_log(LOG_WARNING,"No rtcp found in transport  [%s]\n",transport);
+		ast_log(LOG_WARNING,"No rtcp found in transport  [%.*s]\n",len,transport);
 		/* exit */
 		return;
 	}	
 
 	/* Get port number */
-	rtcp_port = atoi(i+1);
+	rtcp_port = HeaderValueInt(i+1,len-(i+1-transport));
 
 	/* Get send address */
 	addr = GetIPAddr(player->ip,rtp_port,player->isIPv6,&size,&PF);
@@ -1843,12 +3352,12 @@ static void RrspPlayerSetVideoTransport(struct RtspPlayer *player,const char* tr
 
 static void RtspPlayerClose(struct RtspPlayer *player)
 {
-	/* Close sockets */
-	if (player->fd)		close(player->fd);
-	if (player->audioRtp)	close(player->audioRtp);
-	if (player->audioRtcp)	close(player->audioRtcp);
-	if (player->videoRtp)	close(player->videoRtp);
-	if (player->videoRtcp)	close(player->videoRtcp);
+	/* Close sockets. [v2.1] -1 when interleaved */
+	if (player->fd>0)	close(player->fd);
+	if (player->audioRtp>0)	close(player->audioRtp);
+	if (player->audioRtcp>0)	close(player->audioRtcp);
+	if (player->videoRtp>0)	close(player->videoRtp);
+	if (player->videoRtcp>0)	close(player->videoRtcp);
 }
 
 static int SendRequest(int fd,char *request,int *end)
@@ -1906,10 +3415,64 @@ static int RtspPlayerOptions(struct RtspPlayer *player,const char *url)
         return 1;
 }
 
+/* [v2.1] GET_PARAMETER with no body, the RFC 2326 way to keep a session alive */
+static int RtspPlayerGetParameter(struct RtspPlayer *player,const char *url)
+{
+	char request[1024];
+	char uri[256]; /* [v2.1] */
+
+	/* Log */
+	ast_debug(1,"<RTSP GET_PARAMETER [%s]\n",url);
+
+	/* Prepare request */
+	snprintf(request,1024,
+			"GET_PARAMETER rtsp://%s%s RTSP/1.0\r\n"
+			"CSeq: %d\r\n"
+			"User-Agent: app_rtsp\r\n"
+			"Session: %s\r\n",
+			player->hostport,url,player->cseq,player->session[player->numSessions-1]);
+
+	/* [v2.1] Digest for this request */
+	snprintf(uri,sizeof(uri),"rtsp://%s%s",player->hostport,url);
+	RtspPlayerAuthorize(player,"GET_PARAMETER",uri,0);
+
+	/* If we are authorized */
+	if (player->authorization)
+	{
+		/* Append header */
+		strcat(request,player->authorization);
+		/* End line */
+		strcat(request,"\r\n");
+	}
+	/* End request */
+	strcat(request,"\r\n");
+
+	/* Send request */
+	if (!SendRequest(player->fd,request,&player->end))
+		/* exit */
+		return 0;
+	/* Increase player secuence number for request */
+	player->cseq++;
+	ast_debug(3,"\n%s\n",request);
+	return 1;
+}
+
+/* [v2.1] Keep the session from timing out */
+static int RtspPlayerKeepalive(struct RtspPlayer *player,const char *url,int getParameter)
+{
+	/* log */
+	ast_debug(2,"-sending %s keepalive, session timeout %d s\n",getParameter?"get_parameter":"options",player->sessionTimeout);
+
+	if (getParameter)
+		return RtspPlayerGetParameter(player,url);
+	return RtspPlayerOptions(player,url);
+}
+
 static int RtspPlayerDescribe(struct RtspPlayer *player,const char *url)
 {
 
 	char request[1024];
+	char uri[256]; /* [v2.1] */
 
 	/* Log */
      /*	ast_log(LOG_DEBUG,">DESCRIBE [%s]\n",url); OLD */
@@ -1923,6 +3486,10 @@ static int RtspPlayerDescribe(struct RtspPlayer *player,const char *url)
 			"User-Agent: app_rtsp\r\n",
 			player->hostport,url,player->cseq);
 
+	/* [v2.1] Pre-emptive, from the auth cache */
+	snprintf(uri,sizeof(uri),"rtsp://%s%s",player->hostport,url);
+	RtspPlayerAuthorize(player,"DESCRIBE",uri,0);
+
 	/* If we are authorized */
 	if (player->authorization)
 	{
@@ -1972,6 +3539,13 @@ static void SipSpeakerSetAudioTransport(struct RtspPlayer *player, int dst_port)
 
 	ast_free(sendAddr); 
 
+	/* [v2.1] Sender reports go to the next port up, RFC 3550 11 */
+	sendAddr = GetIPAddr(player->ip,dst_port+1,player->isIPv6,&size,&PF);
+	if (connect(player->audioRtcp,sendAddr,size)<0)
+		ast_log(LOG_DEBUG,"Could not connect SIP audio rtcp port [%s,%d,%d].%s\n", \
+			player->ip,dst_port+1,errno,strerror(errno));
+	ast_free(sendAddr);
+
 }
 
 /* [17.x NEW] For SIP */ 
@@ -2032,21 +3606,114 @@ static int SipSpeakerOptions(struct RtspPlayer *player, char *username)
 	return 1;
 }
 
+/*
+ * [v2.1] Talkback codecs. The INVITE used to offer only PCMU or PCMA at
+ * 8 kHz, so a wideband caller was transcoded down to G.711 on every frame.
+ * The offer is now the c() list of the camera, native formats of the
+ * channel first, each with its rtpmap, fmtp and RTP clock. L16 goes on the
+ * wire in network byte order. G.722 keeps its 8000 RTP clock (RFC 3551).
+ */
+struct SipCodec
+{
+	const char	*name;          /* c() option */
+	const char	*rtpmap;        /* encoding/clock[/channels] */
+	int		payload;        /* static, or the dynamic one we offer */
+	uint64_t	format;         /* AST_FORMAT_xxx */
+	int		bandwidth;      /* b=AS, kbps */
+	const char	*fmtp;          /* NULL if none */
+	int		byteSwap;       /* slin is host order, L16 network order */
+};
+
+static const struct SipCodec sipCodecs[] = {
+	{ "opus",	"opus/48000/2",	111, AST_FORMAT_OPUS,	48,	"useinbandfec=1;stereo=0;sprop-stereo=0", 0 },
+	{ "g722",	"G722/8000",	  9, AST_FORMAT_G722,	64,	NULL, 0 },
+	{ "slin16",	"L16/16000",	112, AST_FORMAT_SLIN16,	256,	NULL, 1 },
+	{ "ulaw",	"PCMU/8000",	  0, AST_FORMAT_ULAW,	64,	NULL, 0 },
+	{ "alaw",	"PCMA/8000",	  8, AST_FORMAT_ALAW,	64,	NULL, 0 },
+	{ "slin",	"L16/8000",	113, AST_FORMAT_SLIN,	128,	NULL, 1 },
+};
+
+static int SipCodecFind(const char *name)
+{
+	int i;
+
+	for (i=0;i<(int)(sizeof(sipCodecs)/sizeof(sipCodecs[0]));i++)
+		if (!strcasecmp(name,sipCodecs[i].name))
+			return i;
+	return -1;
+}
+
+static int SipCodecByFormat(uint64_t format)
+{
+	int i;
+
+	for (i=0;i<(int)(sizeof(sipCodecs)/sizeof(sipCodecs[0]));i++)
+		if (sipCodecs[i].format==format)
+			return i;
+	return -1;
+}
+
+/*
+ * Offer codecs in the list the channel has natively, so talkback goes out
+ * as read. If it has none of them, offer the whole list and let Asterisk
+ * transcode. An empty list offers the camera audio codec, as before.
+ */
+static int SipSpeakerOffer(struct RtspPlayer *player, const int *codecs, int numCodecs,
+			   struct ast_format_cap *nativeCap, int audioFormat)
+{
+	struct ast_format *format;
+	int codec;
+	int i;
+
+	player->numSipOffer = 0;
+	for (i=0;i<numCodecs;i++)
+	{
+		format = ast_format_compatibility_bitfield2format(sipCodecs[codecs[i]].format);
+		if (format && nativeCap && ast_format_cap_iscompatible_format(nativeCap,format)!=AST_FORMAT_CMP_NOT_EQUAL)
+			player->sipOffer[player->numSipOffer++] = codecs[i];
+	}
+	/* None native */
+	if (!player->numSipOffer)
+		for (i=0;i<numCodecs;i++)
+			player->sipOffer[player->numSipOffer++] = codecs[i];
+	/* Camera codec */
+	if (!player->numSipOffer)
+	{
+		if ((codec = SipCodecByFormat((uint64_t)audioFormat))<0)
+		{
+			ast_log(LOG_ERROR,"SIP does not support audio Format %"PRIx64"\n",(uint64_t)audioFormat);
+			return 0;
+		}
+		player->sipOffer[player->numSipOffer++] = codec;
+	}
+
+	/* log */
+	for (i=0;i<player->numSipOffer;i++)
+		ast_debug(2,"-sip offer %d: %s\n",i,sipCodecs[player->sipOffer[i]].rtpmap);
+	return 1;
+}
+
 /* [17.x NEW] For SIP */ 
 static int SipSpeakerInvite(struct RtspPlayer *player, char *username, int audioFormat,int retry)
 {
-	char request[1024];
-	char sdp[512];
+	char request[2048]; /* [v2.1] was 1024, room for the codec list */
+	char sdp[1024]; /* [v2.1] was 512 */
 	int  req_string_len = 0;
 	int  sdp_string_len = 0;
 	int temp;
-	int  rtp_pt, rtp_bw;
-	char rtp_pt_name[16];
+	int  rtp_bw = 0; /* [v2.1] */
+	const struct SipCodec *codec; /* [v2.1] */
+	int i; /* [v2.1] */
 
 	/* Log */
 	ast_debug(1,"<SIP INVITE [%s]\n",username); //changed [v2.0]
 
+	/* [v2.1] Codecs from SipSpeakerOffer(), or the camera's */
+	if (!player->numSipOffer && !SipSpeakerOffer(player,NULL,0,NULL,audioFormat))
+		return -1;
+
 	/* Message Body: SDP . Do this first to compute Content-Length.*/
+#if 0 /* [v2.1] G.711 only, see sipCodecs[] */
 	switch (audioFormat)
 	{
 		case AST_FORMAT_ULAW:
@@ -2064,22 +3731,34 @@ static int SipSpeakerInvite(struct RtspPlayer *player, char *username, int audio
 			ast_log(LOG_ERROR,"SIP does not support audio Format %"PRIu64"\n", mimeTypes[audioFormat].format); /* PORT 17.5. Proper way to print */
 			return -1;
 	}
+#endif
+	/* [v2.1] Highest bandwidth of the offer */
+	for (i=0;i<player->numSipOffer;i++)
+		if (sipCodecs[player->sipOffer[i]].bandwidth>rtp_bw)
+			rtp_bw = sipCodecs[player->sipOffer[i]].bandwidth;
 	generateSessionId(player);
-	sdp_string_len = snprintf(sdp,512,
+	sdp_string_len = snprintf(sdp,sizeof(sdp),
 			"v=0\r\n"
 			"o=SIP %s 424 IN IP4 %s\r\n" /* <sessionid> <version> (fixed at 424), <netType> <addrType> <addr> */
 			"s=SIPUA\r\n"
 			"c=IN IP4 %s\r\n"
 			"t=0 0\r\n"
-			"m=audio %i RTP/AVP %d\r\n"
-			"b=AS:%i\r\n"
-			"a=rtpmap:%d %s\r\n"
-			"a=sendonly\r\n",
+			"m=audio %i RTP/AVP",
 			player->session_id,player->local_ctrl_ip, /*o=       */
 			player->local_ctrl_ip,                    /*c=       */
-			player->audioRtpPort,rtp_pt,              /*m=audio  */
-			rtp_bw,                                   /*b=       */
-			rtp_pt,rtp_pt_name);                      /*a=rtpmap */
+			player->audioRtpPort);                    /*m=audio  */
+	/* [v2.1] Payload types, then bandwidth, then rtpmap and fmtp of each */
+	for (i=0;i<player->numSipOffer;i++)
+		sdp_string_len += snprintf(sdp+sdp_string_len,sizeof(sdp)-sdp_string_len," %d",sipCodecs[player->sipOffer[i]].payload);
+	sdp_string_len += snprintf(sdp+sdp_string_len,sizeof(sdp)-sdp_string_len,"\r\nb=AS:%i\r\n",rtp_bw);
+	for (i=0;i<player->numSipOffer;i++)
+	{
+		codec = &sipCodecs[player->sipOffer[i]];
+		sdp_string_len += snprintf(sdp+sdp_string_len,sizeof(sdp)-sdp_string_len,"a=rtpmap:%d %s\r\n",codec->payload,codec->rtpmap);
+		if (codec->fmtp)
+			sdp_string_len += snprintf(sdp+sdp_string_len,sizeof(sdp)-sdp_string_len,"a=fmtp:%d %s\r\n",codec->payload,codec->fmtp);
+	}
+	sdp_string_len += snprintf(sdp+sdp_string_len,sizeof(sdp)-sdp_string_len,"a=sendonly\r\n");
 
 	/* Start Message Header */
 	if (!player->in_a_dialog && !retry) 
@@ -2095,7 +3774,7 @@ static int SipSpeakerInvite(struct RtspPlayer *player, char *username, int audio
 	generateBranch(player);
 
 	/* Prepare SIP request */
-	req_string_len = snprintf(request,1024,
+	req_string_len = snprintf(request,sizeof(request),
 			"INVITE sip:%s@%s:%i SIP/2.0\r\n"
 			"To: <sip:%s@%s:%i>\r\n"
 			"From: <sip:%s@%s>;tag=%s\r\n"
@@ -2147,6 +3826,24 @@ static int SipSpeakerInvite(struct RtspPlayer *player, char *username, int audio
 	return 1;
 }
 
+/* [v2.1] First INVITE of the call, authorized if the speaker challenged us before */
+static int SipSpeakerStart(struct RtspPlayer *player, char *username, int audioFormat,
+			   struct RtspSipOptions *opts, struct ast_format_cap *nativeCap)
+{
+	char uri[256];
+
+	/* Codecs for this and any retried INVITE */
+	if (!SipSpeakerOffer(player,opts->sipCodecs,opts->numSipCodecs,nativeCap,audioFormat))
+		return -1;
+
+	if (player->authScheme==AUTH_SCHEME_DIGEST)
+	{
+		snprintf(uri,sizeof(uri),"sip:%s@%s:%i",username,player->ip,player->port);
+		RtspPlayerAuthorize(player,"INVITE",uri,1);
+	}
+	return SipSpeakerInvite(player,username,audioFormat,0);
+}
+
 static int SipSpeakerAck(struct RtspPlayer *player, char *username, int response_type)
 { 	/* RFC3261 
    	 * Sect 17.1.1.3 For final responses between 300 and 699 
@@ -2267,15 +3964,33 @@ static int SipSpeakerBye(struct RtspPlayer *player, char *username )
 	return 1;
 }
 
+/* [v2.1] Transport header value for SETUP, UDP ports or interleaved channels */
+static void RtspPlayerTransport(struct RtspPlayer* player, int isAudio, char *transport, int size)
+{
+	if (player->interleaved)
+		snprintf(transport,size,"RTP/AVP/TCP;unicast;interleaved=%d-%d",
+			isAudio ? player->audioChannel : player->videoChannel,
+			(isAudio ? player->audioChannel : player->videoChannel)+1);
+	else
+		snprintf(transport,size,"RTP/AVP/UDP;unicast;client_port=%d-%d",
+			isAudio ? player->audioRtpPort : player->videoRtpPort,
+			isAudio ? player->audioRtcpPort : player->videoRtcpPort);
+}
+
 static int RtspPlayerSetupAudio(struct RtspPlayer* player,const char *url)
 {
 	char request[1024];
 	char sessionheader[256];
+	char transport[128]; /* [v2.1] */
+	char uri[256]; /* [v2.1] */
 
 	/* Log */
      /*	ast_log(LOG_DEBUG,"-SETUP AUDIO [%s]\n",url); OLD */
 	ast_debug(1,"<RTSP SETUP for audio [%s]\n",url); //added [v2.0]
 
+	/* [v2.1] Transport */
+	RtspPlayerTransport(player,1,transport,sizeof(transport));
+
 	/* if it got session */
 	if (player->numSessions)
 		/* Create header */
@@ -2290,22 +4005,26 @@ static int RtspPlayerSetupAudio(struct RtspPlayer* player,const char *url)
 		/* Prepare request */
 		snprintf(request,1024,
 				"SETUP %s RTSP/1.0\r\n"
-				"Transport: RTP/AVP/UDP;unicast;client_port=%d-%d\r\n"
+				"Transport: %s\r\n"
 				"CSeq: %d\r\n"
 				"User-Agent: app_rtsp\r\n"
 				"%s",
-				url,player->audioRtpPort,player->audioRtcpPort,player->cseq,sessionheader);
+				url,transport,player->cseq,sessionheader);
 	} else {
 		/* Prepare request */
 		snprintf(request,1024,
 				"SETUP rtsp://%s%s/%s RTSP/1.0\r\n"
-				"Transport: RTP/AVP/UDP;unicast;client_port=%d-%d\r\n"
+				"Transport: %s\r\n"
 				"CSeq: %d\r\n"
 				"User-Agent: app_rtsp\r\n"
 				"%s",
-				player->hostport,player->url,url,player->audioRtpPort,player->audioRtcpPort,player->cseq,sessionheader);
+				player->hostport,player->url,url,transport,player->cseq,sessionheader);
 	}
 
+	/* [v2.1] Digest for this request */
+	RtspPlayerControlUri(player,url,uri,sizeof(uri));
+	RtspPlayerAuthorize(player,"SETUP",uri,0);
+
 	/* If we are authorized */
 	if (player->authorization)
 	{
@@ -2334,10 +4053,15 @@ static int RtspPlayerSetupVideo(struct RtspPlayer* player,const char *url)
 {
 	char request[1024];
 	char sessionheader[256];
+	char transport[128]; /* [v2.1] */
+	char uri[256]; /* [v2.1] */
 
 	/* Log */
 	ast_log(LOG_DEBUG,"-SETUP VIDEO [%s]\n",url);
 
+	/* [v2.1] Transport */
+	RtspPlayerTransport(player,0,transport,sizeof(transport));
+
 	/* if it got session */
 	if (player->numSessions)
 		/* Create header */
@@ -2352,22 +4076,26 @@ static int RtspPlayerSetupVideo(struct RtspPlayer* player,const char *url)
 		/* Prepare request */
 		snprintf(request,1024,
 				"SETUP %s RTSP/1.0\r\n"
-				"Transport: RTP/AVP/UDP;unicast;client_port=%d-%d\r\n"
+				"Transport: %s\r\n"
 				"CSeq: %d\r\n"
 				"User-Agent: app_rtsp\r\n"
 				"%s",
-				url,player->videoRtpPort,player->videoRtcpPort,player->cseq,sessionheader);
+				url,transport,player->cseq,sessionheader);
 	} else {
 		/* Prepare request */
 		snprintf(request,1024,
 				"SETUP rtsp://%s%s/%s RTSP/1.0\r\n"
-				"Transport: RTP/AVP/UDP;unicast;client_port=%d-%d\r\n"
+				"Transport: %s\r\n"
 				"CSeq: %d\r\n"
 				"User-Agent: app_rtsp\r\n"
 				"%s",
-				player->hostport,player->url,url,player->videoRtpPort,player->videoRtcpPort,player->cseq,sessionheader);
+				player->hostport,player->url,url,transport,player->cseq,sessionheader);
 	}
 
+	/* [v2.1] Digest for this request */
+	RtspPlayerControlUri(player,url,uri,sizeof(uri));
+	RtspPlayerAuthorize(player,"SETUP",uri,0);
+
 	/* If we are authorized */
 	if (player->authorization)
 	{
@@ -2394,6 +4122,7 @@ static int RtspPlayerSetupVideo(struct RtspPlayer* player,const char *url)
 static int RtspPlayerPlay(struct RtspPlayer* player)
 {
 	char request[1024];
+	char uri[256]; /* [v2.1] */
 	int i;
 
 	/* Log */
@@ -2416,6 +4145,10 @@ static int RtspPlayerPlay(struct RtspPlayer* player)
 				"Session: %s\r\n",
 				player->hostport,player->url,player->cseq,player->session[i]);
 
+		/* [v2.1] Digest for this request */
+		snprintf(uri,sizeof(uri),"rtsp://%s%s",player->hostport,player->url);
+		RtspPlayerAuthorize(player,"PLAY",uri,0);
+
 		/* If we are authorized */
 		if (player->authorization)
 		{
@@ -2444,6 +4177,7 @@ static int RtspPlayerPlay(struct RtspPlayer* player)
 static int RtspPlayerTeardown(struct RtspPlayer* player)
 {
 	char request[1024];
+	char uri[256]; /* [v2.1] */
 	int i;
 
 	/* Log */
@@ -2466,6 +4200,10 @@ static int RtspPlayerTeardown(struct RtspPlayer* player)
 				"Session: %s\r\n",
 				player->hostport,player->url,player->cseq,player->session[i]);
 
+		/* [v2.1] Digest for this request */
+		snprintf(uri,sizeof(uri),"rtsp://%s%s",player->hostport,player->url);
+		RtspPlayerAuthorize(player,"TEARDOWN",uri,0);
+
 		/* If we are authorized */
 		if (player->authorization)
 		{
@@ -2490,6 +4228,8 @@ static int RtspPlayerTeardown(struct RtspPlayer* player)
 	return 1;
 }
 
+#endif /* RTSP_SIP_STANDALONE */
+
 #define RTSP_TUNNEL_CONNECTING 	0
 #define RTSP_TUNNEL_NEGOTIATION 1
 #define RTSP_TUNNEL_RTP 	2
@@ -2502,6 +4242,8 @@ struct SDPFormat
 	uint64_t		format;		/* PORT 17.3 bit of AST_FORMAT_xxx is ULL */
         struct ast_format	*new_format; 	/* PORT 17.3 add new format  */
 	char*			control;
+	char*			fmtp;		/* [v2.1] a=fmtp parameters, NULL if none */
+	int			rate;		/* [v2.1] RTP clock rate, 0 if unknown */
 };
 
 struct SDPMedia
@@ -2510,20 +4252,119 @@ struct SDPMedia
 	int 		   num;
      /*	int 		   all; OLD */
 	uint64_t 	   all; 		/* PORT 17.3 bit list of AST_FORMAT_xxx is ULL */
+	int		  *payloads;		/* [v2.1] payload types of the m= line, in its order */
 	uint16_t	   peer_media_port; 	/* [17.x NEW]. SIP Peers tcp/udp port for receiving media */
+	int		   bandwidth;		/* [v2.1] b=AS, kbps. 0 if not given */
+	int		   ptime;		/* [v2.1] a=ptime, ms. 0 if not given */
 };
 
 struct SDPContent
 {
 	struct SDPMedia* audio;
 	struct SDPMedia* video;
+	int		 bandwidth;		/* [v2.1] session level b=AS, kbps. 0 if not given */
+	char		*arena;			/* [v2.1] right behind this struct, see SdpArenaAlloc() */
+	size_t		 arenaSize;
+	size_t		 arenaUsed;
 };
 
-static struct SDPMedia* CreateMedia(char *buffer,int bufferLen)
+/*
+ * [v2.1] SDP arena.
+ * CreateSDP() used to allocate the content, each media, its formats array,
+ * every format and every control string separately, and DestroySDP() walked
+ * it all again to free them. Now a first pass counts the m= lines and their
+ * payloads, and the whole model goes in one zeroed allocation behind the
+ * SDPContent: a copy of the SDP with its lines \0 terminated, then media,
+ * format pointers, formats and payload types. Control and fmtp strings point
+ * into the copy, which keeps them valid in the SDP cache after the receive
+ * buffer is reused. DestroySDP() is a single free.
+ */
+#define SDP_ALIGN(n)	(((n)+7) & ~(size_t)7)
+
+/* [v2.1] RFC 3551 static payload types, for m= payloads without an rtpmap */
+static struct
+{
+	int	 payload;
+	char*	 name;		/* rtpmapTable[] key */
+	int	 rate;
+} staticPayloads[] = {
+	{ 0, "PCMU", 8000},
+	{ 3, "GSM", 8000},
+	{ 4, "G723", 8000},
+	{ 8, "PCMA", 8000},
+	{ 9, "G722", 8000},
+	{ 18, "G729", 8000},
+	{ 26, "JPEG", 90000},
+	{ 31, "H261", 90000},
+	{ 34, "H263", 90000},
+};
+
+static size_t SdpArenaSize(const char *buffer,int bufferLen)
+{
+	const char *end = buffer+bufferLen;
+	const char *i;
+	const char *j;
+	const char *k;
+	size_t size;
+	int num;
+
+	/* The copy */
+	size = SDP_ALIGN(bufferLen+1);
+
+	/* Each m= line, a format per space is more than enough */
+	for (i=buffer;i<end;i=j+1)
+	{
+		if (!(j=memchr(i,'\n',end-i)))
+			j = end;
+		if (j-i<3 || i[0]!='m' || i[1]!='=')
+			continue;
+		for (num=0,k=i;k<j;k++)
+			if (*k==' ')
+				num++;
+		size += SDP_ALIGN(sizeof(struct SDPMedia)) + SDP_ALIGN(num*sizeof(struct SDPFormat*)) +
+			num*SDP_ALIGN(sizeof(struct SDPFormat)) + SDP_ALIGN(num*sizeof(int));
+	}
+	return size;
+}
+
+static void* SdpArenaAlloc(struct SDPContent *sdp,size_t size)
+{
+	void *ptr;
+
+	/* Keep everything 8 byte aligned */
+	size = SDP_ALIGN(size);
+	if (sdp->arenaUsed+size>sdp->arenaSize)
+	{
+		ast_log(LOG_ERROR,"SDP arena exhausted [%zu+%zu>%zu]\n",sdp->arenaUsed,size,sdp->arenaSize);
+		return NULL;
+	}
+	ptr = sdp->arena+sdp->arenaUsed;
+	sdp->arenaUsed += size;
+	return ptr;
+}
+
+/* [v2.1] Format of the media for a payload type, NULL if not on the m= line */
+static struct SDPFormat* SdpMediaFormat(struct SDPMedia *media,int payload)
+{
+	int i;
+
+	for (i=0;i<media->num;i++)
+		if (media->formats[i]->payload==payload)
+			return media->formats[i];
+	return NULL;
+}
+
+/* OLD CreateMedia()/CreateSDP()/DestroySDP(): an allocation per media, format and control, replaced by the SDP arena */
+
+static struct SDPMedia* CreateMedia(struct SDPContent *sdp,char *buffer,int bufferLen)
 {
 	int num = 0;
 	int i = 0;
-	struct SDPMedia* media = NULL;;
+	int f = 0;
+	int spaces = 0;
+	struct SDPMedia* media = NULL;
+	struct SDPFormat* format = NULL;
+	const struct RtpmapEntry* entry = NULL;
 
 	/* Count number of spaces*/
 	for (i=0;i<bufferLen;i++)
@@ -2537,107 +4378,100 @@ static struct SDPMedia* CreateMedia(char *buffer,int bufferLen)
 		/* Exit */
 		return NULL;
 
-	/* Allocate */
-     /* media = (struct SDPMedia*) malloc(sizeof(struct SDPMedia)); OLD */
-	media = (struct SDPMedia*) ast_malloc(sizeof(struct SDPMedia));
+	/* Allocate from the arena, zeroed */
+	if (!(media = (struct SDPMedia*) SdpArenaAlloc(sdp,sizeof(struct SDPMedia))))
+		return NULL;
 
 	/* Get number of formats */
 	media->num = num - 2; 
 
 	/* Allocate */
-     /*	media->formats = (struct SDPFormat**) malloc(media->num); OLD */
-     /*	media->formats = (struct SDPFormat**) ast_malloc(media->num);  Alloc the array would only alloc num bytes */
-	media->formats = (struct SDPFormat**) ast_malloc(sizeof(struct SDPFormat**) * media->num); /* Alloc the array */
-
-	/* Set all formats to nothing */
-	media->all = 0;
-
-	/* ADDED. SIP. Set peer media tcp/udp port to nothing */
-	media->peer_media_port = 0;
+	media->formats = (struct SDPFormat**) SdpArenaAlloc(sdp,sizeof(struct SDPFormat*) * media->num);
+	media->payloads = (int*) SdpArenaAlloc(sdp,sizeof(int) * media->num);
+	if (!media->formats || !media->payloads)
+		return NULL;
 
+	/* Payload types after "m=<media> <port> <proto> ", answers are matched on them */
+	for (i=0,num=0;i<bufferLen && num<media->num;i++)
+		if (buffer[i]==' ' && ++spaces>=3)
+			media->payloads[num++] = atoi(buffer+i+1);
 
 	/* For each format */
 	for (i=0;i<media->num;i++)
 	{
 		/* Allocate format */
-	     /*	media->formats[i] = (struct SDPFormat*) malloc(media->num); OLD. BUG TOO */
-	     /*	media->formats[i] = (struct SDPFormat*) ast_malloc(sizeof(struct SDPFormat)); PORT 17.3 */
-		media->formats[i] = (struct SDPFormat*) ast_malloc(sizeof(*(media->formats[i]))); /*PORT 17.5 */
-		/* Init params */
-		media->formats[i]->payload 	= -1;
-		media->formats[i]->format 	= 0;
-		media->formats[i]->control 	= NULL;
+		if (!(format = media->formats[i] = (struct SDPFormat*) SdpArenaAlloc(sdp,sizeof(struct SDPFormat))))
+			return NULL;
+		/* Init params, an rtpmap may change the format */
+		format->payload = media->payloads[i];
+		for (f = 0; f < (int)(sizeof(staticPayloads)/sizeof(staticPayloads[0])); ++f)
+			if (staticPayloads[f].payload==format->payload)
+			{
+				if ((entry = RtpmapLookup(staticPayloads[f].name,strlen(staticPayloads[f].name),staticPayloads[f].rate)))
+				{
+					format->format = entry->format;
+					format->new_format = entry->new_format;
+					format->rate = entry->rate;
+					media->all |= format->format;
+				}
+				break;
+			}
 	}
 
 	/* log */
-     /*	ast_log(LOG_DEBUG,"-creating media [%d,%s]\n",media->num,strndup(buffer,bufferLen)); OLD */
-	ast_debug(2,"-creating media [%d,%s]\n",media->num,strndupa(buffer,bufferLen)); /* PORT 17.3 Avoid mem leak;use strndupa instead */
+	ast_debug(2,"-creating media [%d,%.*s]\n",media->num,bufferLen,buffer);
 
 	/* Return media */
 	return media;
 }
 
-static void DestroyMedia(struct SDPMedia* media)
-{
-	int i = 0;
-
-	/* Free format */
-	for (i=0;i<media->num;i++)
-	{
-		/* Free control */
-		if (media->formats[i]->control) 
-	             /*	free(media->formats[i]->control); OLD */
-			ast_free(media->formats[i]->control);
-		/* Free format*/
-	     /*	free(media->formats[i]); OLD */
-		ast_free(media->formats[i]);
-	}
-	/* Free format */
-     /*	free(media->formats); OLD */
-	ast_free(media->formats);
-	/* Free media */
-     /* free(media); OLD */
-	ast_free(media);
-}
-
 static struct SDPContent* CreateSDP(char *buffer,int bufferLen, int sip_enable)
 {
 	struct SDPContent* sdp = NULL;
 	struct SDPMedia* media = NULL;;
-	char *i = buffer;
-	char *j = NULL;
+	struct SDPFormat* format = NULL;
+	const struct RtpmapEntry* entry = NULL;
+	char *text;
+	char *i;
+	char *j;
+	char *e;
 	char *k = NULL; /* New. SIP */
 	char *ini;
 	char *end;
+	size_t size;
 	int n = 0;
 	int f = 0;
 
-	ast_debug(4,"SDPContent bufferLen %i buffer:\n%s",bufferLen, buffer); /* ADDED */
+	ast_debug(4,"SDPContent bufferLen %i buffer:\n%.*s",bufferLen,bufferLen,buffer);
 
-	/* Malloc */
-     /*	sdp = (struct SDPContent*) malloc(sizeof(struct SDPContent)); OLD */
-	sdp = (struct SDPContent*) ast_malloc(sizeof(struct SDPContent));
+	/* One allocation for all of it */
+	size = SdpArenaSize(buffer,bufferLen);
+	if (!(sdp = (struct SDPContent*) ast_calloc(1,SDP_ALIGN(sizeof(struct SDPContent))+size)))
+		return NULL;
+	sdp->arena = (char*)sdp + SDP_ALIGN(sizeof(struct SDPContent));
+	sdp->arenaSize = size;
 
-	/* NO audio and video */
-	sdp->audio = NULL;
-	sdp->video = NULL;
+	/* Copy the text, lines are terminated in place */
+	text = (char*) SdpArenaAlloc(sdp,bufferLen+1);
+	memcpy(text,buffer,bufferLen);
+	text[bufferLen] = 0;
 
 	/* Read each line */
-     /*	while ( (j=strstr(i,"\n")) != NULL && (j<buffer+bufferLen))  PORT 17.3. Picked up from port to 11.x.x */
-	while ( (j=strstr(i,"\n")) != NULL) 
+	for (i=text;i<text+bufferLen;i=j+1)
 	{
-		/* if it's not enougth data */
-		if (j-i<=1)
-			goto next;
+		/* Get end of line */
+		if (!(j=memchr(i,'\n',text+bufferLen-i)))
+			j = text+bufferLen;
+		/* Terminate, without the \r */
+		e = (j>i && j[-1]=='\r') ? j-1 : j;
+		*e = 0;
 
-		/* If previous is a \r" */
-		if (j[-1]=='\r')
-			/* Decrease end */
-			j--;
+		/* if it's not enougth data */
+		if (e-i<=1)
+			continue;
 
 		/* log */
-	     /*	ast_log(LOG_DEBUG,"-line [%s]\n",strndup(i,j-i)); OLD */
-		ast_debug(3,"-line [%s]\n",strndupa(i,j-i)); /* Avoid mem leak;use strndupa instead */
+		ast_debug(3,"-line [%s]\n",i);
 
 		/* Check header */
 		if (strncmp(i,"m=",2)==0) 
@@ -2646,19 +4480,19 @@ static struct SDPContent* CreateSDP(char *buffer,int bufferLen, int sip_enable)
 			if (strncmp(i+2,"video",5)==0)
 			{
 				/* create video */
-				sdp->video = CreateMedia(i,j-i);
+				sdp->video = CreateMedia(sdp,i,e-i);
 				/* set current media */
 				media = sdp->video;
 			} else if (strncmp(i+2,"audio",5)==0) {
 				/* create audio */
-				sdp->audio = CreateMedia(i,j-i);
+				sdp->audio = CreateMedia(sdp,i,e-i);
 				/* set current media */
 				media = sdp->audio;
 				/* ADDED. SIP Get the Peer's tcp/udp port. RFC 2327 p20
 				 * Ex. m=audio 49170/2 RTP/AVP 31. 49170 is the port. /2 or /(anything) is not supported
 				 * Only parse peer port when SIP is enabled since it's only used for SIP functionality
 				 */
-				if (sip_enable) {
+				if (sip_enable && sdp->audio) {
 					sdp->audio->peer_media_port = (uint16_t) strtol(i+8, &k, 10);
 					if(sdp->audio->peer_media_port == 0)
 						ast_log(LOG_WARNING,"    peer rtp port is not provided\n");
@@ -2678,86 +4512,65 @@ static struct SDPContent* CreateSDP(char *buffer,int bufferLen, int sip_enable)
 		} else if (strncmp(i,"a=rtpmap:",9)==0){
 			/* if not in media */
 			if (!media)
-				goto next;
-			/* If more than formats */
-			if (n==media->num)
-				goto next;
+				continue;
+			/* Format of that payload type, else the next one as before */
+			if (!(format = SdpMediaFormat(media,atoi(i+9))))
+			{
+				if (n==media->num)
+					continue;
+				format = media->formats[n];
+				format->payload = atoi(i+9);
+			}
+			n++;
 			/* get ini */
-			for (ini=i;ini<j;ini++)
+			for (ini=i;ini<e;ini++)
 				/* if it's a space */
 				if (*ini==' ')
 					break;
 			/* skip space*/
-			if (++ini>=j)
-				goto next;
+			if (++ini>=e)
+				continue;
 			/* get end */
-			for (end=ini;end<j;end++)
+			for (end=ini;end<e;end++)
 				/* if it's a space */
 				if (*end=='/')
 					break;
-			/* Check formats */
-			for (f = 0; f < sizeof(mimeTypes)/sizeof(mimeTypes[0]); ++f) 
-				/* If the string is in it */
-				if (strncasecmp(ini,mimeTypes[f].name,end-ini) == 0) 
-				{
-					/* Set type */
-					media->formats[n]->format = mimeTypes[f].format;
-					/* PORT 17.3 add new Asterisk format.
-					 * bifield2format() takes arg something like AST_FORMAT_ULAW
-					 * and returns ast_format *ast_format_ulaw 
-					 */
-
-					media->formats[n]->new_format = ast_format_compatibility_bitfield2format( mimeTypes[f].format);
-					if(media->formats[n]->new_format == NULL) /*ADDED */
-						ast_debug(3,"      added new format to list is NULL\n"); /* ADDED  */
-					else
-					     /* ast_debug(3,"      added format %llx to list \n",mimeTypes[f].format);  ADDED  */
-						ast_debug(3,"      added format %"PRIx64" to list \n",mimeTypes[f].format); /* PORT17.5 Proper way to print */
-
-					/* Set payload */
-					media->formats[n]->payload = atoi(i+9);
-					/* Append to all formats */
-					media->all |= media->formats[n]->format;
-					/* Inc medias */
-					n++;
-					/* Exit */
-					//break;
-				}
-			
+			/* Look up name and clock rate */
+			if ((entry = RtpmapLookup(ini,end-ini,end<e ? atoi(end+1) : 0)))
+			{
+				/* Set type */
+				format->format = entry->format;
+				format->new_format = entry->new_format;
+				format->rate = entry->rate;
+				ast_debug(3,"      added format %"PRIx64" to list \n",entry->format);
+				/* Append to all formats */
+				media->all |= format->format;
+			} else
+				ast_debug(3,"      unknown rtpmap %s\n",ini);
+		} else if (strncmp(i,"a=fmtp:",7)==0){
+			/* Parameters after the payload type */
+			if (!media || !(format = SdpMediaFormat(media,atoi(i+7))) || !(ini = strchr(i+7,' ')))
+				continue;
+			format->fmtp = ini+1;
+			ast_debug(3,"      fmtp %d: %s\n",format->payload,format->fmtp);
+		} else if (strncmp(i,"a=ptime:",8)==0){
+			/* Packet time of the media */
+			if (media)
+				media->ptime = atoi(i+8);
+		} else if (strncmp(i,"b=AS:",5)==0){
+			/* Bandwidth, for the RTCP interval */
+			if (media)
+				media->bandwidth = atoi(i+5);
+			else
+				sdp->bandwidth = atoi(i+5);
 		} else if (strncmp(i,"a=control:",10)==0){
 			/* if not in media */
 			if (!media)
-				goto next;
-			/* If more than formats */
-			if (n>media->num)
-				goto next;
-			/* If it's previous to the ftmp */
-			if (n==0)
-			{
-				/* Set control for all */
-				for ( f=0; f<media->num; f++)
-					/* Set */
-				     /*	media->formats[f]->control = strndup(i+10,j-i-10); OLD */
-					media->formats[f]->control = ast_strndup(i+10,j-i-10);
-			} else  {
-				/* if already had control */
-				if (media->formats[n-1]->control)
-					/* Free it */
-			             /*	free(media->formats[n-1]->control); OLD. BUG TOO*/
-					ast_free(media->formats[n-1]);
-				/* Get new control */
-			     /*	media->formats[n-1]->control = strndup(i+10,j-i-10); OLD */
-			 	media->formats[n-1]->control = ast_strndup(i+10,j-i-10);
-			}
+				continue;
+			/* Control is per media, whichever payload gets picked */
+			for ( f=0; f<media->num; f++)
+				media->formats[f]->control = i+10;
 		}
-next:
-		/* if it's a \r */
-		if (j[0]=='\r')
-			/* skip \r\n to next line */
-			i = j+2;
-		else
-			/* skip \n to next line */
-			i = j+1;
 	}
 
 	/* Return sdp */
@@ -2766,55 +4579,203 @@ next:
 
 static void DestroySDP(struct SDPContent* sdp)
 {
-	/* Free medias */
-	if (sdp->audio) DestroyMedia(sdp->audio);
-	if (sdp->video) DestroyMedia(sdp->video);
-	/* Free */
-     /* free(sdp); OLD */
+	/* [v2.1] All in the arena */
 	ast_free(sdp);
 }
 
+#ifndef RTSP_SIP_STANDALONE /* [v2.1] */
+/*
+ * [v2.1] Talkback codec the speaker answered with, a sipCodecs[] index or
+ * -1. The answer keeps our payload types (RFC 3264 6.1), so its m= line is
+ * matched against the offer in the answer's order. An rtpmap for a format
+ * we know has to agree with the codec too.
+ */
+static int SipSpeakerAnswer(struct RtspPlayer *player, struct SDPContent *sdp)
+{
+	struct SDPMedia *audio = sdp->audio;
+	int codec;
+	int i;
+	int j;
+	int k;
+
+	if (!audio || !audio->payloads)
+		return -1;
+	for (i=0;i<audio->num;i++)
+		for (j=0;j<player->numSipOffer;j++)
+		{
+			codec = player->sipOffer[j];
+			if (audio->payloads[i]!=sipCodecs[codec].payload)
+				continue;
+			/* Same payload type, different codec */
+			for (k=0;k<audio->num;k++)
+				if (audio->formats[k]->payload==audio->payloads[i] && audio->formats[k]->format &&
+				    audio->formats[k]->format!=sipCodecs[codec].format &&
+				    !(sipCodecs[codec].byteSwap && audio->formats[k]->format==AST_FORMAT_SLIN))
+					break;
+			if (k<audio->num)
+			{
+				ast_log(LOG_WARNING,"SIP: Peer answers payload %d with another codec\n",audio->payloads[i]);
+				continue;
+			}
+			return codec;
+		}
+	return -1;
+}
+
+/*
+ * [v2.1] Camera SDP cache.
+ * Camera SDPs practically never change, so the parsed SDP and the media
+ * chosen from it are kept per camera url for rtsp_sip_sdp_ttl seconds.
+ * A call that finds an entry skips DESCRIBE and goes straight to SETUP.
+ * The choice depends on the channel formats, so an entry only hits for
+ * identical native formats. Entries are ao2 objects: the cache holds one
+ * reference and each call using one holds another, so an entry invalidated
+ * on SETUP failure stays valid for calls still using it.
+ */
+#define SDP_CACHE_KEY		512
+#define SDP_CACHE_TTL		300	/* s */
 
-static int HasHeader(char *buffer,int bufferLen,char *header)
+struct SdpMediaChoice
 {
-	int len;
-	char *i;
+	int			audioFormat;
+	struct ast_format	*audioNewFormat;
+	char			*audioControl;   /* points into the sdp */
+	int			videoFormat;
+	struct ast_format	*videoNewFormat;
+	char			*videoControl;   /* points into the sdp */
+};
 
-	/* Get length */
-	len = strlen(header);
+struct SdpCacheEntry
+{
+	char			key[SDP_CACHE_KEY];  /* ip:port/url */
+	struct SDPContent	*sdp;
+	struct ast_format_cap	*caps;           /* formats the choice was made for */
+	struct SdpMediaChoice	choice;
+	struct timeval		created;
+	int			linked;
+	AST_LIST_ENTRY(SdpCacheEntry) list;
+};
 
-	/* If no header*/
-	if (!len)
-		/* Exit */
-		return 0;
+static AST_LIST_HEAD_STATIC(sdp_cache, SdpCacheEntry);
+static int rtsp_sip_sdp_ttl = SDP_CACHE_TTL;
 
-	/* Get Header */
-	i = strcasestr(buffer,header);
+static void SdpCacheEntryDestroy(void *obj)
+{
+	struct SdpCacheEntry *entry = obj;
 
-	/* If not found or not \r\n first*/
-	if (i<buffer+2)
-		/* Exit */
-		return 0;
+	if (entry->sdp)
+		DestroySDP(entry->sdp);
+	ao2_cleanup(entry->caps);
+}
 
-	/* If it's not in this request */
-	if (i-buffer>bufferLen)
-		/* Exit */
-		return 0;
+/* Get a reference to a fresh entry with the same channel formats, NULL if none */
+static struct SdpCacheEntry* SdpCacheGet(const char *key, struct ast_format_cap *nativeCap)
+{
+	struct SdpCacheEntry *entry;
+	struct SdpCacheEntry *found = NULL;
 
-	/* Check for \r\n */
-	if (i[-2]!='\r' || i[-1]!='\n')
-		/* Exit */
-		return 0;
+	AST_LIST_LOCK(&sdp_cache);
+	AST_LIST_TRAVERSE_SAFE_BEGIN(&sdp_cache, entry, list)
+	{
+		/* Expired */
+		if (ast_tvdiff_ms(ast_tvnow(),entry->created)>=rtsp_sip_sdp_ttl*1000)
+		{
+			AST_LIST_REMOVE_CURRENT(list);
+			entry->linked = 0;
+			ao2_ref(entry,-1);
+			continue;
+		}
+		if (!found && !strcmp(entry->key,key) && ast_format_cap_identical(entry->caps,nativeCap))
+		{
+			ao2_ref(entry,+1);
+			found = entry;
+		}
+	}
+	AST_LIST_TRAVERSE_SAFE_END;
+	AST_LIST_UNLOCK(&sdp_cache);
 
-	/* Check for ": " */
-	if (i[len]!=':' || i[len+1]!=' ')
-		/* Exit */
-		return 0;
+	return found;
+}
+
+/*
+ * Cache a parsed SDP and the media chosen from it. The entry takes the sdp.
+ * Returns a reference for the caller, or NULL if not cached (the caller
+ * keeps the sdp then).
+ */
+static struct SdpCacheEntry* SdpCachePut(const char *key, struct SDPContent *sdp, struct ast_format_cap *nativeCap,
+					 struct SdpMediaChoice *choice)
+{
+	struct SdpCacheEntry *entry;
+	struct SdpCacheEntry *old;
+
+	/* Disabled */
+	if (rtsp_sip_sdp_ttl<=0)
+		return NULL;
+
+	if (!(entry = ao2_alloc(sizeof(struct SdpCacheEntry),SdpCacheEntryDestroy)))
+		return NULL;
+	ast_copy_string(entry->key,key,sizeof(entry->key));
+	entry->choice = *choice;
+	entry->created = ast_tvnow();
+	if (!(entry->caps = ast_format_cap_alloc(AST_FORMAT_CAP_FLAG_DEFAULT))
+	    || ast_format_cap_append_from_cap(entry->caps,nativeCap,AST_MEDIA_TYPE_UNKNOWN))
+	{
+		ao2_ref(entry,-1);
+		return NULL;
+	}
+	/* Only now, so a failure above leaves the sdp to the caller */
+	entry->sdp = sdp;
+
+	AST_LIST_LOCK(&sdp_cache);
+	/* Replace the one for the same camera and formats */
+	AST_LIST_TRAVERSE_SAFE_BEGIN(&sdp_cache, old, list)
+	{
+		if (!strcmp(old->key,key) && ast_format_cap_identical(old->caps,nativeCap))
+		{
+			AST_LIST_REMOVE_CURRENT(list);
+			old->linked = 0;
+			ao2_ref(old,-1);
+		}
+	}
+	AST_LIST_TRAVERSE_SAFE_END;
+	/* The cache reference is the one from ao2_alloc() */
+	AST_LIST_INSERT_TAIL(&sdp_cache, entry, list);
+	entry->linked = 1;
+	ao2_ref(entry,+1);
+	AST_LIST_UNLOCK(&sdp_cache);
+
+	return entry;
+}
+
+/* Drop an entry from the cache, callers holding it keep using it */
+static void SdpCacheInvalidate(struct SdpCacheEntry *entry)
+{
+	AST_LIST_LOCK(&sdp_cache);
+	if (entry->linked)
+	{
+		AST_LIST_REMOVE(&sdp_cache, entry, list);
+		entry->linked = 0;
+		ao2_ref(entry,-1);
+	}
+	AST_LIST_UNLOCK(&sdp_cache);
+}
+
+static void SdpCacheFlush(void)
+{
+	struct SdpCacheEntry *entry;
 
-	/* Return value start */
-	return (i-buffer)+len+2;
+	AST_LIST_LOCK(&sdp_cache);
+	while ((entry = AST_LIST_REMOVE_HEAD(&sdp_cache, list)))
+	{
+		entry->linked = 0;
+		ao2_ref(entry,-1);
+	}
+	AST_LIST_UNLOCK(&sdp_cache);
 }
 
+
+#endif /* RTSP_SIP_STANDALONE */
+
 static int GetResponseCode(char *buffer,int bufferLen, int isSIP) /* ADDED. Differentiate RTSP vs. SIP */
 {
 	/* check length */
@@ -2826,17 +4787,26 @@ static int GetResponseCode(char *buffer,int bufferLen, int isSIP) /* ADDED. Diff
 		return atoi(buffer+9);
 }
 
-static int GetHeaderValueInt(char *buffer,int bufferLen,char *header)
+#ifndef RTSP_SIP_STANDALONE /* [v2.1] */
+/* [v2.1] Header named header is there */
+static int HasHeader(const struct HeaderIndex *index,char *header)
 {
-	int i;	 
+	return HeaderIndexFind(index,header,0)>=0;
+}
+#endif /* RTSP_SIP_STANDALONE */
+
+static int GetHeaderValueInt(const struct HeaderIndex *index,char *header) /* [v2.1] indexed once by the caller */
+{
+	const char *value;
+	int len;
 
 	/* Get start */
-	if (!(i=HasHeader(buffer,bufferLen,header)))
+	if (!(value=HeaderIndexValue(index,header,&len)))
 		/* Exit */
 		return 0;
 
 	/* Return value */
-	return atoi(buffer+i);
+	return HeaderValueInt(value,len);
 }
 
 #if 0 /* PORT 17.3 compiler warning about not being used so remove this. */
@@ -2854,48 +4824,42 @@ static long GetHeaderValueLong(char *buffer,int bufferLen,char *header)
 }
 #endif
 
-static char* GetHeaderValue(char *buffer,int bufferLen,char *header)
-{
-	int i;	 
-	char *j;
-
-	/* Get start */
-	if (!(i=HasHeader(buffer,bufferLen,header)))
-		/* Exit */
-		return 0;
-	/* Get end */
-	if (!(j=strstr(buffer+i,"\r\n")))
-		/* Exit */
-		return 0;
-
-	/* Return value */
-     /*	return strndup(buffer+i,(j-buffer)-i); OLD */
-	return ast_strndup(buffer+i,(j-buffer)-i);
-}
-
-static int CheckHeaderValue(char *buffer,int bufferLen,char *header,char*value)
+static int CheckHeaderValue(const struct HeaderIndex *index,char *header,char*value) /* [v2.1] indexed once by the caller */
 {
-	int i;	 
+	const struct HeaderSpan *span;
+	int len = strlen(value);
+	int i;
 
     /*	ast_debug(6,"Looking for value %s in Header %s bufferLen %i in buffer:\n%s\n",value,header,bufferLen,buffer);  DEBUG */
-	/* Get start */
-	if (!(i=HasHeader(buffer,bufferLen,header)))
+	/* Get Header */
+	if ((i=HeaderIndexFind(index,header,0))<0)
 	{
 		ast_debug(4,"No Header Found! \n"); /* ADDED */
 		return 0; /* Exit */
 	}
+	/* [v2.1] Any of the headers with that name, e.g. WWW-Authenticate Basic then Digest */
+	for (;i>=0;i=HeaderIndexFind(index,header,i+1))
+	{
+		span = &index->headers[i];
+		if (span->valueLen>=len && strncasecmp(index->buffer+span->valueOff,value,len)==0)
+			/* Found */
+			return 1;
+	}
 	/* Return value */
-	return (strncasecmp(buffer+i,value,strlen(value))==0);
+	return 0;
 }
 
+#ifndef RTSP_SIP_STANDALONE /* [v2.1] */
 #ifdef OLD_AUTH_SCHEME
 /* [17.x NEW] for Digest Authentication */
-static int GetAuthHeaderData(struct RtspPlayer *player, char *buffer,int bufferLen ,struct DigestAuthData *digest_data)
+static int GetAuthHeaderData(struct RtspPlayer *player, const struct HeaderIndex *index ,struct DigestAuthData *digest_data)
 {
+	const char *value;
 	char *www_header;
 	char *i,*j;
+	int len;
 
-	if ( (www_header=GetHeaderValue(buffer,bufferLen,"WWW-Authenticate")) == 0) /* non-0 returns alloc'd memory */
+	if ( (value=HeaderIndexValue(index,"WWW-Authenticate",&len)) == 0 || (www_header=ast_strndup(value,len)) == 0) /* non-0 returns alloc'd memory */
 	{
 		ast_debug(3,"Could not find any data in header WWW-Authenticate:\n");
 		return -1;
@@ -2948,28 +4912,30 @@ static int GetAuthHeaderData(struct RtspPlayer *player, char *buffer,int bufferL
 #endif
 
 /* [17.x NEW] For SIP */ 
-static int SipSetPeerTag(struct RtspPlayer *player, char *buffer,int bufferLen)
+static int SipSetPeerTag(struct RtspPlayer *player, const struct HeaderIndex *index) /* [v2.1] indexed once by the caller */
 {
-	char *to_header;
-	char *i,*j;
+	const char *to_header;
+	const char *i,*j,*end;
+	int len;
 
 	if (!player->in_a_dialog)
 	{
 		/* update peer Tag from the received To: header */
-		if ( (to_header=GetHeaderValue(buffer,bufferLen,"To")) == 0) /* non-0 returns alloc'd memory */
+		if ( (to_header=HeaderIndexValue(index,"To",&len)) == 0)
 			ast_debug(3,"Could not find To: header\n");
 		else
 		{
 			/* Find tag value within To: header*/
-			if (!(i=strstr(to_header,"tag=")))
-				ast_debug(3,"Could not find tag= in To: header [%s]\n",to_header);
+			end = to_header+len;
+			if (!(i=HeaderValueFind(to_header,len,"tag=")))
+				ast_debug(3,"Could not find tag= in To: header [%.*s]\n",len,to_header);
 			else
 			{   /* get tag value */
 				i+=4;/* +4 advances beyond 'tag=' */
 				j=i;
-				while(j[0] != '\0') /* go to end of tag value */
+				while(j<end && j-i<(int)sizeof(player->peer_tag)-1) /* [v2.1] go to end of tag value, or of peer_tag */
 				{
-					if(j[0] == ' '|| j[0] == '\r')
+					if(j[0] == ' '|| j[0] == '\r' || j[0] == ';')
 						break;
 					player->peer_tag[j-i] = j[0]; 
 					j++;
@@ -2977,21 +4943,22 @@ static int SipSetPeerTag(struct RtspPlayer *player, char *buffer,int bufferLen)
 				player->peer_tag[j-i]='\0'; /* change last ' ' or '\r' to a termination */
 				ast_debug(3,"tag=%s\n",player->peer_tag);
 			}
-			ast_free(to_header);
 		}
 	}
 	return 1;
 }
 
 /* [17.x NEW] SIP */
-static int SipSpeakerReply(struct RtspPlayer *player, char *buffer, int bufferLen,\
-                          char *username, const char *peer_ip, int peer_port, char *request)
+static int SipSpeakerReply(struct RtspPlayer *player, const struct HeaderIndex *index,\
+                          char *username, const char *peer_ip, int peer_port, char *request) /* [v2.1] indexed once by the caller */
 { 
 	/* RFC3261 */
 	char reply[1024];
 	int  reply_string_len = 0;
-	char *tmp_header;
-	char *param_front,*param_back;
+	const char *buffer = index->buffer;
+	const char *tmp_header;
+	const char *param_front,*param_back,*tmp_end;
+	int  len;
 	int  param_count=0;
 	int  temp;
 	int  something2send=0;
@@ -3013,69 +4980,68 @@ static int SipSpeakerReply(struct RtspPlayer *player, char *buffer, int bufferLe
 		 *     To header (If tag present, otherwise match URI and add tag) 
 		 * p219 has an example.
  		 */
-		if ( (tmp_header=GetHeaderValue(buffer,bufferLen,"To")) == 0){ /* non-0 returns alloc'd memory */
+		if ( (tmp_header=HeaderIndexValue(index,"To",&len)) == 0){
 			ast_debug(3,"Could not find To: header\n");
 		}
 		else {
-			ast_debug(3,"-To: header %s\n",tmp_header);
-			reply_string_len += sprintf(reply+reply_string_len,"To: %s\r\n",tmp_header);
-			ast_free(tmp_header);
+			ast_debug(3,"-To: header %.*s\n",len,tmp_header);
+			reply_string_len += sprintf(reply+reply_string_len,"To: %.*s\r\n",len,tmp_header);
 		}
 
-		if ( (tmp_header=GetHeaderValue(buffer,bufferLen,"From")) == 0){ /* non-0 returns alloc'd memory */
+		if ( (tmp_header=HeaderIndexValue(index,"From",&len)) == 0){
 			ast_debug(3,"Could not find From: header\n");
 		}
 		else {
-			ast_debug(3,"-From: header %s\n",tmp_header);
-			reply_string_len += sprintf(reply+reply_string_len,"From: %s\r\n",tmp_header);
-			ast_free(tmp_header);
+			ast_debug(3,"-From: header %.*s\n",len,tmp_header);
+			reply_string_len += sprintf(reply+reply_string_len,"From: %.*s\r\n",len,tmp_header);
 		}
 
-		if ( (tmp_header=GetHeaderValue(buffer,bufferLen,"Via")) == 0){ /* non-0 returns alloc'd memory */
+		if ( (tmp_header=HeaderIndexValue(index,"Via",&len)) == 0){
 			ast_debug(3,"Could not find Via: header\n");
 		}
 		else {
-			ast_debug(3,"-Via: header %s\n",tmp_header);
-
-			param_front = strtok_r(tmp_header,";",&param_back);
-			if(param_front != NULL)
-				reply_string_len += sprintf(reply+reply_string_len,"Via: %s",param_front);
-			while(param_front ){ /* Continue parsing until to end of Via Header */
-				ast_debug(3,"-Via param: %s\n",param_front);
-				param_count++;
-				if (strncmp(param_front,"branch=",7)==0) {
-					reply_string_len += sprintf(reply+reply_string_len,";%s",param_front);
+			ast_debug(3,"-Via: header %.*s\n",len,tmp_header);
+
+			/* [v2.1] Walk the ';' separated params in place, empty ones skipped like strtok_r() did */
+			tmp_end = tmp_header+len;
+			for (param_front=tmp_header;param_front<tmp_end;param_front=param_back+1)
+			{
+				if (!(param_back=memchr(param_front,';',tmp_end-param_front)))
+					param_back = tmp_end;
+				if (param_back==param_front)
+					continue;
+				ast_debug(3,"-Via param: %.*s\n",(int)(param_back-param_front),param_front);
+				if (!param_count++)
+					reply_string_len += sprintf(reply+reply_string_len,"Via: %.*s",(int)(param_back-param_front),param_front);
+				if (param_back-param_front>=7 && strncmp(param_front,"branch=",7)==0) {
+					reply_string_len += sprintf(reply+reply_string_len,";%.*s",(int)(param_back-param_front),param_front);
 				}
 				/* RFC 3581 adds an extension for symmetric routing using "rport" in Via */
-				if (strncmp(param_front,"rport",5)==0) {
+				if (param_back-param_front>=5 && strncmp(param_front,"rport",5)==0) {
 					reply_string_len += sprintf(reply+reply_string_len,\
 								";rport=%i;received=%s", 
 								peer_port,peer_ip); 
 				}
-				param_front = strtok_r(NULL,";",&param_back);
 			}
 			if(param_count ==0) 
 				ast_log(LOG_ERROR,"Via: header missing branch parameter.\n");
 			reply_string_len += sprintf(reply+reply_string_len,"\r\n");
-			ast_free(tmp_header);
 		}
 
-		if ( (tmp_header=GetHeaderValue(buffer,bufferLen,"Call-ID")) == 0){ /* non-0 returns alloc'd memory */
+		if ( (tmp_header=HeaderIndexValue(index,"Call-ID",&len)) == 0){
 			ast_debug(3,"Could not find Call-ID: header\n");
 		}
 		else {
-			ast_debug(3,"-Call-ID: header %s\n",tmp_header);
-			reply_string_len += sprintf(reply+reply_string_len,"Call-ID: %s\r\n",tmp_header);
-			ast_free(tmp_header);
+			ast_debug(3,"-Call-ID: header %.*s\n",len,tmp_header);
+			reply_string_len += sprintf(reply+reply_string_len,"Call-ID: %.*s\r\n",len,tmp_header);
 		}
 
-		if ( (tmp_header=GetHeaderValue(buffer,bufferLen,"Cseq")) == 0){ /* non-0 returns alloc'd memory */
+		if ( (tmp_header=HeaderIndexValue(index,"Cseq",&len)) == 0){
 			ast_debug(3,"Could not find Cseq: header\n");
 		}
 		else {
-			ast_debug(3,"-Cseq: header %s\n",tmp_header);
-			reply_string_len += sprintf(reply+reply_string_len,"Cseq: %s\r\n",tmp_header);
-			ast_free(tmp_header);
+			ast_debug(3,"-Cseq: header %.*s\n",len,tmp_header);
+			reply_string_len += sprintf(reply+reply_string_len,"Cseq: %.*s\r\n",len,tmp_header);
 		}
 		reply_string_len += sprintf(reply+reply_string_len,"Content-Length: 0\r\n");
 		strcat(reply,"\r\n");
@@ -3115,7 +5081,8 @@ static int RecvResponse(int fd,char *buffer,int *bufferLen,int bufferSize,int *e
 	/* if error or closed */
 	errno = 0;
 	/* Read into buffer */
-	int len = recv(fd,buffer,bufferSize-*bufferLen,0);
+     /*	int len = recv(fd,buffer,bufferSize-*bufferLen,0); [v2.1] append, don't overwrite what is there */
+	int len = recv(fd,buffer+*bufferLen,bufferSize-*bufferLen,0);
 
      /*	if (!len>0) OLD */
 	if (!(len > 0)) /*PORT17.3. Fix compiler warning */
@@ -3149,1822 +5116,5503 @@ static int GetResponseLen(char *buffer)
 	/* Get msg leng */
 	return i-buffer+4;
 }
+#endif /* RTSP_SIP_STANDALONE */
 
-
-static int main_loop(struct ast_channel *chan,char *ip, int rtsp_port, char *url,char *username,char *password,int isIPv6,int sip_enable, char *sip_realm, int sip_port)
+/*
+ * [v2.1] Incremental RTSP framer.
+ * GetResponseLen() searched the control buffer from the start after every
+ * read and each consumed message was memmove()d out, so a large SDP arriving
+ * in pieces was rescanned over and over. The framer remembers how far the
+ * message at the front has been searched for its empty line, and takes the
+ * end of the message from Content-Length. Consuming a message moves the
+ * buffer pointer forward. What is left is only moved back to the front when
+ * less than a quarter of the buffer is free at the end.
+ * The headers of the message at the front are indexed once, when its empty
+ * line is found, and the handlers look them up in framer->index.
+ */
+struct RtspFramer
 {
-	struct ast_frame *f = NULL;
-     /*	struct ast_frame *sendFrame = NULL; OLD */
-	struct ast_frame sendFrame; /* PORT 17.5 make this a real ast_frame struct. No longer malloc. */
-	uint8_t FrameBuffer[AST_FRIENDLY_OFFSET + PKT_PAYLOAD];/* PORT 17.5 make a real buffer instead of alloc'd (See app_fax.c) */
-
-	int infds[10]; /* CHANGE. from 5 to 10 to accomdate SIP */
-	int num_infds=5; /* ADDED for use with SIP */
-	int outfd;
-
-	char buffer[16384];
-	int  bufferSize = 16383; /* One less for finall \0 */
-	int  bufferLen = 0;
-	int  recvLen = 0; /* ADDED */
-	int  responseCode = 0;
-	int  responseLen = 0;
-	int  contentLength = 0;
-     /* char *rtpBuffer; OLD */
-	uint8_t *rtpBuffer; /* PORT17.5 model this after app_fax.c */
-	char rtcpBuffer[PKT_PAYLOAD];
-	int  rtpSize = PKT_PAYLOAD;
-	int  rtcpSize = PKT_PAYLOAD;
-	int  rtpLen = 0;
-	int  rtcpLen = 0;
-	char *session;
-	char *transport;
-	char *range;
-	char *j;
-	char src[128];
-	int  res = 0;
-
-	struct SDPContent* sdp = NULL;
-	struct SDPContent* sip_sdp = NULL; /* ADDED */
-	char *audioControl = NULL;
-	char *videoControl = NULL;
-	int audioFormat = 0;
-	int videoFormat = 0;
-	struct ast_format *audioNewFormat = NULL; /* PORT 17.3. Track using new media format */
-	struct ast_format *videoNewFormat = NULL; /* PORT 17.3. Track using new media format */
-	int audioType = 0;
-	int videoType = 0;
-	unsigned int lastVideo = 0;
-	unsigned int lastAudio = 0;
-
-	int duration = 0;
-	int elapsed = 0;
-	int ms = 10000;
-	int i = 0;
-	int temp; /* ADDED. SIP. */
-	int enable_sip_tx = 0; /* ADDED. SIP. */
-	uint16_t pre_enable_vf_tx_count = 0; /*ADDED. SIP */
-	uint16_t post_enable_vf_tx_count = 0; /*ADDED. SIP */
-	uint16_t sip_tx_error_count = 0; /*ADDED. SIP */
-	struct RtspPlayer *player;
-	struct RtpHeader *rtp;
-	struct RtpHeader *sip_rtp; /*ADDED. SIP */
-	uint32_t sip_prev_samples=0; /* ADDED. SIP */
-	struct Rtcp rtcp;
-	struct timeval tv = {0,0};
-	struct timeval rtcptv = {0,0};
+	char	*base;		/* start of the buffer memory */
+	int	size;		/* usable bytes from base, one more is kept for the final \0 */
+	int	scanned;	/* bytes of the message at the front searched for the empty line */
+	int	headerLen;	/* start line and headers with the empty line, 0 until found */
+	int	messageLen;	/* headerLen plus Content-Length, 0 until known */
+	struct HeaderIndex index;	/* headers of the message at the front, once headerLen is known */
+	long	consumed;	/* bytes consumed */
+	int	compactions;	/* times what was left was moved to the front */
+};
 
-	struct RtspPlayer *sip_speaker = NULL;/* sip will make use of RTSP data structures */
+static void RtspFramerInit(struct RtspFramer *framer,char *base,int size)
+{
+	memset(framer,0,sizeof(struct RtspFramer));
+	framer->base = base;
+	framer->size = size;
+}
 
-	/* log */
-     /*	ast_log(LOG_WARNING,">rtsp_sip main loop\n");    was "rtsp play" */
-	ast_log(LOG_NOTICE,">rtsp-sip main loop\n");
+#ifndef RTSP_SIP_STANDALONE /* [v2.1] */
+static int RtspFramerRecv(struct RtspFramer *framer,int fd,char **buffer,int *bufferLen,int *end)
+{
+	/* Empty, start over at the front */
+	if (!*bufferLen)
+		*buffer = framer->base;
+	/* Running out of room at the end, move what is left to the front */
+	else if (*buffer!=framer->base && framer->base+framer->size-(*buffer+*bufferLen) < framer->size/4)
+	{
+		memmove(framer->base,*buffer,*bufferLen);
+		*buffer = framer->base;
+		framer->compactions++;
+	}
+	/* Append */
+	return RecvResponse(fd,*buffer,bufferLen,framer->base+framer->size-*buffer,end);
+}
+#endif /* RTSP_SIP_STANDALONE */
 
-	/* Set random src for AST_FRAME debugging */
-	sprintf(src,"rtsp_play%08lx", ast_random());
+/* Length of the complete message at the front, 0 if not all there yet, -1 if it can't fit */
+static int RtspFramerNext(struct RtspFramer *framer,char *buffer,int bufferLen)
+{
+	char *i;
+	int from;
+	int contentLength;
 
-	/* Create RTSP player */
-	player = RtspPlayerCreate();
+	/* End known already */
+	if (framer->messageLen)
+	{
+		/* Spans are offsets, the message may have been moved to the front since */
+		framer->index.buffer = buffer;
+		return bufferLen>=framer->messageLen ? framer->messageLen : 0;
+	}
 
-	/* if error */
-	if (!player)
+	/* Search only what came in since, backing up over a CRLFCRLF split between reads */
+	from = framer->scanned>3 ? framer->scanned-3 : 0;
+	if (!(i=memmem(buffer+from,bufferLen-from,"\r\n\r\n",4)))
 	{
-		/* log */
-		ast_log(LOG_ERROR,"Couldn't create RTSP player\n");
-		/* exit */
+		framer->scanned = bufferLen;
 		return 0;
 	}
+	framer->headerLen = i-buffer+4;
 
-	/* ADDED Create SIP Speaker */
-	if(sip_enable){
-		sip_speaker = RtspPlayerCreate(); /* SIP will re-use the RTSP data structures for its own use*/
-		if (!sip_speaker)
-		{
-			/* log */
-			ast_log(LOG_ERROR,"Couldn't create SIP Speaker\n");
-			/* exit */
-			return 0;
-		}
-	}
+	/* Index headers */
+	HeaderIndexBuild(&framer->index,buffer,framer->headerLen);
 
-	/* Connect player */
-	if (!RtspPlayerConnect(player,ip,rtsp_port,isIPv6,0))
+	/* Body */
+	contentLength = GetHeaderValueInt(&framer->index,"Content-Length");
+	if (contentLength<0 || contentLength>framer->size-framer->headerLen)
 	{
-		/* log */
-		ast_log(LOG_ERROR,"Couldn't connect RTSP to %s:%d\n",ip,rtsp_port);
-		/* end */
-		goto rtsp_play_clean;
+		ast_log(LOG_ERROR,"RTSP message too big for buffer [%d+%d]\n",framer->headerLen,contentLength);
+		return -1;
 	}
+	framer->messageLen = framer->headerLen+contentLength;
 
-	/* ADDED Connect sip speaker */
-	if(sip_enable){
-		if (!RtspPlayerConnect(sip_speaker,ip,sip_port,isIPv6,1))
-		{
-			/* log */
-			ast_log(LOG_ERROR,"Couldn't connect SIP Speaker to %s:%d\n",ip,sip_port);
-			/* end */
-			goto rtsp_play_clean;
-		}
+	return bufferLen>=framer->messageLen ? framer->messageLen : 0;
+}
+
+static void RtspFramerConsume(struct RtspFramer *framer,char **buffer,int *bufferLen,int len)
+{
+	/* Move cursor */
+	*buffer += len;
+	*bufferLen -= len;
+	framer->consumed += len;
+	/* Next message */
+	framer->scanned = 0;
+	framer->headerLen = 0;
+	framer->messageLen = 0;
+	framer->index.count = 0;
+	/* Empty, start over at the front */
+	if (!*bufferLen)
+	{
+		*buffer = framer->base;
+		(*buffer)[0] = 0;
 	}
+}
 
-	/* Set arrays */
-	infds[0] = player->fd; 
-	infds[1] = player->audioRtp;
-	infds[2] = player->videoRtp;
-	infds[3] = player->audioRtcp;
-	infds[4] = player->videoRtcp;
+#ifndef RTSP_SIP_STANDALONE /* [v2.1] */
+/*
+ * [v2.1] Pipelined setup.
+ * The session id comes back with the first SETUP. From then on the video
+ * SETUP and PLAY go out back to back, saving a round trip. Responses still
+ * arrive in order, but the state machine has already moved on to RTSP_PLAY,
+ * so each response is handled in the state recorded for its CSeq.
+ * A camera that answers a pipelined request with an error gets the step
+ * redone serially, and serial setup on every later call.
+ */
+struct RtspSerialCamera
+{
+	char	hostport[128];
+	AST_LIST_ENTRY(RtspSerialCamera) list;
+};
 
-	/* ADDED more arrays for sip speaker */
-	if(sip_enable){
-		infds[5] = sip_speaker->fd; 
-		infds[6] = sip_speaker->audioRtp;
-		infds[7] = sip_speaker->videoRtp;
-		infds[8] = sip_speaker->audioRtcp;
-		infds[9] = sip_speaker->videoRtcp;
-		num_infds += 5;
-	}
+static AST_LIST_HEAD_STATIC(rtsp_serial_cameras, RtspSerialCamera);
 
-	/* Send RTSP REQUEST */
-	if (!RtspPlayerDescribe(player,url))
-	{
-		/* log */
-		ast_log(LOG_ERROR,"Couldn't handle DESCRIBE in %s\n",url);
-		/* end */
-		goto rtsp_play_end;
-	}
+static int RtspPipelineAllowed(const char *hostport)
+{
+	struct RtspSerialCamera *camera;
 
-	/* ADDed. Send SIP OPTIONS */
-	if(sip_enable){
-		if (!SipSpeakerOptions(sip_speaker,username))
-		{
-			/* log */
-			ast_log(LOG_ERROR,"Couldn't formulate/send SIP Options\n");
-			/* end */
-			goto rtsp_play_end;
-		}
-	}
+	AST_LIST_LOCK(&rtsp_serial_cameras);
+	AST_LIST_TRAVERSE(&rtsp_serial_cameras, camera, list)
+		if (!strcmp(camera->hostport,hostport))
+			break;
+	AST_LIST_UNLOCK(&rtsp_serial_cameras);
 
-	/* malloc frame & data */
-     /*	sendFrame = (struct ast_frame *) malloc(PKT_SIZE); OLD */
-     /*	sendFrame = (struct ast_frame *) ast_malloc(PKT_SIZE);  PORT 17.3. New malloc scheme. OLD */
+	return camera==NULL;
+}
 
-	/* Set data pointer */
-     /*	rtpBuffer = (unsigned char*)sendFrame + PKT_OFFSET; OLD */
-     /*	rtpBuffer = (char*)(sendFrame + PKT_OFFSET);    PORT 17.3. fix compiler warning; signedness of sendFrame */
-	rtpBuffer = (uint8_t*)(FrameBuffer + AST_FRIENDLY_OFFSET);/* PORT 17.5. Restructuring sendFrame */
+static void RtspPipelineFlush(void)
+{
+	struct RtspSerialCamera *camera;
+
+	AST_LIST_LOCK(&rtsp_serial_cameras);
+	while ((camera = AST_LIST_REMOVE_HEAD(&rtsp_serial_cameras, list)))
+		ast_free(camera);
+	AST_LIST_UNLOCK(&rtsp_serial_cameras);
+}
+
+/* Camera didn't take a pipelined request, redo state serially */
+static void RtspPlayerPipelineFailed(struct RtspPlayer *player,int state)
+{
+	struct RtspSerialCamera *camera;
 
 	/* log */
-     /*	ast_log(LOG_DEBUG,"-rtsp play loop [%d]\n",duration); OLD */
-	ast_debug(2,"-rtsp play loop [%d]\n",duration);
+	ast_log(LOG_NOTICE,"%s rejected pipelined %s, using serial setup\n",player->hostport,state==RTSP_PLAY?"PLAY":"SETUP");
 
-	/* Loop */
-	while(!player->end)
+	/* Remember the camera */
+	if (player->pipelined && RtspPipelineAllowed(player->hostport)
+	    && (camera = ast_calloc(1,sizeof(struct RtspSerialCamera))))
 	{
-		/* No output */
-		outfd = -1;
-		/* If the playback has started */
-		if (!ast_tvzero(tv))
-		{
-			/* Get playback time */
-			elapsed = ast_tvdiff_ms(ast_tvnow(),tv); 
-			/* Check how much time have we been playing */
-			if (elapsed>=duration)
-			{
-				/* log */
-			     /*	ast_log(LOG_DEBUG,"Playback finished\n"); OLD */
-				ast_debug(2,"Playback finished\n");
-				/* exit */
-				player->end = 1;
-				/* Exit */
-				break;
-			} else {
-				/* Set timeout to remaining time*/
-				ms = duration-elapsed;
-			}
-		} else {
-			/* 4 seconds timeout */
-			ms = 4000;
-		}
-
-		/* PORT17.3
-		 * ast_waitfor_nandfds can return NULL if timedout, so tweaking the logic to handle it.
-		 * returns NULL if channel has nothing, outfd < 0 if no active infds 
-		 *    (note: active channel overrides active fd). ms returns=0 if no active infds.
-		 */
-		/* Read from channel and fds */
-		outfd = -1;
-		errno = 0;
-		struct ast_channel *rchan;
-	     /*	if (ast_waitfor_nandfds(&chan,1,infds,10,NULL,&outfd,&ms))  CHANGE fd num from 5 to 10 */
-		rchan = ast_waitfor_nandfds(&chan,1,infds,num_infds,NULL,&outfd,&ms); /* CHANGE Handle Null return. var num of fds */
-		if(rchan == NULL && outfd <0 && ms){
-			if (errno == 0 || errno == EINTR)
-				ast_log(LOG_WARNING, "ast_waitfor_nandfds() failed (%s)\n", strerror(errno));
-		}
-		if(rchan !=NULL && outfd <0) /* Channel active */
-		{
-			/* Read frame */
-			f = ast_read(chan);
+		ast_copy_string(camera->hostport,player->hostport,sizeof(camera->hostport));
+		AST_LIST_LOCK(&rtsp_serial_cameras);
+		AST_LIST_INSERT_TAIL(&rtsp_serial_cameras, camera, list);
+		AST_LIST_UNLOCK(&rtsp_serial_cameras);
+	}
+	player->pipelined = 0;
 
-			/* If failed */
-			if (!f) {
-				ast_log(LOG_ERROR, "ast_read() failed. Bail out!\n"); /* ADDED */
-				/* exit */
-				break;
-			}	
-			/* If it's a control channel */
-			if (f->frametype == AST_FRAME_CONTROL) 
-			{
-				/* Check for hangup */
+	/* Earliest step wins */
+	if (!player->resumeState || state<player->resumeState)
+		player->resumeState = state;
+}
 
-				/* PORT 17.3
-				 * from frame.h
-				 * struct ast_frame *f
-				 *   struct ast_frame_subclass subclass 
-				 *     int integer
-				 *     struct ast_format *format
-				 *     unsigned int frame_ending
-				 * Most of the app_xxx code uses: f->subclass.integer == AST_CONTROL_HANGUP.
-				 * So apparently subclass.integer is to be used with 
-				 * enum ast_control_frame_type{AST_CONTROL_HANGUP}
-				 */
-			     /*	if (f->subclass == AST_CONTROL_HANGUP) OLD */
-				if (f->subclass.integer == AST_CONTROL_HANGUP) /* PORT 17.3 */
-				{
-					/* log */
-				     /*	ast_log(LOG_DEBUG,"-Hangup\n"); OLD*/
-					ast_debug(2,"-Hangup\n");
-					/* exit */
-					player->end = 1;
-				}
-				
-			 /* If it's a dtmf */
-			} else if (f->frametype == AST_FRAME_DTMF) {
-				char dtmf[2];
-				/* Get dtmf number */
+/* The response to the next request is handled in state */
+static void RtspPlayerExpect(struct RtspPlayer *player,int state)
+{
+	/* Table full */
+	if (player->numPending==RTSP_MAX_PENDING)
+		return;
+	player->pending[player->numPending].cseq  = player->cseq;
+	player->pending[player->numPending].state = state;
+	player->numPending++;
+}
 
-				/* PORT 17.3 app_meetme.c uses this same subclass.integer
-				 * if (f->frametype == AST_FRAME_DTMF)  
-				 *         dtmfstr[0] = f->subclass.integer;
-				 *         dtmfstr[1] = '\0';
-				 */
-			     /*	dtmf[0] = f->subclass; OLD */
-				dtmf[0] = f->subclass.integer; /* PORT 17.3 */
-				dtmf[1] = 0;
+/*
+ * State to handle the response at the front of buffer in.
+ * *pipelined is set if it answers a pipelined request.
+ */
+static int RtspPlayerResponseState(struct RtspPlayer *player,const struct HeaderIndex *index,int responseLen,int *pipelined)
+{
+	int cseq;
+	int state;
+	int i;
 
-				/* Check for dtmf extension in context */
+	*pipelined = 0;
 
-				/* PORT 17.3                                                          
-				 * chan->context has been replaced with                                
-				 *   const char *ast_channel_context(const struct ast_channel *chan)   
-				 *   which returns chan->context                                       
-				 */
+	/* Nothing in flight, or no complete response yet */
+     /*	if (!player->numPending || buffer[0]=='$' || !(responseLen=GetResponseLen(buffer))) [v2.1] framed by the caller */
+	if (!player->numPending || !responseLen)
+		return player->state;
 
-			     /*	if (ast_exists_extension(chan, chan->context, dtmf, 1, NULL))  OLD  */
-				if (ast_exists_extension(chan, ast_channel_context(chan), dtmf, 1, NULL)) { /* PORT 17.3 */
-					/* Set extension to jump */
-				     /*	res = f->subclass; was */
-					res = f->subclass.integer;
-					/* Free frame */
-					ast_frfree(f);
-					/* exit */
-					goto rstp_play_stop;
-				}
-			} else if (f->frametype == AST_FRAME_VOICE && sip_enable ) { /*ADDED. SIP.*/
-				int no_room_err =- 1;
+	/* Find it */
+	cseq = GetHeaderValueInt(index,"CSeq");
+	for (i=0;i<player->numPending;i++)
+		if (player->pending[i].cseq==cseq)
+		{
+			state = player->pending[i].state;
+			/* Remove it */
+			player->numPending--;
+			memmove(player->pending+i,player->pending+i+1,(player->numPending-i)*sizeof(struct RtspPending));
+			*pipelined = 1;
+			return state;
+		}
 
-				if(enable_sip_tx == 0) /* Start Voice Tx after SIP INVITE is OK'd */
-					pre_enable_vf_tx_count++; /* count num of Frames tossed before SIP INVITE is OK'd */
-				else {
-					post_enable_vf_tx_count++;/* count num of Frames sent after SIP INVITE is OK'd */
+	/* Not one of ours */
+	return player->state;
+}
+#endif /* RTSP_SIP_STANDALONE */
 
-					/* check to see if AST FRAME has enough room for RTP Header */
-					if(f->offset >= sizeof(struct RtpHeader)){ 
-						no_room_err = 0;
+/*
+ * [v2.1] Per-session pool of packet slots.
+ * RTP used to be read into a 9 KB stack buffer that was zeroed for every
+ * packet, when most audio packets are 160-320 bytes. Now recv() writes
+ * straight into a cache line aligned, MTU sized slot and the ast_frame points
+ * into that slot. Nothing is zeroed. A datagram bigger than a slot is only
+ * noticed (MSG_TRUNC) and dropped; from then on the session reads with a second
+ * spill iovec and stitches oversized datagrams in the (rare) jumbo buffer.
+ * recvmsg() with two iovecs is measurably slower than recv(), so it is not
+ * used until a camera actually sends jumbo packets.
+ */
+#define FRAME_SLOT_MTU		1500	/* payload room in one slot */
+#define FRAME_SLOT_ALIGN	64	/* cache line */
+#define FRAME_SLOT_SIZE		((AST_FRIENDLY_OFFSET + FRAME_SLOT_MTU + FRAME_SLOT_ALIGN - 1) & ~(FRAME_SLOT_ALIGN - 1))
+#define FRAME_SPILL_SIZE	(PKT_PAYLOAD - FRAME_SLOT_MTU)
+#define FRAME_POOL_SLOTS	48	/* per session */
 
-						sip_rtp = f->data.ptr - sizeof(struct RtpHeader); /* rtp header starts here */
-						sip_rtp->version = 2;
-						sip_rtp->p=0;
-						sip_rtp->x=0;
-						sip_rtp->cc=0;
-						/* Set Marker on first frame only */
-						if( post_enable_vf_tx_count == 1)
-							sip_rtp->m=1;
-						else
-							sip_rtp->m=0;
-						sip_rtp->pt= sip_sdp->audio->formats[0]->payload; /* Payload Type */
+struct FramePool
+{
+	uint8_t		*mem;         /* raw allocation */
+	uint8_t		**free;       /* stack of free slots */
+	int		numSlots;
+	int		numFree;
+	uint8_t		*spill;       /* tail of an oversized datagram, one packet path */
+	uint8_t		*jumbo;       /* AST_FRIENDLY_OFFSET + PKT_PAYLOAD, rare fallback */
+	int		jumboMode;    /* camera has sent a datagram bigger than a slot */
+	unsigned int	jumboCount;
+	unsigned int	truncated;
+	unsigned int	exhausted;
+};
 
-						/*RFC3550 p14 says start seq num w. random number.
-						 * pre_enable_vf_tx_count is somewhat random as the number of packets tossed
-						 * before SIP INVITE is OK'd is just that. RTP Header:Seq num is 16b 
-						 */
-						sip_rtp->seq = htons(pre_enable_vf_tx_count+post_enable_vf_tx_count); 
+static struct FramePool* FramePoolCreate(int numSlots)
+{
+	struct FramePool *pool;
+	uint8_t *base;
+	int i;
 
-						/* RFC3550 p14.  RTP Header:Timestamp is 32b.
-						 * For fixed rate codecs, TS increments by number of samples since last time.
-						 * Assume for now that the audio codes are fixed-rate (8Khz).
-						 */
-						sip_rtp->ts=htonl(sip_prev_samples);
+	/* Allocate */
+	if (!(pool = ast_calloc(1,sizeof(struct FramePool))))
+		return NULL;
+	pool->mem   = ast_malloc(numSlots*FRAME_SLOT_SIZE + FRAME_SLOT_ALIGN - 1);
+	pool->free  = ast_malloc(numSlots*sizeof(uint8_t*));
+	pool->spill = ast_malloc(FRAME_SPILL_SIZE);
+	pool->jumbo = ast_malloc(AST_FRIENDLY_OFFSET + PKT_PAYLOAD);
+	if (!pool->mem || !pool->free || !pool->spill || !pool->jumbo)
+	{
+		ast_free(pool->mem);
+		ast_free(pool->free);
+		ast_free(pool->spill);
+		ast_free(pool->jumbo);
+		ast_free(pool);
+		return NULL;
+	}
 
-						/* RFC3550 p16. SSRC Should be random. Do the same thing 
-						 * that MediaStatsRR() did. 
-						 */
-					     /* sip_rtp->ssrc=htonl(((unsigned int)&sip_speaker->audioStats)); */
-						sip_rtp->ssrc= htonl((uint32_t)random()); /* PORT 17.5 fix compiler complaint */
+	/* Align first slot to a cache line; slot size is a multiple of it */
+	base = (uint8_t*)(((uintptr_t)pool->mem + FRAME_SLOT_ALIGN - 1) & ~(uintptr_t)(FRAME_SLOT_ALIGN - 1));
+	for (i=0;i<numSlots;i++)
+		pool->free[i] = base + i*FRAME_SLOT_SIZE;
+	pool->numSlots = numSlots;
+	pool->numFree = numSlots;
 
-						sip_prev_samples = sip_prev_samples + f->samples;
+	return pool;
+}
 
-						if( post_enable_vf_tx_count == 1){
-							ast_debug(3,"-vf_frame datalen:%i\n",f->datalen);
-							ast_debug(3,"-vf_frame samples:%i\n",f->samples);
-							ast_debug(3,"-vf_frame offset:%i\n",f->offset);
-							ast_debug(3,"-Offset room error check:%i\n",no_room_err);
-						}
+static void FramePoolDestroy(struct FramePool *pool)
+{
+	ast_free(pool->mem);
+	ast_free(pool->free);
+	ast_free(pool->spill);
+	ast_free(pool->jumbo);
+	ast_free(pool);
+}
 
-						/* Send rtp packet */
-						int num_bytes_sent;
-						errno = 0;
-						num_bytes_sent = send(sip_speaker->audioRtp, sip_rtp,\
-								      sizeof(struct RtpHeader)+f->datalen, 0);
-						if(num_bytes_sent == -1)
-							sip_tx_error_count++;
-					}
+/* Get a free slot. NULL when the pool is empty */
+static uint8_t* FramePoolGet(struct FramePool *pool)
+{
+	if (!pool->numFree)
+	{
+		pool->exhausted++;
+		return NULL;
+	}
+	return pool->free[--pool->numFree];
+}
 
-				} 
-			}
+#ifndef RTSP_SIP_STANDALONE /* [v2.1] */
+/* [v2.1] Is it one of our slots (not the jumbo buffer or someone else's memory) */
+static int FramePoolOwns(struct FramePool *pool, uint8_t *buffer)
+{
+	return buffer>=pool->mem && buffer<pool->mem+pool->numSlots*FRAME_SLOT_SIZE+FRAME_SLOT_ALIGN-1;
+}
+#endif /* RTSP_SIP_STANDALONE */
 
-			/* free frame */
-			ast_frfree(f);
-		} else if (outfd==player->fd) { /* outfd >0 */
-			/* Depending on state */	
-			switch (player->state)
-			{
-				case RTSP_DESCRIBE:
-					/* log */
-				     /*	ast_log(LOG_DEBUG,"-Receiving describe\n"); OLD */
-					ast_debug(2,"-rx describe response\n");
-					/* Read into buffer */
-					if (!RecvResponse(player->fd,buffer,&bufferLen,bufferSize,&player->end))
-						break;
-			              //ast_debug(5,"bufferLen: %i\n%s",bufferLen,buffer);
-					ast_debug(3, "\n%s\n",buffer); 
+/* Give a slot back. The jumbo buffer is not a slot and is ignored */
+static void FramePoolPut(struct FramePool *pool, uint8_t *slot)
+{
+	if (slot && slot!=pool->jumbo)
+		pool->free[pool->numFree++] = slot;
+}
 
-					/* Check for response code */
-					responseCode = GetResponseCode(buffer,bufferLen,0);
+/*
+ * Rare path: stitch a datagram that overflowed its slot into the jumbo buffer.
+ * Returns the jumbo buffer, laid out like a slot.
+ */
+static uint8_t* FramePoolJumbo(struct FramePool *pool, uint8_t *slot, uint8_t *spill, int len)
+{
+	memcpy(pool->jumbo+AST_FRIENDLY_OFFSET,slot+AST_FRIENDLY_OFFSET,FRAME_SLOT_MTU);
+	memcpy(pool->jumbo+AST_FRIENDLY_OFFSET+FRAME_SLOT_MTU,spill,len-FRAME_SLOT_MTU);
+	pool->jumboCount++;
+	return pool->jumbo;
+}
 
-				     /*	ast_log(LOG_DEBUG,"-Describe response code [%d]\n",responseCode); OLD */
-					ast_debug(3,"-describe response code [%d]\n",responseCode);
+/*
+ * Read one datagram into a slot (one packet per wakeup path).
+ * On success *frameBuffer is the slot (or the jumbo buffer) and the
+ * caller gives it back with FramePoolPut(). Returns length, 0 if nothing
+ * was read. Sets *end on a fatal socket error.
+ */
+static int FramePoolRecv(struct FramePool *pool, int fd, uint8_t **frameBuffer, int *end)
+{
+	struct iovec iov[2];
+	struct msghdr msg;
+	uint8_t *slot;
+	int len;
 
-					/* Check unathorized */
-					if (responseCode==401)
-					{
-						/* Check athentication method */
+	/* Get a slot, or read into the jumbo buffer if there is none left */
+	if (!(slot = FramePoolGet(pool)))
+	{
+		len = recv(fd,pool->jumbo+AST_FRIENDLY_OFFSET,PKT_PAYLOAD,MSG_DONTWAIT);
+		*frameBuffer = pool->jumbo;
+	} else if (!pool->jumboMode) {
+		/* Common case: one recv() straight into the slot */
+		len = recv(fd,slot+AST_FRIENDLY_OFFSET,FRAME_SLOT_MTU,MSG_DONTWAIT|MSG_TRUNC);
+		*frameBuffer = slot;
+		/* Too big for a slot, it is lost. Read the next ones with spill */
+		if (len>FRAME_SLOT_MTU)
+		{
+			ast_log(LOG_NOTICE,"Got %d bytes rtp datagram, enabling jumbo reads\n",len);
+			pool->jumboMode = 1;
+			pool->truncated++;
+			FramePoolPut(pool,slot);
+			*frameBuffer = NULL;
+			return 0;
+		}
+	} else {
+		/* Slot first, spill after it */
+		iov[0].iov_base = slot+AST_FRIENDLY_OFFSET;
+		iov[0].iov_len  = FRAME_SLOT_MTU;
+		iov[1].iov_base = pool->spill;
+		iov[1].iov_len  = FRAME_SPILL_SIZE;
+		memset(&msg,0,sizeof(msg));
+		msg.msg_iov = iov;
+		msg.msg_iovlen = 2;
+		len = recvmsg(fd,&msg,MSG_DONTWAIT);
+		*frameBuffer = slot;
+		/* Stitch oversized datagram */
+		if (len>FRAME_SLOT_MTU)
+		{
+			*frameBuffer = FramePoolJumbo(pool,slot,pool->spill,len);
+			FramePoolPut(pool,slot);
+		}
+	}
 
-                                                /* [v2.0]  Adding new way of detecting authentication method */
-					        ast_debug(3,"  describe 401 Processing\n");
-					        ast_debug(3,"    - Checking for Auth Method of Basic\n");
-                                                struct BasicAuthData basic_data;
-                                                if (GetAuthSchemeBasic(buffer,bufferLen,&basic_data) == 0 )
-                                                {
-					            ast_debug(3,"    - Found Auth Method of Basic\n");
+	if (len<=0)
+	{
+		/* If failed connection. An empty UDP datagram is not an error */
+		if (len<0 && errno!=EAGAIN && errno!=EWOULDBLOCK && errno!=EINTR)
+		{
+			ast_log(LOG_ERROR,"Error receiving rtp [%d,%d].%s\n",len,errno,strerror(errno));
+			*end = 1;
+		}
+		FramePoolPut(pool,*frameBuffer);
+		*frameBuffer = NULL;
+		return 0;
+	}
 
-						    /* Create Basic authentication header */
-						    RtspPlayerBasicAuthorization(player,username,password);
-						    /* Send again the describe */
-						    RtspPlayerDescribe(player,url);
-						    /* Enter loop again */
-						    break;
-                                                }
-                                                else
-                                                {
-					            ast_debug(3,"    - No Auth Method of Basic\n");
-					            ast_debug(3,"    - Checking for Auth Method of Digest\n");
+	return len;
+}
 
-                                                    struct DigestAuthData digest_data;
-                                                    if (GetAuthSchemeDigest(buffer,bufferLen,&digest_data) == 0 )
-                                                    {
-					                ast_debug(3,"    - Found Auth Method of Digest\n");
-							char *nc = NULL;
-							char *cnonce = NULL;
-							char *qop = NULL;
-							char uri[256];
-							sprintf(uri,"rtsp://%s%s", player->hostport, url);
-							char *method = "DESCRIBE";
- 
-							ast_debug(5,"  Challenge Response Data- rx_realm: %s nonce: %s uri %s",\
-								digest_data.rx_realm, digest_data.nonce, uri); 
-                                              
-							if (RtspPlayerDigestAuthorization(player,username,\
-									password, digest_data.rx_realm,\
-									digest_data.nonce, nc, cnonce, qop, uri, \
-									digest_data.rx_realm, method, 0) > 0)
-							{
-								/* Send again the describe */
-								RtspPlayerDescribe(player,url);
-								/* Enter loop again */
-								break;
-							}
-							else
-							{
-								ast_log(LOG_ERROR,"Failed to create digest authorization\n");
-								/* End */
-								player->end = 1;
-								/* Exit */
-								break;
-							}
-                                                    }
-                                                    else
-                                                    {
-					                ast_debug(3,"    - No Auth Method of Digest\n");
-						        /* Error */
-						        ast_log(LOG_ERROR,"-No Basic or Digest Authentication found for RTSP.\n");	
-						        /* End */
-						        player->end = 1;
-						        /* Exit */
-						        break;
-                                                    }
-                                                }
-#ifdef OLD_AUTH_SCHEME
-						/* 
-						 * PORT 17.3.  The Basic Realm header format may be device dependent.
-						 * Original code did not work for my cameras.
-						 */
-					      //if (CheckHeaderValue(buffer,bufferLen,"WWW-Authenticate","Basic realm=\"/\"")) */
-				                if (CheckHeaderValue(buffer,bufferLen,"WWW-Authenticate","Basic realm="))
-						{
-							/* Create Basic authentication header */
-							RtspPlayerBasicAuthorization(player,username,password);
-							/* Send again the describe */
-							RtspPlayerDescribe(player,url);
-							/* Enter loop again */
-							break;
-						} else {
-							/* Error */
-					              //ast_log(LOG_ERROR,"-No Authenticate header found\n");	
-							ast_log(LOG_ERROR,"-No Basic Authentication found for RTSP (Digest Auth not yet supported).\n");	
-							/* End */
-							player->end = 1;
-							/* Exit */
-							break;
-						}
-#endif
-					}
+#ifndef RTSP_SIP_STANDALONE /* [v2.1] */
+/*
+ * [v2.1] Shared RTSP pull.
+ * Every call to the same camera URL with the same credentials shares one
+ * RTSP session. The first caller starts a pull thread that runs main_loop()
+ * without a channel; its frame builder hands each frame to RtspShareFanout(),
+ * which copies it into the queue of every subscribed channel and wakes the
+ * channel through a pipe. Each channel writes its own frames, so a slow or
+ * hung up channel never stalls the camera. The last subscriber to leave
+ * stops the pull thread, which sends TEARDOWN.
+ * Calls with SIP talkback enabled keep a private session: the speaker leg
+ * belongs to one caller.
+ */
+#define RTSP_SHARE_QUEUE	100	/* frames queued per subscriber before dropping the oldest */
+#define RTSP_SHARE_KEY		1024
 
-					/* On any other erro code */
-					if (responseCode<200 || responseCode>299)
-					{
-						/* End */
-						player->end = 1;
-						/* Exit */
-						break;
-					}
+struct RtspShareSubscriber
+{
+	struct ast_channel	*chan;
+	int			alert[2];        /* pipe, readable when frames are queued */
+	AST_LIST_HEAD_NOLOCK(, ast_frame) frames;
+	int			queued;
+	unsigned int		dropped;
+	AST_LIST_ENTRY(RtspShareSubscriber) list;
+};
 
-					/* If not reading content */
-					if (contentLength==0)
-					{
-						/* Search end of response */
-						if ( (responseLen=GetResponseLen(buffer)) == 0 )
-							/*Exit*/
-							break;
+struct RtspShare
+{
+	char			key[RTSP_SHARE_KEY]; /* ip:port/url|username|password */
+	char			*ip;
+	int			port;
+	char			*url;
+	char			*username;
+	char			*password;
+	int			isIPv6;
+	struct RtspSipOptions	opts;            /* of the first caller */
+	struct ast_format_cap	*caps;           /* native formats of the first caller */
+	struct ast_format	*writeFormat;    /* chosen from the SDP, set before PLAY */
+	struct ast_format	*audioFormat;    /* what subscribers get, set before SETUP */
+	struct ast_format	*videoFormat;
+	int			mediaKnown;      /* audioFormat and videoFormat are set */
+
+	ast_mutex_t		lock;
+	int			refs;            /* subscribers + pull thread */
+	int			linked;          /* in the registry */
+	int			stop;            /* asked to stop by the last subscriber */
+	int			ended;           /* pull thread left main_loop() */
+	int			warm;            /* [v2.1] pooled, PLAY held until a call claims it */
+	int			maxIdle;         /* s, warm session is torn down after this. 0 keeps it */
+	int			wake[2];         /* pipe, wakes the pull thread on stop */
+	unsigned int		frames;
+	AST_LIST_HEAD_NOLOCK(, RtspShareSubscriber) subscribers;
+	AST_LIST_ENTRY(RtspShare) list;
+};
 
-						ast_debug(5, "ResponseLen: %i\n",responseLen); /*tjl*/
-						/* Does it have content */
-						contentLength = GetHeaderValueInt(buffer,responseLen,"Content-Length");	
-						ast_debug(5, "contentLength: %i\n",contentLength); /*tjl*/
-						/* Is it sdp */
-						if (!CheckHeaderValue(buffer,responseLen,"Content-Type","application/sdp"))
-						{
-							/* log */
-							ast_log(LOG_ERROR,"Content-Type unknown\n");
-							/* End */
-							player->end = 1;
-							/* Exit */
-							break;
-						}
-						/* Get new length */
-						bufferLen -= responseLen;
+/* Registry of running pulls */
+static AST_LIST_HEAD_STATIC(rtsp_shares, RtspShare);
+/* Pull threads still running, unload waits for them */
+static int rtsp_share_threads;
 
-						/* Move Message Body (data) to begining of buffer.*/
-				            /*	memcpy(buffer,buffer+responseLen,bufferLen); OLD BUGGY  */
-						memmove(buffer,buffer+responseLen,bufferLen);
-					}
-					
-					/* If there is not enough data */	
-					if (bufferLen<contentLength) 
-						/* break */
-						break;
+/* Copy a frame to every subscriber */
+static void RtspShareFanout(struct RtspShare *share, struct ast_frame *frame)
+{
+	struct RtspShareSubscriber *sub;
+	struct ast_frame *dup;
+	struct ast_frame *old;
 
-					/* Create SDP */
-#ifdef TEST_BUFFER
-					sdp = CreateSDP(buffer,bufferLen,sip_enable); 
-#else
-					sdp = CreateSDP(buffer,contentLength,sip_enable);
-#endif
-					/* Get new length */
-					bufferLen -= contentLength;
-					/* Move data to begining */
-				    /*	memcpy(buffer,buffer+responseLen,bufferLen); OLD BUGGY */
-					memmove(buffer,buffer+responseLen,bufferLen);
-					/* Reset content */
-					contentLength = 0;
+	ast_mutex_lock(&share->lock);
+	AST_LIST_TRAVERSE(&share->subscribers, sub, list)
+	{
+		/* Channel is not keeping up, drop the oldest */
+		if (sub->queued>=RTSP_SHARE_QUEUE && (old = AST_LIST_REMOVE_HEAD(&sub->frames, frame_list)))
+		{
+			ast_frfree(old);
+			sub->queued--;
+			sub->dropped++;
+		}
+		/* Copy, the packet slot is reused once we return */
+		if (!(dup = ast_frdup(frame)))
+			continue;
+		AST_LIST_INSERT_TAIL(&sub->frames, dup, frame_list);
+		/* Wake it up on the first one */
+		if (!sub->queued++ && write(sub->alert[1],"f",1)<0)
+			ast_debug(3,"-share wake failed (%s)\n",strerror(errno));
+	}
+	share->frames++;
+	ast_mutex_unlock(&share->lock);
+}
 
-					/* If not sdp */
-					if (!sdp)
-					{
-						/* log */
-						ast_log(LOG_ERROR,"Couldn't parse SDP\n");
-						/* end */
-						player->end = 1;
-						/* exit */
-						break;
-					}
-					ast_debug(4,"Successfully parsed SDP\n"); /* ADDED */
+/* Publish the format chosen by the pull, subscribers set it as write format */
+static void RtspShareSetFormat(struct RtspShare *share, struct ast_format *format)
+{
+	ast_mutex_lock(&share->lock);
+	ao2_cleanup(share->writeFormat);
+	share->writeFormat = format ? ao2_bump(format) : NULL;
+	ast_mutex_unlock(&share->lock);
+}
 
-					/* PORT TO 17.3     
-					 * Formats of media has been restructured to be ast_format_cap instead of bit list:
-					 * - chan->nativeformats has been replaced with
-					 *     ast_channel_nativeformats(const struct ast_channel *chan)  @channel_internal.c
-					 *     which returns chan->nativeformats (ptr to struct ast_format_cap) 
-					 * - Can convert to strings using ast_format_cap_get_names(). 
-					 *     See app_dumpchan.c for example.
-					 *   Note: ast_str_alloca uses memory from the stack.
-					 */
-				     /*	ast_log(LOG_DEBUG,"-Finding compatible codecs [%x]\n", chan->nativeformats); OLD */
-					struct ast_str *format_buf = ast_str_alloca(AST_FORMAT_CAP_NAMES_LEN);
-					ast_debug(4,"-Finding compatible codecs [%s]\n", \
-						  ast_format_cap_get_names(ast_channel_nativeformats(chan), &format_buf));
-					/* Get best audio track */
-					if (0)//sdp->audio) // FIXME disable audio from camera for now
-					{
-						/* Avoid overwritten */
+/* Publish the formats the pull delivers, a call only joins if it can take them */
+static void RtspShareSetMedia(struct RtspShare *share, struct ast_format *audio, struct ast_format *video)
+{
+	ast_mutex_lock(&share->lock);
+	ao2_cleanup(share->audioFormat);
+	ao2_cleanup(share->videoFormat);
+	share->audioFormat = audio ? ao2_bump(audio) : NULL;
+	share->videoFormat = video ? ao2_bump(video) : NULL;
+	share->mediaKnown = 1;
+	ast_mutex_unlock(&share->lock);
+}
 
-						/* PORT 17.3 
-						 * Formats of media have been restructured to be ast_format 
-						 * instead of a bit in a bit list. 
-						 * Formats are contained in a list of capabilities 
-						 *     ast_format_cap instead of bit list.
-						 *  Note: Capabilities: ast_format_cap is a vector structure 
-						 *     list of formats and pref order .
-						 * - Go through the sdp->audio->all bitlist and create a ast_format for each
-						 *     and add to ast_format_cap list.
-						 * - ast_translator_best_choice() has been rewritten 
-						 *     for this scheme (and it added other things too ).
-						 * Reference some of the code from channel.c for this.
-						 */
-						struct ast_format_cap *sdp_cap;
-						struct ast_format_cap *chan_native_cap;
+/* Channel can take what the share delivers. Until it is known, only a caller with the same formats joins */
+static int RtspShareAccepts(struct RtspShare *share, struct ast_format_cap *cap)
+{
+	int res;
 
-						/* COMMENT on memory:
-						 * RAII_VAR w. ao2_cleanup: allocs memory 
-						 * but when out of scope will self-destruct 
-						 */
-						RAII_VAR(struct ast_format *, sdp_fmt, NULL, ao2_cleanup);
-						RAII_VAR(struct ast_format *, best_sdp_fmt, NULL, ao2_cleanup);
-						RAII_VAR(struct ast_format *, best_native_fmt, NULL, ao2_cleanup);
+	ast_mutex_lock(&share->lock);
+	if (!share->mediaKnown)
+		res = ast_format_cap_identical(share->caps,cap);
+	else
+		res = (!share->audioFormat || ast_format_cap_iscompatible_format(cap,share->audioFormat)!=AST_FORMAT_CMP_NOT_EQUAL)
+		   && (!share->videoFormat || ast_format_cap_iscompatible_format(cap,share->videoFormat)!=AST_FORMAT_CMP_NOT_EQUAL);
+	ast_mutex_unlock(&share->lock);
 
-						/* COMMENT on memory
-						 * ast_format_cap_alloc allocs memory
-						 * and is freed w. ao2_cleanup 
-						 */
-						sdp_cap = ast_format_cap_alloc(AST_FORMAT_CAP_FLAG_DEFAULT); 
+	return res;
+}
 
-                                                /* 
-						 * PORT 17.3, 
-						 * go thru entire SDP->audio->formats 
-						 * (instead of SDP->audio-all bitlist).  
-						 */
-						for (i=0;i<sdp->audio->num;i++)
-						{
-							sdp_fmt = sdp->audio->formats[i]->new_format;
-							/* append to sdp capability list */
-							ast_format_cap_append(sdp_cap,sdp_fmt,0); 
-						}
-						/* PORT 17.3, get the best sdp media from the sdp learned media list. */
-						best_sdp_fmt = ast_format_cap_get_best_by_type(sdp_cap, AST_MEDIA_TYPE_AUDIO);
+/*
+ * [v2.1] Channel writer, option 'w'.
+ * ast_write() takes the channel lock and may transcode or wait on a bridge.
+ * Done inline it holds up the next recv() and the kernel drops datagrams.
+ * With 'w' the frame builder only pushes a copy of the frame onto a bounded
+ * single producer/single consumer ring and a writer thread per call does
+ * the ast_write(). Producer is whoever holds the session (the call thread,
+ * or a media reactor under the session lock), consumer is the writer.
+ * When the ring is full the oldest frame is dropped and counted: a late
+ * frame is worth less than a fresh one. The producer takes it by moving
+ * tail with a compare and swap, the same way the consumer does, so neither
+ * side ever waits on the other.
+ */
+#define FRAME_RING_SIZE		256	/* power of two */
 
-						/* 
-						 * PORT 17.3 
-						 * - ast_channel_nativeformats(const struct ast_channel *chan)  
-						 *   (See channel_internal.c as an example).
-						 *   returns pointer to ast_format_cap. (See @format_cap.c line54 )
-						 * I have no idea about ORing AMRNB.  So will remove for now.
-						 */
-					     /*	int best = chan->nativeformats | AST_FORMAT_AMRNB; OLD */
-						/* COMMENT: ast_channel_nativeformats() returns chan->nativeformats */
-						chan_native_cap = ast_channel_nativeformats(chan); 
+struct FrameRing
+{
+	struct ast_frame	*slots[FRAME_RING_SIZE];
+	unsigned int		head;            /* next push, written by the producer only */
+	unsigned int		tail;            /* next pop, CAS by both */
+	/* Producer side counters */
+	unsigned int		pushed;
+	unsigned int		dropped;
+	unsigned int		highWater;       /* deepest the ring has been */
+};
 
-						/* ADD. Not likely to happen but keep as a check*/
-						if(ast_format_cap_empty(chan_native_cap)) 
-							ast_debug(1, "No native codec for audio on channel %s\n",\
-								  ast_channel_name(chan)); 
+struct ChannelWriter
+{
+	struct ast_channel	*chan;
+	struct FrameRing	ring;
+	int			wake[2];         /* ring went from empty to not empty, or stop */
+	int			stop;
+	pthread_t		thread;
+	unsigned int		written;
+};
 
-						/* Get best codec format for audio */
+/* Producer. Never blocks: a full ring loses its oldest frame */
+static void FrameRingPush(struct FrameRing *ring, struct ast_frame *frame, int *wasEmpty)
+{
+	unsigned int head = ring->head;
+	unsigned int tail;
+	unsigned int depth;
+	struct ast_frame *old;
 
-						/* PORT 17.3 Reworked this to accomodate new format structures 
-						 * and new capabilities structures. 
-						 * Assume that the legacy code intent is that given media 
-						 * capabilities of the channel, and media capabilities 
-						 * learned from SDP, determine what is the best media for the channel.
-						 *
-						 * New API is  ast_translator_best_choice(
-						 *                 struct ast_format_cap *dst_cap, 
-						 *                 struct ast_format_cap *src_cap,
-						 *                 struct ast_format **dst_fmt_out,
-						 *                 struct ast_format **src_fmt_out)               
-						 *
-						 * Assume the source is sdp, and destination is the channel.
-						 * dst_cap: ast_channel_nativeformats is already a struct ast_format_cap 
-						 * src_cap: sdp->audio->all is an int which 
-						 *          legacy sdp used as a bit list of AST_FORMAT_xxx 
-						 *          but this was reworked above for new media capabilities: sdp_cap.
-						 * src_fmt_out:  finally, we'll use the best sdp format as the source format, 
-						 * dst_cap: let the algorithm determine the best 
-						 *          destination format: best native format.
-						 */
-					     /*	ast_translator_best_choice(&best, &sdp->audio->all); OLD */
-						ast_translator_best_choice(chan_native_cap, sdp_cap, &best_native_fmt, &sdp_fmt);
+	while (1)
+	{
+		tail = __atomic_load_n(&ring->tail,__ATOMIC_ACQUIRE);
+		/* Room */
+		if (head-tail<FRAME_RING_SIZE)
+			break;
+		/* Full, take the oldest unless the consumer just did */
+		old = __atomic_load_n(&ring->slots[tail&(FRAME_RING_SIZE-1)],__ATOMIC_RELAXED);
+		if (__atomic_compare_exchange_n(&ring->tail,&tail,tail+1,0,__ATOMIC_ACQ_REL,__ATOMIC_ACQUIRE))
+		{
+			ast_frfree(old);
+			ring->dropped++;
+		}
+	}
 
-					     /*	ast_log(LOG_DEBUG,"-Best codec for audio [%x]\n", best); OLD */
-						ast_debug(4, "-Best codec for audio on channel %s is format %s\n", 
-							ast_channel_name(chan), ast_format_get_name(best_native_fmt));
-                                                
-						ao2_cleanup(sdp_cap); /* free up sdp_cap allocd memory */
+	__atomic_store_n(&ring->slots[head&(FRAME_RING_SIZE-1)],frame,__ATOMIC_RELAXED);
+	__atomic_store_n(&ring->head,head+1,__ATOMIC_SEQ_CST);
+	ring->pushed++;
 
-						/* Get first matching format */
-						for (i=0;i<sdp->audio->num;i++)
-						{
-							/* log */
-						     /*	ast_log(LOG_DEBUG,"-audio [%x,%d,%s]\n",\
-						       	        sdp->audio->formats[i]->format,\
-						       	        sdp->audio->formats[i]->payload ,
-						       	        sdp->audio->formats[i]->control); OLD */
-							/* PORT 17.5 fix for format now unsigned long long */
-							ast_debug(4,"-audio [%"PRIx64",%d,%s]\n",\
-								sdp->audio->formats[i]->format,\
-							       	sdp->audio->formats[i]->payload,\
-								sdp->audio->formats[i]->control);
+	/* Metrics */
+	depth = head+1-tail;
+	if (depth>ring->highWater)
+		ring->highWater = depth;
+	/* Consumer had taken everything before this one, it may be asleep */
+	*wasEmpty = __atomic_load_n(&ring->tail,__ATOMIC_SEQ_CST)==head;
+}
 
-							/* if we have that */
+/* Consumer. NULL if empty */
+static struct ast_frame* FrameRingPop(struct FrameRing *ring)
+{
+	unsigned int tail;
+	unsigned int head;
+	struct ast_frame *frame;
+
+	tail = __atomic_load_n(&ring->tail,__ATOMIC_ACQUIRE);
+	while (1)
+	{
+		head = __atomic_load_n(&ring->head,__ATOMIC_SEQ_CST);
+		/* Empty */
+		if (tail==head)
+			return NULL;
+		frame = __atomic_load_n(&ring->slots[tail&(FRAME_RING_SIZE-1)],__ATOMIC_RELAXED);
+		/* Ours unless the producer dropped it meanwhile, then tail is reloaded */
+		if (__atomic_compare_exchange_n(&ring->tail,&tail,tail+1,0,__ATOMIC_SEQ_CST,__ATOMIC_ACQUIRE))
+			return frame;
+	}
+}
+
+/* Hand a frame to the writer thread. The frame may point into a pool slot, so it is copied */
+static void ChannelWriterPush(struct ChannelWriter *writer, struct ast_frame *frame)
+{
+	struct ast_frame *dup;
+	int wasEmpty;
+
+	if (!(dup = ast_frdup(frame)))
+		return;
+	FrameRingPush(&writer->ring,dup,&wasEmpty);
+	/* Writer drains until empty, so only the first one needs a wake up */
+	if (wasEmpty && write(writer->wake[1],"f",1)<0 && errno!=EAGAIN)
+		ast_debug(3,"-writer wake failed (%s)\n",strerror(errno));
+}
+
+/*
+ * [v2.1] Frame builder for RTP received from the camera.
+ * This was inline in main_loop(). It is split out so the one packet per wakeup
+ * path and the batched (recvmmsg) path hand packets to the same code.
+ * The audio and video frames are prepared once when the formats are known;
+ * per packet only data, length and samples are filled in.
+ */
+struct RtpFrameBuilder
+{
+	struct ast_channel	*chan;
+	struct RtspShare	*share;          /* [v2.1] shared pull, frames go to the subscribers */
+	char			*src;            /* AST_FRAME src, for debugging */
+	int			audioFormat;
+	struct ast_format	*audioNewFormat;
+	int			videoFormat;
+	struct ast_format	*videoNewFormat;
+	unsigned int		lastAudio;       /* last audio RTP timestamp */
+	unsigned int		lastVideo;       /* last video RTP timestamp */
+	struct ast_frame	audioFrame;      /* template */
+	struct ast_frame	videoFrame;      /* template */
+	struct JitterBuffer	*jb;             /* [v2.1] audio jitter buffer, option 'j' */
+	struct ChannelWriter	*writer;         /* [v2.1] ast_write() on its own thread, option 'w' */
+};
+
+static void RtpFrameBuilderSetFormats(struct RtpFrameBuilder *builder, int audioFormat, struct ast_format *audioNewFormat,
+				      int videoFormat, struct ast_format *videoNewFormat)
+{
+	builder->audioFormat	= audioFormat;
+	builder->audioNewFormat	= audioNewFormat;
+	builder->videoFormat	= videoFormat;
+	builder->videoNewFormat	= videoNewFormat;
+
+	/* Audio template */
+	memset(&builder->audioFrame,0,sizeof(struct ast_frame));
+	builder->audioFrame.frametype		= AST_FRAME_VOICE;
+	builder->audioFrame.subclass.integer	= audioFormat;
+	builder->audioFrame.subclass.format	= audioNewFormat;
+	builder->audioFrame.src			= builder->src;
+	builder->audioFrame.mallocd		= 0; /* Don't free the frame outside */
+
+	/* Video template */
+	memset(&builder->videoFrame,0,sizeof(struct ast_frame));
+	builder->videoFrame.frametype		= AST_FRAME_VIDEO;
+	builder->videoFrame.subclass.integer	= videoFormat;
+	builder->videoFrame.subclass.format	= videoNewFormat;
+	builder->videoFrame.src			= builder->src;
+	builder->videoFrame.mallocd		= 0; /* Don't free the frame outside */
+}
+
+/* Hand a frame to the channel, or to the subscribers of a shared pull */
+static void RtpFrameBuilderOut(struct RtpFrameBuilder *builder, struct ast_frame *frame)
+{
+	if (builder->share)
+		RtspShareFanout(builder->share,frame);
+	else if (builder->writer) /* [v2.1] */
+		ChannelWriterPush(builder->writer,frame);
+	else
+		ast_write(builder->chan,frame);
+}
+
+/*
+ * [v2.1] RTP clock rate of a camera audio format.
+ * G.722 is sampled at 16 kHz but its RTP clock runs at 8 kHz (RFC 3551).
+ */
+static int RtpClockRate(struct ast_format *format)
+{
+	if (!format)
+		return 8000;
+	if (ast_format_cmp(format,ast_format_g722)==AST_FORMAT_CMP_EQUAL)
+		return 8000;
+	return ast_format_get_sample_rate(format);
+}
+
+/* Write one audio packet with a known number of samples */
+static void RtpFrameBuilderSendAudio(struct RtpFrameBuilder *builder, uint8_t *frameBuffer, int rtpLen, int samples)
+{
+	struct ast_frame sendFrame;
+	struct RtpHeader *rtp = (struct RtpHeader*)(frameBuffer+AST_FRIENDLY_OFFSET);
+	int ini = sizeof(struct RtpHeader) + rtp->cc*4;
+
+	/* Start from template */
+	sendFrame = builder->audioFrame;
+	sendFrame.samples = samples;
+	/* Set frame data */
+	AST_FRAME_SET_BUFFER(&sendFrame,frameBuffer,AST_FRIENDLY_OFFSET+ini,rtpLen-ini);
+	/* Send frame */
+	RtpFrameBuilderOut(builder,&sendFrame);
+}
+
+/*
+ * [v2.1] Adaptive jitter buffer for camera audio, option 'j'.
+ * Packets are kept in a ring indexed by RTP sequence number, so reordered
+ * packets fall into place and duplicates or packets older than the playout
+ * point are dropped. The main loop ticks the buffer every JB_TICK ms and
+ * every packet that is due is written to the channel, with samples taken
+ * from the timestamp delta. The playout delay follows the RFC 3550
+ * interarrival jitter estimate, clamped to the configured min/max.
+ * Packets stay in their FramePool slot while buffered; nothing is copied.
+ */
+#define JB_SLOTS	64	/* power of two; 1.28 s of 20 ms packets */
+#define JB_TICK		20	/* ms */
+
+struct JitterEntry
+{
+	uint8_t		*frameBuffer;	/* pool slot, NULL if empty */
+	int		len;
+	uint16_t	seq;
+	uint32_t	ts;
+};
+
+struct JitterBuffer
+{
+	struct FramePool	*pool;
+	struct JitterEntry	ring[JB_SLOTS];
+	int			count;
+
+	/* Depth in ms */
+	int			minDepth;
+	int			maxDepth;
+	int			depth;
+
+	/* Playout */
+	int			rate;           /* RTP clock */
+	int			started;
+	uint16_t		nextSeq;        /* next sequence number to play */
+	struct timeval		playout;        /* when nextSeq is due */
+	struct timeval		tick;           /* next JB_TICK */
+	int			havePlayed;
+	uint16_t		lastSeq;
+	uint32_t		lastTs;
+	int			lastSamples;
+
+	/* Interarrival jitter, RFC 3550 6.4.1, in timestamp units */
+	struct timeval		base;
+	int			haveTransit;
+	uint32_t		lastTransit;
+	double			jitter;
+
+	/* Counters */
+	unsigned int		received;
+	unsigned int		played;
+	unsigned int		late;
+	unsigned int		duplicates;
+	unsigned int		lost;
+	unsigned int		resyncs;
+	unsigned int		shrinks;
+	unsigned int		underruns;
+};
+
+static struct JitterBuffer* JitterBufferCreate(struct FramePool *pool, int minDepth, int maxDepth, int target)
+{
+	struct JitterBuffer *jb;
+
+	/* Allocate */
+	if (!(jb = ast_calloc(1,sizeof(struct JitterBuffer))))
+		return NULL;
+
+	/* Set values */
+	jb->pool	= pool;
+	jb->minDepth	= minDepth;
+	jb->maxDepth	= maxDepth;
+	jb->depth	= target;
+	jb->rate	= 8000;
+	jb->base	= ast_tvnow();
+
+	return jb;
+}
+
+/* Give every buffered slot back to the pool */
+static void JitterBufferFlush(struct JitterBuffer *jb)
+{
+	int i;
+
+	for (i=0;i<JB_SLOTS;i++)
+	{
+		if (jb->ring[i].frameBuffer)
+		{
+			FramePoolPut(jb->pool,jb->ring[i].frameBuffer);
+			jb->ring[i].frameBuffer = NULL;
+		}
+	}
+	jb->count = 0;
+	jb->started = 0;
+}
+
+static void JitterBufferDestroy(struct JitterBuffer *jb)
+{
+	JitterBufferFlush(jb);
+	ast_free(jb);
+}
+
+static void JitterBufferSetRate(struct JitterBuffer *jb, int rate)
+{
+	if (rate>0)
+		jb->rate = rate;
+}
+
+/* Update jitter estimate and the depth it asks for */
+static void JitterBufferEstimate(struct JitterBuffer *jb, uint32_t ts)
+{
+	uint32_t arrival;
+	uint32_t transit;
+	int32_t d;
+	int depth;
+
+	/* Arrival time in timestamp units */
+	arrival = (uint32_t)(ast_tvdiff_ms(ast_tvnow(),jb->base)*jb->rate/1000);
+	transit = arrival - ts;
+
+	if (jb->haveTransit)
+	{
+		d = (int32_t)(transit - jb->lastTransit);
+		if (d<0)
+			d = -d;
+		jb->jitter += (d - jb->jitter)/16.0;
+	}
+	jb->lastTransit = transit;
+	jb->haveTransit = 1;
+
+	/* Three times the jitter plus one tick of slack */
+	depth = (int)(3*jb->jitter*1000/jb->rate) + JB_TICK;
+	if (depth<jb->minDepth)
+		depth = jb->minDepth;
+	if (depth>jb->maxDepth)
+		depth = jb->maxDepth;
+	jb->depth = depth;
+}
+
+/*
+ * Buffer one audio packet.
+ * Returns 1 if the jitter buffer took the slot (it gives it back to the pool),
+ * 0 if the caller still owns it.
+ */
+static int JitterBufferPut(struct JitterBuffer *jb, struct RtpFrameBuilder *builder, uint8_t *frameBuffer, int rtpLen, uint16_t seq, uint32_t ts)
+{
+	struct JitterEntry *entry;
+	uint8_t *slot;
+	int kept = 1;
+	int16_t diff;
+
+	jb->received++;
+
+	/* Not a slot (interleaved TCP buffer, jumbo buffer). Copy it into one if it fits */
+	if (!FramePoolOwns(jb->pool,frameBuffer))
+	{
+		if (rtpLen>FRAME_SLOT_MTU || !(slot = FramePoolGet(jb->pool)))
+		{
+			RtpFrameBuilderSendAudio(builder,frameBuffer,rtpLen,jb->lastSamples ? jb->lastSamples : jb->rate/50);
+			return 0;
+		}
+		memcpy(slot+AST_FRIENDLY_OFFSET,frameBuffer+AST_FRIENDLY_OFFSET,rtpLen);
+		frameBuffer = slot;
+		/* Caller keeps its own buffer */
+		kept = 0;
+	} else if (!jb->pool->numFree) {
+		/* The batched ingest needs a spare slot to refill */
+		RtpFrameBuilderSendAudio(builder,frameBuffer,rtpLen,jb->lastSamples ? jb->lastSamples : jb->rate/50);
+		return 0;
+	}
+
+	JitterBufferEstimate(jb,ts);
+
+	if (jb->started || jb->havePlayed)
+	{
+		diff = (int16_t)(seq - jb->nextSeq);
+		/* Behind the playout point */
+		if (diff<0)
+		{
+			/* A big jump backwards is a restarted stream, not a late packet */
+			if (diff>-JB_SLOTS)
+			{
+				jb->late++;
+				FramePoolPut(jb->pool,frameBuffer);
+				return kept;
+			}
+			JitterBufferFlush(jb);
+			jb->havePlayed = 0;
+			jb->resyncs++;
+		} else if (diff>=JB_SLOTS) {
+			/* Too far ahead to fit. Start over from this packet */
+			JitterBufferFlush(jb);
+			jb->havePlayed = 0;
+			jb->resyncs++;
+		}
+	}
+
+	/* First packet, or first after an underrun */
+	if (!jb->started)
+	{
+		/* Whatever was skipped while dry is lost */
+		if (jb->havePlayed)
+			jb->lost += (uint16_t)(seq - jb->nextSeq);
+		jb->nextSeq = seq;
+		jb->playout = ast_tvadd(ast_tvnow(),ast_samp2tv(jb->depth,1000));
+		jb->started = 1;
+	}
+
+	/* Check for duplicate */
+	entry = &jb->ring[seq & (JB_SLOTS-1)];
+	if (entry->frameBuffer)
+	{
+		jb->duplicates++;
+		FramePoolPut(jb->pool,frameBuffer);
+		return kept;
+	}
+
+	/* Store */
+	entry->frameBuffer = frameBuffer;
+	entry->len = rtpLen;
+	entry->seq = seq;
+	entry->ts = ts;
+	jb->count++;
+
+	return kept;
+}
+
+/* Play out one sequence number, present or not. Returns its duration in samples */
+static int JitterBufferPop(struct JitterBuffer *jb, struct RtpFrameBuilder *builder)
+{
+	struct JitterEntry *entry = &jb->ring[jb->nextSeq & (JB_SLOTS-1)];
+	uint16_t gap;
+	int samples;
+
+	if (!entry->frameBuffer)
+	{
+		/* Missing, skip it */
+		jb->lost++;
+		samples = jb->lastSamples ? jb->lastSamples : jb->rate/50;
+	} else {
+		/* Samples per packet from timestamp delta over sequence delta */
+		gap = entry->seq - jb->lastSeq;
+		if (jb->havePlayed && gap && entry->ts!=jb->lastTs && (int32_t)(entry->ts-jb->lastTs)>0)
+			samples = (entry->ts - jb->lastTs)/gap;
+		else
+			samples = jb->lastSamples ? jb->lastSamples : jb->rate/50;
+		/* Write it */
+		RtpFrameBuilderSendAudio(builder,entry->frameBuffer,entry->len,samples);
+		FramePoolPut(jb->pool,entry->frameBuffer);
+		entry->frameBuffer = NULL;
+		jb->count--;
+		jb->played++;
+		jb->havePlayed = 1;
+		jb->lastSeq = entry->seq;
+		jb->lastTs = entry->ts;
+	}
+
+	jb->lastSamples = samples;
+	jb->nextSeq++;
+
+	return samples;
+}
+
+/* ms until the next playout tick, for the main loop timeout */
+static int JitterBufferNext(struct JitterBuffer *jb)
+{
+	int64_t ms;
+
+	if (ast_tvzero(jb->tick))
+		return JB_TICK;
+	ms = ast_tvdiff_ms(jb->tick,ast_tvnow());
+	return ms>0 ? (int)ms : 0;
+}
+
+/* Play out whatever is due. Called from the main loop on every pass */
+static void JitterBufferTick(struct JitterBuffer *jb, struct RtpFrameBuilder *builder)
+{
+	struct timeval now = ast_tvnow();
+	int buffered;
+	int samples;
+
+	/* Steady JB_TICK clock */
+	if (!ast_tvzero(jb->tick) && ast_tvcmp(now,jb->tick)<0)
+		return;
+	jb->tick = ast_tvadd(now,ast_samp2tv(JB_TICK,1000));
+
+	if (!jb->started)
+		return;
+
+	/* Play every packet that is due */
+	while (jb->count && ast_tvcmp(now,jb->playout)>=0)
+	{
+		samples = JitterBufferPop(jb,builder);
+		jb->playout = ast_tvadd(jb->playout,ast_samp2tv(samples,jb->rate));
+	}
+
+	/* Nothing buffered */
+	if (!jb->count)
+	{
+		/* Ran dry with a packet due. Next packet restarts playout with the current depth */
+		if (ast_tvcmp(now,jb->playout)>=0)
+		{
+			jb->underruns++;
+			jb->started = 0;
+		}
+		return;
+	}
+
+	/* Holding more than the depth asks for. Drop the oldest to cut latency */
+	buffered = ast_tvdiff_ms(jb->playout,now) + jb->count*(jb->lastSamples ? jb->lastSamples : jb->rate/50)*1000/jb->rate;
+	if (buffered>jb->depth+2*JB_TICK)
+	{
+		struct JitterEntry *entry = &jb->ring[jb->nextSeq & (JB_SLOTS-1)];
+		if (entry->frameBuffer)
+		{
+			FramePoolPut(jb->pool,entry->frameBuffer);
+			entry->frameBuffer = NULL;
+			jb->count--;
+		}
+		jb->nextSeq++;
+		jb->shrinks++;
+	}
+}
+
+static void JitterBufferLogStats(struct JitterBuffer *jb)
+{
+	ast_debug(2,"-jitter buffer: %u received, %u played, %u late, %u duplicate, %u lost, %u shrinks, %u underruns, %u resyncs\n",
+		jb->received,jb->played,jb->late,jb->duplicates,jb->lost,jb->shrinks,jb->underruns,jb->resyncs);
+	ast_debug(2,"-jitter buffer: jitter %.1f ms, depth %d ms [%d-%d]\n",
+		jb->jitter*1000/jb->rate,jb->depth,jb->minDepth,jb->maxDepth);
+}
+
+/*
+ * Build an ast_frame around one RTP packet and write it to the channel.
+ * The RTP packet starts at frameBuffer+AST_FRIENDLY_OFFSET, so the frame
+ * points straight into frameBuffer and nothing is copied.
+ * Returns 1 if the jitter buffer kept frameBuffer, 0 if the caller still owns it.
+ */
+static int RtpFrameBuilderWrite(struct RtpFrameBuilder *builder, struct RtspPlayer *player,
+				 int isAudio, uint8_t *frameBuffer, int rtpLen)
+{
+	struct ast_frame sendFrame;
+	struct RtpPacketInfo rtp; /* [v2.1] */
+	unsigned int ts;
+	int ini;
+
+	/* Get headers, exit if not got enough data */
+	if (RtpParseHeader(frameBuffer+AST_FRIENDLY_OFFSET,rtpLen,&rtp))
+		return 0;
+
+	/* Set data ini */
+	ini = rtp.ini;
+
+	/* Get timestamp */
+	ts = rtp.ts;
+
+	/* [v2.1] Audio through the jitter buffer. It takes care of samples */
+	if (isAudio && builder->jb)
+	{
+		/* Set stats */
+		MediaStatsUpdate(&player->audioStats,ts,rtp.seq,rtp.ssrc);
+		/* Buffer it */
+		return JitterBufferPut(builder->jb,builder,frameBuffer,rtpLen,rtp.seq,ts);
+	}
+
+	/* Depending on socket */
+	if (isAudio) {
+		/* Start from template */
+		sendFrame = builder->audioFrame;
+		/* Set number of samples */
+		if (builder->lastAudio)
+			sendFrame.samples = ts-builder->lastAudio;
+		else
+			/* Set number of samples to 160 */
+			sendFrame.samples = 160;
+		/* Save ts */
+		builder->lastAudio = ts;
+		/* Set stats */
+		MediaStatsUpdate(&player->audioStats,ts,rtp.seq,rtp.ssrc);
+	} else {
+		/* Start from template */
+		sendFrame = builder->videoFrame;
+		/* If not the first */
+		if (builder->lastVideo)
+			sendFrame.samples = ts-builder->lastVideo;
+		else
+			sendFrame.samples = 0;
+		/* Save ts */
+		builder->lastVideo = ts;
+		/* Set mark. See PORT 17.3 note: closest thing left to the old subclass marker bit */
+		sendFrame.subclass.frame_ending = rtp.marker;
+		/* Set stats */
+		MediaStatsUpdate(&player->videoStats,ts,rtp.seq,rtp.ssrc);
+	}
+
+	/* Set frame data */
+	AST_FRAME_SET_BUFFER(&sendFrame,frameBuffer,AST_FRIENDLY_OFFSET+ini,rtpLen-ini);
+	/* Send frame */
+	RtpFrameBuilderOut(builder,&sendFrame);
+
+	return 0;
+}
+
+/*
+ * [v2.1] Batched RTP ingest.
+ * Bursty cameras deliver video and audio in clumps. Instead of one
+ * ast_waitfor_nandfds() wakeup plus one recv() per datagram, drain everything
+ * pending on a ready socket with recvmmsg() into a pre-sized array of slots.
+ * The slots are borrowed from the session FramePool and each message has its
+ * own spill region, so an oversized datagram never truncates.
+ */
+#define RTP_BATCH_MAX		32	/* datagrams per recvmmsg() call */
+#define RTP_BATCH_ROUNDS	4	/* recvmmsg() calls per wakeup before going back to poll */
+#define RTP_BATCH_BUCKETS	6	/* packets per wakeup: 1, 2-3, 4-7, 8-15, 16-31, 32+ */
+
+struct RtpIngest
+{
+	struct FramePool *pool;                  /* owner of the slots */
+	uint8_t		*spill;                  /* FRAME_SPILL_SIZE per message, only touched by jumbo datagrams */
+	uint8_t		*slots[RTP_BATCH_MAX];   /* pool slots, packet at +AST_FRIENDLY_OFFSET */
+	struct iovec	iov[RTP_BATCH_MAX][2];
+	struct mmsghdr	msgs[RTP_BATCH_MAX];
+
+	/* Counters for packets per wakeup */
+	unsigned int	wakeups;
+	unsigned int	packets;
+	unsigned int	syscalls;
+	unsigned int	truncated;
+	unsigned int	maxBatch;
+	unsigned int	hist[RTP_BATCH_BUCKETS];
+};
+
+static void RtpIngestDestroy(struct RtpIngest *ingest)
+{
+	int i;
+
+	/* Give slots back */
+	for (i=0;i<RTP_BATCH_MAX;i++)
+		FramePoolPut(ingest->pool,ingest->slots[i]);
+	ast_free(ingest->spill);
+	ast_free(ingest);
+}
+
+static struct RtpIngest* RtpIngestCreate(struct FramePool *pool)
+{
+	struct RtpIngest *ingest;
+	int i;
+
+	/* Allocate */
+	if (!(ingest = ast_calloc(1,sizeof(struct RtpIngest))))
+		return NULL;
+	ingest->pool = pool;
+	/* Large enough to be mmap'd, so pages no jumbo datagram touches are never faulted in */
+	if (!(ingest->spill = ast_malloc(RTP_BATCH_MAX*FRAME_SPILL_SIZE)))
+	{
+		ast_free(ingest);
+		return NULL;
+	}
+
+	/* Set up the slots and message headers once; recvmmsg() only writes msg_len and msg_flags */
+	for (i=0;i<RTP_BATCH_MAX;i++)
+	{
+		if (!(ingest->slots[i] = FramePoolGet(pool)))
+		{
+			RtpIngestDestroy(ingest);
+			return NULL;
+		}
+		ingest->iov[i][0].iov_base = ingest->slots[i] + AST_FRIENDLY_OFFSET;
+		ingest->iov[i][0].iov_len = FRAME_SLOT_MTU;
+		ingest->iov[i][1].iov_base = ingest->spill + i*FRAME_SPILL_SIZE;
+		ingest->iov[i][1].iov_len = FRAME_SPILL_SIZE;
+		ingest->msgs[i].msg_hdr.msg_iov = ingest->iov[i];
+		ingest->msgs[i].msg_hdr.msg_iovlen = 2;
+	}
+
+	return ingest;
+}
+
+/*
+ * Drain a ready RTP socket and hand each datagram to the frame builder.
+ * Returns number of packets read. Sets *end on a fatal socket error.
+ */
+static int RtpIngestDrain(struct RtpIngest *ingest, int fd, struct RtpFrameBuilder *builder,
+			  struct RtspPlayer *player, int isAudio, int *end)
+{
+	uint8_t *frameBuffer;
+	int total = 0;
+	int rounds = 0;
+	int bucket;
+	int len;
+	int n;
+	int i;
+
+	do {
+		/* Non blocking regardless of the socket flags */
+		n = recvmmsg(fd,ingest->msgs,RTP_BATCH_MAX,MSG_DONTWAIT,NULL);
+		ingest->syscalls++;
+		if (n<0)
+		{
+			/* If failed connection */
+			if (errno!=EAGAIN && errno!=EWOULDBLOCK && errno!=EINTR)
+			{
+				ast_log(LOG_ERROR,"Error receiving rtp batch [%d].%s\n",errno,strerror(errno));
+				*end = 1;
+			}
+			break;
+		}
+		/* Build and write each frame */
+		for (i=0;i<n;i++)
+		{
+			if (ingest->msgs[i].msg_hdr.msg_flags & MSG_TRUNC)
+			{
+				ingest->truncated++;
+				continue;
+			}
+			len = ingest->msgs[i].msg_len;
+			frameBuffer = ingest->slots[i];
+			/* Stitch oversized datagram */
+			if (len>FRAME_SLOT_MTU)
+				frameBuffer = FramePoolJumbo(ingest->pool,frameBuffer,ingest->iov[i][1].iov_base,len);
+			/* [v2.1] If the jitter buffer kept the slot, refill from the pool */
+			if (RtpFrameBuilderWrite(builder,player,isAudio,frameBuffer,len) && frameBuffer==ingest->slots[i])
+			{
+				/* Jitter buffer only keeps a slot when the pool has a spare */
+				ingest->slots[i] = FramePoolGet(ingest->pool);
+				ingest->iov[i][0].iov_base = ingest->slots[i] + AST_FRIENDLY_OFFSET;
+			}
+		}
+		total += n;
+	} while (n==RTP_BATCH_MAX && ++rounds<RTP_BATCH_ROUNDS);
+
+	/* Update counters */
+	if (total)
+	{
+		ingest->wakeups++;
+		ingest->packets += total;
+		if ((unsigned int)total>ingest->maxBatch)
+			ingest->maxBatch = total;
+		for (bucket=0;bucket<RTP_BATCH_BUCKETS-1 && total>=(2<<bucket);bucket++);
+		ingest->hist[bucket]++;
+	}
+
+	return total;
+}
+
+static void RtpIngestLogStats(struct RtpIngest *ingest)
+{
+	ast_debug(2,"-rtp ingest: %u packets in %u wakeups (%.2f per wakeup, max %u) using %u recvmmsg calls, %u truncated\n",
+		ingest->packets,ingest->wakeups,
+		ingest->wakeups ? (double)ingest->packets/ingest->wakeups : 0.0,
+		ingest->maxBatch,ingest->syscalls,ingest->truncated);
+	ast_debug(2,"-rtp ingest: %u jumbo datagrams, pool empty %u times\n",ingest->pool->jumboCount,ingest->pool->exhausted);
+
+	ast_debug(2,"-rtp ingest per wakeup: [1]%u [2-3]%u [4-7]%u [8-15]%u [16-31]%u [32+]%u\n",
+		ingest->hist[0],ingest->hist[1],ingest->hist[2],ingest->hist[3],ingest->hist[4],ingest->hist[5]);
+}
+
+
+/*
+ * [v2.1] Interleaved RTP/RTCP demuxer, option 't' (RTP/AVP/TCP, RFC 2326 10.12).
+ * Media comes on the RTSP connection as '$' <channel> <length:16> <packet>,
+ * mixed with RTSP responses. Complete frames at the front of the buffer are
+ * handed to the frame builder or RTCP session where they lie: the bytes in
+ * front of a frame are either buffer headroom or already consumed, so they
+ * serve as AST_FRIENDLY_OFFSET and nothing is copied. A partial frame at the
+ * end stays in place until the rest arrives.
+ * Returns 1 if the buffer now starts with an RTSP message.
+ */
+static int RtspInterleavedDemux(struct RtspPlayer *player, struct RtspFramer *framer, char **bufferp, int *bufferLen,
+				struct RtpFrameBuilder *builder, struct RtcpSession *audioRtcp, struct RtcpSession *videoRtcp)
+{
+	char *buffer = *bufferp;
+	uint8_t *data = (uint8_t*)buffer;
+	uint8_t *sync;
+	int pos = 0;
+	int channel;
+	int len;
+
+	/* Lost sync, skip to the next frame */
+	if (*bufferLen>=5 && data[0]!='$' && strncmp(buffer,"RTSP/",5)!=0)
+	{
+		if ((sync = memchr(data,'$',*bufferLen)))
+			pos = sync-data;
+		else
+			pos = *bufferLen;
+		ast_log(LOG_WARNING,"Skipping %d bytes of unknown data on interleaved connection\n",pos);
+	}
+
+	/* Each complete frame at the front */
+	while (*bufferLen-pos>=4 && data[pos]=='$')
+	{
+		/* Get header */
+		channel = data[pos+1];
+		len = (data[pos+2]<<8) | data[pos+3];
+		/* Partial, wait for the rest */
+		if (*bufferLen-pos-4<len)
+			break;
+		/* Depending on channel */
+		if (channel==player->audioChannel || channel==player->videoChannel)
+			/* Rtp in place, with the bytes in front as headroom */
+			RtpFrameBuilderWrite(builder,player,channel==player->audioChannel,data+pos+4-AST_FRIENDLY_OFFSET,len);
+		else if (channel==player->audioChannel+1 && audioRtcp->stats)
+			RtcpSessionParse(audioRtcp,data+pos+4,len);
+		else if (channel==player->videoChannel+1 && videoRtcp->stats)
+			RtcpSessionParse(videoRtcp,data+pos+4,len);
+		/* Next frame */
+		pos += 4+len;
+	}
+
+	/* Check for bye */
+	if (audioRtcp->bye || videoRtcp->bye)
+	{
+		ast_debug(2,"-rtcp bye from camera\n");
+		player->end = 1;
+	}
+
+	/* Consume them, a partial frame stays where it is */
+	if (pos)
+		RtspFramerConsume(framer,bufferp,bufferLen,pos);
+
+	return *bufferLen>0 && (*bufferp)[0]!='$';
+}
+
+/* [v2.1] Non blocking wake up pipe, shared pulls and the media reactor use it */
+static int RtspSharePipe(int fds[2])
+{
+	if (pipe(fds)<0)
+	{
+		fds[0] = fds[1] = -1;
+		return 0;
+	}
+	fcntl(fds[0],F_SETFL,fcntl(fds[0],F_GETFL)|O_NONBLOCK);
+	fcntl(fds[1],F_SETFL,fcntl(fds[1],F_GETFL)|O_NONBLOCK);
+	return 1;
+}
+
+static void RtspSharePipeClose(int fds[2])
+{
+	if (fds[0]>=0)
+		close(fds[0]);
+	if (fds[1]>=0)
+		close(fds[1]);
+}
+
+/*
+ * [v2.1] Media reactor.
+ * Optional, media_threads in rtsp_sip.conf. A few threads own the camera
+ * RTP/RTCP sockets of every UDP session in one epoll set each, and run the
+ * frame builder and RTCP parser for whichever session is ready. The session
+ * thread keeps the RTSP connection, the channel and the timers (RTCP
+ * reports, keepalives, jitter buffer), and no longer wakes up per packet.
+ * Each session has a lock the session thread holds except while it waits,
+ * so frames are built by one thread at a time. Detaching waits for the
+ * reactor's current pass, so no event outlives the session. Frames from a
+ * reactor go to the channel through a channel writer (see option 'w') or
+ * the share fanout, so a slow channel never holds up a reactor thread.
+ *
+ * Built with HAVE_LIBURING (and -luring), media_backend = io_uring selects
+ * an io_uring reactor instead: one multishot receive per socket, datagrams
+ * land in a ring of provided buffers, and a whole batch of completions
+ * costs one io_uring_enter(). RTCP reports and talkback RTP of its sessions
+ * are queued on the same ring and ride along with the reactor's next submit
+ * (see MediaSessionSend()). Kernels without multishot receive or buffer
+ * rings (before 6.0) fall back to epoll.
+ */
+#define MEDIA_REACTOR_MAX	16
+#define MEDIA_REACTOR_EVENTS	64	/* epoll events per pass */
+#define MEDIA_SOURCES		4	/* audio/video rtp/rtcp */
+#define MEDIA_URING_SENDS	256	/* io_uring sends in flight per reactor */
+
+struct MediaReactor;
+
+struct MediaSession;
+
+/* epoll/io_uring user data, one per socket */
+struct MediaSource
+{
+	struct MediaSession	*media;
+	int			fd;
+	int			armed;         /* io_uring multishot receive in flight */
+};
+
+struct MediaSession
+{
+	ast_mutex_t		lock;          /* builder, jitter buffer, stats and rtcp sessions, see MediaSessionLock() */
+	struct RtspPlayer	*player;
+	struct RtpFrameBuilder	*builder;
+	struct FramePool	*pool;
+	struct RtpIngest	*ingest;       /* NULL without batched ingest */
+	struct RtcpSession	*audioRtcp;
+	struct RtcpSession	*videoRtcp;
+	char			rtcpBuffer[PKT_PAYLOAD+1];
+	struct MediaReactor	*reactor;      /* NULL when the session thread polls its sockets */
+	struct MediaSource	sources[MEDIA_SOURCES];
+	int			wake[2];       /* reactor wakes the session thread when it ends */
+	int			armed;         /* io_uring receives in flight */
+	int			sending;       /* io_uring sends in flight */
+	int			detaching;     /* io_uring receives are being cancelled */
+};
+
+struct MediaReactor
+{
+	int			epfd;
+	int			wake[2];
+	pthread_t		thread;
+	ast_mutex_t		lock;          /* held while dispatching a pass */
+	ast_cond_t		cond;          /* pass done */
+	unsigned int		pass;
+	int			sessions;
+	int			stop;
+	int			uring;         /* io_uring backend */
+#ifdef HAVE_LIBURING
+	struct io_uring		ring;
+	struct io_uring_buf_ring *bufRing;     /* provided receive buffers */
+	uint8_t			*bufMem;       /* MEDIA_URING_BUFS slots, laid out like pool slots */
+	unsigned int		truncated;
+	uint8_t			*sendMem;      /* MEDIA_URING_SENDS datagrams on their way out */
+	struct MediaSession	*sendOwner[MEDIA_URING_SENDS];
+	int			sendFree[MEDIA_URING_SENDS];
+	int			numSendFree;
+	int			waiting;       /* in io_uring_wait_cqe(), nobody submits for a sender */
+	unsigned int		sent;
+	unsigned int		sentBatched;   /* went out with the reactor's own submit */
+	unsigned int		sentDirect;    /* no slot, sent by the session thread */
+	unsigned int		sendErrors;
+#endif
+};
+
+static struct MediaReactor media_reactors[MEDIA_REACTOR_MAX];
+static int media_reactor_count = 0;
+static int rtsp_sip_media_threads = 0;	/* media_threads in [general], 0 is one poll loop per session */
+static int rtsp_sip_media_uring = 0;	/* media_backend = io_uring */
+
+static void MediaSessionInit(struct MediaSession *media,struct RtspPlayer *player,struct RtpFrameBuilder *builder,
+			     struct FramePool *pool,struct RtpIngest *ingest,struct RtcpSession *audioRtcp,struct RtcpSession *videoRtcp)
+{
+	ast_mutex_init(&media->lock);
+	media->player	 = player;
+	media->builder	 = builder;
+	media->pool	 = pool;
+	media->ingest	 = ingest;
+	media->audioRtcp = audioRtcp;
+	media->videoRtcp = videoRtcp;
+	media->reactor	 = NULL;
+	media->wake[0]	 = media->wake[1] = -1;
+	media->armed	 = 0;
+	media->sending	 = 0;
+	media->detaching = 0;
+}
+
+/*
+ * [v2.1] Session thread side of media->lock. On a reactor, the frame builder,
+ * its jitter buffer, the receiver stats and the rtcp sessions are shared with
+ * the reactor thread, so the session thread takes the lock around its own use
+ * of them and nothing else. No channel I/O or RTSP/SIP handling while held:
+ * the reactor serves other sessions, and would wait for it.
+ */
+static void MediaSessionLock(struct MediaSession *media)
+{
+	if (media->reactor)
+		ast_mutex_lock(&media->lock);
+}
+
+static void MediaSessionUnlock(struct MediaSession *media)
+{
+	if (media->reactor)
+		ast_mutex_unlock(&media->lock);
+}
+
+/* Parse one rtcp packet of the session */
+static void MediaSessionRtcp(struct MediaSession *media,int fd,uint8_t *buffer,int len)
+{
+	struct RtspPlayer *player = media->player;
+	struct RtcpSession *rtcpSession;
+
+	/* Parse compound packet. Reports are sent on their own schedule, not as answers */
+	rtcpSession = fd==player->audioRtcp ? media->audioRtcp : media->videoRtcp;
+	/* Nothing to report on before PLAY */
+	if (!rtcpSession->stats)
+		return;
+	RtcpSessionParse(rtcpSession,buffer,len);
+	/* Check for bye */
+	if (rtcpSession->bye)
+	{
+		/* log */
+		ast_debug(2,"-rtcp bye from camera\n");
+		/* End playback */
+		player->end = 1;
+	}
+}
+
+/*
+ * Read a ready rtp or rtcp socket of the session.
+ * Was inline in main_loop(). Returns 0 if rtcp could not be read.
+ */
+static int MediaSessionRead(struct MediaSession *media,int fd)
+{
+	struct RtspPlayer *player = media->player;
+	uint8_t *frameBuffer;
+	int rtpLen;
+	int rtcpLen = 0;
+
+	/* Rtp */
+	if (fd==player->audioRtp || fd==player->videoRtp)
+	{
+		/* Batched ingest: drain every pending datagram in one pass */
+		if (media->ingest)
+			RtpIngestDrain(media->ingest,fd,media->builder,player,fd==player->audioRtp,&player->end);
+		/* Read rtp packet straight into a pool slot */
+		else if ((rtpLen = FramePoolRecv(media->pool,fd,&frameBuffer,&player->end)))
+		{
+			if (!RtpFrameBuilderWrite(media->builder,player,fd==player->audioRtp,frameBuffer,rtpLen))
+				/* Slot is free again once ast_write() returns */
+				FramePoolPut(media->pool,frameBuffer);
+		}
+		return 1;
+	}
+
+	/* Read rtcp packet */
+	if (!RecvResponse(fd,media->rtcpBuffer,&rtcpLen,PKT_PAYLOAD,&player->end))
+	{
+		/* log */
+		ast_log(LOG_WARNING,"-Error reading rtcp from [%d]\n",fd);
+		return 0;
+	}
+
+	/* Parse */
+	MediaSessionRtcp(media,fd,(uint8_t*)media->rtcpBuffer,rtcpLen);
+	return 1;
+}
+
+static void* MediaReactorThread(void *data)
+{
+	struct MediaReactor *reactor = data;
+	struct epoll_event events[MEDIA_REACTOR_EVENTS];
+	struct MediaSource *source;
+	struct MediaSession *media;
+	char wakeBuffer[16];
+	int ended;
+	int n;
+	int i;
+
+	while (!reactor->stop)
+	{
+		/* Wait for any socket of any session */
+		n = epoll_wait(reactor->epfd,events,MEDIA_REACTOR_EVENTS,-1);
+		if (n<0 && errno!=EINTR)
+		{
+			ast_log(LOG_ERROR,"Media reactor epoll_wait failed (%s)\n",strerror(errno));
+			break;
+		}
+
+		/* No reactor lock while dispatching, detach waits for the pass to end instead */
+		for (i=0;i<n;i++)
+		{
+			/* Detach or stop */
+			if (!(source = events[i].data.ptr))
+			{
+				if (read(reactor->wake[0],wakeBuffer,sizeof(wakeBuffer))<0)
+					ast_debug(3,"-reactor wake read failed (%s)\n",strerror(errno));
+				continue;
+			}
+			media = source->media;
+			ast_mutex_lock(&media->lock);
+			ended = media->player->end;
+			if (!MediaSessionRead(media,source->fd))
+				media->player->end = 1;
+			/* Let the session thread see it */
+			if (!ended && media->player->end && write(media->wake[1],"e",1)<0)
+				ast_debug(3,"-session wake failed (%s)\n",strerror(errno));
+			ast_mutex_unlock(&media->lock);
+		}
+		/* Nothing from before this pass is left */
+		ast_mutex_lock(&reactor->lock);
+		reactor->pass++;
+		ast_cond_broadcast(&reactor->cond);
+		ast_mutex_unlock(&reactor->lock);
+	}
+	return NULL;
+}
+
+#ifdef HAVE_LIBURING
+#define MEDIA_URING_ENTRIES	256	/* submission queue per reactor */
+#define MEDIA_URING_BUFS	1024	/* provided receive buffers per reactor, power of two */
+#define MEDIA_URING_BGID	1	/* buffer group */
+#define MEDIA_URING_SEND_TAG	1	/* user data of a send, slot index above it. Sources are aligned */
+
+/* Give a provided buffer back to the kernel */
+static void MediaUringBufPut(struct MediaReactor *reactor,int bid)
+{
+	io_uring_buf_ring_add(reactor->bufRing,reactor->bufMem+bid*FRAME_SLOT_SIZE+AST_FRIENDLY_OFFSET,
+			      FRAME_SLOT_MTU,bid,io_uring_buf_ring_mask(MEDIA_URING_BUFS),0);
+	io_uring_buf_ring_advance(reactor->bufRing,1);
+}
+
+/* Multishot receive on one socket. Called with reactor->lock, submitted by the caller */
+static int MediaUringArm(struct MediaReactor *reactor,struct MediaSource *source)
+{
+	struct io_uring_sqe *sqe;
+
+	/* Queue full, flush it and try again */
+	if (!(sqe = io_uring_get_sqe(&reactor->ring)))
+	{
+		io_uring_submit(&reactor->ring);
+		if (!(sqe = io_uring_get_sqe(&reactor->ring)))
+			return 0;
+	}
+	io_uring_prep_recv_multishot(sqe,source->fd,NULL,0,0);
+	sqe->flags |= IOSQE_BUFFER_SELECT;
+	sqe->buf_group = MEDIA_URING_BGID;
+	io_uring_sqe_set_data(sqe,source);
+	source->armed = 1;
+	source->media->armed++;
+	return 1;
+}
+
+/* Wake the reactor thread with a completion nobody owns */
+static void MediaUringNop(struct MediaReactor *reactor)
+{
+	struct io_uring_sqe *sqe;
+
+	if ((sqe = io_uring_get_sqe(&reactor->ring)))
+	{
+		io_uring_prep_nop(sqe);
+		io_uring_sqe_set_data(sqe,NULL);
+	}
+	io_uring_submit(&reactor->ring);
+}
+
+/*
+ * [v2.1] Queue a datagram for a connected socket of the session. It is
+ * copied to a send slot, so the caller's buffers are free on return. While
+ * the reactor thread is in a pass, its closing submit takes the send along
+ * with the re-arms and the sends of every other session on the reactor;
+ * only when it waits for completions do we submit it ourselves.
+ * Returns the length, -1 if it has to be sent directly.
+ */
+static int MediaUringSend(struct MediaReactor *reactor,struct MediaSession *media,int fd,const struct iovec *iov,int iovcnt)
+{
+	struct io_uring_sqe *sqe;
+	uint8_t *slot;
+	int len = 0;
+	int id;
+	int i;
+
+	for (i=0;i<iovcnt;i++)
+		len += iov[i].iov_len;
+	if (len>FRAME_SLOT_MTU)
+		return -1;
+
+	ast_mutex_lock(&reactor->lock);
+	/* All slots in flight, or queue full even after a flush */
+	if (reactor->stop || !reactor->numSendFree ||
+	    (!(sqe = io_uring_get_sqe(&reactor->ring)) &&
+	     (io_uring_submit(&reactor->ring)<0 || !(sqe = io_uring_get_sqe(&reactor->ring)))))
+	{
+		reactor->sentDirect++;
+		ast_mutex_unlock(&reactor->lock);
+		return -1;
+	}
+
+	/* Gather into a slot */
+	id = reactor->sendFree[--reactor->numSendFree];
+	slot = reactor->sendMem+id*FRAME_SLOT_MTU;
+	for (i=0,len=0;i<iovcnt;i++)
+	{
+		memcpy(slot+len,iov[i].iov_base,iov[i].iov_len);
+		len += iov[i].iov_len;
+	}
+	io_uring_prep_send(sqe,fd,slot,len,0);
+	io_uring_sqe_set_data64(sqe,((uint64_t)id<<1)|MEDIA_URING_SEND_TAG);
+	reactor->sendOwner[id] = media;
+	media->sending++;
+	reactor->sent++;
+
+	/* Nobody else will submit it */
+	if (reactor->waiting)
+		io_uring_submit(&reactor->ring);
+	else
+		reactor->sentBatched++;
+	ast_mutex_unlock(&reactor->lock);
+
+	return len;
+}
+
+/* [v2.1] A send completed, its slot is free again. Called with reactor->lock */
+static void MediaUringSendDone(struct MediaReactor *reactor,int id,int res)
+{
+	if (res<0)
+	{
+		reactor->sendErrors++;
+		ast_debug(3,"-io_uring send failed (%s)\n",strerror(-res));
+	}
+	reactor->sendOwner[id]->sending--;
+	reactor->sendOwner[id] = NULL;
+	reactor->sendFree[reactor->numSendFree++] = id;
+}
+
+/*
+ * One datagram from a provided buffer. The frame builder gets it in place,
+ * except audio for the jitter buffer, which keeps packets and gets a copy
+ * in a session pool slot.
+ */
+static void MediaUringPacket(struct MediaSession *media,int fd,uint8_t *frameBuffer,int len)
+{
+	struct RtspPlayer *player = media->player;
+	uint8_t *slot;
+
+	/* Rtcp */
+	if (fd==player->audioRtcp || fd==player->videoRtcp)
+	{
+		MediaSessionRtcp(media,fd,frameBuffer+AST_FRIENDLY_OFFSET,len);
+		return;
+	}
+
+	/* Kept by the jitter buffer, so it must be ours */
+	if (fd==player->audioRtp && media->builder->jb)
+	{
+		if (!(slot = FramePoolGet(media->pool)))
+			return;
+		memcpy(slot+AST_FRIENDLY_OFFSET,frameBuffer+AST_FRIENDLY_OFFSET,len);
+		if (!RtpFrameBuilderWrite(media->builder,player,1,slot,len))
+			FramePoolPut(media->pool,slot);
+		return;
+	}
+
+	/* Written, or copied, before it returns */
+	RtpFrameBuilderWrite(media->builder,player,fd==player->audioRtp,frameBuffer,len);
+}
+
+static void* MediaReactorUringThread(void *data)
+{
+	struct MediaReactor *reactor = data;
+	struct io_uring_cqe *cqes[MEDIA_REACTOR_EVENTS];
+	struct io_uring_cqe *cqe;
+	struct MediaSource *source;
+	struct MediaSession *media;
+	uint64_t tag;
+	int ended;
+	int bid;
+	int ret;
+	int n;
+	int i;
+
+	while (!reactor->stop)
+	{
+		/* Wait for any completion of any session */
+		if ((ret = io_uring_wait_cqe(&reactor->ring,&cqe))<0)
+		{
+			if (ret==-EINTR)
+				continue;
+			ast_log(LOG_ERROR,"Media reactor io_uring_wait_cqe failed (%s)\n",strerror(-ret));
+			break;
+		}
+
+		ast_mutex_lock(&reactor->lock);
+		/* [v2.1] Sends queued from now on go with our submit */
+		reactor->waiting = 0;
+		n = io_uring_peek_batch_cqe(&reactor->ring,cqes,MEDIA_REACTOR_EVENTS);
+		for (i=0;i<n;i++)
+		{
+			cqe = cqes[i];
+			/* [v2.1] Send */
+			if ((tag = io_uring_cqe_get_data64(cqe)) & MEDIA_URING_SEND_TAG)
+			{
+				MediaUringSendDone(reactor,(int)(tag>>1),cqe->res);
+				continue;
+			}
+			/* Nop or cancel */
+			if (!(source = io_uring_cqe_get_data(cqe)))
+				continue;
+			media = source->media;
+			bid = cqe->flags & IORING_CQE_F_BUFFER ? (int)(cqe->flags >> IORING_CQE_BUFFER_SHIFT) : -1;
+
+			/* Datagram, unless the session is going away */
+			if (cqe->res>0 && bid>=0 && !media->detaching)
+			{
+				/* Filled the buffer, so it was cut short */
+				if (cqe->res>=FRAME_SLOT_MTU)
+					reactor->truncated++;
+				else
+				{
+					/* Ring is left alone meanwhile. Still armed, so detach waits for us */
+					ast_mutex_unlock(&reactor->lock);
+					ast_mutex_lock(&media->lock);
+					ended = media->player->end;
+					MediaUringPacket(media,source->fd,reactor->bufMem+bid*FRAME_SLOT_SIZE,cqe->res);
+					/* Let the session thread see it */
+					if (!ended && media->player->end && write(media->wake[1],"e",1)<0)
+						ast_debug(3,"-session wake failed (%s)\n",strerror(errno));
+					ast_mutex_unlock(&media->lock);
+					ast_mutex_lock(&reactor->lock);
+				}
+			}
+			if (bid>=0)
+				MediaUringBufPut(reactor,bid);
+
+			/* Multishot over: cancelled, out of buffers or socket error */
+			if (!(cqe->flags & IORING_CQE_F_MORE))
+			{
+				source->armed = 0;
+				media->armed--;
+				if (!media->detaching)
+				{
+					if (cqe->res<0 && cqe->res!=-ENOBUFS)
+						ast_debug(3,"-rearming receive on [%d] (%s)\n",source->fd,strerror(-cqe->res));
+					MediaUringArm(reactor,source);
+				}
+			}
+		}
+		io_uring_cq_advance(&reactor->ring,n);
+		/* Re-arms, and the sends session threads queued meanwhile */
+		io_uring_submit(&reactor->ring);
+		reactor->waiting = 1;
+		/* Detach waits for its receives and sends to end */
+		reactor->pass++;
+		ast_cond_broadcast(&reactor->cond);
+		ast_mutex_unlock(&reactor->lock);
+	}
+	return NULL;
+}
+
+/* io_uring with a provided buffer ring, 0 if the kernel can't */
+static int MediaUringSetup(struct MediaReactor *reactor)
+{
+	int ret;
+	int i;
+
+	if ((ret = io_uring_queue_init(MEDIA_URING_ENTRIES,&reactor->ring,0))<0)
+	{
+		ast_log(LOG_WARNING,"io_uring_queue_init failed (%s)\n",strerror(-ret));
+		return 0;
+	}
+	if (!(reactor->bufMem = ast_malloc(MEDIA_URING_BUFS*FRAME_SLOT_SIZE)))
+	{
+		io_uring_queue_exit(&reactor->ring);
+		return 0;
+	}
+	if (!(reactor->sendMem = ast_malloc(MEDIA_URING_SENDS*FRAME_SLOT_MTU)))
+	{
+		ast_free(reactor->bufMem);
+		io_uring_queue_exit(&reactor->ring);
+		return 0;
+	}
+	if (!(reactor->bufRing = io_uring_setup_buf_ring(&reactor->ring,MEDIA_URING_BUFS,MEDIA_URING_BGID,0,&ret)))
+	{
+		ast_log(LOG_WARNING,"io_uring buffer ring not supported (%s)\n",strerror(-ret));
+		ast_free(reactor->sendMem);
+		ast_free(reactor->bufMem);
+		io_uring_queue_exit(&reactor->ring);
+		return 0;
+	}
+	for (i=0;i<MEDIA_URING_BUFS;i++)
+		MediaUringBufPut(reactor,i);
+	/* [v2.1] Send slots, all free */
+	for (i=0;i<MEDIA_URING_SENDS;i++)
+		reactor->sendFree[i] = i;
+	reactor->numSendFree = MEDIA_URING_SENDS;
+	/* The thread starts out waiting */
+	reactor->waiting = 1;
+	reactor->uring = 1;
+	return 1;
+}
+
+static void MediaUringTeardown(struct MediaReactor *reactor)
+{
+	if (reactor->truncated)
+		ast_log(LOG_NOTICE,"Media reactor dropped %u datagrams bigger than %d bytes\n",reactor->truncated,FRAME_SLOT_MTU);
+	if (reactor->sendErrors)
+		ast_log(LOG_NOTICE,"Media reactor had %u of %u sends fail\n",reactor->sendErrors,reactor->sent);
+	ast_debug(2,"-media reactor sent %u datagrams, %u with its own submit, %u more directly\n",
+		  reactor->sent,reactor->sentBatched,reactor->sentDirect);
+	io_uring_free_buf_ring(&reactor->ring,reactor->bufRing,MEDIA_URING_BUFS,MEDIA_URING_BGID);
+	io_uring_queue_exit(&reactor->ring);
+	ast_free(reactor->sendMem);
+	ast_free(reactor->bufMem);
+}
+#endif
+
+/*
+ * [v2.1] Send a datagram gathered from iov on a connected socket of the
+ * session: RTCP reports, talkback RTP. Queued on the ring of an io_uring
+ * reactor the session is on, sent right away otherwise. media may be NULL.
+ */
+static int MediaSessionSend(struct MediaSession *media,int fd,const struct iovec *iov,int iovcnt)
+{
+	struct msghdr msg;
+#ifdef HAVE_LIBURING
+	int len;
+
+	if (media && media->reactor && media->reactor->uring &&
+	    (len = MediaUringSend(media->reactor,media,fd,iov,iovcnt))>=0)
+		return len;
+#else
+	/* No ring to queue on */
+	(void)media;
+#endif
+	memset(&msg,0,sizeof(msg));
+	msg.msg_iov = (struct iovec*)iov;
+	msg.msg_iovlen = iovcnt;
+	return sendmsg(fd,&msg,0);
+}
+
+/*
+ * Hand the rtp/rtcp sockets of a session to the least busy reactor.
+ * Returns 1 if attached, the caller then polls media->wake[0] instead of
+ * the sockets and uses MediaSessionLock() around the state it shares.
+ */
+static int MediaReactorAttach(struct MediaSession *media)
+{
+	struct RtspPlayer *player = media->player;
+	struct MediaReactor *reactor = NULL;
+	struct epoll_event event;
+	int fds[MEDIA_SOURCES];
+	int i;
+
+	/* Disabled */
+	if (!media_reactor_count)
+		return 0;
+
+	/* Least busy */
+	for (i=0;i<media_reactor_count;i++)
+		if (!reactor || media_reactors[i].sessions<reactor->sessions)
+			reactor = &media_reactors[i];
+
+	if (!RtspSharePipe(media->wake))
+		return 0;
+
+	fds[0] = player->audioRtp;
+	fds[1] = player->videoRtp;
+	fds[2] = player->audioRtcp;
+	fds[3] = player->videoRtcp;
+
+#ifdef HAVE_LIBURING
+	/* One multishot receive per socket */
+	if (reactor->uring)
+	{
+		ast_mutex_lock(&reactor->lock);
+		for (i=0;i<MEDIA_SOURCES;i++)
+		{
+			media->sources[i].media = media;
+			media->sources[i].fd = fds[i];
+			media->sources[i].armed = 0;
+			if (!MediaUringArm(reactor,&media->sources[i]))
+				ast_log(LOG_WARNING,"io_uring submission queue full, socket [%d] not polled\n",fds[i]);
+		}
+		io_uring_submit(&reactor->ring);
+		ast_mutex_unlock(&reactor->lock);
+		media->reactor = reactor;
+		ast_atomic_fetchadd_int(&reactor->sessions,1);
+		ast_debug(2,"-media on io_uring reactor %d, %d sessions\n",(int)(reactor-media_reactors),reactor->sessions);
+		return 1;
+	}
+#endif
+
+	for (i=0;i<MEDIA_SOURCES;i++)
+	{
+		media->sources[i].media = media;
+		media->sources[i].fd = fds[i];
+		event.events = EPOLLIN;
+		event.data.ptr = &media->sources[i];
+		if (epoll_ctl(reactor->epfd,EPOLL_CTL_ADD,fds[i],&event)<0)
+		{
+			ast_log(LOG_WARNING,"Couldn't add media socket to reactor (%s), polling it here\n",strerror(errno));
+			/* Undo */
+			while (i--)
+				epoll_ctl(reactor->epfd,EPOLL_CTL_DEL,fds[i],&event);
+			RtspSharePipeClose(media->wake);
+			media->wake[0] = media->wake[1] = -1;
+			return 0;
+		}
+	}
+	media->reactor = reactor;
+	ast_atomic_fetchadd_int(&reactor->sessions,1);
+
+	/* log */
+	ast_debug(2,"-media on reactor %d, %d sessions\n",(int)(reactor-media_reactors),reactor->sessions);
+	return 1;
+}
+
+/* Take the sockets back. Called without media->lock */
+static void MediaReactorDetach(struct MediaSession *media)
+{
+	struct MediaReactor *reactor = media->reactor;
+	struct epoll_event event;
+	unsigned int pass;
+	int i;
+
+	/* Not attached */
+	if (!reactor)
+		return;
+
+	ast_mutex_lock(&reactor->lock);
+#ifdef HAVE_LIBURING
+	/* Cancel the receives and wait for their last completion, it points at us. Sends just complete */
+	if (reactor->uring)
+	{
+		struct io_uring_sqe *sqe;
+
+		media->detaching = 1;
+		for (i=0;i<MEDIA_SOURCES;i++)
+			if (media->sources[i].armed && (sqe = io_uring_get_sqe(&reactor->ring)))
+			{
+				io_uring_prep_cancel_fd(sqe,media->sources[i].fd,IORING_ASYNC_CANCEL_ALL);
+				io_uring_sqe_set_data(sqe,NULL);
+			}
+		io_uring_submit(&reactor->ring);
+		while ((media->armed || media->sending) && !reactor->stop)
+			ast_cond_wait(&reactor->cond,&reactor->lock);
+	} else
+#endif
+	for (i=0;i<MEDIA_SOURCES;i++)
+		epoll_ctl(reactor->epfd,EPOLL_CTL_DEL,media->sources[i].fd,&event);
+	/* An event fetched before the delete is dispatched in the current pass */
+	pass = reactor->pass;
+	if (!reactor->uring && !reactor->stop && write(reactor->wake[1],"d",1)>=0)
+		while (reactor->pass==pass)
+			ast_cond_wait(&reactor->cond,&reactor->lock);
+	ast_mutex_unlock(&reactor->lock);
+
+	ast_atomic_fetchadd_int(&reactor->sessions,-1);
+	RtspSharePipeClose(media->wake);
+	media->wake[0] = media->wake[1] = -1;
+	media->reactor = NULL;
+}
+
+/* Start media_threads reactors, if configured */
+static void MediaReactorStart(void)
+{
+	struct MediaReactor *reactor;
+	struct epoll_event event;
+	int i;
+
+	if (rtsp_sip_media_threads>MEDIA_REACTOR_MAX)
+		rtsp_sip_media_threads = MEDIA_REACTOR_MAX;
+
+	for (i=0;i<rtsp_sip_media_threads;i++)
+	{
+		reactor = &media_reactors[i];
+		memset(reactor,0,sizeof(struct MediaReactor));
+		reactor->epfd = -1;
+		reactor->wake[0] = reactor->wake[1] = -1;
+#ifdef HAVE_LIBURING
+		/* io_uring if asked for and the kernel has it */
+		if (rtsp_sip_media_uring && MediaUringSetup(reactor))
+		{
+			ast_mutex_init(&reactor->lock);
+			ast_cond_init(&reactor->cond,NULL);
+			if (ast_pthread_create_background(&reactor->thread,NULL,MediaReactorUringThread,reactor))
+			{
+				ast_mutex_destroy(&reactor->lock);
+				ast_cond_destroy(&reactor->cond);
+				MediaUringTeardown(reactor);
+				break;
+			}
+			media_reactor_count++;
+			continue;
+		}
+		if (rtsp_sip_media_uring && !i)
+			ast_log(LOG_WARNING,"io_uring media backend not available, using epoll\n");
+#endif
+		if ((reactor->epfd = epoll_create1(EPOLL_CLOEXEC))<0)
+			break;
+		if (!RtspSharePipe(reactor->wake))
+		{
+			close(reactor->epfd);
+			break;
+		}
+		event.events = EPOLLIN;
+		event.data.ptr = NULL;
+		epoll_ctl(reactor->epfd,EPOLL_CTL_ADD,reactor->wake[0],&event);
+		ast_mutex_init(&reactor->lock);
+		ast_cond_init(&reactor->cond,NULL);
+		if (ast_pthread_create_background(&reactor->thread,NULL,MediaReactorThread,reactor))
+		{
+			ast_mutex_destroy(&reactor->lock);
+			ast_cond_destroy(&reactor->cond);
+			RtspSharePipeClose(reactor->wake);
+			close(reactor->epfd);
+			break;
+		}
+		media_reactor_count++;
+	}
+
+	if (rtsp_sip_media_threads)
+		ast_log(LOG_NOTICE,"Media reactor running %d of %d threads%s\n",media_reactor_count,rtsp_sip_media_threads,
+			media_reactor_count && media_reactors[0].uring ? " on io_uring" : "");
+}
+
+static void MediaReactorStop(void)
+{
+	struct MediaReactor *reactor;
+	int count = media_reactor_count;
+	int i;
+
+	/* No new sessions */
+	media_reactor_count = 0;
+
+	for (i=0;i<count;i++)
+	{
+		reactor = &media_reactors[i];
+		ast_mutex_lock(&reactor->lock);
+		reactor->stop = 1;
+#ifdef HAVE_LIBURING
+		if (reactor->uring)
+			MediaUringNop(reactor);
+		else
+#endif
+		if (write(reactor->wake[1],"s",1)<0)
+			ast_debug(3,"-reactor wake failed (%s)\n",strerror(errno));
+		/* Nobody waits for a stopped reactor */
+		ast_cond_broadcast(&reactor->cond);
+		ast_mutex_unlock(&reactor->lock);
+		pthread_join(reactor->thread,NULL);
+		ast_mutex_destroy(&reactor->lock);
+		ast_cond_destroy(&reactor->cond);
+#ifdef HAVE_LIBURING
+		if (reactor->uring)
+		{
+			MediaUringTeardown(reactor);
+			continue;
+		}
+#endif
+		RtspSharePipeClose(reactor->wake);
+		close(reactor->epfd);
+	}
+}
+
+/* [v2.1] Writer thread, the consumer side of the ring */
+static void* ChannelWriterThread(void *data)
+{
+	struct ChannelWriter *writer = data;
+	struct ast_frame *frame;
+	char wakeBuffer[16];
+
+	while (!writer->stop)
+	{
+		/* Wait for frames */
+		if (ast_wait_for_input(writer->wake[0],-1)<0 && errno!=EINTR)
+			break;
+		if (read(writer->wake[0],wakeBuffer,sizeof(wakeBuffer))<0 && errno!=EAGAIN)
+			break;
+		/* Until empty */
+		while ((frame = FrameRingPop(&writer->ring)))
+		{
+			ast_write(writer->chan,frame);
+			ast_frfree(frame);
+			writer->written++;
+		}
+	}
+	return NULL;
+}
+
+static struct ChannelWriter* ChannelWriterStart(struct ast_channel *chan)
+{
+	struct ChannelWriter *writer;
+
+	/* Allocate */
+	if (!(writer = ast_calloc(1,sizeof(struct ChannelWriter))))
+		return NULL;
+	writer->chan = chan;
+	if (!RtspSharePipe(writer->wake))
+	{
+		ast_free(writer);
+		return NULL;
+	}
+	if (ast_pthread_create_background(&writer->thread,NULL,ChannelWriterThread,writer))
+	{
+		RtspSharePipeClose(writer->wake);
+		ast_free(writer);
+		return NULL;
+	}
+	return writer;
+}
+
+/* No more frames pushed after this */
+static void ChannelWriterStop(struct ChannelWriter *writer)
+{
+	struct ast_frame *frame;
+
+	/* Stop and wait */
+	writer->stop = 1;
+	if (write(writer->wake[1],"s",1)<0)
+		ast_debug(3,"-writer wake failed (%s)\n",strerror(errno));
+	pthread_join(writer->thread,NULL);
+
+	/* Not written */
+	while ((frame = FrameRingPop(&writer->ring)))
+		ast_frfree(frame);
+
+	/* log */
+	if (writer->ring.dropped)
+		ast_log(LOG_NOTICE,"%s channel writer dropped %u of %u frames, ring high water %u of %d\n",
+			ast_channel_name(writer->chan),writer->ring.dropped,writer->ring.pushed,writer->ring.highWater,FRAME_RING_SIZE);
+	else
+		ast_debug(2,"-channel writer: %u frames written, ring high water %u of %d\n",
+			writer->written,writer->ring.highWater,FRAME_RING_SIZE);
+
+	RtspSharePipeClose(writer->wake);
+	ast_free(writer);
+}
+
+/*
+ * [v2.1] Header from its own buffer, payload straight from the frame, on a
+ * connected socket. On the ring of the session's io_uring reactor if it has one.
+ */
+static int RtpSendFrame(struct MediaSession *media,int fd,struct RtpHeader *rtp,struct ast_frame *f)
+{
+	struct iovec iov[2];
+
+	iov[0].iov_base = rtp;
+	iov[0].iov_len = sizeof(struct RtpHeader);
+	iov[1].iov_base = f->data.ptr;
+	iov[1].iov_len = f->datalen;
+	return MediaSessionSend(media,fd,iov,2);
+}
+
+/*
+ * [v2.1] Outgoing RTP batch for one connected UDP socket. Packets are added
+ * while a tick runs and flushed at its end with one sendmmsg(), or, when
+ * they are all the same size but the last, one sendmsg() with UDP_SEGMENT
+ * so the kernel (or NIC) splits them. A kernel that refuses GSO turns it
+ * off for the queue. Each packet is a header and a payload gathered from
+ * where they are, both must stay valid until the flush.
+ */
+#ifndef UDP_SEGMENT
+#define UDP_SEGMENT		103
+#endif
+#ifndef SOL_UDP
+#define SOL_UDP			17
+#endif
+#define RTP_SEND_BATCH		32
+#define RTP_SEND_GSO_MAX	64000	/* bytes per GSO send */
+
+struct RtpSendQueue
+{
+	int		fd;
+	int		gso;                     /* UDP_SEGMENT still worth trying */
+	int		count;
+	struct iovec	iov[RTP_SEND_BATCH][2];  /* header, payload */
+	size_t		lens[RTP_SEND_BATCH];
+	struct mmsghdr	msgs[RTP_SEND_BATCH];
+
+	/* Counters for packets per syscall */
+	unsigned int	packets;
+	unsigned int	syscalls;
+	unsigned int	gsoSends;
+	unsigned int	errors;
+	unsigned int	maxBatch;
+};
+
+static void RtpSendQueueInit(struct RtpSendQueue *queue,int fd)
+{
+	memset(queue,0,sizeof(struct RtpSendQueue));
+	queue->fd = fd;
+	queue->gso = 1;
+}
+
+/* One sendmsg() for count equal segments, 0 if GSO can't be used */
+static int RtpSendQueueGso(struct RtpSendQueue *queue)
+{
+	char control[CMSG_SPACE(sizeof(uint16_t))];
+	struct msghdr msg;
+	struct cmsghdr *cmsg;
+	size_t total = 0;
+	int i;
+
+	/* Same size, only the last may be shorter */
+	for (i=0;i<queue->count;i++)
+	{
+		if ((i<queue->count-1 && queue->lens[i]!=queue->lens[0]) || queue->lens[i]>queue->lens[0])
+			return 0;
+		total += queue->lens[i];
+	}
+	if (total>RTP_SEND_GSO_MAX)
+		return 0;
+
+	memset(&msg,0,sizeof(msg));
+	memset(control,0,sizeof(control));
+	/* Segments are cut from the gathered bytes, iovec boundaries don't matter */
+	msg.msg_iov = queue->iov[0];
+	msg.msg_iovlen = queue->count*2;
+	msg.msg_control = control;
+	msg.msg_controllen = sizeof(control);
+	cmsg = CMSG_FIRSTHDR(&msg);
+	cmsg->cmsg_level = SOL_UDP;
+	cmsg->cmsg_type = UDP_SEGMENT;
+	cmsg->cmsg_len = CMSG_LEN(sizeof(uint16_t));
+	*(uint16_t*)CMSG_DATA(cmsg) = queue->lens[0];
+
+	queue->syscalls++;
+	if (sendmsg(queue->fd,&msg,0)>=0)
+	{
+		queue->gsoSends++;
+		return 1;
+	}
+	/* Not supported here, don't ask again */
+	if (errno==EINVAL || errno==EIO || errno==ENOPROTOOPT || errno==EOPNOTSUPP)
+	{
+		ast_debug(2,"-udp gso not available on [%d] (%s), using sendmmsg\n",queue->fd,strerror(errno));
+		queue->gso = 0;
+		return 0;
+	}
+	queue->errors += queue->count;
+	return 1;
+}
+
+static void RtpSendQueueAdd(struct RtpSendQueue *queue,void *header,size_t headerLen,void *data,size_t len)
+{
+	queue->iov[queue->count][0].iov_base = header;
+	queue->iov[queue->count][0].iov_len = headerLen;
+	queue->iov[queue->count][1].iov_base = data;
+	queue->iov[queue->count][1].iov_len = len;
+	queue->lens[queue->count] = headerLen+len;
+	queue->count++;
+}
+
+static int RtpSendQueueFull(struct RtpSendQueue *queue)
+{
+	return queue->count==RTP_SEND_BATCH;
+}
+
+/* Send everything queued */
+static void RtpSendQueueFlush(struct RtpSendQueue *queue)
+{
+	int sent = 0;
+	int n;
+	int i;
+
+	if (!queue->count)
+		return;
+	queue->packets += queue->count;
+	if ((unsigned int)queue->count>queue->maxBatch)
+		queue->maxBatch = queue->count;
+
+	/* One packet, nothing to batch */
+	if (queue->count==1)
+	{
+		queue->syscalls++;
+		if (writev(queue->fd,queue->iov[0],2)<0)
+			queue->errors++;
+		queue->count = 0;
+		return;
+	}
+
+	/* Segmentation offload */
+	if (queue->gso && RtpSendQueueGso(queue))
+	{
+		queue->count = 0;
+		return;
+	}
+
+	/* One message per packet */
+	for (i=0;i<queue->count;i++)
+	{
+		memset(&queue->msgs[i],0,sizeof(struct mmsghdr));
+		queue->msgs[i].msg_hdr.msg_iov = queue->iov[i];
+		queue->msgs[i].msg_hdr.msg_iovlen = 2;
+	}
+	while (sent<queue->count)
+	{
+		queue->syscalls++;
+		if ((n = sendmmsg(queue->fd,queue->msgs+sent,queue->count-sent,0))<=0)
+		{
+			/* Skip the one that failed */
+			queue->errors++;
+			sent++;
+			continue;
+		}
+		sent += n;
+	}
+	queue->count = 0;
+}
+
+static void RtpSendQueueLogStats(struct RtpSendQueue *queue,const char *name)
+{
+	if (!queue->syscalls)
+		return;
+	ast_debug(2,"-%s: %u packets in %u syscalls (%.2f per syscall, max %u), %u gso sends, %u errors\n",
+		name,queue->packets,queue->syscalls,(double)queue->packets/queue->syscalls,queue->maxBatch,
+		queue->gsoSends,queue->errors);
+}
+
+/*
+ * [v2.1] Talkback pacer, option 's'. Voice frames come from the bridge in
+ * bursts, and doorbell speakers with small buffers underrun or clip when
+ * RTP arrives that way. Packets are stamped when read from the channel,
+ * queued with their header beside them, and sent on an Asterisk timer one per ptime, once half of the
+ * depth is buffered. A full queue drops its oldest packet, an empty one
+ * stops the timer and buffers again. Each send is checked against its slot
+ * on the ptime grid, sends off by more than ptime/2 late or PACER_EARLY_MS
+ * early are counted and logged with the drops when the call ends.
+ */
+#define PACER_SLOTS		32	/* packets */
+#define PACER_DEFAULT_DEPTH	60	/* ms */
+#define PACER_EARLY_MS		2
+
+struct TalkbackPacer
+{
+	struct ast_timer	*timer;
+	struct ast_frame	*frames[PACER_SLOTS];
+	struct RtpHeader	headers[PACER_SLOTS]; /* of frames[], same index */
+	int			head;
+	int			count;
+	int			depth;         /* ms */
+	int			ptime;         /* ms, from the first frame */
+	int			maxQueued;     /* depth in packets */
+	int			running;       /* timer on */
+	struct timeval		base;          /* slot 0 of this run */
+	unsigned int		slot;
+	unsigned int		sent;
+	unsigned int		late;
+	unsigned int		early;
+	unsigned int		dropped;
+	unsigned int		underruns;
+	int			worst;         /* ms off its slot */
+	struct RtpSendQueue	queue;         /* packets due in one tick */
+};
+
+static struct TalkbackPacer* TalkbackPacerCreate(int depth,int fd)
+{
+	struct TalkbackPacer *pacer;
+
+	/* Allocate */
+	if (!(pacer = ast_calloc(1,sizeof(struct TalkbackPacer))))
+		return NULL;
+	if (!(pacer->timer = ast_timer_open()))
+	{
+		ast_free(pacer);
+		return NULL;
+	}
+	pacer->depth = depth>0 ? depth : PACER_DEFAULT_DEPTH;
+	RtpSendQueueInit(&pacer->queue,fd);
+	return pacer;
+}
+
+/* Queue a frame and its rtp header. The frame is copied, the channel owns f */
+static void TalkbackPacerPush(struct TalkbackPacer *pacer,struct RtpHeader *rtp,struct ast_frame *f)
+{
+	struct ast_frame *frame;
+	unsigned int rate;
+
+	/* Packet time from the first frame */
+	if (!pacer->ptime)
+	{
+		rate = ast_format_get_sample_rate(f->subclass.format);
+		pacer->ptime = rate && f->samples ? f->samples*1000/rate : 20;
+		if (pacer->ptime<=0)
+			pacer->ptime = 20;
+		pacer->maxQueued = pacer->depth/pacer->ptime;
+		if (pacer->maxQueued<2)
+			pacer->maxQueued = 2;
+		if (pacer->maxQueued>PACER_SLOTS)
+			pacer->maxQueued = PACER_SLOTS;
+		/* log */
+		ast_debug(2,"-talkback pacer ptime:%d ms queue:%d packets\n",pacer->ptime,pacer->maxQueued);
+	}
+
+	/* Copy */
+	if (!(frame = ast_frdup(f)))
+		return;
+
+	/* Full, drop oldest */
+	if (pacer->count==pacer->maxQueued)
+	{
+		ast_frfree(pacer->frames[pacer->head]);
+		pacer->head = (pacer->head+1)%PACER_SLOTS;
+		pacer->count--;
+		pacer->dropped++;
+	}
+	pacer->frames[(pacer->head+pacer->count)%PACER_SLOTS] = frame;
+	pacer->headers[(pacer->head+pacer->count)%PACER_SLOTS] = *rtp;
+	pacer->count++;
+
+	/* Half the depth buffered, start the clock */
+	if (!pacer->running && pacer->count>=(pacer->maxQueued+1)/2)
+	{
+		if (ast_timer_set_rate(pacer->timer,1000/pacer->ptime))
+		{
+			ast_log(LOG_WARNING,"Couldn't start talkback pacer timer (%s)\n",strerror(errno));
+			return;
+		}
+		pacer->running = 1;
+		pacer->base = ast_tvnow();
+		pacer->slot = 0;
+	}
+}
+
+/* Timer fired, send what is due */
+static void TalkbackPacerTick(struct TalkbackPacer *pacer)
+{
+	struct ast_frame *frames[RTP_SEND_BATCH];
+	struct ast_frame *frame;
+	struct timeval now;
+	struct timeval due;
+	int offset;
+	int n = 0;
+
+	if (ast_timer_ack(pacer->timer,1)<0)
+		ast_debug(3,"-talkback pacer ack failed (%s)\n",strerror(errno));
+	if (!pacer->running)
+		return;
+
+	now = ast_tvnow();
+	while (pacer->count && !RtpSendQueueFull(&pacer->queue))
+	{
+		/* Not yet */
+		due = ast_tvadd(pacer->base,ast_samp2tv(pacer->slot*pacer->ptime,1000));
+		offset = (int)ast_tvdiff_ms(now,due);
+		if (offset < -pacer->ptime/4)
+			break;
+
+		/* Queue, sent at the end of the tick */
+		/* Header slot is not reused before the flush, pushes come between ticks */
+		frame = pacer->frames[pacer->head];
+		RtpSendQueueAdd(&pacer->queue,&pacer->headers[pacer->head],sizeof(struct RtpHeader),frame->data.ptr,frame->datalen);
+		pacer->head = (pacer->head+1)%PACER_SLOTS;
+		pacer->count--;
+		frames[n++] = frame;
+		pacer->sent++;
+		pacer->slot++;
+
+		/* How far off its slot */
+		if (offset>pacer->ptime/2)
+			pacer->late++;
+		else if (offset < -PACER_EARLY_MS)
+			pacer->early++;
+		if (abs(offset)>pacer->worst)
+			pacer->worst = abs(offset);
+		/* Fell behind by more than the queue, start a new grid */
+		if (offset>pacer->depth)
+		{
+			pacer->base = now;
+			pacer->slot = 0;
+		}
+	}
+
+	/* Catching up sends several at once */
+	RtpSendQueueFlush(&pacer->queue);
+	while (n)
+		ast_frfree(frames[--n]);
+
+	/* Ran dry, buffer again */
+	if (!pacer->count)
+	{
+		pacer->underruns++;
+		pacer->running = 0;
+		ast_timer_set_rate(pacer->timer,0);
+	}
+}
+
+static void TalkbackPacerDestroy(struct TalkbackPacer *pacer,const char *name)
+{
+	/* Not sent */
+	while (pacer->count)
+	{
+		ast_frfree(pacer->frames[pacer->head]);
+		pacer->head = (pacer->head+1)%PACER_SLOTS;
+		pacer->count--;
+	}
+
+	/* log */
+	if (pacer->late || pacer->early || pacer->dropped || pacer->queue.errors)
+		ast_log(LOG_NOTICE,"%s talkback pacer sent %u packets, %u late %u early, worst %d ms off, %u dropped, %u underruns, %u errors\n",
+			name,pacer->sent,pacer->late,pacer->early,pacer->worst,pacer->dropped,pacer->underruns,pacer->queue.errors);
+	else
+		ast_debug(2,"-talkback pacer: %u packets, worst %d ms off, %u underruns\n",pacer->sent,pacer->worst,pacer->underruns);
+	RtpSendQueueLogStats(&pacer->queue,"talkback send");
+
+	ast_timer_close(pacer->timer);
+	ast_free(pacer);
+}
+
+/*
+ * [v2.1] share is set when running as the pull thread of a shared session.
+ * There is no channel then (chan is NULL), frames go to the subscribers and
+ * codecs are chosen against the native formats of the first caller.
+ */
+static int main_loop(struct ast_channel *chan,char *ip, int rtsp_port, char *url,char *username,char *password,int isIPv6,int sip_enable, char *sip_realm, int sip_port, struct RtspSipOptions *opts,
+		     struct RtspShare *share)
+{
+	struct ast_frame *f = NULL;
+     /*	struct ast_frame *sendFrame = NULL; OLD */
+     /*	struct ast_frame sendFrame;  PORT 17.5. [v2.1] moved to RtpFrameBuilderWrite() */
+	struct RtpFrameBuilder builder = { .chan = chan, .share = share, }; /* [v2.1] */
+	struct ast_format_cap *nativeCap = chan ? ast_channel_nativeformats(chan) : share->caps; /* [v2.1] */
+	const char *chanName = chan ? ast_channel_name(chan) : "shared pull"; /* [v2.1] */
+	char wakeBuffer[16]; /* [v2.1] */
+	struct RtpIngest *ingest = NULL; /* [v2.1] batched ingest, option 'b' */
+     /*	uint8_t FrameBuffer[AST_FRIENDLY_OFFSET + PKT_PAYLOAD]; PORT 17.5 make a real buffer instead of alloc'd (See app_fax.c) */
+	struct FramePool *pool = NULL; /* [v2.1] packet slots, replaces FrameBuffer */
+     /*	uint8_t *frameBuffer = NULL; [v2.1] in MediaSessionRead() */
+	struct MediaSession media; /* [v2.1] rtp/rtcp state, polled here or by a reactor */
+
+	int infds[12]; /* CHANGE. from 5 to 10 to accomdate SIP. [v2.1] 12, share wake and pacer timer */
+	int num_infds=5; /* ADDED for use with SIP */
+	int outfd;
+
+     /*	char buffer[16384]; [v2.1] room for interleaved frames, and headroom to write them in place */
+     /*	char bufferMem[AST_FRIENDLY_OFFSET + RTSP_BUFFER_SIZE]; [v2.1] too big for the thread stack, allocated below */
+	char *bufferMem = NULL;
+	char *buffer = NULL;
+	int  bufferSize = RTSP_BUFFER_SIZE-1; /* One less for finall \0 */
+	int  bufferLen = 0;
+	char *sipBuffer = NULL; /* [v2.1] SIP has its own, RTSP may keep a partial interleaved frame. 16384 bytes */
+	int  sipBufferSize = 16383; /* One less for finall \0 */
+	int  sipBufferLen = 0;
+	int  recvLen = 0; /* ADDED */
+	int  responseCode = 0;
+	int  responseLen = 0;
+	int  contentLength = 0;
+     /* char *rtpBuffer; OLD */
+     /*	uint8_t *rtpBuffer; PORT17.5 model this after app_fax.c. [v2.1] now in FramePool */
+     /*	char rtcpBuffer[PKT_PAYLOAD]; [v2.1] in MediaSession */
+     /*	int  rtpSize = PKT_PAYLOAD; [v2.1] */
+     /*	int  rtcpSize = PKT_PAYLOAD;
+	int  rtpLen = 0;
+	int  rtcpLen = 0; [v2.1] in MediaSessionRead() */
+	const char *session; /* [v2.1] header values in buffer, not terminated */
+	const char *transport;
+	const char *range;
+	const char *j;
+	int sessionLen;
+	int transportLen;
+	int rangeLen;
+	struct HeaderIndex sipIndex; /* [v2.1] headers of the SIP message in sipBuffer */
+	char src[128];
+	int  res = 0;
+
+	struct SDPContent* sdp = NULL;
+	struct SDPContent* sip_sdp = NULL; /* ADDED */
+	struct SdpCacheEntry *sdpEntry = NULL; /* [v2.1] owns sdp when set */
+	struct SdpMediaChoice choice; /* [v2.1] */
+	char sdpKey[SDP_CACHE_KEY]; /* [v2.1] */
+	char controlUri[512]; /* [v2.1] */
+	int sdpCached = 0; /* [v2.1] DESCRIBE skipped */
+	int mediaChosen = 0; /* [v2.1] start SETUP */
+	int pipelinedResponse = 0; /* [v2.1] */
+	struct RtspFramer framer; /* [v2.1] */
+	int  messageLen = 0; /* [v2.1] */
+	long messageConsumed = 0; /* [v2.1] */
+	int sipStarted = 0; /* [v2.1] first INVITE sent */
+	char *audioControl = NULL;
+	char *videoControl = NULL;
+	int audioFormat = 0;
+	int videoFormat = 0;
+	struct ast_format *audioNewFormat = NULL; /* PORT 17.3. Track using new media format */
+	struct ast_format *videoNewFormat = NULL; /* PORT 17.3. Track using new media format */
+	int audioType = 0;
+	int videoType = 0;
+
+	int duration = 0;
+	int elapsed = 0;
+	int ms = 10000;
+	int i = 0;
+	int temp; /* ADDED. SIP. */
+	int enable_sip_tx = 0; /* ADDED. SIP. */
+	uint16_t pre_enable_vf_tx_count = 0; /*ADDED. SIP */
+	uint16_t post_enable_vf_tx_count = 0; /*ADDED. SIP */
+	uint16_t sip_tx_error_count = 0; /*ADDED. SIP */
+	struct RtspPlayer *player;
+     /*	struct RtpHeader *sip_rtp; ADDED. SIP */
+	struct RtpHeader sip_rtp; /* [v2.1] not in the frame headroom */
+     /*	uint32_t sip_prev_samples=0; ADDED. SIP. [v2.1] in RtpSender */
+	struct RtpSender sipSender; /* [v2.1] talkback rtp */
+	struct MediaStats sipStats; /* [v2.1] nothing received from the speaker, an empty RR block */
+	struct RtcpSession sipRtcpSession = { 0, }; /* [v2.1] SR to the speaker, its RRs back */
+	uint8_t sipRtcpBuffer[PKT_PAYLOAD]; /* [v2.1] */
+	int sipRtcpLen; /* [v2.1] */
+	int sipCodec = -1; /* [v2.1] sipCodecs[] index answered */
+	struct ast_frame *sipFrame; /* [v2.1] L16 in network order */
+	struct Rtcp rtcp;
+	struct timeval tv = {0,0};
+     /*	struct timeval rtcptv = {0,0}; [v2.1] */
+	struct timeval keepalivetv = {0,0}; /* [v2.1] RTSP OPTIONS keepalive */
+	struct timeval readytv = {0,0}; /* [v2.1] warm session idle since */
+	struct RtcpSession audioRtcpSession = { 0, }; /* [v2.1] */
+	struct RtcpSession videoRtcpSession = { 0, }; /* [v2.1] */
+     /*	struct RtcpSession *rtcpSession; [v2.1] in MediaSessionRead() */
+	int keepaliveMs; /* [v2.1] */
+
+	struct RtspPlayer *sip_speaker = NULL;/* sip will make use of RTSP data structures */
+	struct TalkbackPacer *pacer = NULL; /* [v2.1] option 's' */
+
+	/* log */
+     /*	ast_log(LOG_WARNING,">rtsp_sip main loop\n");    was "rtsp play" */
+	ast_log(LOG_NOTICE,">rtsp-sip main loop\n");
+
+	/* Set random src for AST_FRAME debugging */
+	sprintf(src,"rtsp_play%08lx", ast_random());
+	builder.src = src;
+
+	/* Create RTSP player */
+	player = RtspPlayerCreate();
+
+	/* if error */
+	if (!player)
+	{
+		/* log */
+		ast_log(LOG_ERROR,"Couldn't create RTSP player\n");
+		/* exit */
+		return 0;
+	}
+
+	/* ADDED Create SIP Speaker */
+	if(sip_enable){
+		sip_speaker = RtspPlayerCreate(); /* SIP will re-use the RTSP data structures for its own use*/
+		if (!sip_speaker)
+		{
+			/* log */
+			ast_log(LOG_ERROR,"Couldn't create SIP Speaker\n");
+			/* exit */
+			return 0;
+		}
+	}
+
+	/* [v2.1] Receive buffers */
+	bufferMem = ast_malloc(AST_FRIENDLY_OFFSET + RTSP_BUFFER_SIZE);
+	sipBuffer = ast_malloc(sipBufferSize+1);
+	if (!bufferMem || !sipBuffer)
+	{
+		/* log */
+		ast_log(LOG_ERROR,"Couldn't allocate receive buffers\n");
+		/* end */
+		goto rtsp_play_clean;
+	}
+	buffer = bufferMem + AST_FRIENDLY_OFFSET;
+	buffer[0] = 0;
+	sipBuffer[0] = 0;
+
+	/* [v2.1] Frame RTSP messages in buffer */
+	RtspFramerInit(&framer,buffer,bufferSize);
+
+	/* [v2.1] Media over the RTSP connection */
+	player->interleaved = opts->interleaved;
+
+	/* Connect player */
+	if (!RtspPlayerConnect(player,ip,rtsp_port,isIPv6,0))
+	{
+		/* log */
+		ast_log(LOG_ERROR,"Couldn't connect RTSP to %s:%d\n",ip,rtsp_port);
+		/* end */
+		goto rtsp_play_clean;
+	}
+
+	/* ADDED Connect sip speaker */
+	if(sip_enable){
+		if (!RtspPlayerConnect(sip_speaker,ip,sip_port,isIPv6,1))
+		{
+			/* log */
+			ast_log(LOG_ERROR,"Couldn't connect SIP Speaker to %s:%d\n",ip,sip_port);
+			/* end */
+			goto rtsp_play_clean;
+		}
+	}
+
+	/* [v2.1] Unless this camera rejected it before */
+	player->pipelined = opts->pipelined && RtspPipelineAllowed(player->hostport);
+
+	/* [v2.1] Credentials from the last call go with the first request */
+	RtspPlayerUseCachedAuth(player,"rtsp",username,password);
+	if (sip_enable)
+		RtspPlayerUseCachedAuth(sip_speaker,"sip",username,password);
+
+	/* Set arrays */
+	infds[0] = player->fd; 
+	infds[1] = player->audioRtp;
+	infds[2] = player->videoRtp;
+	infds[3] = player->audioRtcp;
+	infds[4] = player->videoRtcp;
+
+	/* ADDED more arrays for sip speaker */
+	if(sip_enable){
+		infds[5] = sip_speaker->fd; 
+		infds[6] = sip_speaker->audioRtp;
+		infds[7] = sip_speaker->videoRtp;
+		infds[8] = sip_speaker->audioRtcp;
+		infds[9] = sip_speaker->videoRtcp;
+		num_infds += 5;
+		/* [v2.1] Talkback sent on the pacer clock */
+		if (opts->pacedTalkback)
+		{
+			if ((pacer = TalkbackPacerCreate(opts->paceDepth,sip_speaker->audioRtp)))
+				infds[num_infds++] = ast_timer_fd(pacer->timer);
+			else
+				ast_log(LOG_WARNING,"Couldn't open a timer for the talkback pacer, sending as read\n");
+		}
+	}
+
+	/* [v2.1] Shared pull is woken up when the last subscriber leaves */
+	if (share)
+		infds[num_infds++] = share->wake[0];
+
+	/* [v2.1] Known camera: skip DESCRIBE and go to SETUP */
+	snprintf(sdpKey,sizeof(sdpKey),"%s:%d%s",ip,rtsp_port,url);
+	if ((sdpEntry = SdpCacheGet(sdpKey,nativeCap)))
+	{
+		sdp		= sdpEntry->sdp;
+		audioFormat	= sdpEntry->choice.audioFormat;
+		audioNewFormat	= sdpEntry->choice.audioNewFormat;
+		audioControl	= sdpEntry->choice.audioControl;
+		videoFormat	= sdpEntry->choice.videoFormat;
+		videoNewFormat	= sdpEntry->choice.videoNewFormat;
+		videoControl	= sdpEntry->choice.videoControl;
+		sdpCached = mediaChosen = 1;
+		ast_debug(2,"-sdp cache hit for %s, skipping describe\n",url);
+	}
+
+	/* Send RTSP REQUEST */
+	if (!sdpCached && !RtspPlayerDescribe(player,url))
+	{
+		/* log */
+		ast_log(LOG_ERROR,"Couldn't handle DESCRIBE in %s\n",url);
+		/* end */
+		goto rtsp_play_end;
+	}
+
+	/* ADDed. Send SIP OPTIONS */
+	if(sip_enable){
+		if (!SipSpeakerOptions(sip_speaker,username))
+		{
+			/* log */
+			ast_log(LOG_ERROR,"Couldn't formulate/send SIP Options\n");
+			/* end */
+			goto rtsp_play_end;
+		}
+	}
+
+	/* malloc frame & data */
+     /*	sendFrame = (struct ast_frame *) malloc(PKT_SIZE); OLD */
+     /*	sendFrame = (struct ast_frame *) ast_malloc(PKT_SIZE);  PORT 17.3. New malloc scheme. OLD */
+
+	/* Set data pointer */
+     /*	rtpBuffer = (unsigned char*)sendFrame + PKT_OFFSET; OLD */
+     /*	rtpBuffer = (char*)(sendFrame + PKT_OFFSET);    PORT 17.3. fix compiler warning; signedness of sendFrame */
+     /*	rtpBuffer = (uint8_t*)(FrameBuffer + AST_FRIENDLY_OFFSET); PORT 17.5. Restructuring sendFrame */
+
+	/* [v2.1] Packet slots. The jitter buffer holds on to up to JB_SLOTS more */
+	if (!(pool = FramePoolCreate(FRAME_POOL_SLOTS + (opts->jitterBuffer ? JB_SLOTS : 0))))
+	{
+		/* log */
+		ast_log(LOG_ERROR,"Couldn't allocate rtp frame pool\n");
+		/* end */
+		goto rtsp_play_clean;
+	}
+
+	/* [v2.1] Batched ingest slots */
+	if (opts->batchIngest && !(ingest = RtpIngestCreate(pool)))
+		ast_log(LOG_WARNING,"Couldn't allocate batched rtp ingest, using one recv per packet\n");
+
+	/* [v2.1] Audio jitter buffer */
+	if (opts->jitterBuffer && !(builder.jb = JitterBufferCreate(pool,opts->jbMin,opts->jbMax,opts->jbTarget)))
+		ast_log(LOG_WARNING,"Couldn't allocate jitter buffer, writing audio in arrival order\n");
+
+	/* [v2.1] Channel writes off the receive path. Always on a reactor, its threads serve other sessions too */
+	if (chan && (opts->channelWriter || (media_reactor_count && !player->interleaved))
+	    && !(builder.writer = ChannelWriterStart(chan)))
+		ast_log(LOG_WARNING,"Couldn't start channel writer, writing inline\n");
+
+	/* [v2.1] Rtp/rtcp to the reactor if there is one, this thread keeps RTSP, channel and timers */
+	MediaSessionInit(&media,player,&builder,pool,ingest,&audioRtcpSession,&videoRtcpSession);
+	if (!player->interleaved && (!chan || builder.writer) && MediaReactorAttach(&media))
+	{
+		/* Only told when the session ends */
+		infds[1] = media.wake[0];
+		infds[2] = infds[3] = infds[4] = -1;
+	}
+
+	/* log */
+     /*	ast_log(LOG_DEBUG,"-rtsp play loop [%d]\n",duration); OLD */
+	ast_debug(2,"-rtsp play loop [%d]\n",duration);
+
+	/* Loop */
+	while(!player->end)
+	{
+		/* [v2.1] SDP known and media chosen, from DESCRIBE or the cache */
+		if (mediaChosen)
+		{
+			mediaChosen = 0;
+			/* Log formats */
+		   /*	ast_log(LOG_DEBUG,"-Set write format [%x,%x,%x]\n",\
+		    	 	audioFormat | videoFormat, audioFormat, videoFormat); OLD */
+			ast_debug(4,"-Set write format [%x,%x,%x]\n",\
+				audioFormat | videoFormat, audioFormat, videoFormat);
+
+			/* Set write format */
+			/* PORT 17.3 move ast_set_write_format further down and use new formats */
+		     /*	ast_set_write_format(chan, audioFormat | videoFormat);	OLD. */ 
+
+			/* [v2.1] Hand chosen formats to the frame builder */
+			MediaSessionLock(&media);
+			RtpFrameBuilderSetFormats(&builder,audioFormat,audioNewFormat,videoFormat,videoNewFormat);
+			if (builder.jb)
+				JitterBufferSetRate(builder.jb,RtpClockRate(audioNewFormat));
+			/* [v2.1] Jitter in RR is in timestamp units */
+			MediaStatsSetRate(&player->audioStats,RtpClockRate(audioNewFormat));
+			MediaSessionUnlock(&media);
+
+			ast_debug(3, "-Set write format on channel %s:\n",chanName); /*ADD*/
+
+			/* [v2.1] Calls that can't take these formats get their own session */
+			if (share)
+				RtspShareSetMedia(share, audioControl ? audioNewFormat : NULL, videoControl ? videoNewFormat : NULL);
+
+			/* if audio track */
+			if (audioControl)
+			{
+				/* Open audio */
+			        /* Set write format. PORT17.3 Moved from above to here */
+				ast_debug(1, "  for %s\n ",ast_format_get_name(audioNewFormat)); /*ADD*/
+				if (chan)
+					ast_set_write_format(chan, audioNewFormat);
+				else /* [v2.1] each subscriber sets it on its own channel */
+					RtspShareSetFormat(share, audioNewFormat);
+				RtspPlayerSetupAudio(player,audioControl);
+
+				/* [v2.1] Codec is known, get SIP going alongside */
+				if (sip_enable && opts->earlySip && !sipStarted)
+				{
+					sipStarted = 1;
+					ast_debug(2,"-early sip invite\n");
+					if (!SipSpeakerStart(sip_speaker,username,audioFormat,opts,nativeCap))
+						ast_log(LOG_ERROR,"Couldn't formulate/send INVITE\n");
+				}
+			} else if (videoControl) {
+				/* Open video */
+				/* Set write format. PORT 17.3 Moved from above to here to use new format*/
+				/*ADD. if there is no compatible video format then skip write*/
+				if(videoNewFormat){ 
+					ast_debug(1, "  for %s\n ",ast_format_get_name(videoNewFormat)); /*ADD*/
+					if (chan)
+						ast_set_write_format(chan, videoNewFormat);
+					else /* [v2.1] */
+						RtspShareSetFormat(share, videoNewFormat);
+		 			RtspPlayerSetupVideo(player,videoControl);
+				}
+			} else {
+				/* log */
+				ast_log(LOG_ERROR,"No media found\n");
+				/* end */
+				player->end = 1;
+				/* exit */
+				continue;
+			}
+		}
+
+		/* No output */
+		outfd = -1;
+		/* If the playback has started */
+		if (!ast_tvzero(tv))
+		{
+			/* Get playback time */
+			elapsed = ast_tvdiff_ms(ast_tvnow(),tv); 
+			/* Check how much time have we been playing */
+			if (elapsed>=duration)
+			{
+				/* log */
+			     /*	ast_log(LOG_DEBUG,"Playback finished\n"); OLD */
+				ast_debug(2,"Playback finished\n");
+				/* exit */
+				player->end = 1;
+				/* Exit */
+				break;
+			} else {
+				/* Set timeout to remaining time*/
+				ms = duration-elapsed;
+			}
+		} else {
+			/* 4 seconds timeout */
+			ms = 4000;
+		}
+
+		/* [v2.1] Wake up for the next RTCP report and keepalive */
+		MediaSessionLock(&media);
+		if (player->state==RTSP_PLAYING || player->state==RTSP_READY)
+		{
+			if (RtcpSessionNext(&audioRtcpSession)<ms)
+				ms = RtcpSessionNext(&audioRtcpSession);
+			if (RtcpSessionNext(&videoRtcpSession)<ms)
+				ms = RtcpSessionNext(&videoRtcpSession);
+			keepaliveMs = player->sessionTimeout*1000/2-ast_tvdiff_ms(ast_tvnow(),keepalivetv);
+			if (keepaliveMs<ms)
+				ms = keepaliveMs>0 ? keepaliveMs : 0;
+		}
+
+		/* [v2.1] Wake up for the next talkback sender report */
+		if (enable_sip_tx && RtcpSessionNext(&sipRtcpSession)<ms)
+			ms = RtcpSessionNext(&sipRtcpSession);
+
+		/* [v2.1] Wake up for the next jitter buffer tick */
+		if (builder.jb && player->state==RTSP_PLAYING && JitterBufferNext(builder.jb)<ms)
+			ms = JitterBufferNext(builder.jb);
+		MediaSessionUnlock(&media);
+
+		/* PORT17.3
+		 * ast_waitfor_nandfds can return NULL if timedout, so tweaking the logic to handle it.
+		 * returns NULL if channel has nothing, outfd < 0 if no active infds 
+		 *    (note: active channel overrides active fd). ms returns=0 if no active infds.
+		 */
+		/* Read from channel and fds */
+		outfd = -1;
+		errno = 0;
+		struct ast_channel *rchan;
+	     /*	if (ast_waitfor_nandfds(&chan,1,infds,10,NULL,&outfd,&ms))  CHANGE fd num from 5 to 10 */
+		rchan = ast_waitfor_nandfds(&chan,chan?1:0,infds,num_infds,NULL,&outfd,&ms); /* CHANGE Handle Null return. var num of fds. [v2.1] no channel in a shared pull */
+		if(rchan == NULL && outfd <0 && ms){
+			if (errno == 0 || errno == EINTR)
+				ast_log(LOG_WARNING, "ast_waitfor_nandfds() failed (%s)\n", strerror(errno));
+		}
+		if(rchan !=NULL && outfd <0) /* Channel active */
+		{
+			/* Read frame */
+			f = ast_read(chan);
+
+			/* If failed */
+			if (!f) {
+				ast_log(LOG_ERROR, "ast_read() failed. Bail out!\n"); /* ADDED */
+				/* exit */
+				break;
+			}	
+			/* If it's a control channel */
+			if (f->frametype == AST_FRAME_CONTROL) 
+			{
+				/* Check for hangup */
+
+				/* PORT 17.3
+				 * from frame.h
+				 * struct ast_frame *f
+				 *   struct ast_frame_subclass subclass 
+				 *     int integer
+				 *     struct ast_format *format
+				 *     unsigned int frame_ending
+				 * Most of the app_xxx code uses: f->subclass.integer == AST_CONTROL_HANGUP.
+				 * So apparently subclass.integer is to be used with 
+				 * enum ast_control_frame_type{AST_CONTROL_HANGUP}
+				 */
+			     /*	if (f->subclass == AST_CONTROL_HANGUP) OLD */
+				if (f->subclass.integer == AST_CONTROL_HANGUP) /* PORT 17.3 */
+				{
+					/* log */
+				     /*	ast_log(LOG_DEBUG,"-Hangup\n"); OLD*/
+					ast_debug(2,"-Hangup\n");
+					/* exit */
+					player->end = 1;
+				}
+				
+			 /* If it's a dtmf */
+			} else if (f->frametype == AST_FRAME_DTMF) {
+				char dtmf[2];
+				/* Get dtmf number */
+
+				/* PORT 17.3 app_meetme.c uses this same subclass.integer
+				 * if (f->frametype == AST_FRAME_DTMF)  
+				 *         dtmfstr[0] = f->subclass.integer;
+				 *         dtmfstr[1] = '\0';
+				 */
+			     /*	dtmf[0] = f->subclass; OLD */
+				dtmf[0] = f->subclass.integer; /* PORT 17.3 */
+				dtmf[1] = 0;
+
+				/* Check for dtmf extension in context */
+
+				/* PORT 17.3                                                          
+				 * chan->context has been replaced with                                
+				 *   const char *ast_channel_context(const struct ast_channel *chan)   
+				 *   which returns chan->context                                       
+				 */
+
+			     /*	if (ast_exists_extension(chan, chan->context, dtmf, 1, NULL))  OLD  */
+				if (ast_exists_extension(chan, ast_channel_context(chan), dtmf, 1, NULL)) { /* PORT 17.3 */
+					/* Set extension to jump */
+				     /*	res = f->subclass; was */
+					res = f->subclass.integer;
+					/* Free frame */
+					ast_frfree(f);
+					/* exit */
+					goto rstp_play_stop;
+				}
+			} else if (f->frametype == AST_FRAME_VOICE && sip_enable ) { /*ADDED. SIP.*/
+				int no_room_err =- 1;
+
+			     /*	if(enable_sip_tx == 0) Start Voice Tx after SIP INVITE is OK'd */
+				if(enable_sip_tx == 0 || player->state!=RTSP_PLAYING) /* [v2.1] and the camera is playing */
+					pre_enable_vf_tx_count++; /* count num of Frames tossed before SIP INVITE is OK'd */
+				else {
+					post_enable_vf_tx_count++;/* count num of Frames sent after SIP INVITE is OK'd */
+
+					/* check to see if AST FRAME has enough room for RTP Header */
+				     /*	if(f->offset >= sizeof(struct RtpHeader)){ [v2.1] header has its own buffer, any offset goes */
+					/* [v2.1] Only the answered codec, L16 byte swapped on a copy */
+					if (ast_format_cmp(f->subclass.format,ast_format_compatibility_bitfield2format(sipCodecs[sipCodec].format))==AST_FORMAT_CMP_NOT_EQUAL)
+						sip_tx_error_count++;
+					else if ((sipFrame = sipCodecs[sipCodec].byteSwap ? ast_frdup(f) : f)) {
+						if (sipFrame!=f)
+							ast_frame_byteswap_be(sipFrame);
+						no_room_err = 0;
+
+					     /*	sip_rtp = f->data.ptr - sizeof(struct RtpHeader); rtp header starts here. [v2.1] the frame is not written */
+						/* [v2.1] One SSRC, random seq/ts, marker per talkspurt */
+						RtpSenderStamp(&sipSender,&sip_rtp,sipFrame);
+#if 0 /* [v2.1] a new SSRC every packet and seq/ts from frame counters, replaced by RtpSenderStamp() */
+						sip_rtp->version = 2;
+						sip_rtp->p=0;
+						sip_rtp->x=0;
+						sip_rtp->cc=0;
+						/* Set Marker on first frame only */
+						if( post_enable_vf_tx_count == 1)
+							sip_rtp->m=1;
+						else
+							sip_rtp->m=0;
+						sip_rtp->pt= sip_sdp->audio->formats[0]->payload; /* Payload Type */
+
+						/*RFC3550 p14 says start seq num w. random number.
+						 * pre_enable_vf_tx_count is somewhat random as the number of packets tossed
+						 * before SIP INVITE is OK'd is just that. RTP Header:Seq num is 16b 
+						 */
+						sip_rtp->seq = htons(pre_enable_vf_tx_count+post_enable_vf_tx_count); 
+
+						/* RFC3550 p14.  RTP Header:Timestamp is 32b.
+						 * For fixed rate codecs, TS increments by number of samples since last time.
+						 * Assume for now that the audio codes are fixed-rate (8Khz).
+						 */
+						sip_rtp->ts=htonl(sip_prev_samples);
+
+						/* RFC3550 p16. SSRC Should be random. Do the same thing 
+						 * that MediaStatsRR() did. 
+						 */
+					     /* sip_rtp->ssrc=htonl(((unsigned int)&sip_speaker->audioStats)); */
+						sip_rtp->ssrc= htonl((uint32_t)random()); /* PORT 17.5 fix compiler complaint */
+
+						sip_prev_samples = sip_prev_samples + f->samples;
+#endif
+
+						if( post_enable_vf_tx_count == 1){
+							ast_debug(3,"-vf_frame datalen:%i\n",f->datalen);
+							ast_debug(3,"-vf_frame samples:%i\n",f->samples);
+							ast_debug(3,"-vf_frame offset:%i\n",f->offset);
+							ast_debug(3,"-Offset room error check:%i\n",no_room_err);
+						}
+
+						/* [v2.1] Queue for the pacer clock */
+						if (pacer) {
+							TalkbackPacerPush(pacer,&sip_rtp,sipFrame);
+						} else {
+						/* Send rtp packet */
+						int num_bytes_sent;
+						errno = 0;
+					     /*	num_bytes_sent = send(sip_speaker->audioRtp, sip_rtp,\
+								      sizeof(struct RtpHeader)+f->datalen, 0); [v2.1] header and payload gathered */
+						num_bytes_sent = RtpSendFrame(&media,sip_speaker->audioRtp,&sip_rtp,sipFrame);
+						if(num_bytes_sent == -1)
+							sip_tx_error_count++;
+						}
+						/* [v2.1] Swapped copy */
+						if (sipFrame!=f)
+							ast_frfree(sipFrame);
+					}
+
+				} 
+			}
+
+			/* free frame */
+			ast_frfree(f);
+		} else if (outfd>=0 && outfd==player->fd) { /* outfd >0 */
+			/*
+			 * [v2.1] Read into buffer once here for every state. With interleaved
+			 * transport, pull media frames out first; the state machine only runs
+			 * when a complete RTSP message is at the front, and runs again for
+			 * every other one that came in with the same read.
+			 */
+			if (RtspFramerRecv(&framer,player->fd,&buffer,&bufferLen,&player->end))
+			while (!player->end)
+			{
+			/* Media in front */
+			if (player->interleaved && !RtspInterleavedDemux(player,&framer,&buffer,&bufferLen,&builder,&audioRtcpSession,&videoRtcpSession))
+				/* Nothing for the state machine */
+				break;
+			/* Wait for the rest of the message */
+			if ((messageLen=RtspFramerNext(&framer,buffer,bufferLen))<=0)
+			{
+				/* Can't ever fit */
+				if (messageLen<0)
+					player->end = 1;
+				break;
+			}
+			messageConsumed = framer.consumed;
+			/* Depending on state */	
+		     /*	switch (player->state) [v2.1] pipelined responses by CSeq */
+			switch (RtspPlayerResponseState(player,&framer.index,framer.headerLen,&pipelinedResponse))
+			{
+				case RTSP_DESCRIBE:
+					/* log */
+				     /*	ast_log(LOG_DEBUG,"-Receiving describe\n"); OLD */
+					ast_debug(2,"-rx describe response\n");
+					/* Read into buffer */
+				     /*	if (!RecvResponse(player->fd,buffer,&bufferLen,bufferSize,&player->end))
+						break; [v2.1] read before the switch */
+			              //ast_debug(5,"bufferLen: %i\n%s",bufferLen,buffer);
+					ast_debug(3, "\n%s\n",buffer); 
+
+					/* Check for response code */
+					responseCode = GetResponseCode(buffer,bufferLen,0);
+
+				     /*	ast_log(LOG_DEBUG,"-Describe response code [%d]\n",responseCode); OLD */
+					ast_debug(3,"-describe response code [%d]\n",responseCode);
+
+					/* Check unathorized */
+					if (responseCode==401)
+					{
+						/* Check athentication method */
+
+                                                /* [v2.0]  Adding new way of detecting authentication method */
+					        ast_debug(3,"  describe 401 Processing\n");
+						/* [v2.1] Basic/Digest detection moved to RtspPlayerAuthenticate(), SETUP uses it too */
+						char uri[256];
+						sprintf(uri,"rtsp://%s%s", player->hostport, url);
+						if (RtspPlayerAuthenticate(player,&framer.index,username,password,"DESCRIBE",uri))
+						{
+							/* Send again the describe */
+							RtspPlayerDescribe(player,url);
+							/* Enter loop again */
+							break;
+						}
+						/* End */
+						player->end = 1;
+						/* Exit */
+						break;
+#ifdef OLD_AUTH_SCHEME
+						/* 
+						 * PORT 17.3.  The Basic Realm header format may be device dependent.
+						 * Original code did not work for my cameras.
+						 */
+					      //if (CheckHeaderValue(&framer.index,"WWW-Authenticate","Basic realm=\"/\"")) */
+				                if (CheckHeaderValue(&framer.index,"WWW-Authenticate","Basic realm="))
+						{
+							/* Create Basic authentication header */
+							RtspPlayerBasicAuthorization(player,username,password);
+							/* Send again the describe */
+							RtspPlayerDescribe(player,url);
+							/* Enter loop again */
+							break;
+						} else {
+							/* Error */
+					              //ast_log(LOG_ERROR,"-No Authenticate header found\n");	
+							ast_log(LOG_ERROR,"-No Basic Authentication found for RTSP (Digest Auth not yet supported).\n");	
+							/* End */
+							player->end = 1;
+							/* Exit */
+							break;
+						}
+#endif
+					}
+
+					/* On any other erro code */
+					if (responseCode<200 || responseCode>299)
+					{
+						/* End */
+						player->end = 1;
+						/* Exit */
+						break;
+					}
+
+					/* If not reading content */
+					if (contentLength==0)
+					{
+						/* Search end of response */
+						if ( (responseLen=framer.headerLen) == 0 )
+							/*Exit*/
+							break;
+
+						ast_debug(5, "ResponseLen: %i\n",responseLen); /*tjl*/
+						/* Does it have content */
+						contentLength = GetHeaderValueInt(&framer.index,"Content-Length");	
+						ast_debug(5, "contentLength: %i\n",contentLength); /*tjl*/
+						/* Is it sdp */
+						if (!CheckHeaderValue(&framer.index,"Content-Type","application/sdp"))
+						{
+							/* log */
+							ast_log(LOG_ERROR,"Content-Type unknown\n");
+							/* End */
+							player->end = 1;
+							/* Exit */
+							break;
+						}
+						/* [v2.1] Consume it */
+						RtspFramerConsume(&framer,&buffer,&bufferLen,responseLen);
+					}
+					
+					/* If there is not enough data */	
+					if (bufferLen<contentLength) 
+						/* break */
+						break;
+
+					/* Create SDP */
+#ifdef TEST_BUFFER
+					sdp = CreateSDP(buffer,bufferLen,sip_enable); 
+#else
+					sdp = CreateSDP(buffer,contentLength,sip_enable);
+#endif
+					/* [v2.1] Consume it */
+					RtspFramerConsume(&framer,&buffer,&bufferLen,contentLength);
+					/* Reset content */
+					contentLength = 0;
+
+					/* If not sdp */
+					if (!sdp)
+					{
+						/* log */
+						ast_log(LOG_ERROR,"Couldn't parse SDP\n");
+						/* end */
+						player->end = 1;
+						/* exit */
+						break;
+					}
+					ast_debug(4,"Successfully parsed SDP\n"); /* ADDED */
+
+					/* PORT TO 17.3     
+					 * Formats of media has been restructured to be ast_format_cap instead of bit list:
+					 * - chan->nativeformats has been replaced with
+					 *     ast_channel_nativeformats(const struct ast_channel *chan)  @channel_internal.c
+					 *     which returns chan->nativeformats (ptr to struct ast_format_cap) 
+					 * - Can convert to strings using ast_format_cap_get_names(). 
+					 *     See app_dumpchan.c for example.
+					 *   Note: ast_str_alloca uses memory from the stack.
+					 */
+				     /*	ast_log(LOG_DEBUG,"-Finding compatible codecs [%x]\n", chan->nativeformats); OLD */
+					struct ast_str *format_buf = ast_str_alloca(AST_FORMAT_CAP_NAMES_LEN);
+					ast_debug(4,"-Finding compatible codecs [%s]\n", \
+						  ast_format_cap_get_names(nativeCap, &format_buf));
+					/* Get best audio track */
+					if (0)//sdp->audio) // FIXME disable audio from camera for now
+					{
+						/* Avoid overwritten */
+
+						/* PORT 17.3 
+						 * Formats of media have been restructured to be ast_format 
+						 * instead of a bit in a bit list. 
+						 * Formats are contained in a list of capabilities 
+						 *     ast_format_cap instead of bit list.
+						 *  Note: Capabilities: ast_format_cap is a vector structure 
+						 *     list of formats and pref order .
+						 * - Go through the sdp->audio->all bitlist and create a ast_format for each
+						 *     and add to ast_format_cap list.
+						 * - ast_translator_best_choice() has been rewritten 
+						 *     for this scheme (and it added other things too ).
+						 * Reference some of the code from channel.c for this.
+						 */
+						struct ast_format_cap *sdp_cap;
+						struct ast_format_cap *chan_native_cap;
+
+						/* COMMENT on memory:
+						 * RAII_VAR w. ao2_cleanup: allocs memory 
+						 * but when out of scope will self-destruct 
+						 */
+						RAII_VAR(struct ast_format *, sdp_fmt, NULL, ao2_cleanup);
+						RAII_VAR(struct ast_format *, best_sdp_fmt, NULL, ao2_cleanup);
+						RAII_VAR(struct ast_format *, best_native_fmt, NULL, ao2_cleanup);
+
+						/* COMMENT on memory
+						 * ast_format_cap_alloc allocs memory
+						 * and is freed w. ao2_cleanup 
+						 */
+						sdp_cap = ast_format_cap_alloc(AST_FORMAT_CAP_FLAG_DEFAULT); 
+
+                                                /* 
+						 * PORT 17.3, 
+						 * go thru entire SDP->audio->formats 
+						 * (instead of SDP->audio-all bitlist).  
+						 */
+						for (i=0;i<sdp->audio->num;i++)
+						{
+							sdp_fmt = sdp->audio->formats[i]->new_format;
+							/* append to sdp capability list */
+							if (sdp_fmt) /* [v2.1] dynamic payload type without rtpmap */
+								ast_format_cap_append(sdp_cap,sdp_fmt,0); 
+						}
+						/* PORT 17.3, get the best sdp media from the sdp learned media list. */
+						best_sdp_fmt = ast_format_cap_get_best_by_type(sdp_cap, AST_MEDIA_TYPE_AUDIO);
+
+						/* 
+						 * PORT 17.3 
+						 * - ast_channel_nativeformats(const struct ast_channel *chan)  
+						 *   (See channel_internal.c as an example).
+						 *   returns pointer to ast_format_cap. (See @format_cap.c line54 )
+						 * I have no idea about ORing AMRNB.  So will remove for now.
+						 */
+					     /*	int best = chan->nativeformats | AST_FORMAT_AMRNB; OLD */
+						/* COMMENT: ast_channel_nativeformats() returns chan->nativeformats */
+						chan_native_cap = nativeCap; /* [v2.1] first caller's in a shared pull */
+
+						/* ADD. Not likely to happen but keep as a check*/
+						if(ast_format_cap_empty(chan_native_cap)) 
+							ast_debug(1, "No native codec for audio on channel %s\n",\
+								  chanName); 
+
+						/* Get best codec format for audio */
+
+						/* PORT 17.3 Reworked this to accomodate new format structures 
+						 * and new capabilities structures. 
+						 * Assume that the legacy code intent is that given media 
+						 * capabilities of the channel, and media capabilities 
+						 * learned from SDP, determine what is the best media for the channel.
+						 *
+						 * New API is  ast_translator_best_choice(
+						 *                 struct ast_format_cap *dst_cap, 
+						 *                 struct ast_format_cap *src_cap,
+						 *                 struct ast_format **dst_fmt_out,
+						 *                 struct ast_format **src_fmt_out)               
+						 *
+						 * Assume the source is sdp, and destination is the channel.
+						 * dst_cap: ast_channel_nativeformats is already a struct ast_format_cap 
+						 * src_cap: sdp->audio->all is an int which 
+						 *          legacy sdp used as a bit list of AST_FORMAT_xxx 
+						 *          but this was reworked above for new media capabilities: sdp_cap.
+						 * src_fmt_out:  finally, we'll use the best sdp format as the source format, 
+						 * dst_cap: let the algorithm determine the best 
+						 *          destination format: best native format.
+						 */
+					     /*	ast_translator_best_choice(&best, &sdp->audio->all); OLD */
+						ast_translator_best_choice(chan_native_cap, sdp_cap, &best_native_fmt, &sdp_fmt);
+
+					     /*	ast_log(LOG_DEBUG,"-Best codec for audio [%x]\n", best); OLD */
+						ast_debug(4, "-Best codec for audio on channel %s is format %s\n", 
+							chanName, ast_format_get_name(best_native_fmt));
+                                                
+						ao2_cleanup(sdp_cap); /* free up sdp_cap allocd memory */
+
+						/* Get first matching format */
+						for (i=0;i<sdp->audio->num;i++)
+						{
+							/* log */
+						     /*	ast_log(LOG_DEBUG,"-audio [%x,%d,%s]\n",\
+						       	        sdp->audio->formats[i]->format,\
+						       	        sdp->audio->formats[i]->payload ,
+						       	        sdp->audio->formats[i]->control); OLD */
+							/* PORT 17.5 fix for format now unsigned long long */
+							ast_debug(4,"-audio [%"PRIx64",%d,%s]\n",\
+								sdp->audio->formats[i]->format,\
+							       	sdp->audio->formats[i]->payload,\
+								sdp->audio->formats[i]->control);
+
+							/* if we have that */
 							/* PORT 17.3 Use new media format */
 						     /* if (sdp->audio->formats[i]->format == best) OLD */
 							if(ast_format_cmp(sdp->audio->formats[i]->new_format, \
 									best_native_fmt) == AST_FORMAT_CMP_EQUAL )
 							{
-								/* Store type */
-								audioType = sdp->audio->formats[i]->payload;
-								/* PORT 17.3 compiler warns audioType not used, so use it */
-								if(audioType){ 
-									ast_debug(1, "-audioType is %i\n", audioType );
-								}
-								/* Store format */
-								audioFormat = sdp->audio->formats[i]->format;
-								audioNewFormat = sdp->audio->formats[i]->new_format; /* PORT 17.3 add */
-								/* Store control */
-								audioControl = sdp->audio->formats[i]->control;
-								/* Found best codec */
-								ast_debug(4,"-Found best audio codec\n");
-								/* Got a valid one */
-								break;
+								/* Store type */
+								audioType = sdp->audio->formats[i]->payload;
+								/* PORT 17.3 compiler warns audioType not used, so use it */
+								if(audioType){ 
+									ast_debug(1, "-audioType is %i\n", audioType );
+								}
+								/* Store format */
+								audioFormat = sdp->audio->formats[i]->format;
+								audioNewFormat = sdp->audio->formats[i]->new_format; /* PORT 17.3 add */
+								/* Store control */
+								audioControl = sdp->audio->formats[i]->control;
+								/* Found best codec */
+								ast_debug(4,"-Found best audio codec\n");
+								/* Got a valid one */
+								break;
+							}
+						}
+					}
+
+					/* Get best video track */
+					if (sdp->video)
+						/* Get first matching format */
+						for (i=0;i<sdp->video->num;i++)
+						{
+							/* log */
+						    /*	ast_log(LOG_DEBUG,"-video [%x,%d,%s]\n",\
+						      	        sdp->video->formats[i]->format,\
+						      	        sdp->video->formats[i]->payload,\
+						      	        sdp->video->formats[i]->control); OLD */
+							/* PORT 17.3 fix for format now unsigned long long */
+							ast_debug(4,"-video [%"PRIu64",%d,%s]\n",\
+								sdp->video->formats[i]->format,\
+								sdp->video->formats[i]->payload ,\
+								sdp->video->formats[i]->control); 
+
+							/* if we have that */
+							/* PORT 17.3
+							 * It appears here it is taking the list of rtsp 
+							 * learned media and comparing with the media 
+							 * supported natively by the channel and the 
+							 * first one it finds a match on, 
+							 * will stop the search and declare it the best.
+							 * We'll do something similar by checking 
+							 * to see if rtsp learned media is in the 
+							 * capabilities list of the channel:
+							 *    Returning NULL if not  
+							 *    Otherwise returns a compatible media.
+							 */
+						     /*	if (sdp->video->formats[i]->format & chan->nativeformats) OLD */
+							struct ast_format *video_compat_format;
+							video_compat_format = \
+								ast_format_cap_get_compatible_format(nativeCap,\
+									sdp->video->formats[i]->new_format);
+							if (video_compat_format)
+							{
+								/* Store type */
+								videoType = sdp->video->formats[i]->payload;
+								/* PORT 17.3 compiler warns videoType not used, so use it */
+								if(videoType){ 
+									ast_debug(1, "-videoType is %i\n", videoType );
+                                                                }
+								/* Store format */
+								videoFormat = sdp->video->formats[i]->format;
+								//videoNewFormat = video_compat_format; /* PORT 17.3 */
+								videoNewFormat = sdp->video->formats[i]->new_format; /* PORT 17.3 */
+								/* Store control */
+								videoControl = sdp->video->formats[i]->control;
+								/* Found best codec */
+								ast_debug(4,"Found best video codec\n");
+								/* Got a valid one */
+								break;
+							}
+							else /*ADD */
+								ast_log(LOG_WARNING,\
+									"No compatible format found for Video on channel\n");
+						}
+
+					/* [v2.1] Remember sdp and choice for the next call */
+					choice.audioFormat	= audioFormat;
+					choice.audioNewFormat	= audioNewFormat;
+					choice.audioControl	= audioControl;
+					choice.videoFormat	= videoFormat;
+					choice.videoNewFormat	= videoNewFormat;
+					choice.videoControl	= videoControl;
+					if (audioControl || videoControl)
+						sdpEntry = SdpCachePut(sdpKey,sdp,nativeCap,&choice);
+
+					/* [v2.1] Formats and SETUP moved to the top of the loop, shared with a cache hit */
+					mediaChosen = 1;
+					break;
+				case RTSP_SETUP_AUDIO:
+					/* log */
+				     /*	ast_log(LOG_DEBUG,"-Recv audio response\n"); OLD */
+					ast_debug(2,"-rx rtsp setup for audio response\n");
+					/* Read into buffer */
+				     /*	if (!RecvResponse(player->fd,buffer,&bufferLen,bufferSize,&player->end))
+						break; [v2.1] read before the switch */
+					ast_debug(3, "\n%s\n",buffer); //Added [v2.0]
+					/* Search end of response */
+					if ( (responseLen=framer.headerLen) == 0 )
+						/*Exit*/
+						break;
+
+					/* [v2.1] Check response code, DESCRIBE may have been skipped */
+					responseCode = GetResponseCode(buffer,responseLen,0);
+					if (responseCode==401)
+					{
+						/* Consume it */
+						RtspPlayerControlUri(player,audioControl,controlUri,sizeof(controlUri));
+						temp = RtspPlayerAuthenticate(player,&framer.index,username,password,"SETUP",controlUri);
+						/* [v2.1] Consume it */
+						RtspFramerConsume(&framer,&buffer,&bufferLen,messageLen);
+						/* Send again the setup */
+						if (temp)
+							RtspPlayerSetupAudio(player,audioControl);
+						else
+							player->end = 1;
+						break;
+					}
+					if (responseCode<200 || responseCode>299)
+					{
+						/* log */
+						ast_log(LOG_ERROR,"Audio SETUP failed [%d]\n",responseCode);
+						/* Don't give this sdp to the next call */
+						if (sdpEntry)
+							SdpCacheInvalidate(sdpEntry);
+						/* A cached sdp may be stale: DESCRIBE again if nothing is set up yet */
+						if (sdpCached && !player->numSessions)
+						{
+							/* [v2.1] Consume it */
+							RtspFramerConsume(&framer,&buffer,&bufferLen,messageLen);
+							ao2_ref(sdpEntry,-1);
+							sdpEntry = NULL;
+							sdp = NULL;
+							audioControl = videoControl = NULL;
+							audioNewFormat = videoNewFormat = NULL;
+							audioFormat = videoFormat = 0;
+							sdpCached = 0;
+							RtspPlayerDescribe(player,url);
+							break;
+						}
+						/* end */
+						player->end = 1;
+						break;
+					}
+
+					/* Does it have content */
+					if (GetHeaderValueInt(&framer.index,"Content-Length"))
+					{
+						/* log */
+						ast_log(LOG_ERROR,"Content length not expected\n");
+						/* Uh? */
+						player->end = 1;
+						/* break */
+						break;
+					}
+					/* Get session */
+					if ( (session=HeaderIndexValue(&framer.index,"Session",&sessionLen)) == 0)
+					{
+						/* log */
+						ast_log(LOG_ERROR,"No session [%s]\n",buffer);
+						/* Uh? */
+						player->end = 1;
+						/* break */
+						break;
+					}
+					/* Append session to player */
+					RtspPlayerAddSession(player,session,sessionLen);
+					/* Get transport value to obtain rtcp ports */
+					if ((transport=HeaderIndexValue(&framer.index,"Transport",&transportLen)) == 0)
+					{
+						/* log */
+						ast_log(LOG_ERROR,"No transport [%s]\n",buffer);
+						/* Uh? */
+						player->end = 1;
+						/* break */
+						break;
+					}
+					/* Process transport */
+					RrspPlayerSetAudioTransport(player,transport,transportLen);
+					/* [v2.1] Consume it */
+					RtspFramerConsume(&framer,&buffer,&bufferLen,messageLen);
+					/* If video control */
+					if (videoControl){
+						/* Set up video */
+						/* ADD. If there is no compatible video format then skip video setup*/
+						if(videoNewFormat) 
+						{
+							/* [v2.1] Session known, PLAY can go right behind the SETUP */
+							if (player->pipelined && !(share && share->warm))
+							{
+								RtspPlayerExpect(player,RTSP_SETUP_VIDEO);
+			 					RtspPlayerSetupVideo(player,videoControl);
+								RtspPlayerExpect(player,RTSP_PLAY);
+								RtspPlayerPlay(player);
+							} else
+			 					RtspPlayerSetupVideo(player,videoControl);
+						}
+					}
+					else if (share && share->warm) {
+						/* [v2.1] Warm session, hold PLAY until a call claims it */
+						player->state = RTSP_READY;
+						readytv = keepalivetv = ast_tvnow();
+						ast_debug(2,"-warm session ready\n");
+					}
+					else 
+					{
+						/* play */
+						RtspPlayerPlay(player);
+
+						/* 
+						 * ADDed. 
+						 * RTSP is now playing so get SIP going.
+						 * We also know which audio codec to use (see audioFormat). 
+						 */
+
+						/* Send SIP unauthorized INVITE */
+					     /*	if(sip_enable){ [v2.1] unless it went out with SETUP */
+						if(sip_enable && !sipStarted){
+							sipStarted = 1;
+							/* [v2.1] Or authorized, if the speaker challenged us before */
+							if (!SipSpeakerStart(sip_speaker,username,audioFormat,opts,nativeCap))
+							{
+								ast_log(LOG_ERROR,"Couldn't formulate/send INVITE\n");
+		                                        	/* Nothing else to do, simply don't do any more SIP stuff */
+							}
+						}
+					}
+					break;
+				case RTSP_SETUP_VIDEO:
+					/* log PORT17.3 adder*/
+				     /*	ast_log(LOG_DEBUG,"-Recv video response\n"); OLD */
+					ast_debug(2,"-Recv video response\n");
+
+					/* Read into buffer */
+				     /*	if (!RecvResponse(player->fd,buffer,&bufferLen,bufferSize,&player->end))
+						break; [v2.1] read before the switch */
+					/* Search end of response */
+					if ( (responseLen=framer.headerLen) == 0 )
+						/*Exit*/
+						break;
+
+					/* [v2.1] Check response code, DESCRIBE may have been skipped */
+					responseCode = GetResponseCode(buffer,responseLen,0);
+					/* [v2.1] Pipelined SETUP refused, redo it serially once PLAY is answered */
+					if (pipelinedResponse && (responseCode<200 || responseCode>299))
+					{
+						/* Credentials for the retry */
+						if (responseCode==401)
+						{
+							RtspPlayerControlUri(player,videoControl,controlUri,sizeof(controlUri));
+							RtspPlayerAuthenticate(player,&framer.index,username,password,"SETUP",controlUri);
+						}
+						RtspPlayerPipelineFailed(player,RTSP_SETUP_VIDEO);
+						/* [v2.1] Consume it */
+						RtspFramerConsume(&framer,&buffer,&bufferLen,messageLen);
+						break;
+					}
+					if (responseCode==401)
+					{
+						/* Consume it */
+						RtspPlayerControlUri(player,videoControl,controlUri,sizeof(controlUri));
+						temp = RtspPlayerAuthenticate(player,&framer.index,username,password,"SETUP",controlUri);
+						/* [v2.1] Consume it */
+						RtspFramerConsume(&framer,&buffer,&bufferLen,messageLen);
+						/* Send again the setup */
+						if (temp)
+							RtspPlayerSetupVideo(player,videoControl);
+						else
+							player->end = 1;
+						break;
+					}
+					if (responseCode<200 || responseCode>299)
+					{
+						/* log */
+						ast_log(LOG_ERROR,"Video SETUP failed [%d]\n",responseCode);
+						/* Don't give this sdp to the next call */
+						if (sdpEntry)
+							SdpCacheInvalidate(sdpEntry);
+						/* A cached sdp may be stale: DESCRIBE again if nothing is set up yet */
+						if (sdpCached && !player->numSessions)
+						{
+							/* [v2.1] Consume it */
+							RtspFramerConsume(&framer,&buffer,&bufferLen,messageLen);
+							ao2_ref(sdpEntry,-1);
+							sdpEntry = NULL;
+							sdp = NULL;
+							audioControl = videoControl = NULL;
+							audioNewFormat = videoNewFormat = NULL;
+							audioFormat = videoFormat = 0;
+							sdpCached = 0;
+							RtspPlayerDescribe(player,url);
+							break;
+						}
+						/* end */
+						player->end = 1;
+						break;
+					}
+
+					/* Does it have content */
+					if (GetHeaderValueInt(&framer.index,"Content-Length"))
+					{
+						/* log */
+						ast_log(LOG_ERROR,"No content length\n");
+						/* Uh? */
+						player->end = 1;
+						/* break */
+						break;
+					}
+					/* Get session if we don't have already one*/
+					if ( (session=HeaderIndexValue(&framer.index,"Session",&sessionLen)) == 0)
+					{
+						/* log */
+						ast_log(LOG_ERROR,"No session [%s]\n",buffer);
+						/* Uh? */
+						player->end = 1;
+						/* break */
+						break;
+					}
+					
+					/* Append session to player */
+					RtspPlayerAddSession(player,session,sessionLen);
+					/* Get transport value to obtain rtcp ports */
+					if ((transport=HeaderIndexValue(&framer.index,"Transport",&transportLen)) == 0)
+					{
+						/* log */
+						ast_log(LOG_ERROR,"No transport [%s]\n",buffer);
+						/* Uh? */
+						player->end = 1;
+						/* break */
+						break;
+					}
+					/* Process transport */
+					RrspPlayerSetVideoTransport(player,transport,transportLen);
+					/* [v2.1] Consume it */
+					RtspFramerConsume(&framer,&buffer,&bufferLen,messageLen);
+					//send to first (even) server port (RTP) 8000 0000 0000 0000 0000 0000
+					//FIXME this is needed to start stream, but what should this really be?
+					short rtp_start[] = {0x0080,0x0000,0x0000,0x0000,0x0000,0x0000};
+					/* [v2.1] Only UDP needs the punch through */
+					if (!player->interleaved)
+					{
+						send(player->videoRtp, &rtp_start, sizeof(rtp_start), 0);
+						/* Create rtcp packet */
+						MediaSessionLock(&media);
+						MediaStatsRR(&player->videoStats,&rtcp,player->ssrc);
+						MediaSessionUnlock(&media);
+						/* Send packet */
+					     /*	send(player->videoRtcp, &rtcp, sizeof(rtcp), 0); [v2.1] only the report */
+						send(player->videoRtcp, &rtcp, (ntohs(rtcp.common.length)+1)*4, 0);
+					}
+					/* [v2.1] Warm session, hold PLAY until a call claims it */
+					if (share && share->warm)
+					{
+						player->state = RTSP_READY;
+						readytv = keepalivetv = ast_tvnow();
+						ast_debug(2,"-warm session ready\n");
+						break;
+					}
+					/* [v2.1] PLAY is already in flight */
+					if (pipelinedResponse)
+					{
+						/* It only named the audio session */
+						if (player->numSessions>1)
+							RtspPlayerPipelineFailed(player,RTSP_PLAY);
+						break;
+					}
+					/* Play */
+					RtspPlayerPlay(player);
+					break;
+				case RTSP_PLAY:
+					/* Read into buffer */
+					ast_debug(2,"-rx rtsp play response\n");
+				     /*	if (!RecvResponse(player->fd,buffer,&bufferLen,bufferSize,&player->end))
+						break; [v2.1] read before the switch */
+					ast_debug(3, "\n%s\n",buffer); //Added [v2.0]
+					/* Search end of response */
+					if ( (responseLen=framer.headerLen) == 0 )
+						/*Exit*/
+						break;
+					/* [v2.1] Pipelined PLAY */
+					if (pipelinedResponse)
+					{
+						responseCode = GetResponseCode(buffer,responseLen,0);
+						/* Credentials for the retry */
+						if (responseCode==401)
+						{
+							snprintf(controlUri,sizeof(controlUri),"rtsp://%s%s",player->hostport,player->url);
+							RtspPlayerAuthenticate(player,&framer.index,username,password,"PLAY",controlUri);
+						}
+						if (responseCode<200 || responseCode>299)
+							RtspPlayerPipelineFailed(player,RTSP_PLAY);
+						/* Redone serially, this one doesn't count */
+						if (player->resumeState)
+						{
+							/* [v2.1] Consume it */
+							RtspFramerConsume(&framer,&buffer,&bufferLen,messageLen);
+							break;
+						}
+					}
+					/* Get range */
+					if ( (range=HeaderIndexValue(&framer.index,"Range",&rangeLen)) == 0)
+					{
+						/* No end of stream */
+						duration = -1;
+					} else {
+						/* Get end part */
+						j = memchr(range,'-',rangeLen);
+						/* Check format */
+						if (j)
+							/* Get duration */
+							duration = atof(j+1)*1000;  
+						else 
+							/* No end of stream */
+							duration = -1;
+					}
+					/* If the video has end */
+					if (duration>0)
+						/* Init counter */
+						tv = ast_tvnow();
+					/* log */
+				     /*	ast_log(LOG_DEBUG,"-Started playback [%d]\n",duration); OLD */
+					ast_debug(2,"-Started playback [%d]\n",duration);
+					/* [v2.1] Consume it */
+					RtspFramerConsume(&framer,&buffer,&bufferLen,messageLen);
+					/* Init media stats */
+					MediaSessionLock(&media);
+					MediaStatsReset(&player->audioStats);
+					MediaStatsReset(&player->videoStats);
+					/* [v2.1] Start RTCP reporting, scaled to b=AS from the SDP */
+					if (audioControl)
+						RtcpSessionInit(&audioRtcpSession,
+								player->interleaved ? player->fd : player->audioRtcp,
+								player->interleaved ? player->audioChannel+1 : -1,
+								&player->audioStats,player->ssrc,player->cname,
+								sdp && sdp->audio && sdp->audio->bandwidth ? sdp->audio->bandwidth : (sdp ? sdp->bandwidth : 0));
+					if (videoControl)
+						RtcpSessionInit(&videoRtcpSession,
+								player->interleaved ? player->fd : player->videoRtcp,
+								player->interleaved ? player->videoChannel+1 : -1,
+								&player->videoStats,player->ssrc,player->cname,
+								sdp && sdp->video && sdp->video->bandwidth ? sdp->video->bandwidth : (sdp ? sdp->bandwidth : 0));
+					/* [v2.1] Reports on the reactor ring, if there is one */
+					audioRtcpSession.media = videoRtcpSession.media = &media;
+					MediaSessionUnlock(&media);
+					/* [v2.1] Keepalive at half the session timeout */
+					keepalivetv = ast_tvnow();
+					/* Set playing state */
+					player->state = RTSP_PLAYING;
+					break;
+				case RTSP_READY: /* [v2.1] keepalive responses only */
+				case RTSP_PLAYING:
+					/* Read into buffer */
+				     /*	if (!RecvResponse(player->fd,buffer,&bufferLen,bufferSize,&player->end))
+						break; [v2.1] read before the switch */
+					/* [v2.1] Drop keepalive responses, or the buffer fills up and ends the call */
+				     /*	while (buffer[0]!='$' && (responseLen=GetResponseLen(buffer)) > 0) [v2.1] one at a time, body and all */
+					RtspFramerConsume(&framer,&buffer,&bufferLen,messageLen);
+					break;
+			}
+			/* [v2.1] Not consumed by its state (e.g. a 401 answered with a new request), drop it */
+			if (framer.consumed==messageConsumed)
+				RtspFramerConsume(&framer,&buffer,&bufferLen,messageLen);
+			/* [v2.1] Pipeline drained, redo the rejected step serially */
+			if (player->resumeState && !player->numPending && !player->end)
+			{
+				if (player->resumeState==RTSP_SETUP_VIDEO)
+					RtspPlayerSetupVideo(player,videoControl);
+				else
+					RtspPlayerPlay(player);
+				player->resumeState = 0;
+			}
+			}
+		} else if (outfd>=0 && ((outfd==player->audioRtp) ||  (outfd==player->videoRtp)) ) { /* outfd >0 */
+			/* [v2.1] Batched ingest, pool slots and frame building moved to MediaSessionRead(), the reactor runs it too */
+			MediaSessionRead(&media,outfd);
+		} else if (outfd>=0 && ((outfd==player->audioRtcp) || (outfd==player->videoRtcp))) { /* outfd >0 */
+			/* [v2.1] Read and parse in MediaSessionRead() */
+			if (!MediaSessionRead(&media,outfd))
+				/* exit*/
+				break;
+		} else if (media.reactor && outfd>=0 && outfd==media.wake[0]) { /* [v2.1] */
+			/* Drain, player->end is set */
+			if (read(media.wake[0],wakeBuffer,sizeof(wakeBuffer))<0)
+				ast_debug(3,"-media wake read failed (%s)\n",strerror(errno));
+		} else if (share && outfd>=0 && outfd==share->wake[0]) { /* [v2.1] */
+			/* Drain */
+			if (read(share->wake[0],wakeBuffer,sizeof(wakeBuffer))<0)
+				ast_debug(3,"-share wake read failed (%s)\n",strerror(errno));
+			/* [v2.1] Warm session claimed by a call */
+			if (!share->warm && player->state==RTSP_READY)
+			{
+				/* log */
+				ast_debug(2,"-warm session claimed after %ld ms\n",(long)ast_tvdiff_ms(ast_tvnow(),readytv));
+				/* play */
+				RtspPlayerPlay(player);
+			}
+			/* Last subscriber gone, tear down */
+			if (share->stop)
+			{
+				/* log */
+				ast_debug(2,"-no more subscribers, stopping shared pull\n");
+				/* exit */
+				player->end = 1;
+			}
+		} else if (sip_speaker && outfd>=0 && outfd==sip_speaker->audioRtcp) { /* [v2.1] */
+			/* Speaker reports on our talkback */
+			sipRtcpLen = recv(sip_speaker->audioRtcp,sipRtcpBuffer,sizeof(sipRtcpBuffer),0);
+			if (sipRtcpLen>0 && sipRtcpSession.stats)
+				RtcpSessionParse(&sipRtcpSession,sipRtcpBuffer,sipRtcpLen);
+		} else if (pacer && outfd>=0 && outfd==ast_timer_fd(pacer->timer)) { /* [v2.1] */
+			/* Talkback due */
+			TalkbackPacerTick(pacer);
+		/* ADDED. SIP States */
+		} else if (sip_speaker && outfd>=0 && outfd==sip_speaker->fd) { /* outfd >0. [v2.1] sip_speaker is NULL without SIP */
+			/* Depending on state */	
+			switch (sip_speaker->state)
+			{
+			    	case SIP_STATE_OPTIONS:
+			               //ast_debug(5,"-Receiving sip options\n");
+					/* Read into sipBuffer. ignore player->end by using temp*/
+					if (!(recvLen=RecvResponse(sip_speaker->fd,sipBuffer,&sipBufferLen,sipBufferSize,&temp)))
+					{
+						break; /* switch-case */
+					}
+					ast_debug(3, "-rx sip options response \n%s\n",sipBuffer); 
+					/* Check for response code */
+					responseCode = GetResponseCode(sipBuffer,sipBufferLen,1);
+
+					ast_debug(3,"-sip options response code [%d]\n",responseCode);
+					/* done with SIP message */
+					sipBufferLen =0;
+					break;
+			    	case SIP_STATE_INVITE:
+			        	ast_debug(3,"-rx sip invite response\n");
+
+					/* Read into sipBuffer. ignore player->end by using temp*/
+					sipBufferLen =0; /* TEMP */
+					if (!RecvResponse(sip_speaker->fd,sipBuffer,&sipBufferLen,sipBufferSize,&temp))
+						break;/* switch-case */
+					ast_debug(3, "\n%s\n",sipBuffer); 
+					/* [v2.1] Index headers once */
+					HeaderIndexBuild(&sipIndex,sipBuffer,sipBufferLen);
+
+					/* Check for response code */
+					responseCode = GetResponseCode(sipBuffer,sipBufferLen,1);
+					ast_debug(3,"-sip invite response code [%d]\n",responseCode);
+
+					if (responseCode>=100 && responseCode<=199)
+					{   /* Provisional Response codes */
+						switch(responseCode){
+							case 100:
+								ast_debug(3,"-sip invite response: 100 Trying\n");
+								break;
+							case 180:
+								ast_debug(3,"-sip invite response: 180 Ringing\n");
+								break;
+							default:
+								ast_debug(3,"-sip invite response: Unsupported 1xx Provisional response code\n");
+						}
+					}
+					else if (responseCode>=200 && responseCode<=299)
+					{
+						if( SipSetPeerTag(sip_speaker,&sipIndex) == -1)
+							ast_debug(3,"SIP: Setting Peer Tag had a Failure.\n");
+
+						/* RFC3261 13.1 2xx responses to a INVITE: session established, dialog is created */
+						sip_speaker->in_a_dialog = 1; /* Set this after getting Peer Tag */
+
+						/* RFC3261 2xx responses, an ACK is generated */
+						/* RFC3261 17.1.1.3 ACK Cseq is to be same as last Cseq INVITE */
+						sip_speaker->cseqm[ACK] = sip_speaker->cseqm[INVITE] - 1; 
+						if (!SipSpeakerAck(sip_speaker,username,2))
+						{
+							ast_log(LOG_ERROR,"Couldn't formulate/send SIP ACK\n");
+							/* Nothing else to do, simply don't do any more SIP stuff */
+						}
+
+						switch(responseCode){
+							case 200:
+								ast_debug(3,"-rx sip invite response: 200 OK\n");
+								/* Search end of SIP Message Header */
+							     /*	if ( (responseLen=GetResponseLen(sipBuffer)) == 0 ) [v2.1] found when indexed */
+								if ( (responseLen=sipIndex.bodyOff) == 0 )
+									break; /* switch-case */
+
+								ast_debug(5, "ResponseLen: %i\n",responseLen); /*tjl*/
+								contentLength = GetHeaderValueInt(&sipIndex,"Content-Length");	
+								if (!CheckHeaderValue(&sipIndex,"Content-Type","application/sdp"))
+								{
+									ast_log(LOG_ERROR,"SIP: Content-Type unknown\n");
+									break;/* switch-case */
+								}
+								/* Shift Message Data (i.e. SDP data) to beginning of sipBuffer */
+								sipBufferLen -= responseLen; 
+								memmove(sipBuffer,sipBuffer+responseLen,sipBufferLen+1);/* ADDED +1 preserves string term*/
+
+								/* If there is not enough room for data in the sipBuffer */	
+								if (sipBufferLen<contentLength) {
+									ast_log(LOG_WARNING,"SIP: Message Data too big to fit!!\n");
+									break; /* switch-case */
+								}
+								sip_sdp = CreateSDP(sipBuffer,contentLength,1);
+					   
+								if (!sip_sdp)
+								{
+									ast_log(LOG_ERROR,"Couldn't parse sip SDP\n");
+									break; /* switch-case */
+								}
+								ast_debug(3,"Successfully parsed sip SDP\n"); 
+
+								/* Check SDP data to ensure only one codec in "Answer" */
+							     /*	if( sip_sdp->audio->num != 1){ [v2.1] the first one we offered is used */
+								if (!sip_sdp->audio || (sipCodec = SipSpeakerAnswer(sip_speaker,sip_sdp))<0) {
+								     /*	ast_log(LOG_ERROR,"SIP: Peer Answers with more than 1 codec\n"); */
+									ast_log(LOG_ERROR,"SIP: Peer Answers with no codec we offered\n");
+								}
+								else{
+									/* Check SDP data to ensure the "Answer" codec matches "Offer" */
+								     /*	if(sip_sdp->audio->formats[0]->format != audioFormat){
+										ast_log(LOG_ERROR,"SIP: Peer Answers with mismatched codec\n");
+									} [v2.1] in SipSpeakerAnswer() */
+								     /*	ast_debug(3,"sip tx codec: %x\n",audioFormat); */
+									ast_debug(3,"sip tx codec: %s\n",sipCodecs[sipCodec].rtpmap);
+									/* [v2.1] Read talkback in that codec, Asterisk only transcodes if the channel has another */
+									if (chan && ast_set_read_format(chan,ast_format_compatibility_bitfield2format(sipCodecs[sipCodec].format)))
+										ast_log(LOG_WARNING,"Couldn't read %s from %s\n",sipCodecs[sipCodec].name,chanName);
+									/* Prepare to start sending Voice Frames */
+									enable_sip_tx = 1;
+								     /*	sip_prev_samples=0; [v2.1] */
+									SipSpeakerSetAudioTransport(sip_speaker,sip_sdp->audio->peer_media_port);
+									/* [v2.1] Talkback source and its reports */
+									RtpSenderInit(&sipSender,sipCodecs[sipCodec].payload);
+									MediaStatsReset(&sipStats);
+									RtcpSessionInit(&sipRtcpSession,sip_speaker->audioRtcp,-1,&sipStats,
+											sipSender.ssrc,sip_speaker->cname,
+											sip_sdp->audio->bandwidth ? sip_sdp->audio->bandwidth : sip_sdp->bandwidth);
+									sipRtcpSession.sender = &sipSender;
+									sipRtcpSession.media = &media;
+									/* [v2.1] Talkback goes out in channel frames, note what the speaker asked for */
+									if (sip_sdp->audio->ptime)
+										ast_debug(3,"sip peer ptime %d ms\n",sip_sdp->audio->ptime);
+								}
+								break;
+							default:
+								ast_debug(3,"Not Processing SIP 2xx Successful response code\n");
+						}
+						sip_speaker->state = SIP_STATE_NONE;
+					}
+					else if (responseCode>=400 && responseCode<=499)
+					{  
+						/* 4xx Request Failure */ 
+						/* RFC3261 13.1 For final responses between 300 and 699, the ACK processing is done */
+ 						/* Especially need to ACK a 401, otherwise peer will resend a few times */
+
+						/* Check/Get peer's tag as maybe first/new one peer sends */
+						if( SipSetPeerTag(sip_speaker,&sipIndex) == -1)
+							ast_debug(3,"SIP: Getting Peer Tag had a Failure.\n");
+
+						/* RFC3261 17.1.1.3 ACK Cseq is to be same as last Cseq INVITE */
+						sip_speaker->cseqm[ACK] = sip_speaker->cseqm[INVITE] - 1; 
+						if (!SipSpeakerAck(sip_speaker,username,4))
+						{
+							ast_log(LOG_ERROR,"Couldn't formulate/send SIP ACK\n");
+							/* Nothing else to do, simply don't do any more SIP stuff */
+						}
+						switch(responseCode){
+							case 400:
+								sip_speaker->state = SIP_STATE_NONE;
+								ast_log(LOG_ERROR,"SIP: 400 Bad Request. Not Processing.\n");
+								break;
+							case 401:
+					                       ast_debug(3,"  sip invite 401 processing\n");
+
+                                                                /* [v2.0]  Adding new way of detecting authentication method */
+					                        ast_debug(3,"    - Checking for Auth Method of Basic\n");
+
+                                                                struct BasicAuthData basic_data;
+
+                                                                if (GetAuthSchemeBasic(&sipIndex,&basic_data) == 0 )
+                                                                {
+					                            ast_debug(3,"    - Found Auth Method of Basic\n");
+						                    ast_log(LOG_WARNING,"SIP Code does not yet support Basic Auth\n");
+                                                                }
+                                                                else
+                                                                {
+					                            ast_debug(3,"    - No Auth Method of Basic\n");
+					                            ast_debug(3,"    - Checking for Auth Method of Digest\n");
+
+                                                                    struct DigestAuthData digest_data;
+
+                                                                    if (GetAuthSchemeDigest(&sipIndex,&digest_data) == 0 )
+                                                                    {
+					                                ast_debug(3,"    - Found Auth Method of Digest\n");
+									char *nc = NULL;
+									char *cnonce = NULL;
+									char *qop = NULL;
+									char uri[64];
+									sprintf(uri,"sip:%s@%s:%i", username,sip_speaker->ip,sip_port);
+									char *method = "INVITE";
+ 
+									ast_debug(5,"  Challenge Response Data- rx_realm: %s nonce: %s uri %s",\
+										digest_data.rx_realm, digest_data.nonce,uri); 
+                                              
+								     /*	RtspPlayerDigestAuthorization(sip_speaker,username,\
+											password, sip_realm,\
+											digest_data.nonce, nc, cnonce, qop, uri, \
+											digest_data.rx_realm, method, 1); [v2.1] */
+									if (sip_speaker->authorization)
+									{
+										ast_free(sip_speaker->authorization);
+										sip_speaker->authorization = NULL;
+									}
+									if (RtspPlayerDigestAuthorization(sip_speaker,username,\
+											password, sip_realm,\
+											digest_data.nonce, nc, cnonce, qop, uri, \
+											digest_data.rx_realm, method, 1) > 0)
+										/* [v2.1] Next call sends it with the first INVITE */
+										AuthCacheStoreDigest(sip_speaker,&digest_data);
+									else
+										/* [v2.1] Realm changed, don't send stale credentials next time */
+										AuthCacheForget(sip_speaker);
+
+									/* Try Invite again w. Auth */
+									if(sip_speaker->cseqm[INVITE] == 3)   
+										ast_debug(3,"  Too many INVITEs \n");
+									else
+									{
+										if (!SipSpeakerInvite(sip_speaker,username,audioFormat,1))
+										{
+											ast_log(LOG_ERROR,"SIP: Couldn't formulate/send INVITE\n");
+											/* Nothing else to do, simply don't do any more SIP stuff */
+										}
+									}
+                                                                    }
+                                                                    else
+                                                                    {
+					                                ast_debug(3,"    - No Auth Method of Digest\n");
+							                ast_log(LOG_ERROR,"No Basic/Digest Authentication header/data present\n");
+                                                                    }
+                                                                }
+
+#ifdef OLD_AUTH_SCHEME
+								if (CheckHeaderValue(&sipIndex,"WWW-Authenticate","Basic realm="))
+								{
+									ast_log(LOG_WARNING,"SIP Code does not yet support Basic Auth\n");
+								}
+								else if (CheckHeaderValue(&sipIndex,"WWW-Authenticate","Digest"))
+								{
+									struct DigestAuthData digest_data;
+
+									if(GetAuthHeaderData(sip_speaker,&sipIndex,&digest_data) == -1)
+									{
+									    ast_log(LOG_ERROR,"SIP: WWW-Authenticate header missing\n");
+									}
+									char *nc = NULL;
+									char *cnonce = NULL;
+									char *qop = NULL;
+									char uri[64];
+									sprintf(uri,"sip:%s@%s:%i", username,sip_speaker->ip,sip_port);
+									char *method = "INVITE";
+ 
+									ast_debug(5,"  GetChallenge Response- rx_realm: %s nonce: %s uri %s",\
+										digest_data.rx_realm, digest_data.nonce,uri); 
+                                              
+									RtspPlayerDigestAuthorization(sip_speaker,username,\
+											password, sip_realm,\
+											digest_data.nonce, nc, cnonce, qop, uri, \
+											digest_data.rx_realm, method, 1);
+
+									/* Try Invite again w. Auth */
+									if(sip_speaker->cseqm[INVITE] == 3)   
+										ast_debug(3,"Too many INVITEs \n");
+									else
+									{
+										if (!SipSpeakerInvite(sip_speaker,username,audioFormat,1))
+										{
+											ast_log(LOG_ERROR,"SIP: Couldn't formulate/send INVITE\n");
+											/* Nothing else to do, simply don't do any more SIP stuff */
+										}
+									}
+								}
+#endif
+								break;
+							case 420:
+								sip_speaker->state = SIP_STATE_NONE;
+								ast_debug(3,"420 Bad Extension. Not Processing.\n");
+								break;
+							default:
+								sip_speaker->state = SIP_STATE_NONE;
+								ast_debug(3,"SIP Not Processing these 4xx Request Failure response codes\n");
+						}
+					}
+					else 
+					{
+						ast_debug(3,"SIP Not Processing 5xx Server Failure nor 6xx Global Failures response code\n");
+						sip_speaker->state = SIP_STATE_NONE;
+					}
+
+					/* done with received SIP message */
+					sipBufferLen =0;
+					break;
+			    	case SIP_STATE_NONE:
+					/* Get received SIP message */
+					sipBufferLen =0;
+					if (!RecvResponse(sip_speaker->fd,sipBuffer,&sipBufferLen,sipBufferSize,&temp))
+					{
+						ast_log(LOG_ERROR,"SIP: failed to read unsolicted request sipBuffer.\n"); 
+						break;
+					}
+					ast_debug(3,"-sip rx req from peer\n%s",sipBuffer); 
+					/* [v2.1] Index headers once */
+					HeaderIndexBuild(&sipIndex,sipBuffer,sipBufferLen);
+					if (strncmp(sipBuffer,"BYE",3)==0) {
+						ast_debug(1,">BYE\n"); 
+						/* Send OK back to peer */
+						if( SipSpeakerReply(sip_speaker,&sipIndex,username,ip,sip_port,"BYE")==1)
+							enable_sip_tx=0;
+						/* [v2.1] Talkback source leaves */
+						if (!enable_sip_tx && sipRtcpSession.stats)
+						{
+							RtcpSessionBye(&sipRtcpSession);
+							RtpSenderLogStats(&sipSender);
+							sipRtcpSession.stats = NULL;
+						}
+					      //ast_debug(1,"<BYE\n"); //changed [v2.0]
+						}
+					else if (strncmp(sipBuffer,"INFO",4)==0) {
+						ast_debug(1,">INFO\n"); 
+						/* Send OK back to peer */
+						if( SipSpeakerReply(sip_speaker,&sipIndex,username,ip,sip_port,"BYE")==1)
+							ast_debug(3,"send OK\n");
+			                	//ast_debug(1,"<INFO\n"); //change [v2.0]
+					}
+					else if (strncmp(sipBuffer,"CANCEL",5)==0) {
+						ast_debug(1,">CANCEL\n"); 
+				              //ast_debug(1,"<CANCEL\n"); //change [v2.0]
+					}
+					else {
+						ast_log(LOG_ERROR,"Unsupported SIP Request receive");
+					}
+
+					/* done with received SIP message */
+					sipBufferLen =0;
+					break;
+			}/* end of SIP States */
+		} else if (rchan == NULL && outfd <0 && ms==0 && player->state!=RTSP_PLAYING && player->state!=RTSP_READY) {
+			/* log */
+			ast_log(LOG_ERROR,"-timedout and not connected [%d]",outfd);
+			/* Exit f timedout and not conected*/
+			player->end = 1;
+		} 
+
+		/* [v2.1] Play out buffered audio that is due, to the channel writer on a reactor */
+		MediaSessionLock(&media);
+		if (builder.jb && player->state==RTSP_PLAYING)
+			JitterBufferTick(builder.jb,&builder);
+		MediaSessionUnlock(&media);
+
+		/* [v2.1] Talkback sender report */
+		if (enable_sip_tx)
+			RtcpSessionTick(&sipRtcpSession);
+
+		/* If the playback has started */
+		if (player->state==RTSP_PLAYING) 
+		{
+			/* [v2.1] Reports on the RFC 3550 interval */
+			MediaSessionLock(&media);
+			RtcpSessionTick(&audioRtcpSession);
+			RtcpSessionTick(&videoRtcpSession);
+			MediaSessionUnlock(&media);
+			/* [v2.1] Send OPTIONS at half the session timeout, not with every report */
+			if (ast_tvdiff_ms(ast_tvnow(),keepalivetv)>=player->sessionTimeout*1000/2)
+			{
+				/* Send OPTIONS, or GET_PARAMETER */
+			     /*	RtspPlayerOptions(player,url); [v2.1] */
+				RtspPlayerKeepalive(player,url,opts->getParameter);
+				/* Reset timeout value */
+				keepalivetv = ast_tvnow();
+			}
+		}
+
+		/* [v2.1] Warm session waiting for a call */
+		if (player->state==RTSP_READY) 
+		{
+			/* Keep it alive */
+			if (ast_tvdiff_ms(ast_tvnow(),keepalivetv)>=player->sessionTimeout*1000/2)
+			{
+				RtspPlayerKeepalive(player,url,opts->getParameter);
+				keepalivetv = ast_tvnow();
+			}
+			/* Idle too long, the pool starts a fresh one */
+			if (share->maxIdle && ast_tvdiff_ms(ast_tvnow(),readytv)>=share->maxIdle*1000)
+			{
+				/* log */
+				ast_debug(2,"-warm session idle for %d s, releasing\n",share->maxIdle);
+				/* exit */
+				player->end = 1;
+			}
+		}
+	}
+
+rstp_play_stop:
+
+	/* [v2.1] Sockets back from the reactor */
+	if (media.reactor)
+		MediaReactorDetach(&media);
+	ast_mutex_destroy(&media.lock);
+	/* [v2.1] Nothing builds frames any more */
+	if (builder.writer)
+		ChannelWriterStop(builder.writer);
+	/* [v2.1] Talkback still queued is dropped */
+	if (pacer)
+		TalkbackPacerDestroy(pacer,chanName);
+
+	/* log */
+     /*	ast_log(LOG_DEBUG,"-rtsp_play end loop [%d]\n",res); OLD */
+	ast_debug(2,"-rtsp_play end loop [%d]\n",res);
+
+	/* [v2.1] RTCP BYE and counters */
+	if (audioRtcpSession.stats)
+	{
+		RtcpSessionBye(&audioRtcpSession);
+		RtcpSessionLogStats(&audioRtcpSession,"audio");
+	}
+	if (videoRtcpSession.stats)
+	{
+		RtcpSessionBye(&videoRtcpSession);
+		RtcpSessionLogStats(&videoRtcpSession,"video");
+	}
+
+	/* [v2.1] Framer stats */
+	ast_debug(2,"-rtsp framer: %ld bytes consumed, %d compactions\n",framer.consumed,framer.compactions);
+
+	/* Send rtsp teardown if something was setup */
+	if (player->state>RTSP_DESCRIBE)
+		/* Teardown */
+		RtspPlayerTeardown(player);
+
+	/* [v2.1] Talkback source leaves */
+	if (sipRtcpSession.stats)
+	{
+		RtcpSessionBye(&sipRtcpSession);
+		RtpSenderLogStats(&sipSender);
+	}
+
+	/* Send SIP BYE if in a dialog */
+	if (sip_enable) {
+		if (sip_speaker->in_a_dialog){
+			ms = 500;
+			int result;
+			/* [v2.1] Digest covers the method, the INVITE one doesn't do */
+			if (sip_speaker->authScheme==AUTH_SCHEME_DIGEST)
+			{
+				snprintf(controlUri,sizeof(controlUri),"sip:%s@%s:%i",username,sip_speaker->ip,sip_port);
+				RtspPlayerAuthorize(sip_speaker,"BYE",controlUri,1);
+			}
+			SipSpeakerBye(sip_speaker,username);
+			result=ast_wait_for_input(sip_speaker->fd,ms); /*Wait for response */
+			if(result>0){
+				ast_debug(3,"rx bye response\n");
+				bufferLen =0; /* TEMP */
+				buffer = framer.base; /* [v2.1] back to the front */
+				if (!RecvResponse(sip_speaker->fd,buffer,&bufferLen,bufferSize,&temp))
+					ast_debug(3,"Couldn't get BYE response from buffer\n");
+				else{
+					ast_debug(3, "\n%s\n",buffer);
+					/* Check for response code */
+					responseCode = GetResponseCode(buffer,bufferLen,1);
+					ast_debug(3,"-SIP Bye response code [%d]\n",responseCode);
+					/* [v2.1] Index headers once */
+					HeaderIndexBuild(&sipIndex,buffer,bufferLen);
+
+					if (responseCode==401){
+						SipSetPeerTag(sip_speaker,&sipIndex);
+						sip_speaker->cseqm[ACK] = sip_speaker->cseqm[BYE] - 1;
+						SipSpeakerAck(sip_speaker,username,4);
+
+                                                /* [v2.0]  Adding new way of detecting authentication method */
+					        ast_debug(3,"  sip bye 401 Processing\n");
+					        ast_debug(3,"    - Checking for Auth Method of Basic\n");
+                                                struct BasicAuthData basic_data;
+                                                if (GetAuthSchemeBasic(&sipIndex,&basic_data) == 0 )
+                                                {
+					            ast_debug(3,"    - Found Auth Method of Basic\n");
+						    ast_log(LOG_WARNING,"SIP Code does not yet support Basic Auth\n");
+                                                }
+                                                else
+                                                {
+					            ast_debug(5,"    - No Auth Method of Basic\n");
+					            ast_debug(5,"    - Checking for Auth Method of Digest\n");
+
+                                                    struct DigestAuthData digest_data;
+                                                    if (GetAuthSchemeDigest(&sipIndex,&digest_data) == 0 )
+                                                    {
+					                ast_debug(3,"    - Found Auth Method of Digest\n");
+							char *nc = NULL;
+							char *cnonce = NULL;
+							char *qop = NULL;
+							char uri[64];
+							sprintf(uri,"sip:%s@%s:%i", username,sip_speaker->ip,sip_port);
+							char *method = "BYE";
+
+							ast_debug(5,"  input data for challenge response- rx_realm: %s nonce: %s uri %s",\
+								digest_data.rx_realm, digest_data.nonce,uri);
+
+							if (sip_speaker->authorization) /* [v2.1] */
+							{
+								ast_free(sip_speaker->authorization);
+								sip_speaker->authorization = NULL;
 							}
-						}
-					}
+							if (RtspPlayerDigestAuthorization(sip_speaker,username,password, sip_realm,\
+									digest_data.nonce, nc, cnonce, qop, uri, \
+									digest_data.rx_realm, method, 1) > 0)
+								/* [v2.1] */
+								AuthCacheStoreDigest(sip_speaker,&digest_data);
 
-					/* Get best video track */
-					if (sdp->video)
-						/* Get first matching format */
-						for (i=0;i<sdp->video->num;i++)
-						{
-							/* log */
-						    /*	ast_log(LOG_DEBUG,"-video [%x,%d,%s]\n",\
-						      	        sdp->video->formats[i]->format,\
-						      	        sdp->video->formats[i]->payload,\
-						      	        sdp->video->formats[i]->control); OLD */
-							/* PORT 17.3 fix for format now unsigned long long */
-							ast_debug(4,"-video [%"PRIu64",%d,%s]\n",\
-								sdp->video->formats[i]->format,\
-								sdp->video->formats[i]->payload ,\
-								sdp->video->formats[i]->control); 
+							/* Try Bye again w. Auth */
+							SipSpeakerBye(sip_speaker,username);
+                                                    }
+                                                    else
+                                                    {
+					                ast_debug(3,"    - No Auth Method of Digest\n");
+							ast_log(LOG_ERROR,"No Basic/Digest Authentication header/data present\n");
+                                                    }
+                                                }
 
-							/* if we have that */
-							/* PORT 17.3
-							 * It appears here it is taking the list of rtsp 
-							 * learned media and comparing with the media 
-							 * supported natively by the channel and the 
-							 * first one it finds a match on, 
-							 * will stop the search and declare it the best.
-							 * We'll do something similar by checking 
-							 * to see if rtsp learned media is in the 
-							 * capabilities list of the channel:
-							 *    Returning NULL if not  
-							 *    Otherwise returns a compatible media.
-							 */
-						     /*	if (sdp->video->formats[i]->format & chan->nativeformats) OLD */
-							struct ast_format *video_compat_format;
-							video_compat_format = \
-								ast_format_cap_get_compatible_format(ast_channel_nativeformats(chan),\
-									sdp->video->formats[i]->new_format);
-							if (video_compat_format)
+#ifdef OLD_AUTH_SCHEME
+				                if (CheckHeaderValue(&sipIndex,"WWW-Authenticate","Basic realm="))
+						{
+							ast_log(LOG_WARNING,"SIP Code does not yet support Basic Auth\n");
+						}
+						else if (CheckHeaderValue(&sipIndex,"WWW-Authenticate","Digest"))
+						{
+							struct DigestAuthData digest_data;
+							if(GetAuthHeaderData(sip_speaker,&sipIndex,&digest_data) == -1)
 							{
-								/* Store type */
-								videoType = sdp->video->formats[i]->payload;
-								/* PORT 17.3 compiler warns videoType not used, so use it */
-								if(videoType){ 
-									ast_debug(1, "-videoType is %i\n", videoType );
-                                                                }
-								/* Store format */
-								videoFormat = sdp->video->formats[i]->format;
-								//videoNewFormat = video_compat_format; /* PORT 17.3 */
-								videoNewFormat = sdp->video->formats[i]->new_format; /* PORT 17.3 */
-								/* Store control */
-								videoControl = sdp->video->formats[i]->control;
-								/* Found best codec */
-								ast_debug(4,"Found best video codec\n");
-								/* Got a valid one */
-								break;
+								ast_log(LOG_ERROR,"WWW-Authenticate header missing\n");
 							}
-							else /*ADD */
-								ast_log(LOG_WARNING,\
-									"No compatible format found for Video on channel\n");
-						}
-
-					/* Log formats */
-				   /*	ast_log(LOG_DEBUG,"-Set write format [%x,%x,%x]\n",\
-				    	 	audioFormat | videoFormat, audioFormat, videoFormat); OLD */
-					ast_debug(4,"-Set write format [%x,%x,%x]\n",\
-						audioFormat | videoFormat, audioFormat, videoFormat);
+							char *nc = NULL;
+							char *cnonce = NULL;
+							char *qop = NULL;
+							char uri[64];
+							sprintf(uri,"sip:%s@%s:%i", username,sip_speaker->ip,sip_port);
+							char *method = "BYE";
 
-					/* Set write format */
-					/* PORT 17.3 move ast_set_write_format further down and use new formats */
-				     /*	ast_set_write_format(chan, audioFormat | videoFormat);	OLD. */ 
+							ast_debug(5,"  GetChallenge Response- rx_realm: %s nonce: %s uri %s",\
+								digest_data.rx_realm, digest_data.nonce,uri);
 
-					ast_debug(3, "-Set write format on channel %s:\n",ast_channel_name(chan)); /*ADD*/
+							RtspPlayerDigestAuthorization(sip_speaker,username,password, sip_realm,\
+									digest_data.nonce, nc, cnonce, qop, uri, \
+									digest_data.rx_realm, method, 1);
 
-					/* if audio track */
-					if (audioControl)
-					{
-						/* Open audio */
-					        /* Set write format. PORT17.3 Moved from above to here */
-						ast_debug(1, "  for %s\n ",ast_format_get_name(audioNewFormat)); /*ADD*/
-						ast_set_write_format(chan, audioNewFormat);
-						RtspPlayerSetupAudio(player,audioControl);
-					} else if (videoControl) {
-						/* Open video */
-						/* Set write format. PORT 17.3 Moved from above to here to use new format*/
-						/*ADD. if there is no compatible video format then skip write*/
-						if(videoNewFormat){ 
-							ast_debug(1, "  for %s\n ",ast_format_get_name(videoNewFormat)); /*ADD*/
-							ast_set_write_format(chan, videoNewFormat);
-				 			RtspPlayerSetupVideo(player,videoControl);
+							/* Try Bye again w. Auth */
+							SipSpeakerBye(sip_speaker,username);
 						}
-					} else {
-						/* log */
-						ast_log(LOG_ERROR,"No media found\n");
-						/* end */
-						player->end = 1;
+#endif
 					}
-					break;
-				case RTSP_SETUP_AUDIO:
-					/* log */
-				     /*	ast_log(LOG_DEBUG,"-Recv audio response\n"); OLD */
-					ast_debug(2,"-rx rtsp setup for audio response\n");
-					/* Read into buffer */
-					if (!RecvResponse(player->fd,buffer,&bufferLen,bufferSize,&player->end))
-						break;
-					ast_debug(3, "\n%s\n",buffer); //Added [v2.0]
-					/* Search end of response */
-					if ( (responseLen=GetResponseLen(buffer)) == 0 )
-						/*Exit*/
-						break;
+				}
+			}
+			sip_speaker->in_a_dialog=0;
+		}
+        }
 
-					/* Does it have content */
-					if (GetHeaderValueInt(buffer,responseLen,"Content-Length"))
-					{
-						/* log */
-						ast_log(LOG_ERROR,"Content length not expected\n");
-						/* Uh? */
-						player->end = 1;
-						/* break */
-						break;
-					}
-					/* Get session */
-					if ( (session=GetHeaderValue(buffer,responseLen,"Session")) == 0)
-					{
-						/* log */
-						ast_log(LOG_ERROR,"No session [%s]\n",buffer);
-						/* Uh? */
-						player->end = 1;
-						/* break */
-						break;
-					}
-					/* Append session to player */
-					RtspPlayerAddSession(player,session);
-					/* Get transport value to obtain rtcp ports */
-					if ((transport=GetHeaderValue(buffer,responseLen,"Transport")) == 0)
-					{
-						/* log */
-						ast_log(LOG_ERROR,"No transport [%s]\n",buffer);
-						/* Uh? */
-						player->end = 1;
-						/* break */
-						break;
-					}
-					/* Process transport */
-					RrspPlayerSetAudioTransport(player,transport);
-					/* Free string */
-			             /*	free(transport); was */
-					ast_free(transport);
-					/* Get new length */
-					bufferLen -= responseLen;
-					/* Move data to begining */
-				     /*	memcpy(buffer,buffer+responseLen,bufferLen); OLD */
-					memmove(buffer,buffer+responseLen,bufferLen);
-					/* If video control */
-					if (videoControl){
-						/* Set up video */
-						/* ADD. If there is no compatible video format then skip video setup*/
-						if(videoNewFormat) 
-			 				RtspPlayerSetupVideo(player,videoControl);
-					}
-					else 
-					{
-						/* play */
-						RtspPlayerPlay(player);
+	if (sip_sdp && sip_enable)
+		DestroySDP(sip_sdp);
+	ast_debug(3,"-sip tx vf count pre:%i post:%i error:%i\n",pre_enable_vf_tx_count,post_enable_vf_tx_count,sip_tx_error_count);
+	/*
+	 * PORT 17.5 restructure sendFrame. No longer malloc'd */
+	/* Free frame */
+     /*	if (sendFrame) OLD */
+		/* Free memory */
+	     /*	free(sendFrame); OLD */
+	     /*	ast_free(sendFrame); * PORT17.3 */
+
+	/* If ther was a sdp */
+	if (sdp && !sdpEntry) /* [v2.1] otherwise the cache entry owns it */
+		/* Destroy it */
+		DestroySDP(sdp);
+
+rtsp_play_clean:
+	/* Close sockets */
+	RtspPlayerClose(player);
+	if(sip_enable)
+		RtspPlayerClose(sip_speaker);
+
+rtsp_play_end:
+	/* [v2.1] Receive buffers, DESCRIBE and OPTIONS failures skip rtsp_play_clean */
+	ast_free(bufferMem);
+	ast_free(sipBuffer);
+	/* [v2.1] Release cached sdp */
+	if (sdpEntry)
+		ao2_ref(sdpEntry,-1);
+	/* Destroy player */
+	RtspPlayerDestroy(player);
+	if(sip_enable)
+		RtspPlayerDestroy(sip_speaker);
 
-						/* 
-						 * ADDed. 
-						 * RTSP is now playing so get SIP going.
-						 * We also know which audio codec to use (see audioFormat). 
-						 */
+	/* [v2.1] Batching ratio */
+	if (ingest)
+	{
+		RtpIngestLogStats(ingest);
+		RtpIngestDestroy(ingest);
+	}
+	/* [v2.1] Jitter buffer gives its slots back */
+	if (builder.jb)
+	{
+		JitterBufferLogStats(builder.jb);
+		JitterBufferDestroy(builder.jb);
+	}
+	/* [v2.1] Free packet slots */
+	if (pool)
+		FramePoolDestroy(pool);
 
-						/* Send SIP unauthorized INVITE */
-						if(sip_enable){
-							if (!SipSpeakerInvite(sip_speaker,username,audioFormat,0))
-							{
-								ast_log(LOG_ERROR,"Couldn't formulate/send INVITE\n");
-		                                        	/* Nothing else to do, simply don't do any more SIP stuff */
-							}
-						}
-					}
-					break;
-				case RTSP_SETUP_VIDEO:
-					/* log PORT17.3 adder*/
-				     /*	ast_log(LOG_DEBUG,"-Recv video response\n"); OLD */
-					ast_debug(2,"-Recv video response\n");
+	/* log */
+	ast_log(LOG_NOTICE,"<rtsp-sip main loop\n");
 
-					/* Read into buffer */
-					if (!RecvResponse(player->fd,buffer,&bufferLen,bufferSize,&player->end))
-						break;
-					/* Search end of response */
-					if ( (responseLen=GetResponseLen(buffer)) == 0 )
-						/*Exit*/
-						break;
+	/* Exit */	
+	return res;
+}
 
-					/* Does it have content */
-					if (GetHeaderValueInt(buffer,responseLen,"Content-Length"))
-					{
-						/* log */
-						ast_log(LOG_ERROR,"No content length\n");
-						/* Uh? */
-						player->end = 1;
-						/* break */
-						break;
-					}
-					/* Get session if we don't have already one*/
-					if ( (session=GetHeaderValue(buffer,responseLen,"Session")) == 0)
-					{
-						/* log */
-						ast_log(LOG_ERROR,"No session [%s]\n",buffer);
-						/* Uh? */
-						player->end = 1;
-						/* break */
-						break;
-					}
-					
-					/* Append session to player */
-					RtspPlayerAddSession(player,session);
-					/* Get transport value to obtain rtcp ports */
-					if ((transport=GetHeaderValue(buffer,responseLen,"Transport")) == 0)
-					{
-						/* log */
-						ast_log(LOG_ERROR,"No transport [%s]\n",buffer);
-						/* Uh? */
-						player->end = 1;
-						/* break */
-						break;
-					}
-					/* Process transport */
-					RrspPlayerSetVideoTransport(player,transport);
-					/* Free string */
-				     /*	free(transport); OLD */
-					ast_free(transport);
-					/* Get new length */
-					bufferLen -= responseLen;
-					/* Move data to begining */
-				     /*	memcpy(buffer,buffer+responseLen,bufferLen); OLD */
-					memmove(buffer,buffer+responseLen,bufferLen);
-					//send to first (even) server port (RTP) 8000 0000 0000 0000 0000 0000
-					//FIXME this is needed to start stream, but what should this really be?
-					short rtp_start[] = {0x0080,0x0000,0x0000,0x0000,0x0000,0x0000};
-					send(player->videoRtp, &rtp_start, sizeof(rtp_start), 0);
-					/* Create rtcp packet */
-					MediaStatsRR(&player->videoStats,&rtcp);
-					/* Send packet */
-					send(player->videoRtcp, &rtcp, sizeof(rtcp), 0);
-					/* Play */
-					RtspPlayerPlay(player);
-					break;
-				case RTSP_PLAY:
-					/* Read into buffer */
-					ast_debug(2,"-rx rtsp play response\n");
-					if (!RecvResponse(player->fd,buffer,&bufferLen,bufferSize,&player->end))
-						break;
-					ast_debug(3, "\n%s\n",buffer); //Added [v2.0]
-					/* Search end of response */
-					if ( (responseLen=GetResponseLen(buffer)) == 0 )
-						/*Exit*/
-						break;
-					/* Get range */
-					if ( (range=GetHeaderValue(buffer,responseLen,"Range")) == 0)
-					{
-						/* No end of stream */
-						duration = -1;
-					} else {
-						/* Get end part */
-						j = strchr(range,'-');
-						/* Check format */
-						if (j)
-							/* Get duration */
-							duration = atof(j+1)*1000;  
-						else 
-							/* No end of stream */
-							duration = -1;
-						/* Free string */
-					     /*	free(range); was */
-						ast_free(range);
-					}
-					/* If the video has end */
-					if (duration>0)
-						/* Init counter */
-						tv = ast_tvnow();
-					/* log */
-				     /*	ast_log(LOG_DEBUG,"-Started playback [%d]\n",duration); OLD */
-					ast_debug(2,"-Started playback [%d]\n",duration);
-					/* Get new length */
-					bufferLen -= responseLen;
-					/* Move data to begining */
-				     /*	memcpy(buffer,buffer+responseLen,bufferLen); OLD */
-					memmove(buffer,buffer+responseLen,bufferLen);
-					/* Init media stats */
-					MediaStatsReset(&player->audioStats);
-					MediaStatsReset(&player->videoStats);
-					/* Set playing state */
-					player->state = RTSP_PLAYING;
-					break;
-				case RTSP_PLAYING:
-					/* Read into buffer */
-					if (!RecvResponse(player->fd,buffer,&bufferLen,bufferSize,&player->end))
-						break;
-					break;
-			}
-		} else if ((outfd==player->audioRtp) ||  (outfd==player->videoRtp) ) { /* outfd >0 */
-			/* Set length */
-			rtpLen = 0;
+static int rtsp_tunnel(struct ast_channel *chan,char *ip, int port, char *url)
+{
+	struct sockaddr_in sendAddr;
+	struct ast_frame *f;
 
-			/* Clean frame */
-		     /*	memset(sendFrame,0,sizeof(struct ast_frame) + rtpSize); OLD */
-			memset(&sendFrame,0,sizeof(struct ast_frame)); /* PORT17.5 Restructuring sendFrame */
-			memset(FrameBuffer,0,AST_FRIENDLY_OFFSET+PKT_PAYLOAD); /* PORT17.5 Restructuring sendFrame */
+	int infds[1];
+	int outfd;
+	int rtsp;
 
+	int state = RTSP_TUNNEL_CONNECTING;
+	char request[1024];
+	char buffer[16384];
+     /*	char *i;  PORT 17.3 compiler warning not used, so removed */
+	int  bufferSize = 16383; /* One less for finall \0 */
+	int  bufferLen = 0;
+	int  responseLen = 0;
+	int  contentLength = 0;
+	struct HeaderIndex index; /* [v2.1] */
 
-			/* Read rtp packet */
-			if (!RecvResponse(outfd,(char*)rtpBuffer,&rtpLen,rtpSize,&player->end))
-			{
-				/* log */
-			     /*	ast_log(LOG_DEBUG,"-Error reading rtp from [%d]\n",outfd); CHANGE */
-				ast_log(LOG_WARNING,"-Error reading rtp from [%d]\n",outfd);
-				/* exit*/
-				break;
-			}
+        struct SDPContent* sdp = NULL; /* PORT 17.3: init to NULL to remove compiler warning */
 
-			/* If not got enough data */
-			if (rtpLen<12)
-				/*exit*/
-				break;
+	int  isSDP;
 
-			/* Get headers */
-			rtp = (struct RtpHeader*)rtpBuffer;
+	int end = 0;
+	int ms = 10000;
+	int flags;
 
-			/* Set data ini */
-		     /*	int ini = sizeof(struct RtpHeader)-4; CHANGE. Compensate for removing csrc from RtpHeader */
-			int ini = sizeof(struct RtpHeader);
 
-			/* Increase length */
-			ini += rtp->cc;
+	/* open socket */
+	rtsp = socket(PF_INET,SOCK_STREAM,0);
 
-			/* Get timestamp */
-			unsigned int ts = ntohl(rtp->ts);
-			 
-			/* Set frame data */
-		     /*	AST_FRAME_SET_BUFFER(sendFrame,rtpBuffer,ini,rtpLen-ini); OLD */
-			AST_FRAME_SET_BUFFER(&sendFrame,FrameBuffer,AST_FRIENDLY_OFFSET+ini,rtpLen-ini);
-		     /*	sendFrame->src = strdup(src); OLD */
-		     /*	sendFrame->src = ast_strdup(src); New way but why dup this as src is already an array */
-			sendFrame.src = src; /* PORT17.3, removed strdup. PORT17.5 restructure sendFrame */
+	/* empty addres */
+	memset(&sendAddr,0,sizeof(struct sockaddr_in));
 
-			/* Depending on socket */
-			if (outfd==player->audioRtp) {
-				/* Set type */
-			     /*	sendFrame->frametype = AST_FRAME_VOICE; OLD */
-				sendFrame.frametype = AST_FRAME_VOICE; /* PORT17.5 restructure sendFrame */
-
-				/* 
-				 * PORT 17.3.  Rework to accomodate the new media format.
-				 * subclass.integer for VOICE is codec in AST_FORMAT_*
-				 * subclass.format for VOICE is new media format in struct ast_format
-				 * PORT 17.5 restructure sendFrame
-				 */
-			     /*	sendFrame->subclass =  audioFormat; OLD */
-				sendFrame.subclass.integer =  audioFormat;
-				sendFrame.subclass.format =  audioNewFormat;
-				/* Set number of samples */
-				if (lastAudio)
-					/* Set number of samples */
-				     /*	sendFrame->samples = ts-lastAudio; OLD */
-					sendFrame.samples = ts-lastAudio;
-				else
-					/* Set number of samples to 160 */
-				     /*	sendFrame->samples = 160; OLD */
-					sendFrame.samples = 160;
-				/* Save ts */
-				lastAudio = ts;
-				/* Set stats */
-				MediaStatsUpdate(&player->audioStats,ts,ntohs(rtp->seq),ntohl(rtp->ssrc));
-			} else {
-				/* Set type */
-			     /*	sendFrame->frametype = AST_FRAME_VIDEO; OLD */
-				sendFrame.frametype = AST_FRAME_VIDEO;/* PORT 17.5 restructure sendFrame */
+	/* Set data */
+	sendAddr.sin_family	 = AF_INET;
+	sendAddr.sin_addr.s_addr = INADDR_ANY;
+	sendAddr.sin_addr.s_addr = inet_addr(ip);
+	sendAddr.sin_port	 = htons(port);
 
-				/* PORT 17.3.  Rework to accomodate the new media format 
-				 * subclass.integer for VIDEO is codec in AST_FORMAT_*
-				 * subclass.format for VIDEO is new media format in struct ast_format
-				 * PORT 17.5 restructure sendFrame
-				 */
-			     /*	sendFrame->subclass = videoFormat; OLD */
-				sendFrame.subclass.integer =  videoFormat;
-				sendFrame.subclass.format =  videoNewFormat;
-				/* If not the first */
-				if (lastVideo)
-					/* Set number of samples */
-				     /*	sendFrame->samples = ts-lastVideo; OLD */
-					sendFrame.samples = ts-lastVideo; /* PORT 17.5 restructure sendFrame */
-				else
-					/* Set number of samples to 0 */
-				     /*	sendFrame->samples = 0; OLD */
-					sendFrame.samples = 0; /* PORT 17.5 restructure sendFrame */
-				/* Save ts */
-				lastVideo = ts;
-				/* Set mark */
-	 			/*	
-				 * PORT 17.3 sendFrame->subclass is OLD. app_rtsp.new removed this line.
-				 * This is trying to indicate the RTP frame has marker bit set (or not).
-				 * I can not find anything, other than perhaps AST_CONTROL_SRCUPDATE
-				 * that indicates an RTP frame maker being set and in channel.c 
-				 * appears to not used.  Will skip for now.
-				 */
-			     /*	sendFrame->subclass |= rtp->m; OLD */
-				sendFrame.subclass.frame_ending = rtp->m;
+	/* Get flags */
+	flags = fcntl(rtsp,F_GETFD);
 
-				/* Set stats */
-				MediaStatsUpdate(&player->videoStats,ts,ntohs(rtp->seq),ntohl(rtp->ssrc));
-			}
+	/* Set socket non-blocking */
+	fcntl(rtsp,F_SETFD,flags | O_NONBLOCK);
 
-			/* Reset */
-		     /*	sendFrame->delivery.tv_usec = 0; OLD */
-			sendFrame.delivery.tv_usec = 0; /* PORT 17.5 restructure sendFrame */
-		     /*	sendFrame->delivery.tv_sec = 0; OLD */
-			sendFrame.delivery.tv_sec = 0;/* PORT 17.5 restructure sendFrame */
-			/* Don't free the frame outside */
-		     /*	sendFrame->mallocd = 0; OLD */
-			sendFrame.mallocd = 0; /* PORT 17.5 restructure sendFrame */
-			/* Send frame */
-		     /*	ast_write(chan,sendFrame); OLD */
-			ast_write(chan,&sendFrame); /* PORT 17.5 restructure sendFrame */
-
-			/* PORT17.3 ADD. Fix memory-leak. Free mem from strdup(src) */
-		     /*	ast_free((void*)sendFrame->src); PORT 17.5 No longer using strdup*/
-
-		} else if ((outfd==player->audioRtcp) || (outfd==player->videoRtcp)) { /* outfd >0 */
-			/* Set length */
-			rtcpLen = 0;
-			i = 0;
-			
-			/* Read rtcp packet */
-			if (!RecvResponse(outfd,rtcpBuffer,&rtcpLen,rtcpSize,&player->end))
-			{
-				/* log */
-			     /*	ast_log(LOG_DEBUG,"-Error reading rtcp from [%d]\n",outfd); CHANGE*/
-				ast_log(LOG_WARNING,"-Error reading rtcp from [%d]\n",outfd);
-				/* exit*/
-				break;
-			}
+	/* Connect */
+	if (connect(rtsp,(struct sockaddr *)&sendAddr,sizeof(sendAddr))<0)
+		/* Exit */
+		return 0;
+
+	/* Prepare request */
+	snprintf(request,1024,"GET %s HTTP/1.0\r\nUser-Agent: app_rtsp\r\n Accept: application/x-rtsp-tunnelled\r\nPragma: no-cache\r\nCache-Control: no-cache\r\n\r\n",url);
+
+
+	/* Set arrays */
+	infds[0] = rtsp;
+
+	/* Loop */
+	while(!end)
+	{
+		/* No output */
+		outfd = -1;
+		/* Read from channels and fd*/
+		if (ast_waitfor_nandfds(&chan,1,infds,1,NULL,&outfd,&ms))
+		{
+			/* Read frame */
+			f = ast_read(chan);
 
-			/* Process rtcp packets */
-			while(i<rtcpLen)
+			/* If failed */
+			if (!f) 
+				/* exit */
+				break;
+			
+			/* If it's a control channel */
+			if (f->frametype == AST_FRAME_CONTROL) 
+				/* Check for hangup */
+			     /*	if (f->subclass == AST_CONTROL_HANGUP) OLD */
+				if (f->subclass.integer == AST_CONTROL_HANGUP)
+					/* exit */
+					end = 1;
+			/* free frame */
+			ast_frfree(f);
+		} else if (outfd==rtsp) {
+			/* Depending on state */	
+			switch (state)
 			{
-				/* Get packet */
-				struct Rtcp *rtcpRecv = (struct Rtcp*)(rtcpBuffer+i);
-				/* Increase pointer */
-				i += (ntohs(rtcpRecv->common.length)+1)*4;
-				/* Check for bye */
-				if (rtcpRecv->common.pt == RTCP_BYE)
-				{
-					/* End playback */
-					player->end = 1;
-					/* exit */	
+				case RTSP_TUNNEL_CONNECTING:
+					/* Send request */
+					if (!SendRequest(rtsp,request,&end))
+						/* exit*/
+						break;
+					/* It has been opened and sent*/
+					state = RTSP_TUNNEL_NEGOTIATION;	
+					break;
+				case RTSP_TUNNEL_NEGOTIATION:
+					/* Read into buffer */
+					if (!RecvResponse(rtsp,buffer,&bufferLen,bufferSize,&end))
+						break;
+					/* Process */
+					while (1)
+					{	
+						/* If not reading content */
+						if (contentLength==0)
+						{
+							/* Search end of response */
+							if ( (responseLen=GetResponseLen(buffer)) == 0 )
+								/*Exit*/
+								break;
+							/* [v2.1] Index headers once */
+							HeaderIndexBuild(&index,buffer,responseLen);
+							/* Does it have content */
+							contentLength = GetHeaderValueInt(&index,"Content-Length");	
+							/* Is it sdp */
+							if (CheckHeaderValue(&index,"Content-Type","application/sdp"))
+								/* SDP */
+								isSDP = 1;
+							else
+								/* NO SDP*/
+								isSDP = 0;
+							/* If we have the sdp already */
+							if (sdp && HasHeader(&index,"RTP-Info"))
+								/* RTP */
+								state = RTSP_TUNNEL_RTP;
+							/* Get new length */
+							bufferLen -= responseLen;
+							/* Move data to begining */
+						     /*	memcpy(buffer,buffer+responseLen,bufferLen); OLD */
+							memmove(buffer,buffer+responseLen,bufferLen);
+			
+						/* If there is enough data */	
+						} else if (bufferLen>=contentLength) {
+							/* If it's the sdp */
+							if (isSDP)
+								/* Create SDP */
+								sdp = CreateSDP(buffer,contentLength,0);
+							/* Get new length */
+							bufferLen -= contentLength;
+							/* Move data to begining */
+						     /*	memcpy(buffer,buffer+contentLength,bufferLen); OLD */
+							memmove(buffer,buffer+contentLength,bufferLen);
+							/* Reset content */
+							contentLength = 0;
+						} else
+							break;
+					}
+					break;
+				case RTSP_TUNNEL_RTP:
 					break;
-				}
-			}
-			/* Send corresponding report */
-			if (outfd==player->audioRtcp) {
-				/* Create rtcp packet */
-				MediaStatsRR(&player->audioStats,&rtcp);
-				/* Reset media */
-				MediaStatsReset(&player->audioStats);
-				/* Send packet */
-     				send(player->audioRtcp, &rtcp, (ntohs(rtcp.common.length)+1)*4, 0);
-				/* log */
-			    /*	ast_log(LOG_DEBUG,"-Sent rtcp audio report [%d]\n",errno); OLD */
-				ast_debug(2,"-sent rtcp audio report [%d]\n",errno); 
-			} else {
-				/* Create rtcp packet */
-				MediaStatsRR(&player->videoStats,&rtcp);
-				/* Reset media */
-				MediaStatsReset(&player->videoStats);
-				/* Send packet */
-     				send(player->videoRtcp, &rtcp, (ntohs(rtcp.common.length)+1)*4, 0);
-				/* log */
-			     /*	ast_log(LOG_DEBUG,"-Sent rtcp video report [%d]\n",errno); OLD */
-				ast_debug(2,"-sent rtcp video report [%d]\n",errno); 
 			}
-		/* ADDED. SIP States */
-		} else if (outfd==sip_speaker->fd) { /* outfd >0 */
-			/* Depending on state */	
-			switch (sip_speaker->state)
-			{
-			    	case SIP_STATE_OPTIONS:
-			               //ast_debug(5,"-Receiving sip options\n");
-					/* Read into buffer. ignore player->end by using temp*/
-					if (!(recvLen=RecvResponse(sip_speaker->fd,buffer,&bufferLen,bufferSize,&temp)))
-					{
-						break; /* switch-case */
-					}
-					ast_debug(3, "-rx sip options response \n%s\n",buffer); 
-					/* Check for response code */
-					responseCode = GetResponseCode(buffer,bufferLen,1);
+		} else if (state==RTSP_TUNNEL_CONNECTING) 
+			/* Exit f timedout and not conected*/
+			end = 1;
+	}
 
-					ast_debug(3,"-sip options response code [%d]\n",responseCode);
-					/* done with SIP message */
-					bufferLen =0;
-					break;
-			    	case SIP_STATE_INVITE:
-			        	ast_debug(3,"-rx sip invite response\n");
+	/* If there was a sdp */
+	if (sdp)
+		/* Destroy it */
+		DestroySDP(sdp);
 
-					/* Read into buffer. ignore player->end by using temp*/
-					bufferLen =0; /* TEMP */
-					if (!RecvResponse(sip_speaker->fd,buffer,&bufferLen,bufferSize,&temp))
-						break;/* switch-case */
-					ast_debug(3, "\n%s\n",buffer); 
+	/* Close socket */
+	close(rtsp);
 
-					/* Check for response code */
-					responseCode = GetResponseCode(buffer,bufferLen,1);
-					ast_debug(3,"-sip invite response code [%d]\n",responseCode);
+	/* Exit */	
+	return 0;
+}
 
-					if (responseCode>=100 && responseCode<=199)
-					{   /* Provisional Response codes */
-						switch(responseCode){
-							case 100:
-								ast_debug(3,"-sip invite response: 100 Trying\n");
-								break;
-							case 180:
-								ast_debug(3,"-sip invite response: 180 Ringing\n");
-								break;
-							default:
-								ast_debug(3,"-sip invite response: Unsupported 1xx Provisional response code\n");
-						}
-					}
-					else if (responseCode>=200 && responseCode<=299)
-					{
-						if( SipSetPeerTag(sip_speaker,buffer,bufferLen) == -1)
-							ast_debug(3,"SIP: Setting Peer Tag had a Failure.\n");
+/* [v2.1] Registry key: same camera, same credentials */
+static void RtspShareKey(char *key,int size,const char *ip,int port,const char *url,const char *username,const char *password)
+{
+	snprintf(key,size,"%s:%d%s|%s|%s",ip,port,url,username?:"",password?:"");
+}
 
-						/* RFC3261 13.1 2xx responses to a INVITE: session established, dialog is created */
-						sip_speaker->in_a_dialog = 1; /* Set this after getting Peer Tag */
+/* [v2.1] Pipe with both ends non blocking */
+/* Drop a reference, the last one frees the share */
+static void RtspShareRelease(struct RtspShare *share)
+{
+	int refs;
 
-						/* RFC3261 2xx responses, an ACK is generated */
-						/* RFC3261 17.1.1.3 ACK Cseq is to be same as last Cseq INVITE */
-						sip_speaker->cseqm[ACK] = sip_speaker->cseqm[INVITE] - 1; 
-						if (!SipSpeakerAck(sip_speaker,username,2))
-						{
-							ast_log(LOG_ERROR,"Couldn't formulate/send SIP ACK\n");
-							/* Nothing else to do, simply don't do any more SIP stuff */
-						}
+	ast_mutex_lock(&share->lock);
+	refs = --share->refs;
+	ast_mutex_unlock(&share->lock);
 
-						switch(responseCode){
-							case 200:
-								ast_debug(3,"-rx sip invite response: 200 OK\n");
-								/* Search end of SIP Message Header */
-								if ( (responseLen=GetResponseLen(buffer)) == 0 )
-									break; /* switch-case */
+	/* Still in use */
+	if (refs)
+		return;
 
-								ast_debug(5, "ResponseLen: %i\n",responseLen); /*tjl*/
-								contentLength = GetHeaderValueInt(buffer,responseLen,"Content-Length");	
-								if (!CheckHeaderValue(buffer,responseLen,"Content-Type","application/sdp"))
-								{
-									ast_log(LOG_ERROR,"SIP: Content-Type unknown\n");
-									break;/* switch-case */
-								}
-								/* Shift Message Data (i.e. SDP data) to beginning of buffer */
-								bufferLen -= responseLen; 
-								memmove(buffer,buffer+responseLen,bufferLen+1);/* ADDED +1 preserves string term*/
+	/* log */
+	ast_debug(2,"-shared pull of %s:%d%s released after %u frames\n",share->ip,share->port,share->url,share->frames);
+
+	RtspSharePipeClose(share->wake);
+	ao2_cleanup(share->caps);
+	ao2_cleanup(share->writeFormat);
+	ao2_cleanup(share->audioFormat);
+	ao2_cleanup(share->videoFormat);
+	ast_free(share->ip);
+	ast_free(share->url);
+	ast_free(share->username);
+	ast_free(share->password);
+	ast_mutex_destroy(&share->lock);
+	ast_free(share);
+}
 
-								/* If there is not enough room for data in the buffer */	
-								if (bufferLen<contentLength) {
-									ast_log(LOG_WARNING,"SIP: Message Data too big to fit!!\n");
-									break; /* switch-case */
-								}
-								sip_sdp = CreateSDP(buffer,contentLength,1);
-					   
-								if (!sip_sdp)
-								{
-									ast_log(LOG_ERROR,"Couldn't parse sip SDP\n");
-									break; /* switch-case */
-								}
-								ast_debug(3,"Successfully parsed sip SDP\n"); 
+/* Pull thread: runs the camera session with no channel attached */
+static void* RtspShareThread(void *data)
+{
+	struct RtspShare *share = data;
+	struct RtspShareSubscriber *sub;
 
-								/* Check SDP data to ensure only one codec in "Answer" */
-								if( sip_sdp->audio->num != 1){
-									ast_log(LOG_ERROR,"SIP: Peer Answers with more than 1 codec\n");
-								}
-								else{
-									/* Check SDP data to ensure the "Answer" codec matches "Offer" */
-									if(sip_sdp->audio->formats[0]->format != audioFormat){
-										ast_log(LOG_ERROR,"SIP: Peer Answers with mismatched codec\n");
-									}
-									ast_debug(3,"sip tx codec: %x\n",audioFormat);
-									/* Prepare to start sending Voice Frames */
-									enable_sip_tx = 1;
-									sip_prev_samples=0;
-									SipSpeakerSetAudioTransport(sip_speaker,sip_sdp->audio->peer_media_port);
-								}
-								break;
-							default:
-								ast_debug(3,"Not Processing SIP 2xx Successful response code\n");
-						}
-						sip_speaker->state = SIP_STATE_NONE;
-					}
-					else if (responseCode>=400 && responseCode<=499)
-					{  
-						/* 4xx Request Failure */ 
-						/* RFC3261 13.1 For final responses between 300 and 699, the ACK processing is done */
- 						/* Especially need to ACK a 401, otherwise peer will resend a few times */
+	/* log */
+	ast_debug(2,"-shared pull of %s:%d%s started\n",share->ip,share->port,share->url);
 
-						/* Check/Get peer's tag as maybe first/new one peer sends */
-						if( SipSetPeerTag(sip_speaker,buffer,bufferLen) == -1)
-							ast_debug(3,"SIP: Getting Peer Tag had a Failure.\n");
+	/* Play until the last subscriber leaves or the camera ends it */
+	main_loop(NULL,share->ip,share->port,share->url,share->username,share->password,share->isIPv6,0,"None",5060,&share->opts,share);
 
-						/* RFC3261 17.1.1.3 ACK Cseq is to be same as last Cseq INVITE */
-						sip_speaker->cseqm[ACK] = sip_speaker->cseqm[INVITE] - 1; 
-						if (!SipSpeakerAck(sip_speaker,username,4))
-						{
-							ast_log(LOG_ERROR,"Couldn't formulate/send SIP ACK\n");
-							/* Nothing else to do, simply don't do any more SIP stuff */
-						}
-						switch(responseCode){
-							case 400:
-								sip_speaker->state = SIP_STATE_NONE;
-								ast_log(LOG_ERROR,"SIP: 400 Bad Request. Not Processing.\n");
-								break;
-							case 401:
-					                       ast_debug(3,"  sip invite 401 processing\n");
+	/* No new subscribers, and tell the current ones */
+	AST_LIST_LOCK(&rtsp_shares);
+	ast_mutex_lock(&share->lock);
+	if (share->linked)
+	{
+		AST_LIST_REMOVE(&rtsp_shares, share, list);
+		share->linked = 0;
+	}
+	share->ended = 1;
+	AST_LIST_TRAVERSE(&share->subscribers, sub, list)
+		if (write(sub->alert[1],"e",1)<0)
+			ast_debug(3,"-share wake failed (%s)\n",strerror(errno));
+	ast_mutex_unlock(&share->lock);
+	AST_LIST_UNLOCK(&rtsp_shares);
+
+	/* Thread reference */
+	RtspShareRelease(share);
+	ast_atomic_fetchadd_int(&rtsp_share_threads,-1);
+
+	return NULL;
+}
 
-                                                                /* [v2.0]  Adding new way of detecting authentication method */
-					                        ast_debug(3,"    - Checking for Auth Method of Basic\n");
+/*
+ * Create a share, RtspShareStart() runs it.
+ * Codecs are picked against nativeCap, or any format we know when there is
+ * no caller yet (warm pool).
+ */
+static struct RtspShare* RtspShareCreate(struct ast_format_cap *nativeCap,const char *key,char *ip,int port,char *url,
+					 char *username,char *password,int isIPv6,struct RtspSipOptions *opts)
+{
+	struct RtspShare *share;
 
-                                                                struct BasicAuthData basic_data;
+	/* Malloc */
+	if (!(share = ast_calloc(1,sizeof(struct RtspShare))))
+		return NULL;
 
-                                                                if (GetAuthSchemeBasic(buffer,bufferLen,&basic_data) == 0 )
-                                                                {
-					                            ast_debug(3,"    - Found Auth Method of Basic\n");
-						                    ast_log(LOG_WARNING,"SIP Code does not yet support Basic Auth\n");
-                                                                }
-                                                                else
-                                                                {
-					                            ast_debug(3,"    - No Auth Method of Basic\n");
-					                            ast_debug(3,"    - Checking for Auth Method of Digest\n");
+	/* Copy, the caller's strings go away when it hangs up */
+	ast_copy_string(share->key,key,sizeof(share->key));
+	share->ip	= ast_strdup(ip);
+	share->port	= port;
+	share->url	= ast_strdup(url);
+	share->username	= username ? ast_strdup(username) : NULL;
+	share->password	= password ? ast_strdup(password) : NULL;
+	share->isIPv6	= isIPv6;
+	share->opts	= *opts;
+	share->wake[0]	= share->wake[1] = -1;
+	ast_mutex_init(&share->lock);
+	AST_LIST_HEAD_INIT_NOLOCK(&share->subscribers);
+
+	/* Codecs are picked against the first caller */
+	if (!(share->caps = ast_format_cap_alloc(AST_FORMAT_CAP_FLAG_DEFAULT))
+	    || (nativeCap ? ast_format_cap_append_from_cap(share->caps,nativeCap,AST_MEDIA_TYPE_UNKNOWN)
+			  : ast_format_cap_append_by_type(share->caps,AST_MEDIA_TYPE_UNKNOWN))
+	    || !share->ip || !share->url || !RtspSharePipe(share->wake))
+		goto share_error;
+
+	/* One reference for the thread */
+	share->refs = 1;
+
+	return share;
+
+share_error:
+	ast_log(LOG_ERROR,"Couldn't create shared pull of %s:%d%s\n",ip,port,url);
+	share->refs = 1;
+	RtspShareRelease(share);
+	return NULL;
+}
 
-                                                                    struct DigestAuthData digest_data;
+/* Start the pull thread and register. Called with the registry locked, frees the share on error */
+static int RtspShareStart(struct RtspShare *share)
+{
+	pthread_t thread;
 
-                                                                    if (GetAuthSchemeDigest(buffer,bufferLen,&digest_data) == 0 )
-                                                                    {
-					                                ast_debug(3,"    - Found Auth Method of Digest\n");
-									char *nc = NULL;
-									char *cnonce = NULL;
-									char *qop = NULL;
-									char uri[64];
-									sprintf(uri,"sip:%s@%s:%i", username,sip_speaker->ip,sip_port);
-									char *method = "INVITE";
- 
-									ast_debug(5,"  Challenge Response Data- rx_realm: %s nonce: %s uri %s",\
-										digest_data.rx_realm, digest_data.nonce,uri); 
-                                              
-									RtspPlayerDigestAuthorization(sip_speaker,username,\
-											password, sip_realm,\
-											digest_data.nonce, nc, cnonce, qop, uri, \
-											digest_data.rx_realm, method, 1);
+	/* Unload waits for it to leave */
+	ast_atomic_fetchadd_int(&rtsp_share_threads,1);
+	if (ast_pthread_create_detached(&thread,NULL,RtspShareThread,share))
+	{
+		ast_atomic_fetchadd_int(&rtsp_share_threads,-1);
+		ast_log(LOG_ERROR,"Couldn't start shared pull of %s:%d%s\n",share->ip,share->port,share->url);
+		RtspShareRelease(share);
+		return 0;
+	}
 
-									/* Try Invite again w. Auth */
-									if(sip_speaker->cseqm[INVITE] == 3)   
-										ast_debug(3,"  Too many INVITEs \n");
-									else
-									{
-										if (!SipSpeakerInvite(sip_speaker,username,audioFormat,1))
-										{
-											ast_log(LOG_ERROR,"SIP: Couldn't formulate/send INVITE\n");
-											/* Nothing else to do, simply don't do any more SIP stuff */
-										}
-									}
-                                                                    }
-                                                                    else
-                                                                    {
-					                                ast_debug(3,"    - No Auth Method of Digest\n");
-							                ast_log(LOG_ERROR,"No Basic/Digest Authentication header/data present\n");
-                                                                    }
-                                                                }
+	/* Register */
+	AST_LIST_INSERT_TAIL(&rtsp_shares, share, list);
+	share->linked = 1;
 
-#ifdef OLD_AUTH_SCHEME
-								if (CheckHeaderValue(buffer,bufferLen,"WWW-Authenticate","Basic realm="))
-								{
-									ast_log(LOG_WARNING,"SIP Code does not yet support Basic Auth\n");
-								}
-								else if (CheckHeaderValue(buffer,bufferLen,"WWW-Authenticate","Digest"))
-								{
-									struct DigestAuthData digest_data;
+	return 1;
+}
 
-									if(GetAuthHeaderData(sip_speaker,buffer,bufferLen,&digest_data) == -1)
-									{
-									    ast_log(LOG_ERROR,"SIP: WWW-Authenticate header missing\n");
-									}
-									char *nc = NULL;
-									char *cnonce = NULL;
-									char *qop = NULL;
-									char uri[64];
-									sprintf(uri,"sip:%s@%s:%i", username,sip_speaker->ip,sip_port);
-									char *method = "INVITE";
- 
-									ast_debug(5,"  GetChallenge Response- rx_realm: %s nonce: %s uri %s",\
-										digest_data.rx_realm, digest_data.nonce,uri); 
-                                              
-									RtspPlayerDigestAuthorization(sip_speaker,username,\
-											password, sip_realm,\
-											digest_data.nonce, nc, cnonce, qop, uri, \
-											digest_data.rx_realm, method, 1);
+/* Subscribe a channel, starting the pull if nobody is watching that camera */
+static struct RtspShareSubscriber* RtspShareSubscribe(struct ast_channel *chan,char *ip,int port,char *url,
+						      char *username,char *password,int isIPv6,
+						      struct RtspSipOptions *opts,struct RtspShare **shared)
+{
+	struct RtspShareSubscriber *sub;
+	struct RtspShare *share;
+	struct RtspShare *warm = NULL;
+	char key[RTSP_SHARE_KEY];
 
-									/* Try Invite again w. Auth */
-									if(sip_speaker->cseqm[INVITE] == 3)   
-										ast_debug(3,"Too many INVITEs \n");
-									else
-									{
-										if (!SipSpeakerInvite(sip_speaker,username,audioFormat,1))
-										{
-											ast_log(LOG_ERROR,"SIP: Couldn't formulate/send INVITE\n");
-											/* Nothing else to do, simply don't do any more SIP stuff */
-										}
-									}
-								}
-#endif
-								break;
-							case 420:
-								sip_speaker->state = SIP_STATE_NONE;
-								ast_debug(3,"420 Bad Extension. Not Processing.\n");
-								break;
-							default:
-								sip_speaker->state = SIP_STATE_NONE;
-								ast_debug(3,"SIP Not Processing these 4xx Request Failure response codes\n");
-						}
-					}
-					else 
-					{
-						ast_debug(3,"SIP Not Processing 5xx Server Failure nor 6xx Global Failures response code\n");
-						sip_speaker->state = SIP_STATE_NONE;
-					}
+	/* Same camera, same credentials */
+	RtspShareKey(key,sizeof(key),ip,port,url,username,password);
+
+	/* Malloc */
+	if (!(sub = ast_calloc(1,sizeof(struct RtspShareSubscriber))))
+		return NULL;
+	sub->chan = chan;
+	AST_LIST_HEAD_INIT_NOLOCK(&sub->frames);
+	if (!RtspSharePipe(sub->alert))
+	{
+		ast_free(sub);
+		return NULL;
+	}
+
+	AST_LIST_LOCK(&rtsp_shares);
+	/* Look for a running pull, then for a warm one, delivering formats this channel takes */
+	AST_LIST_TRAVERSE(&rtsp_shares, share, list)
+		if (!share->stop && !share->ended && !strcmp(share->key,key)
+		    && RtspShareAccepts(share,ast_channel_nativeformats(chan)))
+		{
+			if (!share->warm)
+				break;
+			if (!warm)
+				warm = share;
+		}
+	/* [v2.1] Claim a warm one, its pull thread sends PLAY */
+	if (!share && (share = warm))
+	{
+		ast_mutex_lock(&share->lock);
+		share->warm = 0;
+		if (write(share->wake[1],"c",1)<0)
+			ast_debug(3,"-share wake failed (%s)\n",strerror(errno));
+		ast_mutex_unlock(&share->lock);
+		/* log */
+		ast_debug(2,"-%s claimed a warm session\n",ast_channel_name(chan));
+	}
+	/* Start one */
+	if (!share && (!(share = RtspShareCreate(ast_channel_nativeformats(chan),key,ip,port,url,username,password,isIPv6,opts))
+		       || !RtspShareStart(share)))
+	{
+		AST_LIST_UNLOCK(&rtsp_shares);
+		RtspSharePipeClose(sub->alert);
+		ast_free(sub);
+		return NULL;
+	}
+	/* Join */
+	ast_mutex_lock(&share->lock);
+	AST_LIST_INSERT_TAIL(&share->subscribers, sub, list);
+	share->refs++;
+	ast_mutex_unlock(&share->lock);
+	AST_LIST_UNLOCK(&rtsp_shares);
 
-					/* done with received SIP message */
-					bufferLen =0;
-					break;
-			    	case SIP_STATE_NONE:
-					/* Get received SIP message */
-					bufferLen =0;
-					if (!RecvResponse(sip_speaker->fd,buffer,&bufferLen,bufferSize,&temp))
-					{
-						ast_log(LOG_ERROR,"SIP: failed to read unsolicted request buffer.\n"); 
-						break;
-					}
-					ast_debug(3,"-sip rx req from peer\n%s",buffer); 
-					if (strncmp(buffer,"BYE",3)==0) {
-						ast_debug(1,">BYE\n"); 
-						/* Send OK back to peer */
-						if( SipSpeakerReply(sip_speaker,buffer,bufferLen,username,ip,sip_port,"BYE")==1)
-							enable_sip_tx=0;
-					      //ast_debug(1,"<BYE\n"); //changed [v2.0]
-						}
-					else if (strncmp(buffer,"INFO",4)==0) {
-						ast_debug(1,">INFO\n"); 
-						/* Send OK back to peer */
-						if( SipSpeakerReply(sip_speaker,buffer,bufferLen,username,ip,sip_port,"BYE")==1)
-							ast_debug(3,"send OK\n");
-			                	//ast_debug(1,"<INFO\n"); //change [v2.0]
-					}
-					else if (strncmp(buffer,"CANCEL",5)==0) {
-						ast_debug(1,">CANCEL\n"); 
-				              //ast_debug(1,"<CANCEL\n"); //change [v2.0]
-					}
-					else {
-						ast_log(LOG_ERROR,"Unsupported SIP Request receive");
-					}
+	/* log */
+	ast_debug(2,"-%s watching %s:%d%s\n",ast_channel_name(chan),ip,port,url);
 
-					/* done with received SIP message */
-					bufferLen =0;
-					break;
-			}/* end of SIP States */
-		} else if (rchan == NULL && outfd <0 && ms==0 && player->state!=RTSP_PLAYING) {
-			/* log */
-			ast_log(LOG_ERROR,"-timedout and not connected [%d]",outfd);
-			/* Exit f timedout and not conected*/
-			player->end = 1;
-		} 
+	*shared = share;
+	return sub;
+}
 
-		/* If the playback has started */
-		if (player->state==RTSP_PLAYING) 
+/* Leave, the last one out stops the pull */
+static void RtspShareUnsubscribe(struct RtspShare *share, struct RtspShareSubscriber *sub)
+{
+	struct ast_frame *f;
+
+	AST_LIST_LOCK(&rtsp_shares);
+	ast_mutex_lock(&share->lock);
+	AST_LIST_REMOVE(&share->subscribers, sub, list);
+	if (AST_LIST_EMPTY(&share->subscribers) && !share->stop)
+	{
+		/* Stop and let the next caller start a new one */
+		share->stop = 1;
+		if (share->linked)
+		{
+			AST_LIST_REMOVE(&rtsp_shares, share, list);
+			share->linked = 0;
+		}
+		if (write(share->wake[1],"s",1)<0)
+			ast_debug(3,"-share wake failed (%s)\n",strerror(errno));
+	}
+	ast_mutex_unlock(&share->lock);
+	AST_LIST_UNLOCK(&rtsp_shares);
+
+	/* log */
+	if (sub->dropped)
+		ast_log(LOG_NOTICE,"%s dropped %u frames from the shared pull\n",ast_channel_name(sub->chan),sub->dropped);
+
+	/* Free */
+	while ((f = AST_LIST_REMOVE_HEAD(&sub->frames, frame_list)))
+		ast_frfree(f);
+	RtspSharePipeClose(sub->alert);
+	ast_free(sub);
+
+	RtspShareRelease(share);
+}
+
+/*
+ * [v2.1] Channel side of a shared pull.
+ * Writes the frames queued by the pull thread, and handles hangup and
+ * dtmf the same way main_loop() does.
+ */
+static int RtspShareWatch(struct ast_channel *chan,char *ip,int port,char *url,char *username,char *password,
+			  int isIPv6,struct RtspSipOptions *opts)
+{
+	AST_LIST_HEAD_NOLOCK(, ast_frame) frames;
+	struct RtspShareSubscriber *sub;
+	struct RtspShare *share = NULL;
+	struct ast_channel *rchan;
+	struct ast_format *writeFormat = NULL;
+	struct ast_frame *f;
+	char wakeBuffer[16];
+	int outfd;
+	int ms;
+	int res = 0;
+	int end = 0;
+
+	/* Join */
+	if (!(sub = RtspShareSubscribe(chan,ip,port,url,username,password,isIPv6,opts,&share)))
+	{
+		/* log */
+		ast_log(LOG_ERROR,"Couldn't subscribe to %s:%d%s\n",ip,port,url);
+		/* exit */
+		return 0;
+	}
+
+	/* Loop */
+	while (!end)
+	{
+		/* No output */
+		outfd = -1;
+		ms = 1000;
+		/* Wait for channel or frames */
+		rchan = ast_waitfor_nandfds(&chan,1,&sub->alert[0],1,NULL,&outfd,&ms);
+
+		/* Channel active */
+		if (rchan && outfd<0)
 		{
-			/* If is not the first one */
-			if (!ast_tvzero(rtcptv))
+			/* Read frame */
+			if (!(f = ast_read(chan)))
+				break;
+			/* Check for hangup */
+			if (f->frametype == AST_FRAME_CONTROL && f->subclass.integer == AST_CONTROL_HANGUP)
 			{
-				/* Check Rtcp timeout */
-				if (ast_tvdiff_ms(ast_tvnow(),rtcptv)>10000)
+				ast_debug(2,"-Hangup\n");
+				end = 1;
+			/* Check for dtmf extension in context */
+			} else if (f->frametype == AST_FRAME_DTMF) {
+				char dtmf[2] = { f->subclass.integer, 0 };
+				if (ast_exists_extension(chan, ast_channel_context(chan), dtmf, 1, NULL))
 				{
-					/* If got audio */
-					if (player->audioRtcp>0)
-					{
-						/* Create rtcp packet */
-						MediaStatsRR(&player->audioStats,&rtcp);
-						/* Reset media */
-						MediaStatsReset(&player->audioStats);
-						/* Send packet */
-						send(player->audioRtcp, &rtcp, (ntohs(rtcp.common.length)+1)*4, 0);
-						/* log */
-					     /*	ast_log(LOG_DEBUG,"-Sent rtcp audio report [%d]\n",errno); OLD */
-						ast_debug(2,"-sent rtcp audio report [%d]\n",errno); 
-					}
-					/* If got audio */
-					if (player->videoRtcp>0)
-					{
-						/* Create rtcp packet */
-						MediaStatsRR(&player->videoStats,&rtcp);
-						/* Reset media */
-						MediaStatsReset(&player->videoStats);
-						/* Send packet */
-						send(player->videoRtcp, &rtcp, (ntohs(rtcp.common.length)+1)*4, 0);
-						/* log */
-					     /*	ast_log(LOG_DEBUG,"-Sent rtcp video report [%d]\n",errno); OLD */
-						ast_debug(2,"-sent rtcp video report [%d]\n",errno); 
-					}
-					/* Send OPTIONS */
-                                        RtspPlayerOptions(player,url);
-					/* log */
-				     /*	ast_log(LOG_DEBUG,"-Sending OPTIONS and reseting RTCP timer\n"); OLD */
-					ast_debug(2,"-sending options and resetting RTCP timer\n");
-					/* Reset timeout value */
-					rtcptv = ast_tvnow();
+					/* Set extension to jump */
+					res = f->subclass.integer;
+					end = 1;
 				}
-			} else {
-				/* log */
-			     /*	ast_log(LOG_DEBUG,"-Init RTCP timer\n"); */
-				ast_debug(2,"-init RTCP timer\n");
-				/* Init timeout value */
-				rtcptv = ast_tvnow();
+			}
+			/* Free frame */
+			ast_frfree(f);
+		} else if (outfd==sub->alert[0]) {
+			/* Drain */
+			if (read(sub->alert[0],wakeBuffer,sizeof(wakeBuffer))<0)
+				ast_debug(3,"-share wake read failed (%s)\n",strerror(errno));
+			/* Take all queued frames */
+			AST_LIST_HEAD_INIT_NOLOCK(&frames);
+			ast_mutex_lock(&share->lock);
+			AST_LIST_APPEND_LIST(&frames, &sub->frames, frame_list);
+			sub->queued = 0;
+			/* Follow the format chosen by the pull */
+			if (share->writeFormat && share->writeFormat!=writeFormat)
+			{
+				writeFormat = share->writeFormat;
+				ast_set_write_format(chan,writeFormat);
+			}
+			/* Camera is gone */
+			if (share->ended)
+				end = 1;
+			ast_mutex_unlock(&share->lock);
+			/* Write them */
+			while ((f = AST_LIST_REMOVE_HEAD(&frames, frame_list)))
+			{
+				ast_write(chan,f);
+				ast_frfree(f);
 			}
 		}
 	}
 
-rstp_play_stop:
-
-	/* log */
-     /*	ast_log(LOG_DEBUG,"-rtsp_play end loop [%d]\n",res); OLD */
-	ast_debug(2,"-rtsp_play end loop [%d]\n",res);
-
-	/* Send rtsp teardown if something was setup */
-	if (player->state>RTSP_DESCRIBE)
-		/* Teardown */
-		RtspPlayerTeardown(player);
+	/* Leave */
+	RtspShareUnsubscribe(share,sub);
 
-	/* Send SIP BYE if in a dialog */
-	if (sip_enable) {
-		if (sip_speaker->in_a_dialog){
-			ms = 500;
-			int result;
-			SipSpeakerBye(sip_speaker,username);
-			result=ast_wait_for_input(sip_speaker->fd,ms); /*Wait for response */
-			if(result>0){
-				ast_debug(3,"rx bye response\n");
-				bufferLen =0; /* TEMP */
-				if (!RecvResponse(sip_speaker->fd,buffer,&bufferLen,bufferSize,&temp))
-					ast_debug(3,"Couldn't get BYE response from buffer\n");
-				else{
-					ast_debug(3, "\n%s\n",buffer);
-					/* Check for response code */
-					responseCode = GetResponseCode(buffer,bufferLen,1);
-					ast_debug(3,"-SIP Bye response code [%d]\n",responseCode);
+	return res;
+}
 
-					if (responseCode==401){
-						SipSetPeerTag(sip_speaker,buffer,bufferLen);
-						sip_speaker->cseqm[ACK] = sip_speaker->cseqm[BYE] - 1;
-						SipSpeakerAck(sip_speaker,username,4);
+/* [v2.1] Parse j(min:max:target) depths in ms. Empty or missing fields keep defaults */
+static void ParseJitterOption(struct RtspSipOptions *opts, char *arg)
+{
+	char *field;
+	int *depths[3] = { &opts->jbMin, &opts->jbMax, &opts->jbTarget };
+	int i = 0;
 
-                                                /* [v2.0]  Adding new way of detecting authentication method */
-					        ast_debug(3,"  sip bye 401 Processing\n");
-					        ast_debug(3,"    - Checking for Auth Method of Basic\n");
-                                                struct BasicAuthData basic_data;
-                                                if (GetAuthSchemeBasic(buffer,bufferLen,&basic_data) == 0 )
-                                                {
-					            ast_debug(3,"    - Found Auth Method of Basic\n");
-						    ast_log(LOG_WARNING,"SIP Code does not yet support Basic Auth\n");
-                                                }
-                                                else
-                                                {
-					            ast_debug(5,"    - No Auth Method of Basic\n");
-					            ast_debug(5,"    - Checking for Auth Method of Digest\n");
+	/* Set defaults */
+	opts->jitterBuffer	= 1;
+	opts->jbMin		= JB_DEFAULT_MIN;
+	opts->jbMax		= JB_DEFAULT_MAX;
+	opts->jbTarget		= JB_DEFAULT_TARGET;
 
-                                                    struct DigestAuthData digest_data;
-                                                    if (GetAuthSchemeDigest(buffer,bufferLen,&digest_data) == 0 )
-                                                    {
-					                ast_debug(3,"    - Found Auth Method of Digest\n");
-							char *nc = NULL;
-							char *cnonce = NULL;
-							char *qop = NULL;
-							char uri[64];
-							sprintf(uri,"sip:%s@%s:%i", username,sip_speaker->ip,sip_port);
-							char *method = "BYE";
+	/* Get each field */
+	while (arg && i<3 && (field = strsep(&arg,":")))
+	{
+		if (!ast_strlen_zero(field))
+			*depths[i] = atoi(field);
+		i++;
+	}
 
-							ast_debug(5,"  input data for challenge response- rx_realm: %s nonce: %s uri %s",\
-								digest_data.rx_realm, digest_data.nonce,uri);
+	/* Sanity: the ring holds JB_SLOTS packets */
+	if (opts->jbMin<0)
+		opts->jbMin = 0;
+	if (opts->jbMax>JB_SLOTS*JB_TICK)
+		opts->jbMax = JB_SLOTS*JB_TICK;
+	if (opts->jbMax<opts->jbMin)
+		opts->jbMax = opts->jbMin;
+	if (opts->jbTarget<opts->jbMin)
+		opts->jbTarget = opts->jbMin;
+	if (opts->jbTarget>opts->jbMax)
+		opts->jbTarget = opts->jbMax;
+
+	ast_debug(2,"-jitter buffer min:%d max:%d target:%d ms\n",opts->jbMin,opts->jbMax,opts->jbTarget);
+}
 
-							RtspPlayerDigestAuthorization(sip_speaker,username,password, sip_realm,\
-									digest_data.nonce, nc, cnonce, qop, uri, \
-									digest_data.rx_realm, method, 1);
+/* [v2.1] Parse c(codec:codec...), unknown names are skipped */
+static void ParseSipCodecsOption(struct RtspSipOptions *opts, char *arg)
+{
+	char *name;
+	int codec;
 
-							/* Try Bye again w. Auth */
-							SipSpeakerBye(sip_speaker,username);
-                                                    }
-                                                    else
-                                                    {
-					                ast_debug(3,"    - No Auth Method of Digest\n");
-							ast_log(LOG_ERROR,"No Basic/Digest Authentication header/data present\n");
-                                                    }
-                                                }
+	while (arg && (name = strsep(&arg,":")))
+	{
+		if (ast_strlen_zero(name))
+			continue;
+		if ((codec = SipCodecFind(name))<0)
+		{
+			ast_log(LOG_WARNING,"Unknown talkback codec '%s'\n",name);
+			continue;
+		}
+		if (opts->numSipCodecs<SIP_MAX_CODECS)
+			opts->sipCodecs[opts->numSipCodecs++] = codec;
+	}
+}
 
-#ifdef OLD_AUTH_SCHEME
-				                if (CheckHeaderValue(buffer,bufferLen,"WWW-Authenticate","Basic realm="))
-						{
-							ast_log(LOG_WARNING,"SIP Code does not yet support Basic Auth\n");
-						}
-						else if (CheckHeaderValue(buffer,bufferLen,"WWW-Authenticate","Digest"))
-						{
-							struct DigestAuthData digest_data;
-							if(GetAuthHeaderData(sip_speaker,buffer,bufferLen,&digest_data) == -1)
-							{
-								ast_log(LOG_ERROR,"WWW-Authenticate header missing\n");
-							}
-							char *nc = NULL;
-							char *cnonce = NULL;
-							char *qop = NULL;
-							char uri[64];
-							sprintf(uri,"sip:%s@%s:%i", username,sip_speaker->ip,sip_port);
-							char *method = "BYE";
+/* [v2.1] Application options, also used for the options= of pooled cameras */
+static void RtspSipParseOptions(struct RtspSipOptions *opts, char *options)
+{
+	struct ast_flags opt_flags = { 0, };
+	char *opt_args[OPT_ARG_ARRAY_SIZE] = { NULL, };
+
+	if (!ast_strlen_zero(options))
+		ast_app_parse_options(rtsp_sip_opts, &opt_flags, opt_args, options);
+	opts->batchIngest = ast_test_flag(&opt_flags, OPT_BATCH_INGEST) ? 1 : 0;
+	opts->interleaved = ast_test_flag(&opt_flags, OPT_INTERLEAVED) ? 1 : 0;
+	opts->sharedPull = ast_test_flag(&opt_flags, OPT_SHARED_PULL) ? 1 : 0;
+	opts->pipelined = ast_test_flag(&opt_flags, OPT_PIPELINED) ? 1 : 0;
+	opts->earlySip = ast_test_flag(&opt_flags, OPT_EARLY_SIP) ? 1 : 0;
+	opts->channelWriter = ast_test_flag(&opt_flags, OPT_CHANNEL_WRITER) ? 1 : 0;
+	/* s(depth) */
+	opts->pacedTalkback = ast_test_flag(&opt_flags, OPT_PACED_TALKBACK) ? 1 : 0;
+	/* c(codec:codec...) */
+	opts->numSipCodecs = 0;
+	if (ast_test_flag(&opt_flags, OPT_SIP_CODECS))
+		ParseSipCodecsOption(opts,opt_args[OPT_ARG_SIP_CODECS]);
+	opts->paceDepth = PACER_DEFAULT_DEPTH;
+	if (opts->pacedTalkback && !ast_strlen_zero(opt_args[OPT_ARG_PACED_TALKBACK]))
+		opts->paceDepth = atoi(opt_args[OPT_ARG_PACED_TALKBACK]);
+	/* j(min:max:target), any of them may be left empty */
+	if (ast_test_flag(&opt_flags, OPT_JITTER_BUFFER))
+		ParseJitterOption(opts,opt_args[OPT_ARG_JITTER_BUFFER]);
+}
 
-							ast_debug(5,"  GetChallenge Response- rx_realm: %s nonce: %s uri %s",\
-								digest_data.rx_realm, digest_data.nonce,uri);
+/*
+ * [v2.1] Warm session pool, configured per camera in rtsp_sip.conf.
+ * A pooled session is a shared pull whose thread connects, authenticates
+ * and runs DESCRIBE and SETUP ahead of time, then holds PLAY and keeps the
+ * session alive. A call to the same URL claims it and only PLAY is left.
+ * The pool is refilled while no call is watching the camera, so it never
+ * adds sessions on top of a running one. A warm session idle for max_idle
+ * seconds is torn down and replaced, which also refreshes stale nonces.
+ */
+#define RTSP_SIP_CONFIG		"rtsp_sip.conf"
+#define RTSP_POOL_RETRY		5	/* s between starts for one camera */
+#define RTSP_POOL_MAX_IDLE	600	/* s */
 
-							RtspPlayerDigestAuthorization(sip_speaker,username,password, sip_realm,\
-									digest_data.nonce, nc, cnonce, qop, uri, \
-									digest_data.rx_realm, method, 1);
+struct RtspPoolCamera
+{
+	char			name[64];
+	char			*uri;            /* copy, url/username/password point into it */
+	char			*hostport;       /* copy, ip points into it */
+	char			*ip;
+	int			port;
+	char			*url;
+	char			*username;
+	char			*password;
+	int			isIPv6;
+	int			poolSize;
+	int			maxIdle;
+	struct RtspSipOptions	opts;
+	char			key[RTSP_SHARE_KEY];
+	struct timeval		lastStart;
+	AST_LIST_ENTRY(RtspPoolCamera) list;
+};
 
-							/* Try Bye again w. Auth */
-							SipSpeakerBye(sip_speaker,username);
-						}
-#endif
-					}
-				}
-			}
-			sip_speaker->in_a_dialog=0;
-		}
-        }
+/* Only changed at load and unload, while the pool thread is not running */
+static AST_LIST_HEAD_NOLOCK_STATIC(rtsp_pool_cameras, RtspPoolCamera);
+static pthread_t rtsp_pool_thread = AST_PTHREADT_NULL;
+AST_MUTEX_DEFINE_STATIC(rtsp_pool_lock);
+static ast_cond_t rtsp_pool_cond;
+static int rtsp_pool_stop;
 
-	if (sip_sdp && sip_enable)
-		DestroySDP(sip_sdp);
-	ast_debug(3,"-sip tx vf count pre:%i post:%i error:%i\n",pre_enable_vf_tx_count,post_enable_vf_tx_count,sip_tx_error_count);
-	/*
-	 * PORT 17.5 restructure sendFrame. No longer malloc'd */
-	/* Free frame */
-     /*	if (sendFrame) OLD */
-		/* Free memory */
-	     /*	free(sendFrame); OLD */
-	     /*	ast_free(sendFrame); * PORT17.3 */
+/* Split rtsp://[user[:password]@]host[:port]/path the same way app_rtsp_sip() does */
+static int RtspPoolParseUri(struct RtspPoolCamera *camera)
+{
+	char *url;
+	char *i;
 
-	/* If ther was a sdp */
-	if (sdp)
-		/* Destroy it */
-		DestroySDP(sdp);
+	/* Only rtsp */
+	if (strncmp(camera->uri,"rtsp://",7))
+		return 0;
+	url = camera->uri + 7;
 
-rtsp_play_clean:
-	/* Close sockets */
-	RtspPlayerClose(player);
-	if(sip_enable)
-		RtspPlayerClose(sip_speaker);
+	/* Check for username and password */
+	if ((i=strstr(url,"@"))!=NULL)
+	{
+		i[0] = 0;
+		camera->username = url;
+		url = i + 1;
+		/* Check for password */
+		if ((i=strstr(camera->username,":"))!=NULL)
+		{
+			i[0] = 0;
+			camera->password = i + 1;
+		}
+	}
 
-rtsp_play_end:
-	/* Destroy player */
-	RtspPlayerDestroy(player);
-	if(sip_enable)
-		RtspPlayerDestroy(sip_speaker);
+	/* Get server part, the path keeps its slash */
+	if ((i=strstr(url,"/"))==NULL || !(camera->hostport = ast_strndup(url,i-url)))
+		return 0;
+	camera->ip = camera->hostport;
+	camera->url = i;
 
-	/* log */
-	ast_log(LOG_NOTICE,"<rtsp-sip main loop\n");
+	/* Check if it is ipv6 */
+	camera->port = 554;
+	if (camera->ip[0]=='[')
+	{
+		camera->isIPv6 = 1;
+		camera->ip++;
+		if ((i=strstr(camera->ip,"]"))==NULL)
+			return 0;
+		i[0] = 0;
+		if (i[1]==':')
+			camera->port = atoi(i+2);
+	} else if ((i=strstr(camera->ip,":"))!=NULL) {
+		camera->port = atoi(i+1);
+		i[0] = 0;
+	}
 
-	/* Exit */	
-	return res;
+	return 1;
 }
 
-static int rtsp_tunnel(struct ast_channel *chan,char *ip, int port, char *url)
+/* Camera has warm sessions configured. The list only changes on load and unload */
+static int RtspPoolHasCamera(const char *ip,int port,const char *url,const char *username,const char *password)
 {
-	struct sockaddr_in sendAddr;
-	struct ast_frame *f;
-
-	int infds[1];
-	int outfd;
-	int rtsp;
+	struct RtspPoolCamera *camera;
+	char key[RTSP_SHARE_KEY];
+
+	/* Same key as the shares */
+	RtspShareKey(key,sizeof(key),ip,port,url,username,password);
+	AST_LIST_TRAVERSE(&rtsp_pool_cameras, camera, list)
+		if (!strcmp(camera->key,key))
+			return 1;
+	return 0;
+}
 
-	int state = RTSP_TUNNEL_CONNECTING;
-	char request[1024];
-	char buffer[16384];
-     /*	char *i;  PORT 17.3 compiler warning not used, so removed */
-	int  bufferSize = 16383; /* One less for finall \0 */
-	int  bufferLen = 0;
-	int  responseLen = 0;
-	int  contentLength = 0;
+/* Start warm sessions for cameras that are short of them */
+static void RtspPoolFill(void)
+{
+	struct RtspPoolCamera *camera;
+	struct RtspShare *share;
+	int warm;
+	int live;
 
-        struct SDPContent* sdp = NULL; /* PORT 17.3: init to NULL to remove compiler warning */
+	AST_LIST_TRAVERSE(&rtsp_pool_cameras, camera, list)
+	{
+		/* Don't hammer a camera that keeps failing */
+		if (ast_tvdiff_ms(ast_tvnow(),camera->lastStart)<RTSP_POOL_RETRY*1000)
+			continue;
+
+		AST_LIST_LOCK(&rtsp_shares);
+		/* Count what is running */
+		warm = live = 0;
+		AST_LIST_TRAVERSE(&rtsp_shares, share, list)
+			if (!share->stop && !share->ended && !strcmp(share->key,camera->key))
+			{
+				if (share->warm)
+					warm++;
+				else
+					live++;
+			}
+		/* One short, and nobody watching */
+		if (!live && warm<camera->poolSize
+		    && (share = RtspShareCreate(NULL,camera->key,camera->ip,camera->port,camera->url,
+						camera->username,camera->password,camera->isIPv6,&camera->opts)))
+		{
+			share->warm = 1;
+			share->maxIdle = camera->maxIdle;
+			/* log */
+			if (RtspShareStart(share))
+				ast_debug(2,"-starting warm session %d/%d for %s\n",warm+1,camera->poolSize,camera->name);
+			camera->lastStart = ast_tvnow();
+		}
+		AST_LIST_UNLOCK(&rtsp_shares);
+	}
+}
 
-	int  isSDP;
+static void* RtspPoolThread(void *data)
+{
+	struct timeval tv;
+	struct timespec ts;
 
-	int end = 0;
-	int ms = 10000;
-	int flags;
+	/* Nothing passed */
+	(void)data;
 
+	ast_mutex_lock(&rtsp_pool_lock);
+	while (!rtsp_pool_stop)
+	{
+		/* Top up */
+		RtspPoolFill();
+		/* Once a second */
+		tv = ast_tvadd(ast_tvnow(),ast_tv(1,0));
+		ts.tv_sec = tv.tv_sec;
+		ts.tv_nsec = tv.tv_usec*1000;
+		ast_cond_timedwait(&rtsp_pool_cond,&rtsp_pool_lock,&ts);
+	}
+	ast_mutex_unlock(&rtsp_pool_lock);
 
-	/* open socket */
-	rtsp = socket(PF_INET,SOCK_STREAM,0);
+	return NULL;
+}
 
-	/* empty addres */
-	memset(&sendAddr,0,sizeof(struct sockaddr_in));
+/* Read the pooled cameras from rtsp_sip.conf. Each section other than general is a camera */
+static int RtspPoolLoad(void)
+{
+	struct ast_flags config_flags = { 0 };
+	struct ast_config *cfg;
+	struct ast_variable *var;
+	struct RtspPoolCamera *camera;
+	char *category = NULL;
+	char *options;
+	int pooled = 0;
+
+	/* Optional */
+	cfg = ast_config_load2(RTSP_SIP_CONFIG,"app_rtsp_sip",config_flags);
+	if (!cfg || cfg==CONFIG_STATUS_FILEINVALID)
+	{
+		ast_debug(1,"No %s, no warm sessions\n",RTSP_SIP_CONFIG);
+		return 0;
+	}
 
-	/* Set data */
-	sendAddr.sin_family	 = AF_INET;
-	sendAddr.sin_addr.s_addr = INADDR_ANY;
-	sendAddr.sin_addr.s_addr = inet_addr(ip);
-	sendAddr.sin_port	 = htons(port);
+	while ((category = ast_category_browse(cfg,category)))
+	{
+		/* Module settings */
+		if (!strcasecmp(category,"general"))
+		{
+			for (var = ast_variable_browse(cfg,category); var; var = var->next)
+			{
+				if (!strcasecmp(var->name,"sdp_cache_ttl"))
+					rtsp_sip_sdp_ttl = atoi(var->value);
+				else if (!strcasecmp(var->name,"media_threads")) /* [v2.1] */
+					rtsp_sip_media_threads = atoi(var->value);
+				else if (!strcasecmp(var->name,"media_backend")) /* [v2.1] */
+					rtsp_sip_media_uring = !strcasecmp(var->value,"io_uring");
+			}
+			continue;
+		}
+		if (!(camera = ast_calloc(1,sizeof(struct RtspPoolCamera))))
+			break;
+		ast_copy_string(camera->name,category,sizeof(camera->name));
+		camera->maxIdle = RTSP_POOL_MAX_IDLE;
+		options = NULL;
 
-	/* Get flags */
-	flags = fcntl(rtsp,F_GETFD);
+		for (var = ast_variable_browse(cfg,category); var; var = var->next)
+		{
+			if (!strcasecmp(var->name,"url"))
+			{
+				ast_free(camera->uri);
+				camera->uri = ast_strdup(var->value);
+			} else if (!strcasecmp(var->name,"pool_size")) {
+				camera->poolSize = atoi(var->value);
+			} else if (!strcasecmp(var->name,"max_idle")) {
+				camera->maxIdle = atoi(var->value);
+			} else if (!strcasecmp(var->name,"keepalive")) {
+				camera->opts.getParameter = !strcasecmp(var->value,"get_parameter");
+			} else if (!strcasecmp(var->name,"options")) {
+				options = ast_strdupa(var->value);
+			} else {
+				ast_log(LOG_WARNING,"Unknown option %s in [%s] of %s\n",var->name,category,RTSP_SIP_CONFIG);
+			}
+		}
 
-	/* Set socket non-blocking */
-	fcntl(rtsp,F_SETFD,flags | O_NONBLOCK);
+		/* Options as given to the application */
+		RtspSipParseOptions(&camera->opts,options);
+		if (camera->poolSize<0)
+			camera->poolSize = 0;
+		if (camera->maxIdle<0)
+			camera->maxIdle = 0;
 
-	/* Connect */
-	if (connect(rtsp,(struct sockaddr *)&sendAddr,sizeof(sendAddr))<0)
-		/* Exit */
-		return 0;
+		if (!camera->uri || !RtspPoolParseUri(camera))
+		{
+			ast_log(LOG_WARNING,"Camera [%s] in %s needs url=rtsp://[user[:password]@]host[:port]/path\n",category,RTSP_SIP_CONFIG);
+			ast_free(camera->hostport);
+			ast_free(camera->uri);
+			ast_free(camera);
+			continue;
+		}
+		RtspShareKey(camera->key,sizeof(camera->key),camera->ip,camera->port,camera->url,camera->username,camera->password);
 
-	/* Prepare request */
-	snprintf(request,1024,"GET %s HTTP/1.0\r\nUser-Agent: app_rtsp\r\n Accept: application/x-rtsp-tunnelled\r\nPragma: no-cache\r\nCache-Control: no-cache\r\n\r\n",url);
+		/* log */
+		ast_debug(1,"Camera [%s] %s:%d%s pool_size %d max_idle %d s\n",camera->name,camera->ip,camera->port,camera->url,camera->poolSize,camera->maxIdle);
+		AST_LIST_INSERT_TAIL(&rtsp_pool_cameras, camera, list);
+		pooled += camera->poolSize;
+	}
+	ast_config_destroy(cfg);
 
+	/* [v2.1] Before any warm session starts */
+	MediaReactorStart();
 
-	/* Set arrays */
-	infds[0] = rtsp;
+	/* Nothing to keep warm */
+	if (!pooled)
+		return 0;
 
-	/* Loop */
-	while(!end)
+	ast_cond_init(&rtsp_pool_cond,NULL);
+	rtsp_pool_stop = 0;
+	if (ast_pthread_create_background(&rtsp_pool_thread,NULL,RtspPoolThread,NULL))
 	{
-		/* No output */
-		outfd = -1;
-		/* Read from channels and fd*/
-		if (ast_waitfor_nandfds(&chan,1,infds,1,NULL,&outfd,&ms))
-		{
-			/* Read frame */
-			f = ast_read(chan);
+		ast_log(LOG_ERROR,"Couldn't start the warm session pool\n");
+		rtsp_pool_thread = AST_PTHREADT_NULL;
+		ast_cond_destroy(&rtsp_pool_cond);
+		return -1;
+	}
+	return 0;
+}
 
-			/* If failed */
-			if (!f) 
-				/* exit */
-				break;
-			
-			/* If it's a control channel */
-			if (f->frametype == AST_FRAME_CONTROL) 
-				/* Check for hangup */
-			     /*	if (f->subclass == AST_CONTROL_HANGUP) OLD */
-				if (f->subclass.integer == AST_CONTROL_HANGUP)
-					/* exit */
-					end = 1;
-			/* free frame */
-			ast_frfree(f);
-		} else if (outfd==rtsp) {
-			/* Depending on state */	
-			switch (state)
-			{
-				case RTSP_TUNNEL_CONNECTING:
-					/* Send request */
-					if (!SendRequest(rtsp,request,&end))
-						/* exit*/
-						break;
-					/* It has been opened and sent*/
-					state = RTSP_TUNNEL_NEGOTIATION;	
-					break;
-				case RTSP_TUNNEL_NEGOTIATION:
-					/* Read into buffer */
-					if (!RecvResponse(rtsp,buffer,&bufferLen,bufferSize,&end))
-						break;
-					/* Process */
-					while (1)
-					{	
-						/* If not reading content */
-						if (contentLength==0)
-						{
-							/* Search end of response */
-							if ( (responseLen=GetResponseLen(buffer)) == 0 )
-								/*Exit*/
-								break;
-							/* Does it have content */
-							contentLength = GetHeaderValueInt(buffer,responseLen,"Content-Length");	
-							/* Is it sdp */
-							if (CheckHeaderValue(buffer,responseLen,"Content-Type","application/sdp"))
-								/* SDP */
-								isSDP = 1;
-							else
-								/* NO SDP*/
-								isSDP = 0;
-							/* If we have the sdp already */
-							if (sdp && HasHeader(buffer,responseLen,"RTP-Info"))
-								/* RTP */
-								state = RTSP_TUNNEL_RTP;
-							/* Get new length */
-							bufferLen -= responseLen;
-							/* Move data to begining */
-						     /*	memcpy(buffer,buffer+responseLen,bufferLen); OLD */
-							memmove(buffer,buffer+responseLen,bufferLen);
-			
-						/* If there is enough data */	
-						} else if (bufferLen>=contentLength) {
-							/* If it's the sdp */
-							if (isSDP)
-								/* Create SDP */
-								sdp = CreateSDP(buffer,contentLength,0);
-							/* Get new length */
-							bufferLen -= contentLength;
-							/* Move data to begining */
-						     /*	memcpy(buffer,buffer+contentLength,bufferLen); OLD */
-							memmove(buffer,buffer+contentLength,bufferLen);
-							/* Reset content */
-							contentLength = 0;
-						} else
-							break;
-					}
-					break;
-				case RTSP_TUNNEL_RTP:
-					break;
-			}
-		} else if (state==RTSP_TUNNEL_CONNECTING) 
-			/* Exit f timedout and not conected*/
-			end = 1;
+/* Stop the pool and every pull, wait for their threads */
+static void RtspPoolUnload(void)
+{
+	struct RtspPoolCamera *camera;
+	struct RtspShare *share;
+	int threads;
+	int i;
+
+	/* No more refills */
+	if (rtsp_pool_thread!=AST_PTHREADT_NULL)
+	{
+		ast_mutex_lock(&rtsp_pool_lock);
+		rtsp_pool_stop = 1;
+		ast_cond_signal(&rtsp_pool_cond);
+		ast_mutex_unlock(&rtsp_pool_lock);
+		pthread_join(rtsp_pool_thread,NULL);
+		rtsp_pool_thread = AST_PTHREADT_NULL;
+		ast_cond_destroy(&rtsp_pool_cond);
 	}
 
-	/* If there was a sdp */
-	if (sdp)
-		/* Destroy it */
-		DestroySDP(sdp);
+	/* Stop whatever is still pulling */
+	AST_LIST_LOCK(&rtsp_shares);
+	AST_LIST_TRAVERSE_SAFE_BEGIN(&rtsp_shares, share, list)
+	{
+		ast_mutex_lock(&share->lock);
+		share->stop = 1;
+		share->linked = 0;
+		if (write(share->wake[1],"s",1)<0)
+			ast_debug(3,"-share wake failed (%s)\n",strerror(errno));
+		ast_mutex_unlock(&share->lock);
+		AST_LIST_REMOVE_CURRENT(list);
+	}
+	AST_LIST_TRAVERSE_SAFE_END;
+	AST_LIST_UNLOCK(&rtsp_shares);
 
-	/* Close socket */
-	close(rtsp);
+	/* Wait for them to send TEARDOWN, the shares they hold are freed below */
+	for (i=1;(threads = ast_atomic_fetchadd_int(&rtsp_share_threads,0));i++)
+	{
+		if (!(i%500))
+			ast_log(LOG_WARNING,"Waiting for %d shared pulls to end\n",threads);
+		usleep(10000);
+	}
 
-	/* Exit */	
-	return 0;
+	/* Free cameras */
+	while ((camera = AST_LIST_REMOVE_HEAD(&rtsp_pool_cameras, list)))
+	{
+		ast_free(camera->hostport);
+		ast_free(camera->uri);
+		ast_free(camera);
+	}
 }
 
 /* static int app_rtsp_sip(struct ast_channel *chan, void *data) OLD. */
@@ -5002,7 +10650,9 @@ static int app_rtsp_sip(struct ast_channel *chan, const char *data) /* PORT 17.3
 		AST_APP_ARG(sip_enable);
 		AST_APP_ARG(sip_realm);
 		AST_APP_ARG(sip_port);
+		AST_APP_ARG(options); /* [v2.1] */
 	);
+	struct RtspSipOptions opts = { 0, };
 	parse = ast_strdupa(data ?: "");
 	AST_STANDARD_APP_ARGS(args, parse);
 
@@ -5025,6 +10675,9 @@ static int app_rtsp_sip(struct ast_channel *chan, const char *data) /* PORT 17.3
 
 	sip_port = atoi(args.sip_port);
 
+	/* [v2.1] Options */
+	RtspSipParseOptions(&opts,args.options);
+
 	/* Get data */
      /*	uri = (char*)data; OLD */
 	uri = args.rtsp_uri; /* PORT 17.3 new way */
@@ -5138,7 +10791,11 @@ static int app_rtsp_sip(struct ast_channel *chan, const char *data) /* PORT 17.3
 			/* Default */
 			rtsp_port = 554;
 		/* Play */
-		res = main_loop(chan,ip,rtsp_port,url,username,password,isIPv6,sip_enable,sip_realm,sip_port); /* name change */
+		/* [v2.1] Cameras without talkback are shared between calls when asked, or when pooled */
+		if (!sip_enable && (opts.sharedPull || RtspPoolHasCamera(ip,rtsp_port,url,username,password)))
+			res = RtspShareWatch(chan,ip,rtsp_port,url,username,password,isIPv6,&opts);
+		else
+			res = main_loop(chan,ip,rtsp_port,url,username,password,isIPv6,sip_enable,sip_realm,sip_port,&opts,NULL); /* name change */
 
 	} else
 		ast_log(LOG_ERROR,"RTSP ERROR: Unknown protocol in rtsp uri %s\n",uri);
@@ -5171,6 +10828,18 @@ static int unload_module(void)
 
 	ast_module_user_hangup_all();
 
+	/* [v2.1] Warm pool and shared pulls */
+	RtspPoolUnload();
+	/* [v2.1] After the sessions it serves */
+	MediaReactorStop();
+	/* [v2.1] Cached sdps */
+	SdpCacheFlush();
+	/* [v2.1] */
+	AuthCacheFlush();
+	RtspPipelineFlush();
+	/* [v2.1] After the sdps pointing at its formats */
+	RtpmapTableDestroy();
+
 	return res;
 }
 
@@ -5180,6 +10849,10 @@ static int load_module(void)
 	 * PORT17.3. New way: Register as an xml app. (old way works too) 
 	 */
 	int res;
+	/* [v2.1] Before anything parses an sdp */
+	RtpmapTableBuild();
+	/* [v2.1] Warm sessions from rtsp_sip.conf, optional */
+	RtspPoolLoad();
 	res = ast_register_application_xml(app, app_rtsp_sip);
 	return res;
 
@@ -5197,3 +10870,184 @@ AST_MODULE_INFO(ASTERISK_GPL_KEY, AST_MODFLAG_DEFAULT, "RTSP-SIP Application",
 	.load = load_module,
 	.unload = unload_module,
 );
+#endif /* RTSP_SIP_STANDALONE */
+
+#ifdef RTSP_SIP_STANDALONE
+/*
+ * [v2.1] Standalone entry points, see RTSP_SIP_STANDALONE at the top.
+ * Each takes a message as it comes off the socket and does what the module
+ * does with it, indexing its headers once like the framer.
+ */
+void rtsp_sip_parse_init(void)
+{
+	RtpmapTableBuild();
+}
+
+void rtsp_sip_parse_destroy(void)
+{
+	RtpmapTableDestroy();
+}
+
+/* Headers indexed, -1 without a start line */
+int rtsp_sip_parse_headers(const char *buffer,int bufferLen)
+{
+	struct HeaderIndex index;
+
+	if (HeaderIndexBuild(&index,buffer,bufferLen))
+		return -1;
+	return index.count;
+}
+
+/* Response code, with the CSeq, Content-Length, session, transport and range the state machine reads */
+int rtsp_sip_parse_response(char *buffer,int bufferLen,int isSIP,int *cseq,int *contentLength)
+{
+	struct HeaderIndex index;
+	const char *session;
+	const char *transport;
+	int len;
+
+	HeaderIndexBuild(&index,buffer,bufferLen);
+	*cseq = GetHeaderValueInt(&index,"CSeq");
+	*contentLength = GetHeaderValueInt(&index,"Content-Length");
+	if (*contentLength)
+		CheckHeaderValue(&index,"Content-Type","application/sdp");
+	/* Session timeout, as RtspPlayerAddSession() reads it */
+	if ((session = HeaderIndexValue(&index,"Session",&len)))
+		HeaderValueFind(session,len,";timeout=");
+	/* Server ports, as RrspPlayerSetAudioTransport() reads them */
+	if ((transport = HeaderIndexValue(&index,"Transport",&len)))
+		HeaderValueFind(transport,len,"server_port=");
+	HeaderIndexValue(&index,"Range",&len);
+	return GetResponseCode(buffer,bufferLen,isSIP);
+}
+
+/* Challenge of a 401: 2 Digest, 1 Basic, 0 none */
+int rtsp_sip_parse_auth(char *buffer,int bufferLen)
+{
+	struct HeaderIndex index;
+	struct DigestAuthData digest_data;
+	struct BasicAuthData basic_data;
+
+	memset(&digest_data,0,sizeof(digest_data));
+	memset(&basic_data,0,sizeof(basic_data));
+	HeaderIndexBuild(&index,buffer,bufferLen);
+	if (GetAuthSchemeDigest(&index,&digest_data) == 0)
+		return 2;
+	if (GetAuthSchemeBasic(&index,&basic_data) == 0)
+		return 1;
+	return 0;
+}
+
+/* Audio and video formats in an SDP body, -1 if it can't be parsed */
+int rtsp_sip_parse_sdp(char *buffer,int bufferLen)
+{
+	struct SDPContent *sdp;
+	int num;
+
+	if (!(sdp = CreateSDP(buffer,bufferLen,1)))
+		return -1;
+	num = (sdp->audio ? sdp->audio->num : 0) + (sdp->video ? sdp->video->num : 0);
+	DestroySDP(sdp);
+	return num;
+}
+
+/* Complete messages framed from data arriving step bytes at a time, -1 if one can't fit */
+int rtsp_sip_frame(const char *data,int dataLen,int step)
+{
+	struct RtspFramer framer;
+	char *base;
+	char *buffer;
+	int bufferLen = 0;
+	int messageLen = 0;
+	int messages = 0;
+	int pos;
+	int len;
+
+	if (step<=0 || !(base = ast_malloc(dataLen+1)))
+		return -1;
+	RtspFramerInit(&framer,base,dataLen);
+	buffer = base;
+	for (pos=0;pos<dataLen && messageLen>=0;pos+=len)
+	{
+		/* As RecvResponse() would */
+		len = dataLen-pos<step ? dataLen-pos : step;
+		if (!bufferLen)
+			buffer = base;
+		memcpy(buffer+bufferLen,data+pos,len);
+		bufferLen += len;
+		buffer[bufferLen] = 0;
+		/* Every complete one */
+		while ((messageLen = RtspFramerNext(&framer,buffer,bufferLen))>0)
+		{
+			RtspFramerConsume(&framer,&buffer,&bufferLen,messageLen);
+			messages++;
+		}
+	}
+	ast_free(base);
+	return messageLen<0 ? -1 : messages;
+}
+
+/* RTP headers stamped into header for count frames of samples on an 8 kHz clock, 20 ms apart. Returns packets sent */
+int rtsp_sip_rtp_stamp(void *header,int count,int samples)
+{
+	struct RtpSender sender;
+	struct timeval now = {0,0};
+	int i;
+
+	RtpSenderInit(&sender,0);
+	for (i=0;i<count;i++)
+	{
+		RtpSenderStampAt(&sender,(struct RtpHeader*)header,now,8000,8000,samples,samples);
+		/* Next packet time */
+		if ((now.tv_usec += 20000)>=1000000)
+		{
+			now.tv_sec++;
+			now.tv_usec -= 1000000;
+		}
+	}
+	return sender.psent;
+}
+
+/* Payload offset of an RTP packet with its seq and timestamp, -1 if it has no payload */
+int rtsp_sip_rtp_parse(const void *packet,int len,int *seq,unsigned int *ts)
+{
+	struct RtpPacketInfo info;
+
+	if (RtpParseHeader(packet,len,&info))
+		return -1;
+	*seq = info.seq;
+	*ts = info.ts;
+	return info.ini;
+}
+
+/* Datagrams read off fd into pool slots, RTP headers parsed, until none is left. Returns packets, -1 on error */
+int rtsp_sip_rtp_recv(int fd)
+{
+	struct FramePool *pool;
+	struct RtpPacketInfo info;
+	uint8_t *frameBuffer;
+	unsigned int truncated;
+	int packets = 0;
+	int end = 0;
+	int len;
+
+	if (!(pool = FramePoolCreate(FRAME_POOL_SLOTS)))
+		return -1;
+	while (!end)
+	{
+		truncated = pool->truncated;
+		/* Nothing read, go on only if it switched to jumbo reads */
+		if (!(len = FramePoolRecv(pool,fd,&frameBuffer,&end)))
+		{
+			if (pool->truncated==truncated)
+				break;
+			continue;
+		}
+		if (!RtpParseHeader(frameBuffer+AST_FRIENDLY_OFFSET,len,&info))
+			packets++;
+		FramePoolPut(pool,frameBuffer);
+	}
+	FramePoolDestroy(pool);
+	return end ? -1 : packets;
+}
+#endif /* RTSP_SIP_STANDALONE */
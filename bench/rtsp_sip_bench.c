@@ -0,0 +1,347 @@
+/*
+ * [v2.1] Throughput of the app_rtsp_sip message parsers and RTP header code.
+ *
+ * Build and run from the top of the repository:
+ *
+ *   cc -O2 -D_GNU_SOURCE -DRTSP_SIP_STANDALONE -I. -o rtsp_sip_bench \
+ *      bench/rtsp_sip_bench.c app_rtsp_sip.c
+ *   ./rtsp_sip_bench [iterations]
+ *
+ * Each case is run 5 times and the best is reported, in messages per second
+ * for the responses a Vivotek camera and speaker send during a call, and in
+ * packets per second for the RTP header stamped on talkback and parsed on
+ * every camera packet. Compare the numbers before and after a change on the
+ * same machine; they are not meaningful across machines.
+ *
+ * The rtp recv cases queue batches of 172 byte RTP packets on a loopback
+ * UDP socket and time only draining them, so it is receiver CPU on one core.
+ * "memset+recv" is how camera RTP was read before the packet slot pool:
+ * the 9 KB frame buffer zeroed and then recv() into it.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include "rtsp_sip_standalone.h"
+
+#define BENCH_RUNS	5
+#define RECV_BATCH	128	/* datagrams queued at a time, fits the default receive buffer */
+#define RECV_PACKET	172	/* 20 ms of PCMU */
+#define OLD_OFFSET	64	/* AST_FRIENDLY_OFFSET */
+#define OLD_PAYLOAD	9000	/* PKT_PAYLOAD */
+
+/* DESCRIBE response, SDP as sent by a Vivotek camera */
+static const char describeSdp[] =
+	"v=0\r\n"
+	"o=RTSP 1700000000 602 IN IP4 0.0.0.0\r\n"
+	"s=RTSP server\r\n"
+	"c=IN IP4 0.0.0.0\r\n"
+	"t=0 0\r\n"
+	"a=charset:Shift_JIS\r\n"
+	"a=range:npt=0-\r\n"
+	"a=control:*\r\n"
+	"a=etag:1234567890\r\n"
+	"m=video 0 RTP/AVP 96\r\n"
+	"b=AS:1200\r\n"
+	"a=rtpmap:96 H264/90000\r\n"
+	"a=control:trackID=1\r\n"
+	"a=fmtp:96 profile-level-id=4D4029;sprop-parameter-sets=Z01AKZpmAoAt/zUBAQFAAAD6AAAw1DAC,aO48gA==;packetization-mode=1\r\n"
+	"m=audio 0 RTP/AVP 0\r\n"
+	"a=control:trackID=2\r\n"
+	"a=rtpmap:0 PCMU/8000\r\n";
+
+static const char describeHeaders[] =
+	"RTSP/1.0 200 OK\r\n"
+	"CSeq: 2\r\n"
+	"Date: Fri, Oct 16 2026 10:00:00 GMT\r\n"
+	"Content-Base: rtsp://192.168.1.90:554/live.sdp/\r\n"
+	"Content-Type: application/sdp\r\n"
+	"Content-Length: %d\r\n"
+	"\r\n"
+	"%s";
+
+static const char unauthorized[] =
+	"RTSP/1.0 401 Unauthorized\r\n"
+	"CSeq: 1\r\n"
+	"Date: Fri, Oct 16 2026 10:00:00 GMT\r\n"
+	"WWW-Authenticate: Digest realm=\"streaming_server\", nonce=\"a9e6f7d2c8b0e1f4a3b5c7d9e0f1a2b3\"\r\n"
+	"WWW-Authenticate: Basic realm=\"streaming_server\"\r\n"
+	"\r\n";
+
+static const char setup[] =
+	"RTSP/1.0 200 OK\r\n"
+	"CSeq: 3\r\n"
+	"Date: Fri, Oct 16 2026 10:00:00 GMT\r\n"
+	"Session: 47112344;timeout=60\r\n"
+	"Transport: RTP/AVP/UDP;unicast;client_port=5000-5001;server_port=5556-5557;ssrc=1A2B3C4D;mode=\"play\"\r\n"
+	"\r\n";
+
+static const char play[] =
+	"RTSP/1.0 200 OK\r\n"
+	"CSeq: 5\r\n"
+	"Date: Fri, Oct 16 2026 10:00:00 GMT\r\n"
+	"Session: 47112344\r\n"
+	"Range: npt=0.000-\r\n"
+	"RTP-Info: url=rtsp://192.168.1.90:554/live.sdp/trackID=1;seq=21310;rtptime=2183729,"
+	"url=rtsp://192.168.1.90:554/live.sdp/trackID=2;seq=4410;rtptime=178190\r\n"
+	"\r\n";
+
+/* INVITE answer from the speaker */
+static const char sipSdp[] =
+	"v=0\r\n"
+	"o=- 0 0 IN IP4 192.168.1.91\r\n"
+	"s=-\r\n"
+	"c=IN IP4 192.168.1.91\r\n"
+	"t=0 0\r\n"
+	"m=audio 7078 RTP/AVP 0\r\n"
+	"a=rtpmap:0 PCMU/8000\r\n"
+	"a=ptime:20\r\n";
+
+static const char sipHeaders[] =
+	"SIP/2.0 200 OK\r\n"
+	"Via: SIP/2.0/UDP 192.168.1.10:5060;branch=z9hG4bK776asdhds;rport=5060;received=192.168.1.10\r\n"
+	"From: <sip:door@192.168.1.90>;tag=1928301774\r\n"
+	"To: <sip:speaker@192.168.1.91>;tag=a6c85cf\r\n"
+	"Call-ID: a84b4c76e66710@192.168.1.10\r\n"
+	"CSeq: 1 INVITE\r\n"
+	"Contact: <sip:speaker@192.168.1.91:5060>\r\n"
+	"Content-Type: application/sdp\r\n"
+	"Content-Length: %d\r\n"
+	"\r\n"
+	"%s";
+
+static char describe[2048];
+static char sip[2048];
+
+static double Now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC,&ts);
+	return ts.tv_sec + ts.tv_nsec/1e9;
+}
+
+/* Frame it, read the headers, then the body, as main_loop() does */
+static int HandleResponse(const char *message,int isSIP)
+{
+	char buffer[2048];
+	int len = strlen(message);
+	int cseq;
+	int contentLength;
+	int code;
+
+	/* As RecvResponse() leaves it */
+	memcpy(buffer,message,len+1);
+	if (!isSIP && rtsp_sip_frame(buffer,len,len)!=1)
+		return -1;
+	code = rtsp_sip_parse_response(buffer,len,isSIP,&cseq,&contentLength);
+	if (code==401)
+		return rtsp_sip_parse_auth(buffer,len);
+	if (contentLength)
+		return rtsp_sip_parse_sdp(buffer+len-contentLength,contentLength);
+	return code;
+}
+
+static void BenchMessage(const char *name,const char *message,int isSIP,int iterations)
+{
+	double best = 0;
+	double start;
+	double rate;
+	int run;
+	int i;
+
+	for (run=0;run<BENCH_RUNS;run++)
+	{
+		start = Now();
+		for (i=0;i<iterations;i++)
+			if (HandleResponse(message,isSIP)<0)
+			{
+				fprintf(stderr,"%s: not parsed\n",name);
+				exit(1);
+			}
+		rate = iterations/(Now()-start);
+		if (rate>best)
+			best = rate;
+	}
+	printf("%-22s %12.0f msgs/s\n",name,best);
+}
+
+static void BenchRtp(int iterations)
+{
+	unsigned int packet[(12+160)/4];
+	double bestStamp = 0;
+	double bestParse = 0;
+	double start;
+	double rate;
+	unsigned int ts;
+	int seq;
+	int run;
+	int i;
+
+	memset(packet,0,sizeof(packet));
+	for (run=0;run<BENCH_RUNS;run++)
+	{
+		/* Talkback, one header per 20 ms PCMU frame */
+		start = Now();
+		rtsp_sip_rtp_stamp(packet,iterations,160);
+		rate = iterations/(Now()-start);
+		if (rate>bestStamp)
+			bestStamp = rate;
+
+		/* Camera, each packet read off the socket */
+		start = Now();
+		for (i=0;i<iterations;i++)
+			if (rtsp_sip_rtp_parse(packet,sizeof(packet),&seq,&ts)!=12)
+			{
+				fprintf(stderr,"rtp: not parsed\n");
+				exit(1);
+			}
+		rate = iterations/(Now()-start);
+		if (rate>bestParse)
+			bestParse = rate;
+	}
+	printf("%-22s %12.0f pkts/s\n","rtp stamp",bestStamp);
+	printf("%-22s %12.0f pkts/s\n","rtp parse",bestParse);
+}
+
+/* Loopback UDP pair, rx non-blocking */
+static int OpenPair(int *rx,int *tx)
+{
+	struct sockaddr_in addr;
+	socklen_t size = sizeof(addr);
+	int rcvbuf = 1<<20;
+
+	memset(&addr,0,sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	if ((*rx = socket(AF_INET,SOCK_DGRAM,0))<0 || (*tx = socket(AF_INET,SOCK_DGRAM,0))<0)
+		return -1;
+	setsockopt(*rx,SOL_SOCKET,SO_RCVBUF,&rcvbuf,sizeof(rcvbuf));
+	if (bind(*rx,(struct sockaddr*)&addr,sizeof(addr)) || getsockname(*rx,(struct sockaddr*)&addr,&size)
+	    || connect(*tx,(struct sockaddr*)&addr,sizeof(addr)))
+		return -1;
+	return 0;
+}
+
+/* Queue a batch, every packet stamped in turn */
+static void SendBatch(int tx,unsigned int *packet)
+{
+	int i;
+
+	for (i=0;i<RECV_BATCH;i++)
+	{
+		rtsp_sip_rtp_stamp(packet,1,160);
+		if (send(tx,packet,RECV_PACKET,0)!=RECV_PACKET)
+		{
+			perror("send");
+			exit(1);
+		}
+	}
+}
+
+/* Before the slot pool: zero the whole frame buffer, then recv() into it */
+static int OldRecv(int fd)
+{
+	unsigned int frameBuffer[(OLD_OFFSET+OLD_PAYLOAD)/4];
+	unsigned int ts;
+	int packets = 0;
+	int seq;
+	int len;
+
+	while (1)
+	{
+		memset(frameBuffer,0,sizeof(frameBuffer));
+		if ((len = recv(fd,(char*)frameBuffer+OLD_OFFSET,OLD_PAYLOAD,MSG_DONTWAIT))<=0)
+			break;
+		if (rtsp_sip_rtp_parse((char*)frameBuffer+OLD_OFFSET,len,&seq,&ts)>=0)
+			packets++;
+	}
+	return packets;
+}
+
+static void BenchRecv(int iterations)
+{
+	unsigned int packet[RECV_PACKET/4];
+	double bestOld = 0;
+	double bestPool = 0;
+	double elapsedOld;
+	double elapsedPool;
+	double start;
+	int batches = iterations/RECV_BATCH;
+	int rx,tx;
+	int run;
+	int i;
+
+	if (batches<1)
+		batches = 1;
+	if (OpenPair(&rx,&tx))
+	{
+		perror("socket");
+		exit(1);
+	}
+	memset(packet,0,sizeof(packet));
+	for (run=0;run<BENCH_RUNS;run++)
+	{
+		elapsedOld = elapsedPool = 0;
+		for (i=0;i<batches;i++)
+		{
+			SendBatch(tx,packet);
+			start = Now();
+			if (OldRecv(rx)!=RECV_BATCH)
+			{
+				fprintf(stderr,"rtp recv: datagrams dropped, lower RECV_BATCH\n");
+				exit(1);
+			}
+			elapsedOld += Now()-start;
+
+			SendBatch(tx,packet);
+			start = Now();
+			if (rtsp_sip_rtp_recv(rx)!=RECV_BATCH)
+			{
+				fprintf(stderr,"rtp recv: datagrams dropped, lower RECV_BATCH\n");
+				exit(1);
+			}
+			elapsedPool += Now()-start;
+		}
+		if (batches*RECV_BATCH/elapsedOld>bestOld)
+			bestOld = batches*RECV_BATCH/elapsedOld;
+		if (batches*RECV_BATCH/elapsedPool>bestPool)
+			bestPool = batches*RECV_BATCH/elapsedPool;
+	}
+	close(rx);
+	close(tx);
+	printf("%-22s %12.0f pkts/s\n","rtp recv memset+recv",bestOld);
+	printf("%-22s %12.0f pkts/s\n","rtp recv pooled slot",bestPool);
+}
+
+int main(int argc,char **argv)
+{
+	int iterations = argc>1 ? atoi(argv[1]) : 200000;
+
+	if (iterations<=0)
+	{
+		fprintf(stderr,"usage: %s [iterations]\n",argv[0]);
+		return 1;
+	}
+
+	rtsp_sip_parse_init();
+
+	snprintf(describe,sizeof(describe),describeHeaders,(int)strlen(describeSdp),describeSdp);
+	snprintf(sip,sizeof(sip),sipHeaders,(int)strlen(sipSdp),sipSdp);
+
+	BenchMessage("rtsp describe 200+sdp",describe,0,iterations);
+	BenchMessage("rtsp 401 digest+basic",unauthorized,0,iterations);
+	BenchMessage("rtsp setup 200",setup,0,iterations);
+	BenchMessage("rtsp play 200",play,0,iterations);
+	BenchMessage("sip invite 200+sdp",sip,1,iterations);
+	BenchRtp(iterations*10);
+	BenchRecv(iterations/4);
+
+	rtsp_sip_parse_destroy();
+
+	return 0;
+}
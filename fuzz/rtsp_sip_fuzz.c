@@ -0,0 +1,75 @@
+/*
+ * [v2.1] libFuzzer target for the app_rtsp_sip message parsers and RTP header.
+ *
+ * Build and run from the top of the repository:
+ *
+ *   clang -g -O1 -fsanitize=fuzzer,address,undefined -D_GNU_SOURCE \
+ *         -DRTSP_SIP_STANDALONE -I. -o rtsp_sip_fuzz \
+ *         fuzz/rtsp_sip_fuzz.c app_rtsp_sip.c
+ *   ./rtsp_sip_fuzz -max_len=16384 corpus/
+ *
+ * The first byte of the input picks the parser, the second is the read size
+ * for the framer, the rest is the message. Messages are handed over as
+ * RecvResponse() leaves them, in their own buffer with a \0 after the end.
+ */
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include "rtsp_sip_standalone.h"
+
+int LLVMFuzzerTestOneInput(const uint8_t *data,size_t size)
+{
+	static int initialized = 0;
+	char *buffer;
+	unsigned int ts;
+	int len;
+	int cseq;
+	int contentLength;
+	int seq;
+
+	if (size<2 || size>65536)
+		return 0;
+
+	/* rtpmap table, kept for the whole run */
+	if (!initialized)
+	{
+		rtsp_sip_parse_init();
+		initialized = 1;
+	}
+
+	/* Own copy, aligned and terminated */
+	len = size-2;
+	if (!(buffer = malloc(len+1)))
+		return 0;
+	memcpy(buffer,data+2,len);
+	buffer[len] = 0;
+
+	switch (data[0]%7)
+	{
+		case 0:
+			rtsp_sip_parse_headers(buffer,len);
+			break;
+		case 1:
+			rtsp_sip_parse_response(buffer,len,0,&cseq,&contentLength);
+			break;
+		case 2:
+			rtsp_sip_parse_response(buffer,len,1,&cseq,&contentLength);
+			break;
+		case 3:
+			rtsp_sip_parse_auth(buffer,len);
+			break;
+		case 4:
+			rtsp_sip_parse_sdp(buffer,len);
+			break;
+		case 5:
+			rtsp_sip_frame(buffer,len,data[1]+1);
+			break;
+		case 6:
+			rtsp_sip_rtp_parse(buffer,len,&seq,&ts);
+			break;
+	}
+
+	free(buffer);
+
+	return 0;
+}
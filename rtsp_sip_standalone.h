@@ -0,0 +1,40 @@
+/*
+ * [v2.1] Entry points of app_rtsp_sip.c built with -DRTSP_SIP_STANDALONE.
+ *
+ * Only the message parsers and the RTP header code are compiled, over a libc
+ * shim, so they can be timed (bench/) and fuzzed (fuzz/) without Asterisk.
+ * Messages are passed as they come off the socket, NUL terminated one byte
+ * past bufferLen as RecvResponse() leaves them.
+ */
+#ifndef RTSP_SIP_STANDALONE_H
+#define RTSP_SIP_STANDALONE_H
+
+/* rtpmap table, once before and after the rest */
+void rtsp_sip_parse_init(void);
+void rtsp_sip_parse_destroy(void);
+
+/* Headers indexed, -1 without a start line */
+int rtsp_sip_parse_headers(const char *buffer,int bufferLen);
+
+/* Response code, with the CSeq and Content-Length */
+int rtsp_sip_parse_response(char *buffer,int bufferLen,int isSIP,int *cseq,int *contentLength);
+
+/* Challenge of a 401: 2 Digest, 1 Basic, 0 none */
+int rtsp_sip_parse_auth(char *buffer,int bufferLen);
+
+/* Audio and video formats in an SDP body, -1 if it can't be parsed */
+int rtsp_sip_parse_sdp(char *buffer,int bufferLen);
+
+/* Complete messages framed from data arriving step bytes at a time, -1 if one can't fit */
+int rtsp_sip_frame(const char *data,int dataLen,int step);
+
+/* RTP headers (12 bytes, 4 byte aligned) stamped for count frames of samples. Returns packets sent */
+int rtsp_sip_rtp_stamp(void *header,int count,int samples);
+
+/* Payload offset of an RTP packet (4 byte aligned), -1 if it has no payload */
+int rtsp_sip_rtp_parse(const void *packet,int len,int *seq,unsigned int *ts);
+
+/* Datagrams on fd read into pool slots and parsed until none is left. Returns packets, -1 on error */
+int rtsp_sip_rtp_recv(int fd);
+
+#endif /* RTSP_SIP_STANDALONE_H */